@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __ALLOC_GUARD_H__
+#define __ALLOC_GUARD_H__
+
+#include <execinfo.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace respeaker
+{
+
+/** One allocation made by a node after the guard was armed. */
+struct AllocationReport
+{
+    const char* node;   ///< The name given to the scope of the node, e.g. "ChannelMatrixNode".
+    size_t size;        ///< The bytes requested from `operator new`.
+    long tid;
+    int depth;          ///< The number of frames in `call_site`.
+    void* call_site[12];
+};
+
+/**
+ * A debug check of the promise that the nodes don't allocate once the chain runs. After `Start()` returns, the nodes
+ * of this library reuse their buffers in `ProcessBlock`/`FetchBlock`/`StoreBlock`: their outputs are swapped into
+ * the buffer of their input (respeaker::SwapOutBlock), their queues are respeaker::FixedRing. The collectors still
+ * create one `std::string` per block (respeaker::NewBlock, before their node scope starts, so it isn't reported), and
+ * so do the closed-source nodes and the `DetectHotword`/`Listen` results, which is why respeaker::CoreBlockPool
+ * serves them from per-core free lists instead of the general-purpose heap.
+ *
+ * To check it, build with `-DRESPEAKER_ALLOC_GUARD` (the node scopes of RESPEAKER_TRACE_SCOPE then also name the node
+ * for the guard) and expand the hook in one source file, or use RESPEAKER_BLOCK_POOL_OPERATOR_NEW() which reports
+ * the allocations the pool can't serve:
+ * ```cpp
+ * RESPEAKER_ALLOC_GUARD_OPERATOR_NEW()
+ * ...
+ * respeaker->Start(&exit);
+ * AllocationGuard::Arm(true);
+ * ...
+ * AllocationGuard::Dump(STDERR_FILENO);   // node, size and the call site of every allocation
+ * ```
+ * Any allocation inside a node scope while armed is counted and the first ones are kept with their backtrace, or
+ * abort the process at once with `SetAbortOnAllocation(true)` to get the core of the offending call.
+ */
+class AllocationGuard
+{
+public:
+    /** Start or stop reporting, arm it once the chain started (the nodes allocate in `OnStartThread`). */
+    static void Arm(bool armed)
+    {
+        if (armed) {
+            // the first backtrace() loads libgcc_s, which allocates
+            void* frames[2];
+            backtrace(frames, 2);
+        }
+        _Armed().store(armed, std::memory_order_release);
+    }
+
+    static bool IsArmed() { return _Armed().load(std::memory_order_relaxed); }
+
+    static void SetAbortOnAllocation(bool abort_on_allocation)
+    {
+        _AbortOnAllocation().store(abort_on_allocation, std::memory_order_relaxed);
+    }
+
+    /** Called by the `operator new` hook, it doesn't allocate. */
+    static void OnAllocate(size_t size)
+    {
+        const char* node = _CurrentNode();
+        if (!node || !IsArmed()) return;
+        static thread_local bool reporting = false;
+        if (reporting) return;
+        reporting = true;
+
+        uint64_t index = _Count().fetch_add(1, std::memory_order_relaxed);
+        if (index < kMaxReports) {
+            AllocationReport& report = _Reports()[index];
+            report.node = node;
+            report.size = size;
+            report.tid = static_cast<long>(syscall(SYS_gettid));
+            // skip this function, the hook frames are kept as they depend on the inlining
+            void* frames[kMaxDepth + 1];
+            int depth = backtrace(frames, kMaxDepth + 1) - 1;
+            report.depth = depth > 0 ? depth : 0;
+            for (int i = 0; i < report.depth; i++) report.call_site[i] = frames[i + 1];
+            _NumReports().fetch_add(1, std::memory_order_release);
+        }
+        if (_AbortOnAllocation().load(std::memory_order_relaxed)) {
+            dprintf(STDERR_FILENO, "respeaker: %zu bytes allocated in %s\n", size, node);
+            abort();
+        }
+        reporting = false;
+    }
+
+    /** Get how many allocations were made in the node scopes while armed. */
+    static uint64_t GetCount() { return _Count().load(std::memory_order_relaxed); }
+
+    /**
+     * Get the reports kept, the first 64 allocations.
+     *
+     * @return const AllocationReport* - `*num_reports` of them.
+     */
+    static const AllocationReport* GetReports(size_t* num_reports)
+    {
+        *num_reports = _NumReports().load(std::memory_order_acquire);
+        return _Reports();
+    }
+
+    /** Print the reports with symbolized call sites, without allocating. */
+    static void Dump(int fd)
+    {
+        size_t num_reports = 0;
+        const AllocationReport* reports = GetReports(&num_reports);
+        dprintf(fd, "respeaker: %llu allocations in the nodes while armed\n",
+                static_cast<unsigned long long>(GetCount()));
+        for (size_t i = 0; i < num_reports; i++) {
+            const AllocationReport& r = reports[i];
+            dprintf(fd, "%zu bytes in %s (tid %ld):\n", r.size, r.node, r.tid);
+            backtrace_symbols_fd(r.call_site, r.depth, fd);
+        }
+    }
+
+    /** Drop the reports and the count, only when the guard is disarmed. */
+    static void Clear()
+    {
+        _NumReports().store(0, std::memory_order_relaxed);
+        _Count().store(0, std::memory_order_relaxed);
+    }
+
+private:
+    friend class AllocationGuardScope;
+
+    static const size_t kMaxReports = 64;
+    static const int kMaxDepth = 12;
+
+    static std::atomic<bool>& _Armed()
+    {
+        static std::atomic<bool> armed(false);
+        return armed;
+    }
+
+    static std::atomic<bool>& _AbortOnAllocation()
+    {
+        static std::atomic<bool> abort_on_allocation(false);
+        return abort_on_allocation;
+    }
+
+    static std::atomic<uint64_t>& _Count()
+    {
+        static std::atomic<uint64_t> count(0);
+        return count;
+    }
+
+    static std::atomic<size_t>& _NumReports()
+    {
+        static std::atomic<size_t> num_reports(0);
+        return num_reports;
+    }
+
+    static AllocationReport* _Reports()
+    {
+        static AllocationReport reports[kMaxReports];
+        return reports;
+    }
+
+    /** The name of the node scope the calling thread is in, `nullptr` outside of the scopes. */
+    static const char*& _CurrentNode()
+    {
+        static thread_local const char* node = nullptr;
+        return node;
+    }
+};
+
+/**
+ * Name the node which runs on this thread for respeaker::AllocationGuard, until the end of the scope. A `nullptr` name
+ * lifts the guard, for a one-time allocation of the library inside a node scope.
+ */
+class AllocationGuardScope
+{
+public:
+    explicit AllocationGuardScope(const char* node) : _previous(AllocationGuard::_CurrentNode())
+    {
+        AllocationGuard::_CurrentNode() = node;
+    }
+
+    ~AllocationGuardScope() { AllocationGuard::_CurrentNode() = _previous; }
+
+private:
+    AllocationGuardScope(const AllocationGuardScope&) = delete;
+    AllocationGuardScope& operator=(const AllocationGuardScope&) = delete;
+
+    const char* _previous;
+};
+
+}  //namespace
+
+/** Report the allocations of the nodes through `malloc`-backed global operators, expand it in one source file. */
+#define RESPEAKER_ALLOC_GUARD_OPERATOR_NEW()                                                                           \
+    void* operator new(std::size_t size)                                                                               \
+    {                                                                                                                  \
+        respeaker::AllocationGuard::OnAllocate(size);                                                                  \
+        void* p = malloc(size ? size : 1);                                                                             \
+        if (!p) throw std::bad_alloc();                                                                                \
+        return p;                                                                                                      \
+    }                                                                                                                  \
+    void* operator new[](std::size_t size) { return operator new(size); }                                              \
+    void* operator new(std::size_t size, const std::nothrow_t&) noexcept                                               \
+    {                                                                                                                  \
+        respeaker::AllocationGuard::OnAllocate(size);                                                                  \
+        return malloc(size ? size : 1);                                                                                \
+    }                                                                                                                  \
+    void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept { return operator new(size, tag); }     \
+    void operator delete(void* p) noexcept { free(p); }                                                                \
+    void operator delete[](void* p) noexcept { free(p); }                                                              \
+    void operator delete(void* p, std::size_t) noexcept { free(p); }                                                   \
+    void operator delete[](void* p, std::size_t) noexcept { free(p); }                                                 \
+    void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }                                         \
+    void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+
+#endif // !__ALLOC_GUARD_H__
@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __ALSA_MMAP_COLLECTOR_NODE_H__
+#define __ALSA_MMAP_COLLECTOR_NODE_H__
+
+#include <alsa/asoundlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <ctime>
+#include <functional>
+#include <mutex>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/capture_clock_node.h"
+#include "chain_nodes/chain_trace.h"
+#include "chain_nodes/resampler.h"
+
+namespace respeaker
+{
+
+/**
+ * The AlsaMmapCollectorNode does the same job as AlsaCollectorNode, but it captures with SND_PCM_ACCESS_MMAP_*.
+ * The samples are resampled and deinterleaved straight from the DMA ring buffer of the driver into the output block,
+ * there's no `snd_pcm_readi` copy and no intermediate buffer. The node thread only sleeps in `snd_pcm_wait` when
+ * the ring doesn't hold a whole block yet, so there's about one wake-up per block.
+ *
+ * The blocks are made by respeaker::NewBlock. With respeaker::CoreBlockPool enabled, they're recycled through the
+ * free list of the collector thread: a block freed at the end of the chain, on any core, goes back to it, so a fixed
+ * set of buffers (the blocks in flight) goes round and the capture never reaches the general-purpose heap.
+ *
+ * Every block is timestamped from the device clock (`snd_pcm_htimestamp`), the overruns are counted, and the drift of
+ * the device clock is estimated from the timestamps and compensated by nudging the resampler, so the chain runs at
+ * exactly 16000 samples per second of CLOCK_MONOTONIC, or of the reference device set by `SetReferenceDriftSource`.
+ *
+ * This node is header-only and uses alsa-lib directly, please link your application with `-lasound`.
+ */
+class AlsaMmapCollectorNode : public BaseNode, public CaptureClockNode
+{
+public:
+    /**
+     * Create a AlsaMmapCollectorNode instance. Collect 8 channels audio data stream from Alsa directly.
+     *
+     * @param pcm_device_name - Users can obtain this by `arecord -L`, the device must support mmap, e.g. "hw:*"
+     *                          or "plughw:*".
+     * @param rate - The recording sample rate of your board, it must be a multiple of 16000(Hz), e.g. 48000.
+     * @param output_interleaved - Set it true to output interleaved data, false to output deinterleaved data.
+     *
+     * @return AlsaMmapCollectorNode*
+     */
+    static AlsaMmapCollectorNode* Create(std::string pcm_device_name, int rate, bool output_interleaved=false)
+    {
+        return new AlsaMmapCollectorNode(pcm_device_name, rate, 8, 8, 16, 64, output_interleaved);
+    }
+
+    /**
+     * @param pcm_device_name - Users can obtain this by `arecord -L`.
+     * @param rate - The recording sample rate of your board, it must be a multiple of 16000(Hz), e.g. 48000.
+     * @param num_channels - The number of channels to capture, default to 8.
+     * @param block_len_ms - The output block time length, in milliseconds, default to 8.
+     * @param period_time_ms - Set period time of Alsa PCM handle, period time should be less than buffer time,
+     *                         default to 16ms. A period shorter than the block doesn't save latency.
+     * @param buffer_time_ms - Set buffer time of Alsa PCM handle, default to 64ms. This is how long the chain can
+     *                         stall before an overrun.
+     * @param output_interleaved - Set it true to output interleaved data, false to output deinterleaved data.
+     *
+     * @return AlsaMmapCollectorNode*
+     */
+    static AlsaMmapCollectorNode* Create(std::string pcm_device_name, int rate, int num_channels, int block_len_ms,
+                                         int period_time_ms, int buffer_time_ms, bool output_interleaved=false)
+    {
+        return new AlsaMmapCollectorNode(pcm_device_name, rate, num_channels, block_len_ms,
+                                         period_time_ms, buffer_time_ms, output_interleaved);
+    }
+
+    virtual ~AlsaMmapCollectorNode()
+    {
+        _ClosePcm();
+    }
+
+    virtual bool OnStartThread()
+    {
+        if (_rate <= 0 || _rate % 16000 != 0 || _num_channels <= 0 || _block_len_ms <= 0) return false;
+        if (!_OpenPcm()) return false;
+
+        _resampler.Init(_rate / 16000, _num_channels);
+        _out_frames = 16000 * _block_len_ms / 1000;
+        _sequence = 0;
+        _timestamps.Clear(_block_len_ms);
+
+        _output_parameter.node_type = ALSA_MMAP_COLLECTOR_NODE;
+        _output_parameter.mic_type = CIRCULAR_6MIC_7BEAM;
+        _output_parameter.block_len_ms = _block_len_ms;
+        _output_parameter.rate = 16000;
+        _output_parameter.num_channel = _num_channels;
+        _output_parameter.interleaved = _output_interleaved;
+        _is_interleaved_after_process = _output_interleaved;
+
+        return snd_pcm_start(_pcm) >= 0;
+    }
+
+    virtual std::string FetchBlock(bool& exit)
+    {
+        // the block handed to the chain, allocated before the wait for the ring, the rest must not allocate
+        std::string block = NewBlock(_out_frames * _num_channels * sizeof(int16_t));
+        RESPEAKER_ALLOC_GUARD_SCOPE("AlsaMmapCollectorNode");
+        int16_t* out = BlockSamples(block);
+        const size_t out_channel_stride = _output_interleaved ? 1 : _out_frames;
+        const size_t out_frame_stride = _output_interleaved ? _num_channels : 1;
+        size_t produced = 0;
+
+        while (produced < _out_frames) {
+            if (_IsExit()) {
+                exit = true;
+                return std::string();
+            }
+            if (_restart_after_pause.exchange(false)) {
+                _Restart();
+                continue;
+            }
+
+            // only the frames which complete this block, the rest stays in the ring for the next one
+            snd_pcm_uframes_t wanted = _resampler.NumInputFrames(_out_frames - produced);
+            snd_pcm_sframes_t avail = snd_pcm_avail_update(_pcm);
+            if (avail < 0) {
+                _Recover(static_cast<int>(avail));
+                continue;
+            }
+            if (static_cast<snd_pcm_uframes_t>(avail) < wanted) {
+                int err = snd_pcm_wait(_pcm, 100);
+                if (err < 0) _Recover(err);
+                continue;
+            }
+
+            if (produced == 0) _TimestampBlock();
+
+            const snd_pcm_channel_area_t* areas;
+            snd_pcm_uframes_t offset, frames = wanted;
+            int err = snd_pcm_mmap_begin(_pcm, &areas, &offset, &frames);
+            if (err < 0) {
+                _Recover(err);
+                continue;
+            }
+
+            // S16 interleaved: channel c of frame i is at addr + first/8 + (offset + i) * step/8
+            const int16_t* base = reinterpret_cast<const int16_t*>(
+                static_cast<const char*>(areas[0].addr) + areas[0].first / 8 + offset * (areas[0].step / 8));
+            size_t in_channel_stride = _num_channels > 1 ? (areas[1].first - areas[0].first) / 16 : 1;
+            size_t in_frame_stride = areas[0].step / 16;
+            size_t consumed = 0;
+            produced += _resampler.Process(base, in_channel_stride, in_frame_stride, frames,
+                                           out + produced * out_frame_stride, out_channel_stride, out_frame_stride,
+                                           _out_frames - produced, &consumed);
+
+            snd_pcm_sframes_t committed = snd_pcm_mmap_commit(_pcm, offset, consumed);
+            if (committed < 0 || static_cast<size_t>(committed) != consumed) {
+                _Recover(committed < 0 ? static_cast<int>(committed) : -EPIPE);
+            } else {
+                _position += consumed;
+            }
+        }
+        _sequence++;
+        return block;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        return block;
+    }
+
+    virtual bool OnJoinThread()
+    {
+        _ClosePcm();
+        return true;
+    }
+
+    /** The ring keeps running while the chain is paused, the stale audio is dropped on the first fetch after it. */
+    virtual void Pause()
+    {
+        BaseNode::Pause();
+        _restart_after_pause = true;
+    }
+
+    /** Get the actual period size of the Alsa PCM handle, in frames of the capture rate. */
+    size_t GetPeriodSize() { return _period_size; }
+
+    /** Get the actual buffer size of the Alsa PCM handle, in frames of the capture rate. */
+    size_t GetBufferSize() { return _buffer_size; }
+
+    /**
+     * Compensate the drift against another clock instead of CLOCK_MONOTONIC, e.g. the playback or aloop device which
+     * will consume the processed audio. Must be called before `RecursivelyStartThread`.
+     *
+     * @param reference_drift_ppm - Returns the drift of the reference clock against CLOCK_MONOTONIC, in ppm. It's
+     *                              called from the node thread about once per second.
+     */
+    void SetReferenceDriftSource(std::function<double()> reference_drift_ppm)
+    {
+        _reference_drift_ppm = reference_drift_ppm;
+    }
+
+    /** Enable or disable the drift compensation, it's enabled by default. The drift is estimated anyway. */
+    void EnableDriftCompensation(bool enable) { _compensate_drift = enable; }
+
+    virtual BlockTimestamp GetLastBlockTimestamp() { return _timestamps.Newest(); }
+
+    virtual BlockTimestamp GetBlockTimestamp(uint64_t sequence) { return _timestamps.Get(sequence); }
+
+    /** Get how many overruns have been recovered. */
+    virtual uint64_t GetXrunCount() { return _xrun_count; }
+
+    virtual double GetDriftPpm() { return _drift_ppm; }
+
+protected:
+    AlsaMmapCollectorNode(std::string pcm_device_name, int rate, int num_channels, int block_len_ms,
+                          int period_time_ms, int buffer_time_ms, bool output_interleaved)
+        : _device_name(pcm_device_name),
+          _rate(rate),
+          _num_channels(num_channels),
+          _block_len_ms(block_len_ms),
+          _period_time_ms(period_time_ms),
+          _buffer_time_ms(buffer_time_ms),
+          _output_interleaved(output_interleaved),
+          _pcm(nullptr),
+          _period_size(0),
+          _buffer_size(0),
+          _out_frames(0),
+          _position(0),
+          _sequence(0),
+          _discontinuity(false),
+          _anchor_valid(false),
+          _anchor_position(0),
+          _anchor_time_ns(0),
+          _last_drift_update_ns(0),
+          _drift_estimated(false),
+          _compensate_drift(true),
+          _restart_after_pause(false),
+          _xrun_count(0),
+          _drift_ppm(0.0) {}
+
+    bool _OpenPcm()
+    {
+        if (snd_pcm_open(&_pcm, _device_name.c_str(), SND_PCM_STREAM_CAPTURE, 0) < 0) {
+            _pcm = nullptr;
+            return false;
+        }
+
+        snd_pcm_hw_params_t* hw;
+        snd_pcm_hw_params_alloca(&hw);
+        unsigned int rate = _rate;
+        unsigned int period_us = _period_time_ms * 1000, buffer_us = _buffer_time_ms * 1000;
+        int dir = 0;
+        if (snd_pcm_hw_params_any(_pcm, hw) < 0 ||
+            snd_pcm_hw_params_set_access(_pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0 ||
+            snd_pcm_hw_params_set_format(_pcm, hw, SND_PCM_FORMAT_S16_LE) < 0 ||
+            snd_pcm_hw_params_set_channels(_pcm, hw, _num_channels) < 0 ||
+            snd_pcm_hw_params_set_rate_near(_pcm, hw, &rate, &dir) < 0 || rate != static_cast<unsigned int>(_rate) ||
+            snd_pcm_hw_params_set_buffer_time_near(_pcm, hw, &buffer_us, &dir) < 0 ||
+            snd_pcm_hw_params_set_period_time_near(_pcm, hw, &period_us, &dir) < 0 ||
+            snd_pcm_hw_params(_pcm, hw) < 0) {
+            _ClosePcm();
+            return false;
+        }
+        snd_pcm_uframes_t period_size = 0, buffer_size = 0;
+        snd_pcm_hw_params_get_period_size(hw, &period_size, &dir);
+        snd_pcm_hw_params_get_buffer_size(hw, &buffer_size);
+        _period_size = period_size;
+        _buffer_size = buffer_size;
+
+        // wake up once a whole output block is in the ring
+        snd_pcm_sw_params_t* sw;
+        snd_pcm_sw_params_alloca(&sw);
+        snd_pcm_uframes_t block_frames = _rate * _block_len_ms / 1000;
+        if (snd_pcm_sw_params_current(_pcm, sw) < 0 ||
+            snd_pcm_sw_params_set_avail_min(_pcm, sw, std::min(block_frames, buffer_size / 2)) < 0 ||
+            snd_pcm_sw_params_set_start_threshold(_pcm, sw, 1) < 0 ||
+            snd_pcm_sw_params_set_tstamp_mode(_pcm, sw, SND_PCM_TSTAMP_ENABLE) < 0 ||
+            snd_pcm_sw_params_set_tstamp_type(_pcm, sw, SND_PCM_TSTAMP_TYPE_MONOTONIC) < 0 ||
+            _ConfigureSwParams(sw) < 0 ||
+            snd_pcm_sw_params(_pcm, sw) < 0) {
+            _ClosePcm();
+            return false;
+        }
+        return true;
+    }
+
+    /** Derived nodes can add more software parameters before they are applied. */
+    virtual int _ConfigureSwParams(snd_pcm_sw_params_t* sw)
+    {
+        (void)sw;
+        return 0;
+    }
+
+    void _ClosePcm()
+    {
+        if (_pcm) {
+            snd_pcm_close(_pcm);
+            _pcm = nullptr;
+        }
+    }
+
+    /** Recover from an overrun or a suspend, and restart the capture. */
+    virtual void _Recover(int err)
+    {
+        if (err == -EPIPE || snd_pcm_state(_pcm) == SND_PCM_STATE_XRUN) {
+            _xrun_count++;
+            RESPEAKER_TRACE_INSTANT("xrun", _xrun_count);
+        }
+        _discontinuity = true;
+        _anchor_valid = false;
+        // the frames before the gap must not leak into the filter of the frames after it
+        _resampler.Reset();
+        if (snd_pcm_recover(_pcm, err, 1) >= 0 && snd_pcm_state(_pcm) != SND_PCM_STATE_RUNNING) {
+            snd_pcm_start(_pcm);
+        }
+    }
+
+    void _Restart()
+    {
+        snd_pcm_drop(_pcm);
+        snd_pcm_prepare(_pcm);
+        snd_pcm_start(_pcm);
+        _discontinuity = true;
+        _anchor_valid = false;
+        _resampler.Reset();
+    }
+
+    static int64_t _MonotonicNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+    }
+
+    /** Called before the first frame of a block is consumed: the oldest frame in the ring is the block's first one. */
+    void _TimestampBlock()
+    {
+        snd_pcm_uframes_t avail = 0;
+        snd_htimestamp_t ts;
+        int64_t now_ns;
+        if (snd_pcm_htimestamp(_pcm, &avail, &ts) < 0 || (ts.tv_sec == 0 && ts.tv_nsec == 0)) {
+            // the driver doesn't give timestamps, fall back to the wake-up time
+            snd_pcm_sframes_t a = snd_pcm_avail_update(_pcm);
+            avail = a > 0 ? a : 0;
+            now_ns = _MonotonicNs();
+        } else {
+            now_ns = static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+        }
+
+        BlockTimestamp stamp;
+        stamp.sequence = _sequence;
+        stamp.capture_time_ns = now_ns - static_cast<int64_t>(avail * 1000000000.0 / _rate);
+        stamp.xrun_count = _xrun_count;
+        stamp.discontinuity = _discontinuity;
+        _discontinuity = false;
+        _timestamps.Push(stamp);
+        _UpdateDrift(_position + avail, now_ns);
+    }
+
+    /**
+     * The device position against the timestamps gives the real rate of the device. The estimate is taken over at
+     * least 2 seconds since the anchor, smoothed, and the anchor is moved every minute to follow the temperature.
+     */
+    void _UpdateDrift(uint64_t position, int64_t now_ns)
+    {
+        if (!_anchor_valid) {
+            _anchor_position = position;
+            _anchor_time_ns = now_ns;
+            _anchor_valid = true;
+            return;
+        }
+        double span = (now_ns - _anchor_time_ns) * 1e-9;
+        if (span < 2.0 || now_ns - _last_drift_update_ns < 1000000000LL) return;
+        _last_drift_update_ns = now_ns;
+
+        double estimate = ((position - _anchor_position) / (span * _rate) - 1.0) * 1e6;
+        if (std::fabs(estimate) > 2000.0) {
+            // not a crystal drift, e.g. the device was suspended, start over
+            _anchor_valid = false;
+            return;
+        }
+        double drift = _drift_estimated ? _drift_ppm + 0.1 * (estimate - _drift_ppm) : estimate;
+        _drift_estimated = true;
+        _drift_ppm = drift;
+        if (span > 60.0) {
+            _anchor_position = position;
+            _anchor_time_ns = now_ns;
+        }
+
+        double reference = _reference_drift_ppm ? _reference_drift_ppm() : 0.0;
+        _resampler.SetDriftPpm(_compensate_drift ? drift - reference : 0.0);
+    }
+
+    bool _IsExit()
+    {
+        if (!_chain_shared_data) return false;
+        std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_exit_flag);
+        return _chain_shared_data->exit_flag;
+    }
+
+    std::string _device_name;
+    int _rate;
+    int _num_channels;
+    int _block_len_ms;
+    int _period_time_ms;
+    int _buffer_time_ms;
+    bool _output_interleaved;
+
+    snd_pcm_t* _pcm;
+    size_t _period_size;
+    size_t _buffer_size;
+    size_t _out_frames;
+    DecimatingResampler _resampler;
+
+    uint64_t _position;                     ///< frames consumed from the ring since the start
+    uint64_t _sequence;
+    bool _discontinuity;
+    BlockTimestampHistory _timestamps;
+
+    bool _anchor_valid;
+    uint64_t _anchor_position;
+    int64_t _anchor_time_ns;
+    int64_t _last_drift_update_ns;
+    bool _drift_estimated;
+    bool _compensate_drift;
+    std::function<double()> _reference_drift_ppm;
+
+    std::atomic<bool> _restart_after_pause;
+    std::atomic<uint64_t> _xrun_count;
+    std::atomic<double> _drift_ppm;
+};
+
+}  //namespace
+
+#endif // !__ALSA_MMAP_COLLECTOR_NODE_H__
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __ALSA_REFERENCE_SOURCE_H__
+#define __ALSA_REFERENCE_SOURCE_H__
+
+#include <alsa/asoundlib.h>
+
+#include "chain_nodes/reference_source.h"
+
+namespace respeaker
+{
+
+/**
+ * Read the reference from an Alsa capture device which taps the playback, e.g. the capture side of an aloop device
+ * the player writes to ("hw:Loopback,1,0"), a `multi`/`dsnoop` plug around the playback device, or the "pipewire"
+ * PCM on a monitor source. The device is read in non-blocking mode, so the node never waits for the player.
+ * Please link your application with `-lasound`.
+ */
+class AlsaReferenceSource : public ReferenceSource
+{
+public:
+    /**
+     * @param pcm_device_name - The capture device which carries the playback.
+     * @param rate - The rate of the device, it must be a multiple of 16000(Hz).
+     * @param num_channels - The channels are downmixed to mono.
+     */
+    AlsaReferenceSource(const std::string& pcm_device_name, int rate = 48000, int num_channels = 2)
+        : _device_name(pcm_device_name), _rate(rate), _num_channels(num_channels), _factor(1), _pcm(nullptr) {}
+
+    virtual ~AlsaReferenceSource() { Close(); }
+
+    virtual bool Open()
+    {
+        if (_rate <= 0 || _rate % 16000 != 0 || _num_channels <= 0) return false;
+        if (snd_pcm_open(&_pcm, _device_name.c_str(), SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK) < 0) {
+            _pcm = nullptr;
+            return false;
+        }
+        snd_pcm_hw_params_t* hw;
+        snd_pcm_hw_params_alloca(&hw);
+        unsigned int rate = _rate;
+        unsigned int period_us = 8000, buffer_us = 128000;
+        int dir = 0;
+        if (snd_pcm_hw_params_any(_pcm, hw) < 0 ||
+            snd_pcm_hw_params_set_access(_pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED) < 0 ||
+            snd_pcm_hw_params_set_format(_pcm, hw, SND_PCM_FORMAT_S16_LE) < 0 ||
+            snd_pcm_hw_params_set_channels(_pcm, hw, _num_channels) < 0 ||
+            snd_pcm_hw_params_set_rate_near(_pcm, hw, &rate, &dir) < 0 || rate != static_cast<unsigned int>(_rate) ||
+            snd_pcm_hw_params_set_buffer_time_near(_pcm, hw, &buffer_us, &dir) < 0 ||
+            snd_pcm_hw_params_set_period_time_near(_pcm, hw, &period_us, &dir) < 0 ||
+            snd_pcm_hw_params(_pcm, hw) < 0 ||
+            snd_pcm_start(_pcm) < 0) {
+            Close();
+            return false;
+        }
+        _factor = _rate / 16000;
+        _resampler.Init(_factor, 1);
+        return true;
+    }
+
+    virtual size_t Read(int16_t* out, size_t num_frames)
+    {
+        if (!_pcm) return 0;
+        size_t in_frames = _resampler.NumInputFrames(num_frames);
+        _interleaved.resize(in_frames * _num_channels);
+        _mono.resize(in_frames);
+
+        snd_pcm_sframes_t n = snd_pcm_readi(_pcm, _interleaved.data(), in_frames);
+        if (n == -EAGAIN) return 0;
+        if (n < 0) {
+            if (snd_pcm_recover(_pcm, static_cast<int>(n), 1) >= 0) snd_pcm_start(_pcm);
+            return 0;
+        }
+        for (snd_pcm_sframes_t i = 0; i < n; i++) {
+            int32_t acc = 0;
+            for (int c = 0; c < _num_channels; c++) acc += _interleaved[i * _num_channels + c];
+            _mono[i] = static_cast<int16_t>(acc / _num_channels);
+        }
+        return _resampler.Process(_mono.data(), 0, 1, n, out, 0, 1, num_frames);
+    }
+
+    virtual void Close()
+    {
+        if (_pcm) {
+            snd_pcm_close(_pcm);
+            _pcm = nullptr;
+        }
+    }
+
+private:
+    std::string _device_name;
+    int _rate;
+    int _num_channels;
+    size_t _factor;
+    snd_pcm_t* _pcm;
+    DecimatingResampler _resampler;
+    std::vector<int16_t> _interleaved;
+    std::vector<int16_t> _mono;
+};
+
+}  //namespace
+
+#endif // !__ALSA_REFERENCE_SOURCE_H__
@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __ASYNC_WAV_WRITER_H__
+#define __ASYNC_WAV_WRITER_H__
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "chain_nodes/fixed_ring.h"
+
+namespace respeaker
+{
+
+/**
+ * Write a S16_LE stream into *.wav files from a background thread, so the thread which produces the audio only copies
+ * it into a preallocated chunk and never waits for the disk.
+ *
+ * - The chunks (1MB by default) are allocated and aligned in `Open`, the producer fills one while the writer thread
+ *   writes the others. When all of them are waiting for the disk, the audio is dropped and counted, not queued.
+ * - The files are opened with `O_DIRECT` when the filesystem supports it (the page cache isn't polluted and the
+ *   writes don't stall on writeback), and preallocated with `fallocate`. The data starts at 4KB: the header is padded
+ *   with a "JUNK" chunk, so every write is 4KB aligned.
+ * - A new file is started at `max_file_bytes`, the oldest files are deleted above `max_total_bytes`. The files a
+ *   previous run left in the directory with the same prefix count towards the cap, they are found in `Open`.
+ */
+class AsyncWavWriter
+{
+public:
+    /**
+     * @param directory - Where the files go, it must exist.
+     * @param prefix - The files are named `prefix-YYYYmmdd-HHMMSS-N.wav`.
+     */
+    AsyncWavWriter(const std::string& directory, const std::string& prefix = "respeaker")
+        : _directory(directory), _prefix(prefix), _chunk_bytes(1 << 20), _num_chunks(4),
+          _max_file_bytes(64ull << 20), _max_total_bytes(512ull << 20), _direct_io(true),
+          _rate(0), _num_channels(0), _header(nullptr), _current(-1), _fill(0), _stop(false),
+          _fd(-1), _file_bytes(0), _file_index(0), _total_bytes(0),
+          _dropped_frames(0), _written_bytes(0), _num_files(0), _write_errors(0) {}
+
+    virtual ~AsyncWavWriter() { Close(); }
+
+    /** Set the chunk size and the number of chunks, must be called before `Open`. Default to 1MB and 4. */
+    void SetChunking(size_t chunk_bytes, size_t num_chunks)
+    {
+        _chunk_bytes = chunk_bytes;
+        _num_chunks = num_chunks < 2 ? 2 : num_chunks;
+    }
+
+    /** Set the size caps, must be called before `Open`. Default to 64MB per file and 512MB for all the files. */
+    void SetRotation(uint64_t max_file_bytes, uint64_t max_total_bytes)
+    {
+        _max_file_bytes = max_file_bytes;
+        _max_total_bytes = max_total_bytes;
+    }
+
+    /** Use `O_DIRECT` if the filesystem supports it, default to true. */
+    void SetDirectIo(bool enable) { _direct_io = enable; }
+
+    /** Find the files of the previous runs, allocate the chunks and start the writer thread. */
+    bool Open(int rate, int num_channels)
+    {
+        Close();
+        if (rate <= 0 || num_channels <= 0) return false;
+        _rate = rate;
+        _num_channels = static_cast<size_t>(num_channels);
+        _ScanFiles();
+        _Prune(0);
+
+        // every chunk holds whole frames and is a multiple of the 4KB alignment of O_DIRECT
+        size_t frame_bytes = _num_channels * sizeof(int16_t);
+        size_t unit = kAlign;
+        while (unit % frame_bytes) unit += kAlign;
+        _chunk_bytes = (_chunk_bytes + unit - 1) / unit * unit;
+
+        _chunks.assign(_num_chunks, nullptr);
+        for (size_t i = 0; i < _num_chunks; i++) {
+            if (posix_memalign(reinterpret_cast<void**>(&_chunks[i]), kAlign, _chunk_bytes) != 0) {
+                _chunks[i] = nullptr;
+                _FreeChunks();
+                return false;
+            }
+            memset(_chunks[i], 0, _chunk_bytes);
+        }
+        if (posix_memalign(reinterpret_cast<void**>(&_header), kAlign, kAlign) != 0) {
+            _header = nullptr;
+            _FreeChunks();
+            return false;
+        }
+
+        // a chunk is either current, free, full or being written, so the rings never overflow
+        _free.Clear();
+        _full.Clear();
+        _free.SetCapacity(_num_chunks);
+        _full.SetCapacity(_num_chunks);
+        for (size_t i = 1; i < _num_chunks; i++) _free.PushBack() = static_cast<int>(i);
+        _current = 0;
+        _fill = 0;
+        _stop = false;
+        _thread = std::thread(&AsyncWavWriter::_Run, this);
+        return true;
+    }
+
+    /**
+     * Copy the frames into the current chunk, called from the producer thread. It never blocks on the disk.
+     *
+     * @param samples - `num_frames * num_channels` samples.
+     * @param num_frames - The number of frames.
+     * @param interleaved - `false` if the samples are in channel planes (a deinterleaved block).
+     *
+     * @return bool - `false` if some frames were dropped because the disk is late.
+     */
+    bool Write(const int16_t* samples, size_t num_frames, bool interleaved = true)
+    {
+        if (_chunks.empty()) return false;
+        const size_t frame_bytes = _num_channels * sizeof(int16_t);
+        size_t dropped = 0;
+        for (size_t i = 0; i < num_frames;) {
+            if (_current < 0 && !_NextChunk()) {
+                dropped += num_frames - i;
+                break;
+            }
+            int16_t* dst = reinterpret_cast<int16_t*>(_chunks[_current] + _fill);
+            size_t n = std::min(num_frames - i, (_chunk_bytes - _fill) / frame_bytes);
+            if (interleaved) {
+                memcpy(dst, samples + i * _num_channels, n * frame_bytes);
+            } else {
+                for (size_t c = 0; c < _num_channels; c++) {
+                    const int16_t* src = samples + c * num_frames + i;
+                    for (size_t f = 0; f < n; f++) dst[f * _num_channels + c] = src[f];
+                }
+            }
+            _fill += n * frame_bytes;
+            i += n;
+            if (_fill == _chunk_bytes) _Submit();
+        }
+        _dropped_frames += dropped;
+        return dropped == 0;
+    }
+
+    /** Write what's left, finish the file and stop the writer thread. */
+    void Close()
+    {
+        if (!_thread.joinable()) return;
+        if (_current >= 0 && _fill > 0) _Submit();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cv.notify_one();
+        _thread.join();
+        _FreeChunks();
+    }
+
+    /** Get how many frames were dropped because all the chunks were waiting for the disk. */
+    uint64_t GetDroppedFrames() { return _dropped_frames; }
+
+    /** Get how many bytes of audio reached the files. */
+    uint64_t GetWrittenBytes() { return _written_bytes; }
+
+    /** Get how many files were started. */
+    uint64_t GetFileCount() { return _num_files; }
+
+    /** Get how many writes or file operations failed. */
+    uint64_t GetWriteErrorCount() { return _write_errors; }
+
+private:
+    static const size_t kAlign = 4096;
+
+    struct FullChunk
+    {
+        int index;
+        size_t bytes;
+    };
+
+    /** Producer side: hand the current chunk to the writer. */
+    void _Submit()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _full.PushBack() = FullChunk{_current, _fill};
+        }
+        _cv.notify_one();
+        _current = -1;
+        _fill = 0;
+        _NextChunk();
+    }
+
+    bool _NextChunk()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_free.Empty()) return false;
+        _current = _free.Front();
+        _free.PopFront();
+        return true;
+    }
+
+    void _Run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _cv.wait(lock, [this] { return _stop || !_full.Empty(); });
+            if (_full.Empty()) break;
+            FullChunk chunk = _full.Front();
+            _full.PopFront();
+            lock.unlock();
+            _WriteChunk(chunk);
+            lock.lock();
+            _free.PushBack() = chunk.index;
+        }
+        lock.unlock();
+        _CloseFile();
+    }
+
+    void _WriteChunk(const FullChunk& chunk)
+    {
+        if (_fd < 0 && !_OpenFile()) {
+            _dropped_frames += chunk.bytes / (_num_channels * sizeof(int16_t));
+            return;
+        }
+        // the last chunk may be partial, O_DIRECT still needs a 4KB multiple: pad it, the file is truncated on close
+        size_t bytes = (chunk.bytes + kAlign - 1) / kAlign * kAlign;
+        uint8_t* data = _chunks[chunk.index];
+        memset(data + chunk.bytes, 0, bytes - chunk.bytes);
+        if (_PwriteAll(data, bytes, kAlign + _file_bytes)) {
+            _file_bytes += chunk.bytes;
+            _written_bytes += chunk.bytes;
+        } else {
+            _write_errors++;
+        }
+        if (_file_bytes + _chunk_bytes > _max_file_bytes || chunk.bytes < _chunk_bytes) _CloseFile();
+    }
+
+    bool _PwriteAll(const uint8_t* data, size_t bytes, uint64_t offset)
+    {
+        while (bytes > 0) {
+            ssize_t n = pwrite(_fd, data, bytes, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            data += n;
+            bytes -= static_cast<size_t>(n);
+            offset += static_cast<uint64_t>(n);
+        }
+        return true;
+    }
+
+    bool _OpenFile()
+    {
+        char stamp[32];
+        time_t now = time(nullptr);
+        struct tm tm_now;
+        localtime_r(&now, &tm_now);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm_now);
+        _path = _directory + "/" + _prefix + "-" + stamp + "-" + std::to_string(_file_index++) + ".wav";
+
+        int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+#ifdef O_DIRECT
+        if (_direct_io) _fd = open(_path.c_str(), flags | O_DIRECT, 0644);
+#endif
+        if (_fd < 0) _fd = open(_path.c_str(), flags, 0644);   // tmpfs and some others refuse O_DIRECT
+        if (_fd < 0) {
+            _write_errors++;
+            return false;
+        }
+#ifdef FALLOC_FL_KEEP_SIZE
+        fallocate(_fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(kAlign + _max_file_bytes));
+#endif
+        _file_bytes = 0;
+        _num_files++;
+        _BuildHeader(0);
+        if (!_PwriteAll(_header, kAlign, 0)) _write_errors++;
+        return true;
+    }
+
+    void _CloseFile()
+    {
+        if (_fd < 0) return;
+        _BuildHeader(_file_bytes);
+        if (!_PwriteAll(_header, kAlign, 0)) _write_errors++;
+        if (ftruncate(_fd, static_cast<off_t>(kAlign + _file_bytes)) != 0) _write_errors++;
+        close(_fd);
+        _fd = -1;
+
+        _files.push_back(std::make_pair(_path, kAlign + _file_bytes));
+        _total_bytes += kAlign + _file_bytes;
+        _Prune(1);
+    }
+
+    /** Delete the oldest files until the total is under the cap, keeping at least `min_files`. */
+    void _Prune(size_t min_files)
+    {
+        while (_total_bytes > _max_total_bytes && _files.size() > min_files) {
+            unlink(_files.front().first.c_str());
+            _total_bytes -= _files.front().second;
+            _files.pop_front();
+        }
+    }
+
+    /**
+     * List the `prefix-YYYYmmdd-HHMMSS-N.wav` files already in the directory, oldest first, and continue their
+     * numbering so a restart within the same second doesn't overwrite one.
+     */
+    void _ScanFiles()
+    {
+        struct Found
+        {
+            std::string stamp;
+            uint64_t index;
+            std::string path;
+            uint64_t bytes;
+        };
+        std::vector<Found> found;
+        _files.clear();
+        _total_bytes = 0;
+
+        DIR* dir = opendir(_directory.c_str());
+        if (!dir) return;
+        const std::string head = _prefix + "-";
+        while (struct dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            // "YYYYmmdd-HHMMSS-" then at least one digit and ".wav"
+            if (name.size() < head.size() + 16 + 5 || name.compare(0, head.size(), head) != 0) continue;
+            if (name.compare(name.size() - 4, 4, ".wav") != 0) continue;
+            std::string stamp = name.substr(head.size(), 15);
+            std::string index = name.substr(head.size() + 16, name.size() - head.size() - 16 - 4);
+            bool valid = name[head.size() + 15] == '-' && stamp[8] == '-';
+            for (size_t i = 0; i < stamp.size() && valid; i++) valid = i == 8 || isdigit(static_cast<unsigned char>(stamp[i]));
+            for (size_t i = 0; i < index.size() && valid; i++) valid = isdigit(static_cast<unsigned char>(index[i]));
+            struct stat st;
+            std::string path = _directory + "/" + name;
+            if (!valid || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            uint64_t n = strtoull(index.c_str(), nullptr, 10);
+            found.push_back(Found{stamp, n, path, static_cast<uint64_t>(st.st_size)});
+        }
+        closedir(dir);
+
+        std::sort(found.begin(), found.end(), [](const Found& a, const Found& b) {
+            return a.stamp != b.stamp ? a.stamp < b.stamp : a.index < b.index;
+        });
+        for (const Found& f : found) {
+            _files.push_back(std::make_pair(f.path, f.bytes));
+            _total_bytes += f.bytes;
+            _file_index = std::max(_file_index, f.index + 1);
+        }
+    }
+
+    /** RIFF, fmt and a JUNK chunk which pads the header to 4KB, then the data chunk header. */
+    void _BuildHeader(uint64_t data_bytes)
+    {
+        uint32_t data_size = static_cast<uint32_t>(std::min<uint64_t>(data_bytes, 0xffffffffull - kAlign));
+        uint32_t riff_size = static_cast<uint32_t>(kAlign - 8 + data_size);
+        uint16_t channels = static_cast<uint16_t>(_num_channels);
+        uint32_t rate = static_cast<uint32_t>(_rate);
+        uint32_t byte_rate = rate * channels * 2;
+        uint16_t block_align = static_cast<uint16_t>(channels * 2), bits = 16, format = 1;
+        uint32_t fmt_size = 16, junk_size = static_cast<uint32_t>(kAlign - 8 - 44);
+
+        uint8_t* h = _header;
+        memset(h, 0, kAlign);
+        memcpy(h, "RIFF", 4);
+        memcpy(h + 4, &riff_size, 4);
+        memcpy(h + 8, "WAVEfmt ", 8);
+        memcpy(h + 16, &fmt_size, 4);
+        memcpy(h + 20, &format, 2);
+        memcpy(h + 22, &channels, 2);
+        memcpy(h + 24, &rate, 4);
+        memcpy(h + 28, &byte_rate, 4);
+        memcpy(h + 32, &block_align, 2);
+        memcpy(h + 34, &bits, 2);
+        memcpy(h + 36, "JUNK", 4);
+        memcpy(h + 40, &junk_size, 4);
+        memcpy(h + kAlign - 8, "data", 4);
+        memcpy(h + kAlign - 4, &data_size, 4);
+    }
+
+    void _FreeChunks()
+    {
+        for (uint8_t* chunk : _chunks) free(chunk);
+        _chunks.clear();
+        free(_header);
+        _header = nullptr;
+        _current = -1;
+    }
+
+    std::string _directory;
+    std::string _prefix;
+    size_t _chunk_bytes;
+    size_t _num_chunks;
+    uint64_t _max_file_bytes;
+    uint64_t _max_total_bytes;
+    bool _direct_io;
+    int _rate;
+    size_t _num_channels;
+
+    std::vector<uint8_t*> _chunks;
+    uint8_t* _header;
+    int _current;                   ///< The chunk being filled by the producer, `-1` if none is free.
+    size_t _fill;
+
+    std::mutex _mutex;              ///< Only for the chunk lists, held for a push or a pop, once per chunk.
+    std::condition_variable _cv;
+    FixedRing<int> _free;
+    FixedRing<FullChunk> _full;
+    bool _stop;
+    std::thread _thread;
+
+    // writer thread only
+    int _fd;
+    std::string _path;
+    uint64_t _file_bytes;
+    uint64_t _file_index;
+    std::deque<std::pair<std::string, uint64_t>> _files;
+    uint64_t _total_bytes;
+
+    std::atomic<uint64_t> _dropped_frames;
+    std::atomic<uint64_t> _written_bytes;
+    std::atomic<uint64_t> _num_files;
+    std::atomic<uint64_t> _write_errors;
+};
+
+}  //namespace
+
+#endif // !__ASYNC_WAV_WRITER_H__
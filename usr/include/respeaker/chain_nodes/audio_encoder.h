@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __AUDIO_ENCODER_H__
+#define __AUDIO_ENCODER_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace respeaker
+{
+
+/**
+ * An audio codec for respeaker::EncoderNode, e.g. respeaker::OpusAudioEncoder or respeaker::FlacAudioEncoder.
+ * All the methods are called from the node thread. The encoder allocates its state in `Open`, `Encode` doesn't
+ * allocate.
+ */
+class AudioEncoder
+{
+public:
+    /**
+     * The packets come out through this callback, during `Open` (stream headers, `num_frames` is 0) and during
+     * `Encode`. The data is only valid during the call.
+     */
+    typedef std::function<void(const uint8_t* data, size_t size, size_t num_frames)> PacketCallback;
+
+    virtual ~AudioEncoder() = default;
+
+    /**
+     * Called in `EncoderNode::OnStartThread`.
+     *
+     * @param rate - The sample rate of the stream.
+     * @param num_channels - The number of channels, the samples come interleaved.
+     * @param callback - Where the packets go.
+     *
+     * @return bool - `false` if the codec doesn't support this format.
+     */
+    virtual bool Open(int rate, int num_channels, const PacketCallback& callback) = 0;
+
+    /** The number of frames `Encode` takes at each call, e.g. 20ms of audio for Opus. */
+    virtual size_t FrameSize() = 0;
+
+    /**
+     * Encode exactly `FrameSize()` frames.
+     *
+     * @param interleaved - `FrameSize() * num_channels` samples.
+     *
+     * @return bool - `false` on encoder error.
+     */
+    virtual bool Encode(const int16_t* interleaved) = 0;
+
+    /**
+     * Encode the last, partial frame of the stream, called once in `EncoderNode::OnJoinThread` before `Close`.
+     * The default pads the frame with silence and calls `Encode`.
+     *
+     * @param interleaved - `FrameSize() * num_channels` samples, those after `num_frames` are zero.
+     * @param num_frames - The frames of audio, less than `FrameSize()`.
+     *
+     * @return bool - `false` on encoder error.
+     */
+    virtual bool EncodeLast(const int16_t* interleaved, size_t num_frames)
+    {
+        (void)num_frames;
+        return Encode(interleaved);
+    }
+
+    /** Called in `EncoderNode::OnJoinThread`, flush what's left and free the state. */
+    virtual void Close() {}
+
+    /** The largest packet the encoder emits, the packet buffers of the node are allocated with this size. */
+    virtual size_t MaxPacketSize() = 0;
+};
+
+}  //namespace
+
+#endif // !__AUDIO_ENCODER_H__
@@ -40,15 +40,35 @@ enum NodeType {
     PULSE_COLLECTOR_NODE = 10, ///< PulseCollectorNode
     ALSA_COLLECTOR_NODE = 11, ///< AlsaCollectorNode
     FILE_COLLECTOR_NODE = 12, ///< FileCollectorNode
+    ALSA_MMAP_COLLECTOR_NODE = 13, ///< AlsaMmapCollectorNode
+    PIPEWIRE_COLLECTOR_NODE = 14, ///< PipeWireCollectorNode
+    REPLAY_COLLECTOR_NODE = 15, ///< ReplayCollectorNode
     HYBRID_NODE = 20, ///< HybridNode
     SELECTOR_NODE = 21, ///< SelectorNode
+    WAKE_GATE_NODE = 22, ///< WakeGateNode
+    SRP_PHAT_DOA_NODE = 23, ///< SrpPhatDoaNode
+    REFERENCE_INPUT_NODE = 24, ///< ReferenceInputNode
+    ECHO_ACTIVITY_NODE = 25, ///< EchoActivityNode
+    MULTI_CHANNEL_HYBRID_NODE = 26, ///< MultiChannelHybridNode
+    LIGHT_VAD_NODE = 27, ///< LightVadNode
+    ENCODER_NODE = 28, ///< EncoderNode
+    WAV_LOGGER_NODE = 29, ///< WavLoggerNode
     VEP_AEC_BEAMFORMING_NODE = 30, ///< VepAecBeamformingNode
+    GEOMETRIC_BEAMFORMING_NODE = 31, ///< GeometricBeamformingNode
     SNOWBOY_1B_DOA_KWS_NODE = 40, ///< Snowboy1bDoaKwsNode
     SNOWBOY_MANUAL_BEAM_KWS_NODE = 41, ///< SnowboyManKwsNode
     SNOWBOY_MB_DOA_KWS_NODE = 42, ///< SnowboyMbDoaKwsNode
     SNIPS_1B_DOA_KWS_NODE = 43, ///< Snips1bDoaKwsNode
     SNIPS_MANUAL_BEAM_KWS_NODE = 44, ///< SnipsManBeamKwsNode
+    RANKED_MB_DOA_KWS_NODE = 45, ///< RankedMbDoaKwsNode
     ALOOP_OUTPUT_NODE = 50, ///< AloopOutputNode
+    PIPEWIRE_OUTPUT_NODE = 51, ///< PipeWireOutputNode
+    SHM_OUTPUT_NODE = 52, ///< ShmOutputNode
+    SESSION_RECORDER_NODE = 60, ///< SessionRecorderNode
+    CHANNEL_MATRIX_NODE = 61, ///< ChannelMatrixNode
+    BROADCAST_NODE = 62, ///< BroadcastNode
+    BROADCAST_READER_NODE = 63, ///< BroadcastReaderNode
+    DUTY_CYCLE_NODE = 64, ///< DutyCycleNode
 };
 
 /** The paramenters for a node's input and output block */
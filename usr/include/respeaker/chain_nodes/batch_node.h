@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __BATCH_NODE_H__
+#define __BATCH_NODE_H__
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "chain_nodes/base_node.h"
+
+namespace respeaker
+{
+
+/**
+ * The nodes which can process several blocks at once should inherit from this class and implement `ProcessBlocks`
+ * instead of `ProcessBlock`. With 8ms blocks, a node thread wakes up 125 times per second and pays the queue lock,
+ * the virtual calls and a cold cache for each block. When the blocks pile up in the input queue of the node (the chain
+ * is behind, a burst from respeaker::DutyCycleNode, or an offline run from a file), this takes up to
+ * `max_batch_blocks` of them in one go, under one lock, and hands them to `ProcessBlocks` as a span, so a stateless
+ * or vectorized stage runs over all of them back to back. When a single block is queued, the span is that block.
+ *
+ * The outputs keep the order of the blocks: all but the last are stored by `StoreBlock` from here, the last one is
+ * returned to BaseNode, which stores it as usual. So `StoreBlock` still sees every block once, in order, from the
+ * thread of the node, as BaseNode would have called it after each `ProcessBlock`.
+ *
+ * The extra blocks are popped from the queue of the uplink node directly, under its queue mutex, since
+ * `BaseNode::FetchBlock` would wait for a block when there's none. This bypasses what `FetchBlock` does beyond the
+ * pop, for those blocks only: the wait on the condition variable (they're already there), the check of the exit flag
+ * and the queue flush of an overloaded uplink (`EnableQueueFlush`), both applied again by the next `FetchBlock`. The
+ * exit flag and the pause are checked here before taking any, so a stopping chain doesn't start a new span.
+ *
+ * Subclasses call `_InitBatch()` in their `OnStartThread`, it sizes the span to `SetMaxBatchBlocks`.
+ */
+class BatchNode : public BaseNode
+{
+public:
+    virtual ~BatchNode() = default;
+
+    /**
+     * Subclass should implement this method, process the blocks in place, each block is replaced by its output.
+     *
+     * @param blocks [in/out] - The blocks, oldest first.
+     * @param num_blocks - At least `1`.
+     * @param exit [out] - The exit flag of the ChainSharedData is set, the thread should join now.
+     */
+    virtual void ProcessBlocks(std::string* blocks, size_t num_blocks, bool& exit) = 0;
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        _batch[0].swap(block);
+        size_t num_blocks = 1 + _TakeQueuedBlocks(_batch.size() - 1);
+        ProcessBlocks(_batch.data(), num_blocks, exit);
+        _num_batches++;
+        _num_blocks += num_blocks;
+
+        for (size_t i = 0; i + 1 < num_blocks; i++) StoreBlock(std::move(_batch[i]), exit);
+        std::string last;
+        last.swap(_batch[num_blocks - 1]);
+        return last;
+    }
+
+    /**
+     * Set the maximum number of blocks in a span, default to 8. It takes effect when the chain starts.
+     *
+     * @param max_batch_blocks - `1` processes the blocks one by one.
+     */
+    void SetMaxBatchBlocks(size_t max_batch_blocks)
+    {
+        _max_batch_blocks = max_batch_blocks ? max_batch_blocks : 1;
+    }
+
+    virtual void Pause()
+    {
+        _paused = true;
+        BaseNode::Pause();
+    }
+
+    virtual void Resume()
+    {
+        _paused = false;
+        BaseNode::Resume();
+    }
+
+    /** Get the average number of blocks per span, how far behind the node runs. */
+    float GetAverageBatchSize()
+    {
+        uint64_t batches = _num_batches, blocks = _num_blocks;
+        return batches ? static_cast<float>(blocks) / batches : 0.0f;
+    }
+
+protected:
+    BatchNode() : _max_batch_blocks(8), _paused(false), _batch(8), _num_batches(0), _num_blocks(0) {}
+
+    /** Size the span, from `OnStartThread`, on the thread which starts the chain. */
+    void _InitBatch()
+    {
+        _batch.resize(_max_batch_blocks);
+    }
+
+    /** Take the blocks which are already in the input queue, without waiting for more. */
+    size_t _TakeQueuedBlocks(size_t max_blocks)
+    {
+        if (!_uplink_node || max_blocks == 0 || _paused) return 0;
+        if (_chain_shared_data) {
+            std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_exit_flag);
+            if (_chain_shared_data->exit_flag) return 0;
+        }
+        std::mutex* mutex = _uplink_node->GetDownlinkDataQueueMutex(this);
+        if (!mutex) return 0;
+        std::queue<std::string>& queue = _uplink_node->GetDownlinkDataQueue(this);
+        std::lock_guard<std::mutex> lock(*mutex);
+        size_t taken = 0;
+        while (taken < max_blocks && !queue.empty()) {
+            _batch[1 + taken].swap(queue.front());
+            queue.pop();
+            taken++;
+        }
+        return taken;
+    }
+
+    std::atomic<size_t> _max_batch_blocks;
+    std::atomic<bool> _paused;
+    std::vector<std::string> _batch;        ///< Only touched by the thread of the node, after `_InitBatch`.
+    std::atomic<uint64_t> _num_batches;
+    std::atomic<uint64_t> _num_blocks;
+};
+
+}  //namespace
+
+#endif // !__BATCH_NODE_H__
@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __BLOCK_POOL_H__
+#define __BLOCK_POOL_H__
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef RESPEAKER_ALLOC_GUARD
+#include "chain_nodes/alloc_guard.h"
+#endif
+
+#ifndef RESPEAKER_BLOCK_POOL_ARENA_MB
+#define RESPEAKER_BLOCK_POOL_ARENA_MB (sizeof(void*) == 4 ? 64 : 256)
+#endif
+
+namespace respeaker
+{
+
+/**
+ * A block allocator for the chain threads. The blocks are `std::string`s created by one node thread and freed by
+ * another one after crossing a queue, so with the general-purpose heap the node threads (pinned by `BindToCore`)
+ * contend on the allocator and the cache lines of the buffers bounce between the cores.
+ *
+ * Here every thread owns a heap (a thread pinned to a core gets back a heap of that core after a restart of the
+ * chain), with a free list per size class (64B to 32KB, powers of two, the larger ones go to `malloc`). The buffers are
+ * cut from 64KB slabs of one hugepage-backed arena, cache-line aligned, and a slab is first touched by its owner so
+ * it's local to its NUMA node. A buffer freed by its owner goes back to the owner's free list and stays warm in its
+ * L2. A buffer freed by another thread is pushed onto a lock-free return stack of the owner (remote free), which the
+ * owner takes whole when its free list runs out. Once the free lists are warm, the steady state doesn't touch the
+ * general-purpose heap at all.
+ *
+ * The pool serves the `std::string` blocks of the whole library (including the closed-source nodes) through a
+ * replacement of the global `operator new`, which you opt in by expanding this in one source file of the application:
+ * ```cpp
+ * #include <respeaker/chain_nodes/block_pool.h>
+ * RESPEAKER_BLOCK_POOL_OPERATOR_NEW()
+ * ```
+ * The arena is reserved (not committed) at the first allocation, `-DRESPEAKER_BLOCK_POOL_ARENA_MB=N` sets its size.
+ */
+class CoreBlockPool
+{
+public:
+    struct Stats
+    {
+        size_t num_heaps;           ///< The threads which allocated from the pool.
+        size_t num_slabs;           ///< The 64KB slabs in use.
+        uint64_t remote_frees;      ///< The buffers freed by another thread than their owner.
+        uint64_t fallback_allocs;   ///< The allocations which went to `malloc`: too large, arena full or re-entrant.
+        bool hugepages;             ///< The arena is backed by hugetlbfs pages, else transparent hugepages if enabled.
+    };
+
+    /** Allocate `size` bytes, 64 bytes aligned when served by the pool. Falls back to `malloc`. */
+    static void* Allocate(size_t size)
+    {
+        int size_class = _SizeClass(size);
+        Heap* heap = size_class >= 0 ? _ThreadHeap() : nullptr;
+        if (!heap) return _Fallback(size);
+
+        FreeBlock* block = heap->local[size_class];
+        if (!block) {
+            // take back what the other threads freed
+            block = heap->remote[size_class].exchange(nullptr, std::memory_order_acquire);
+        }
+        if (block) {
+            heap->local[size_class] = block->next;
+            return block;
+        }
+        void* p = _CarveBlock(heap, size_class);
+        return p ? p : _Fallback(size);
+    }
+
+    static void Free(void* p)
+    {
+        if (!p) return;
+        Arena& arena = _Arena();
+        char* c = static_cast<char*>(p);
+        if (c < arena.base || c >= arena.end) {
+            free(p);
+            return;
+        }
+
+        Slab* slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(p) & ~(kSlabSize - 1));
+        Heap* owner = slab->owner;
+        FreeBlock* block = static_cast<FreeBlock*>(p);
+        if (owner == _CurrentHeap()) {
+            block->next = owner->local[slab->size_class];
+            owner->local[slab->size_class] = block;
+            return;
+        }
+
+        // multiple producers push, only the owner pops and it takes the whole stack, so there's no ABA
+        std::atomic<FreeBlock*>& stack = owner->remote[slab->size_class];
+        FreeBlock* head = stack.load(std::memory_order_relaxed);
+        do {
+            block->next = head;
+        } while (!stack.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+        owner->remote_frees.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /** Get if `p` was allocated by the pool (rather than by the `malloc` fallback). */
+    static bool Owns(const void* p)
+    {
+        Arena& arena = _Arena();
+        const char* c = static_cast<const char*>(p);
+        return c >= arena.base && c < arena.end;
+    }
+
+    static Stats GetStats()
+    {
+        Arena& arena = _Arena();
+        Stats stats;
+        stats.num_heaps = arena.num_heaps.load(std::memory_order_relaxed);
+        stats.num_slabs = (arena.next_slab.load(std::memory_order_relaxed) - arena.base) / kSlabSize;
+        stats.remote_frees = 0;
+        for (size_t i = 0; i < stats.num_heaps && i < kMaxHeaps; i++) {
+            stats.remote_frees += arena.heaps[i].remote_frees.load(std::memory_order_relaxed);
+        }
+        stats.fallback_allocs = arena.fallback_allocs.load(std::memory_order_relaxed);
+        stats.hugepages = arena.hugepages;
+        return stats;
+    }
+
+    static const size_t kSlabSize = 64 * 1024;
+    static const size_t kMinBlockShift = 6;
+    static const int kNumClasses = 10;  // 64B ... 32KB
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    enum HeapState { HEAP_UNUSED = 0, HEAP_OWNED = 1, HEAP_ORPHAN = 2 };
+
+    /** Only touched by its owner thread, except the return stacks which have their own cache line. */
+    struct alignas(64) Heap
+    {
+        std::atomic<int> state;
+        int core;
+        FreeBlock* local[kNumClasses];
+        char* bump[kNumClasses];
+        char* bump_end[kNumClasses];
+        alignas(64) std::atomic<FreeBlock*> remote[kNumClasses];
+        std::atomic<uint64_t> remote_frees;
+    };
+
+    /** At the start of every slab, found from any block by masking its address. */
+    struct alignas(64) Slab
+    {
+        Heap* owner;
+        int size_class;
+    };
+
+    static const size_t kMaxHeaps = 128;
+
+    struct Arena
+    {
+        char* base;
+        char* end;
+        std::atomic<char*> next_slab;
+        bool hugepages;
+        std::atomic<size_t> num_heaps;
+        std::atomic<uint64_t> fallback_allocs;
+        pthread_key_t exit_key;
+        Heap heaps[kMaxHeaps];
+    };
+
+    static int _SizeClass(size_t size)
+    {
+        if (size > (kSlabSize >> 1)) return -1;
+        int size_class = 0;
+        while ((static_cast<size_t>(1) << (size_class + kMinBlockShift)) < size) size_class++;
+        return size_class < kNumClasses ? size_class : -1;
+    }
+
+    static void* _Fallback(size_t size)
+    {
+#ifdef RESPEAKER_ALLOC_GUARD
+        AllocationGuard::OnAllocate(size);
+#endif
+        _Arena().fallback_allocs.fetch_add(1, std::memory_order_relaxed);
+        return malloc(size ? size : 1);
+    }
+
+    static void* _CarveBlock(Heap* heap, int size_class)
+    {
+        size_t block_size = static_cast<size_t>(1) << (size_class + kMinBlockShift);
+        if (heap->bump[size_class] + block_size > heap->bump_end[size_class]) {
+            Arena& arena = _Arena();
+            char* slab = arena.next_slab.fetch_add(kSlabSize, std::memory_order_relaxed);
+            if (slab + kSlabSize > arena.end) return nullptr;
+            // first touch by the owner, the page is allocated on its NUMA node
+            Slab* header = reinterpret_cast<Slab*>(slab);
+            header->owner = heap;
+            header->size_class = size_class;
+            size_t first = sizeof(Slab) > block_size ? sizeof(Slab) : block_size;
+            heap->bump[size_class] = slab + first;
+            heap->bump_end[size_class] = slab + kSlabSize;
+        }
+        void* p = heap->bump[size_class];
+        heap->bump[size_class] += block_size;
+        return p;
+    }
+
+    static Arena& _Arena()
+    {
+        // placement-new into static storage, the arena must not depend on the heap it replaces
+        alignas(Arena) static char storage[sizeof(Arena)];
+        static Arena* arena = _CreateArena(storage);
+        return *arena;
+    }
+
+    static Arena* _CreateArena(void* storage)
+    {
+        Arena* arena = static_cast<Arena*>(storage);
+        memset(storage, 0, sizeof(Arena));
+        size_t size = static_cast<size_t>(RESPEAKER_BLOCK_POOL_ARENA_MB) << 20;
+        const size_t align = 2 << 20;
+        arena->hugepages = false;
+        char* base = nullptr;
+#ifdef MAP_HUGETLB
+        // without MAP_NORESERVE the hugepages are reserved now, else a missing page would be a SIGBUS on first touch
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            base = static_cast<char*>(p);
+            arena->hugepages = true;
+        }
+#endif
+        if (!base) {
+            // over-reserve to align on a hugepage boundary, then ask for transparent hugepages
+            void* q = mmap(nullptr, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                           -1, 0);
+            if (q != MAP_FAILED) {
+                base = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(q) + align - 1) & ~(align - 1));
+#ifdef MADV_HUGEPAGE
+                madvise(base, size, MADV_HUGEPAGE);
+#endif
+            } else {
+                size = 0;
+            }
+        }
+        arena->base = base;
+        arena->end = base + size;
+        arena->next_slab.store(base, std::memory_order_relaxed);
+        pthread_key_create(&arena->exit_key, &CoreBlockPool::_OnThreadExit);
+        return arena;
+    }
+
+    static Heap*& _CurrentHeap()
+    {
+        static thread_local Heap* heap = nullptr;
+        return heap;
+    }
+
+    /** The heap of the calling thread, or `nullptr` while it's being set up (the setup may allocate). */
+    static Heap* _ThreadHeap()
+    {
+        Heap*& heap = _CurrentHeap();
+        if (heap) return heap;
+        static thread_local bool busy = false;
+        if (busy) return nullptr;
+        busy = true;
+        heap = _AcquireHeap();
+        if (heap) pthread_setspecific(_Arena().exit_key, heap);
+        busy = false;
+        return heap;
+    }
+
+    /** Adopt a heap left by an exited thread, preferably one of this core, or take a new one. */
+    static Heap* _AcquireHeap()
+    {
+        Arena& arena = _Arena();
+        if (arena.base == arena.end) return nullptr;
+        int core = sched_getcpu();
+        size_t num_heaps = arena.num_heaps.load(std::memory_order_acquire);
+        for (int pass = 0; pass < 2; pass++) {
+            for (size_t i = 0; i < num_heaps && i < kMaxHeaps; i++) {
+                Heap& heap = arena.heaps[i];
+                int expected = HEAP_ORPHAN;
+                if ((pass == 1 || heap.core == core) &&
+                    heap.state.compare_exchange_strong(expected, HEAP_OWNED, std::memory_order_acquire)) {
+                    heap.core = core;
+                    return &heap;
+                }
+            }
+        }
+        size_t i = arena.num_heaps.fetch_add(1, std::memory_order_acq_rel);
+        if (i >= kMaxHeaps) return nullptr;
+        Heap& heap = arena.heaps[i];
+        heap.core = core;
+        heap.state.store(HEAP_OWNED, std::memory_order_release);
+        return &heap;
+    }
+
+    static void _OnThreadExit(void* heap)
+    {
+        static_cast<Heap*>(heap)->state.store(HEAP_ORPHAN, std::memory_order_release);
+    }
+};
+
+}  //namespace
+
+/** Route the global `operator new`/`delete` through respeaker::CoreBlockPool, expand it in one source file. */
+#define RESPEAKER_BLOCK_POOL_OPERATOR_NEW()                                                                            \
+    void* operator new(std::size_t size)                                                                               \
+    {                                                                                                                  \
+        void* p = respeaker::CoreBlockPool::Allocate(size);                                                            \
+        if (!p) throw std::bad_alloc();                                                                                \
+        return p;                                                                                                      \
+    }                                                                                                                  \
+    void* operator new[](std::size_t size) { return operator new(size); }                                              \
+    void* operator new(std::size_t size, const std::nothrow_t&) noexcept                                               \
+    {                                                                                                                  \
+        return respeaker::CoreBlockPool::Allocate(size);                                                               \
+    }                                                                                                                  \
+    void* operator new[](std::size_t size, const std::nothrow_t&) noexcept                                             \
+    {                                                                                                                  \
+        return respeaker::CoreBlockPool::Allocate(size);                                                               \
+    }                                                                                                                  \
+    void operator delete(void* p) noexcept { respeaker::CoreBlockPool::Free(p); }                                      \
+    void operator delete[](void* p) noexcept { respeaker::CoreBlockPool::Free(p); }                                    \
+    void operator delete(void* p, std::size_t) noexcept { respeaker::CoreBlockPool::Free(p); }                         \
+    void operator delete[](void* p, std::size_t) noexcept { respeaker::CoreBlockPool::Free(p); }                       \
+    void operator delete(void* p, const std::nothrow_t&) noexcept { respeaker::CoreBlockPool::Free(p); }               \
+    void operator delete[](void* p, const std::nothrow_t&) noexcept { respeaker::CoreBlockPool::Free(p); }
+
+#endif // !__BLOCK_POOL_H__
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __BLOCK_UTILS_H__
+#define __BLOCK_UTILS_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+namespace respeaker
+{
+
+/**
+ * Get the number of frames (samples per channel) contained in a S16_LE block.
+ *
+ * @param block - The audio block.
+ * @param num_channels - The number of channels of the block.
+ *
+ * @return size_t
+ */
+inline size_t BlockNumFrames(const std::string& block, size_t num_channels)
+{
+    return num_channels ? block.size() / (sizeof(int16_t) * num_channels) : 0;
+}
+
+/** Get the read-only sample pointer of a block. */
+inline const int16_t* BlockSamples(const std::string& block)
+{
+    return reinterpret_cast<const int16_t*>(block.data());
+}
+
+/** Get the writable sample pointer of a block. */
+inline int16_t* BlockSamples(std::string& block)
+{
+    return reinterpret_cast<int16_t*>(&block[0]);
+}
+
+/**
+ * Hand out `output` as the processed block and keep the buffer of the input `block` for the next output, rather than
+ * allocating a block per call: `return SwapOutBlock(block, _output);`. It doesn't allocate as long as the outputs
+ * aren't larger than the capacity of the inputs, see respeaker::ReserveBlockCapacity.
+ */
+inline std::string SwapOutBlock(std::string& block, std::string& output)
+{
+    block.swap(output);
+    return std::move(block);
+}
+
+/** The capacity of the blocks made by respeaker::NewBlock, in bytes. */
+inline std::atomic<size_t>& BlockCapacity()
+{
+    static std::atomic<size_t> capacity(0);
+    return capacity;
+}
+
+/**
+ * Make the collectors of this library give their blocks at least `bytes` of capacity. The nodes whose output is larger
+ * than their input (e.g. an upmix) call it when they start: the input buffers they recycle with
+ * respeaker::SwapOutBlock are then large enough for their output, and they don't allocate per block.
+ */
+inline void ReserveBlockCapacity(size_t bytes)
+{
+    std::atomic<size_t>& capacity = BlockCapacity();
+    size_t current = capacity.load(std::memory_order_relaxed);
+    while (current < bytes && !capacity.compare_exchange_weak(current, bytes, std::memory_order_relaxed)) {}
+}
+
+/**
+ * Allocate a zeroed block of `bytes` bytes, with the capacity reserved by respeaker::ReserveBlockCapacity. This is the
+ * block a collector hands to the chain, the one allocation per block of the chain (served by respeaker::CoreBlockPool
+ * when it's enabled).
+ */
+inline std::string NewBlock(size_t bytes)
+{
+    std::string block;
+    block.reserve(std::max(bytes, BlockCapacity().load(std::memory_order_relaxed)));
+    block.assign(bytes, '\0');
+    return block;
+}
+
+/**
+ * Copy one channel out of a block, works for both interleaved and deinterleaved layouts.
+ *
+ * @param block - The audio block.
+ * @param num_channels - The number of channels of the block.
+ * @param interleaved - The layout of the block.
+ * @param channel - The index of the channel to copy, starts from `0`.
+ * @param out [out] - At least `BlockNumFrames(block, num_channels)` samples.
+ *
+ * @return size_t - The number of frames copied.
+ */
+inline size_t CopyChannel(const std::string& block, size_t num_channels, bool interleaved, size_t channel,
+                          int16_t* out)
+{
+    const size_t num_frames = BlockNumFrames(block, num_channels);
+    const int16_t* in = BlockSamples(block);
+
+    if (channel >= num_channels) return 0;
+
+    if (interleaved) {
+        in += channel;
+        for (size_t i = 0; i < num_frames; i++) {
+            out[i] = in[i * num_channels];
+        }
+    } else {
+        in += channel * num_frames;
+        for (size_t i = 0; i < num_frames; i++) {
+            out[i] = in[i];
+        }
+    }
+    return num_frames;
+}
+
+/**
+ * Get the sum of squares and the sum of squared first differences of one channel, in a single pass.
+ * The ratio of the two is a cheap spectral tilt measure: ~0 for low rumble, ~2 for white noise.
+ *
+ * @return int64_t - The sum of squares (energy).
+ */
+inline int64_t ChannelEnergy(const std::string& block, size_t num_channels, bool interleaved, size_t channel,
+                             int64_t* diff_energy = nullptr)
+{
+    const size_t num_frames = BlockNumFrames(block, num_channels);
+    const int16_t* in = BlockSamples(block);
+    const size_t stride = interleaved ? num_channels : 1;
+    int64_t energy = 0, denergy = 0;
+    int32_t prev = 0;
+
+    if (channel >= num_channels || num_frames == 0) {
+        if (diff_energy) *diff_energy = 0;
+        return 0;
+    }
+
+    in += interleaved ? channel : channel * num_frames;
+    prev = in[0];
+    for (size_t i = 0; i < num_frames; i++) {
+        int32_t s = in[i * stride];
+        int32_t d = s - prev;
+        energy += s * s;
+        denergy += static_cast<int64_t>(d) * d;
+        prev = s;
+    }
+    if (diff_energy) *diff_energy = denergy;
+    return energy;
+}
+
+}  // namespace respeaker
+
+#endif // !__BLOCK_UTILS_H__
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __BROADCAST_NODE_H__
+#define __BROADCAST_NODE_H__
+
+#include <cstdint>
+#include <string>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/broadcast_ring.h"
+#include "chain_nodes/chain_trace.h"
+
+namespace respeaker
+{
+
+/**
+ * The BroadcastNode fans a stream out to several branches without copying the block for each of them. BaseNode keeps
+ * one queue per downlink and `StoreBlock` copies the block into every queue, on the thread of the node, so adding a
+ * monitoring branch doubles the memory traffic of the node which feeds it. Here the block is published once into a
+ * respeaker::BroadcastRing and only an 8 bytes token goes through the queues, to respeaker::BroadcastReaderNode
+ * downlinks which copy the block out on their own threads (and cores).
+ *
+ *     collector --> ... --> BroadcastNode --> BroadcastReaderNode(BLOCK) --> KWS node ...
+ *                                        \--> BroadcastReaderNode(DROP)  --> ShmOutputNode (monitoring)
+ *
+ * Every downlink of this node must be a BroadcastReaderNode, and this node must not be a tail of the chain.
+ */
+class BroadcastNode : public BaseNode
+{
+public:
+    /**
+     * Create a BroadcastNode instance.
+     *
+     * @param capacity - The blocks kept in the ring, i.e. how far a reader can fall behind before its policy applies.
+     * @param block_timeout_ms - How long the node waits for a BROADCAST_BLOCK reader a whole ring behind, before it
+     *                           overwrites the block anyway. Default to 200ms.
+     *
+     * @return BroadcastNode*
+     */
+    static BroadcastNode* Create(size_t capacity=16, int block_timeout_ms=200)
+    {
+        return new BroadcastNode(capacity, block_timeout_ms);
+    }
+
+    virtual ~BroadcastNode() = default;
+
+    virtual bool OnStartThread()
+    {
+        if (_ring.GetNumReaders() == 0) return false;
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = BROADCAST_NODE;
+        // the tokens must reach the queues untouched, no layout conversion in StoreBlock
+        _is_interleaved_after_process = _input_parameter.interleaved;
+        _ring.Reset();
+        return true;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        return block;
+    }
+
+    virtual void StoreBlock(std::string block, bool& exit)
+    {
+        RESPEAKER_TRACE_SCOPE("BroadcastNode");
+        uint64_t seq = _ring.Publish(block);
+        BaseNode::StoreBlock(BroadcastRing::Token(seq), exit);
+    }
+
+    virtual bool OnJoinThread()
+    {
+        return true;
+    }
+
+    /** Get the ring, for the stats of the readers. */
+    BroadcastRing& GetRing() { return _ring; }
+
+protected:
+    friend class BroadcastReaderNode;
+
+    BroadcastNode(size_t capacity, int block_timeout_ms) : _ring(capacity, block_timeout_ms) {}
+
+    BroadcastRing _ring;
+};
+
+/**
+ * The BroadcastReaderNode is a downlink of a respeaker::BroadcastNode: it turns the tokens back into the blocks of the
+ * stream, with the same format, according to its policy when it falls a whole ring behind:
+ * - BROADCAST_BLOCK - the broadcast node waits for it, for the branches which must not lose audio (e.g. the KWS). A
+ *   reader stalled longer than the block timeout is marked lagging and loses blocks like a DROP reader until it
+ *   catches up, so it doesn't slow the other branches down to one block per timeout.
+ * - BROADCAST_DROP - the lost blocks are output as empty blocks and counted, e.g. for a monitoring tap.
+ * - BROADCAST_DETACH - it stops at the first lost block and outputs empty blocks until `Reattach()`, so a stalled
+ *   consumer doesn't slow down the other branches.
+ *
+ * Each reader allocates one block buffer per block, like a collector: its output leaves with the chain, and the token
+ * it gets in exchange is too small to hold the next block. That allocation is served by respeaker::CoreBlockPool when
+ * the application enables it, and it's exempt from respeaker::AllocationGuard.
+ */
+class BroadcastReaderNode : public BaseNode
+{
+public:
+    /**
+     * Create a BroadcastReaderNode instance, then register `source` as its uplink node.
+     *
+     * @param source - The broadcast node, created before, before the chain starts.
+     * @param policy - What to do when this reader is too slow, default to BROADCAST_DROP.
+     *
+     * @return BroadcastReaderNode*
+     */
+    static BroadcastReaderNode* Create(BroadcastNode* source, BroadcastPolicy policy=BROADCAST_DROP)
+    {
+        return new BroadcastReaderNode(source, policy);
+    }
+
+    virtual ~BroadcastReaderNode() = default;
+
+    virtual bool OnStartThread()
+    {
+        if (!_source || _uplink_node != _source) return false;
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = BROADCAST_READER_NODE;
+        _is_interleaved_after_process = _input_parameter.interleaved;
+        size_t block_ms = _input_parameter.block_len_ms ? _input_parameter.block_len_ms : 8;
+        _block_bytes = _input_parameter.rate * block_ms / 1000 * _input_parameter.num_channel * sizeof(int16_t);
+        _out.reserve(_block_bytes);
+        return true;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("BroadcastReaderNode");
+        if (_out.capacity() < _block_bytes) {
+            // the one block buffer per block of the reader, see the class docs
+            RESPEAKER_ALLOC_GUARD_SCOPE(nullptr);
+            _out.reserve(_block_bytes);
+        }
+        uint64_t seq = BroadcastRing::ParseToken(block);
+        _out.clear();
+        if (seq) _source->_ring.Read(_reader_id, seq, _out);
+        _out.swap(block);
+        return block;
+    }
+
+    virtual bool OnJoinThread()
+    {
+        return true;
+    }
+
+    /** Attach the reader again after it was detached (BROADCAST_DETACH), from the next block. */
+    void Reattach() { _source->_ring.Reattach(_reader_id); }
+
+    bool IsAttached() { return _source->_ring.IsAttached(_reader_id); }
+
+    /** Get if this BROADCAST_BLOCK reader is lagging, i.e. the broadcast node stopped waiting for it. */
+    bool IsLagging() { return _source->_ring.IsLagging(_reader_id); }
+
+    /** Get how many blocks this reader lost. */
+    uint64_t GetDroppedCount() { return _source->_ring.GetDroppedCount(_reader_id); }
+
+    /** Get how many blocks this reader is behind the broadcast node. */
+    uint64_t GetLag() { return _source->_ring.GetLag(_reader_id); }
+
+protected:
+    BroadcastReaderNode(BroadcastNode* source, BroadcastPolicy policy)
+        : _source(source),
+          _reader_id(source ? source->_ring.AddReader(policy) : -1),
+          _block_bytes(0)
+    {}
+
+    BroadcastNode* _source;
+    int _reader_id;
+    size_t _block_bytes;
+    std::string _out;           ///< Filled by the ring, then swapped with the token, so `Read` keeps its capacity.
+};
+
+}  //namespace
+
+#endif // !__BROADCAST_NODE_H__
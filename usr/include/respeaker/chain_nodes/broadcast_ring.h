@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __BROADCAST_RING_H__
+#define __BROADCAST_RING_H__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace respeaker
+{
+
+/** What happens to a reader of a respeaker::BroadcastRing which falls a whole ring behind the writer. */
+enum BroadcastPolicy
+{
+    BROADCAST_BLOCK = 0,    ///< The writer waits for the reader, up to the block timeout of the ring. After a
+                            ///< timeout the reader is lagging: it's not waited for, and loses the overwritten blocks
+                            ///< (counted), until its cursor is back within the ring.
+    BROADCAST_DROP = 1,     ///< The reader loses the overwritten blocks, they're counted.
+    BROADCAST_DETACH = 2,   ///< The reader is detached at its first lost block, until `Reattach`.
+};
+
+/**
+ * A ring of the last `capacity` blocks of a stream, published once by one writer and read by several readers, each
+ * with its own cursor and its own policy when it's too slow. A block is published by swapping it into a slot, so the
+ * writer doesn't copy it at all, whatever the number of readers. The readers copy it out on their own threads.
+ *
+ * The sequence numbers start from `1`, the blocks travel through the queues of the chain as an 8 bytes token (short
+ * enough for the inline buffer of `std::string`, so the token doesn't allocate either).
+ */
+class BroadcastRing
+{
+public:
+    explicit BroadcastRing(size_t capacity = 16, int block_timeout_ms = 200)
+        : _capacity(capacity ? capacity : 1),
+          _slots(new Slot[_capacity]),
+          _block_timeout_ms(block_timeout_ms),
+          _has_blocking_readers(false),
+          _last_seq(0),
+          _block_timeouts(0)
+    {}
+
+    /**
+     * Add a reader, before the chain starts.
+     *
+     * @return int - The id of the reader.
+     */
+    int AddReader(BroadcastPolicy policy)
+    {
+        std::unique_ptr<Reader> reader(new Reader());
+        reader->policy = policy;
+        _readers.push_back(std::move(reader));
+        if (policy == BROADCAST_BLOCK) _has_blocking_readers = true;
+        Reset();
+        return static_cast<int>(_readers.size()) - 1;
+    }
+
+    size_t GetNumReaders() { return _readers.size(); }
+
+    /** Forget the blocks and attach all the readers again, when the chain starts. */
+    void Reset()
+    {
+        for (size_t i = 0; i < _capacity; i++) {
+            std::lock_guard<std::mutex> lock(_slots[i].mutex);
+            _slots[i].seq = 0;
+        }
+        for (std::unique_ptr<Reader>& reader : _readers) {
+            reader->cursor = 1;
+            reader->resume_seq = 1;
+            reader->attached = true;
+            reader->lagging = false;
+        }
+        _last_seq = 0;
+    }
+
+    /**
+     * Publish a block, from the writer thread. The blocking readers which are a whole ring behind are waited for, up
+     * to the block timeout. Those still behind then lose the oldest block and are marked lagging, so one stalled
+     * reader costs the writer one timeout, not one per block, until it catches up.
+     *
+     * @param block [in, out] - The block is swapped into the ring, it's left with the buffer of the block it replaced.
+     *
+     * @return uint64_t - The sequence number of the block.
+     */
+    uint64_t Publish(std::string& block)
+    {
+        uint64_t seq = _last_seq.load(std::memory_order_relaxed) + 1;
+        if (_has_blocking_readers && seq > _capacity) _WaitForBlockingReaders(seq - _capacity);
+
+        Slot& slot = _slots[seq % _capacity];
+        {
+            std::lock_guard<std::mutex> lock(slot.mutex);
+            slot.data.swap(block);
+            slot.seq = seq;
+        }
+        _last_seq.store(seq, std::memory_order_release);
+        return seq;
+    }
+
+    /**
+     * Copy the block `seq` out for a reader, from the reader thread.
+     *
+     * @param out [out] - Assigned, it keeps its capacity.
+     *
+     * @return bool - `false` if the block was lost (overwritten before the reader got to it) or the reader is detached.
+     */
+    bool Read(int reader_id, uint64_t seq, std::string& out)
+    {
+        Reader& reader = *_readers[reader_id];
+        // the tokens queued before a reattach are skipped silently
+        if (!reader.attached.load(std::memory_order_acquire) || seq < reader.resume_seq.load()) return false;
+
+        bool found = false;
+        {
+            Slot& slot = _slots[seq % _capacity];
+            std::lock_guard<std::mutex> lock(slot.mutex);
+            if (slot.seq == seq) {
+                out.assign(slot.data);
+                found = true;
+            }
+        }
+        if (!found) {
+            reader.dropped.fetch_add(1, std::memory_order_relaxed);
+            if (reader.policy == BROADCAST_DETACH) reader.attached.store(false, std::memory_order_release);
+        }
+
+        reader.cursor.store(seq + 1, std::memory_order_release);
+        // caught up once the next block to publish won't overwrite its cursor
+        uint64_t last_seq = _last_seq.load(std::memory_order_acquire);
+        if (reader.lagging.load(std::memory_order_relaxed) && seq + _capacity > last_seq) {
+            reader.lagging.store(false, std::memory_order_release);
+        }
+        if (reader.policy == BROADCAST_BLOCK) {
+            { std::lock_guard<std::mutex> lock(_mutex_wait); }
+            _cv_wait.notify_one();
+        }
+        return found;
+    }
+
+    /** Attach a detached reader again, from the next block published. */
+    void Reattach(int reader_id)
+    {
+        Reader& reader = *_readers[reader_id];
+        uint64_t next = _last_seq.load(std::memory_order_acquire) + 1;
+        reader.resume_seq.store(next);
+        reader.cursor.store(next, std::memory_order_release);
+        reader.lagging.store(false, std::memory_order_release);
+        reader.attached.store(true, std::memory_order_release);
+    }
+
+    bool IsAttached(int reader_id) { return _readers[reader_id]->attached.load(); }
+
+    /** Get if a blocking reader is lagging, i.e. the writer stopped waiting for it after a timeout. */
+    bool IsLagging(int reader_id) { return _readers[reader_id]->lagging.load(); }
+
+    /** Get how many blocks a reader lost. */
+    uint64_t GetDroppedCount(int reader_id) { return _readers[reader_id]->dropped.load(); }
+
+    /** Get how far a reader is behind the writer, in blocks. */
+    uint64_t GetLag(int reader_id)
+    {
+        uint64_t cursor = _readers[reader_id]->cursor.load();
+        uint64_t last = _last_seq.load();
+        return last + 1 > cursor ? last + 1 - cursor : 0;
+    }
+
+    /** Get how many times the writer gave up waiting for a blocking reader, i.e. a reader became lagging. */
+    uint64_t GetBlockTimeoutCount() { return _block_timeouts.load(); }
+
+    /** Encode the token of a block, sent to the readers through the queues of the chain. */
+    static std::string Token(uint64_t seq) { return std::string(reinterpret_cast<const char*>(&seq), sizeof(seq)); }
+
+    /** @return uint64_t - The sequence number in the token, `0` if it's not a token. */
+    static uint64_t ParseToken(const std::string& token)
+    {
+        uint64_t seq = 0;
+        if (token.size() == sizeof(seq)) memcpy(&seq, token.data(), sizeof(seq));
+        return seq;
+    }
+
+private:
+    struct Slot
+    {
+        Slot() : seq(0) {}
+        std::mutex mutex;
+        uint64_t seq;
+        std::string data;
+    };
+
+    struct Reader
+    {
+        Reader() : policy(BROADCAST_DROP), cursor(1), resume_seq(1), attached(true), lagging(false), dropped(0) {}
+        BroadcastPolicy policy;
+        std::atomic<uint64_t> cursor;       ///< The next block the reader will read.
+        std::atomic<uint64_t> resume_seq;
+        std::atomic<bool> attached;
+        std::atomic<bool> lagging;          ///< A blocking reader the writer gave up waiting for.
+        std::atomic<uint64_t> dropped;
+    };
+
+    bool _IsBehind(const Reader& reader, uint64_t oldest)
+    {
+        return reader.policy == BROADCAST_BLOCK && reader.attached.load(std::memory_order_acquire) &&
+               !reader.lagging.load(std::memory_order_acquire) &&
+               reader.cursor.load(std::memory_order_acquire) <= oldest;
+    }
+
+    /**
+     * Wait until every attached blocking reader is past the block `oldest`, which is about to be overwritten. The
+     * lagging ones aren't waited for, and the ones still behind after the timeout become lagging.
+     */
+    void _WaitForBlockingReaders(uint64_t oldest)
+    {
+        auto behind = [this, oldest]() {
+            for (const std::unique_ptr<Reader>& reader : _readers) {
+                if (_IsBehind(*reader, oldest)) return true;
+            }
+            return false;
+        };
+        if (!behind()) return;
+        std::unique_lock<std::mutex> lock(_mutex_wait);
+        if (_cv_wait.wait_for(lock, std::chrono::milliseconds(_block_timeout_ms), [&behind]() { return !behind(); })) {
+            return;
+        }
+        _block_timeouts++;
+        for (std::unique_ptr<Reader>& reader : _readers) {
+            if (_IsBehind(*reader, oldest)) reader->lagging.store(true, std::memory_order_release);
+        }
+    }
+
+    size_t _capacity;
+    std::unique_ptr<Slot[]> _slots;
+    std::vector<std::unique_ptr<Reader>> _readers;
+    int _block_timeout_ms;
+    bool _has_blocking_readers;
+    std::atomic<uint64_t> _last_seq;
+    std::atomic<uint64_t> _block_timeouts;
+
+    std::mutex _mutex_wait;
+    std::condition_variable _cv_wait;
+};
+
+}  //namespace
+
+#endif // !__BROADCAST_RING_H__
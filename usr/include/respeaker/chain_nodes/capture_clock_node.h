@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __CAPTURE_CLOCK_NODE_H__
+#define __CAPTURE_CLOCK_NODE_H__
+
+#include <cstdint>
+#include <mutex>
+
+#include "chain_nodes/fixed_ring.h"
+
+namespace respeaker
+{
+
+/** The capture time of a block, taken from the device clock. */
+struct BlockTimestamp
+{
+    uint64_t sequence;         ///< The index of the block since the capture started.
+    int64_t capture_time_ns;   ///< CLOCK_MONOTONIC time when the first frame of the block was captured, in nanoseconds.
+    uint64_t xrun_count;       ///< The number of overruns before this block.
+    bool discontinuity;        ///< Frames were lost between the previous block and this one.
+};
+
+/**
+ * Collector nodes who can timestamp their blocks from the device clock should inherit from this class.
+ * The latency of a downstream node is `now - capture_time_ns` of the block it just got.
+ */
+class CaptureClockNode
+{
+public:
+    /**
+     * Subclass should implement this method, get the timestamp of the latest block which was fetched.
+     */
+    virtual BlockTimestamp GetLastBlockTimestamp() = 0;
+
+    /**
+     * Subclass should implement this method, get the timestamp of the block `sequence`. A node downstream counts the
+     * blocks it got since the chain started to know the sequence of its block, the latest block of the collector is
+     * ahead of it by the depth of the queues in between.
+     *
+     * @param sequence - The index of the block since the capture started.
+     *
+     * @return BlockTimestamp - The one recorded for the block, derived from the nearest recorded block when it's too
+     *                          old (see respeaker::BlockTimestampHistory).
+     */
+    virtual BlockTimestamp GetBlockTimestamp(uint64_t sequence) = 0;
+
+    /**
+     * Subclass should implement this method, get the number of overruns since the capture started.
+     */
+    virtual uint64_t GetXrunCount() = 0;
+
+    /**
+     * Subclass should implement this method, get the estimated drift of the device clock against CLOCK_MONOTONIC, in
+     * ppm. It's positive when the device runs faster than its nominal rate.
+     */
+    virtual double GetDriftPpm() = 0;
+};
+
+/**
+ * The timestamps of the last 256 blocks (2 seconds of 8ms blocks) of a collector, for
+ * respeaker::CaptureClockNode::GetBlockTimestamp. Pushed by the collector thread, read by the node threads downstream.
+ */
+class BlockTimestampHistory
+{
+public:
+    BlockTimestampHistory() : _size(0), _block_len_ns(8000000) {}
+
+    /** Forget the blocks, when the capture starts. */
+    void Clear(int block_len_ms)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _size = 0;
+        _block_len_ns = static_cast<int64_t>(block_len_ms) * 1000000;
+    }
+
+    void Push(const BlockTimestamp& stamp)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stamps[stamp.sequence % kSize] = stamp;
+        _newest = stamp;
+        if (_size < kSize) _size++;
+    }
+
+    /** The latest block, a default BlockTimestamp before the first one. */
+    BlockTimestamp Newest()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _size ? _newest : BlockTimestamp();
+    }
+
+    /** The block `sequence`, or one block length per block away from the nearest kept one when it's not kept. */
+    BlockTimestamp Get(uint64_t sequence)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_size == 0) return BlockTimestamp();
+        uint64_t oldest = _newest.sequence + 1 - _size;
+        if (sequence >= oldest && sequence <= _newest.sequence) return _stamps[sequence % kSize];
+
+        BlockTimestamp stamp = sequence < oldest ? _stamps[oldest % kSize] : _newest;
+        stamp.capture_time_ns -= (static_cast<int64_t>(stamp.sequence) - static_cast<int64_t>(sequence)) *
+                                 _block_len_ns;
+        stamp.sequence = sequence;
+        stamp.discontinuity = false;
+        return stamp;
+    }
+
+private:
+    static const uint64_t kSize = 256;
+
+    std::mutex _mutex;
+    BlockTimestamp _stamps[kSize];
+    BlockTimestamp _newest;
+    uint64_t _size;
+    int64_t _block_len_ns;
+};
+
+/**
+ * Where a node which doesn't pass every block down (e.g. respeaker::WakeGateNode) dropped blocks. A node further down
+ * which counts its blocks to find their capture sequence (e.g. respeaker::ShmOutputNode) maps its count through the
+ * logs of the nodes in between, rather than being shifted by every dropped block. Pushed by the dropping node, read
+ * by the node threads downstream. The last 256 drops are kept, far more than the blocks queued in between.
+ */
+class BlockSkipLog
+{
+public:
+    BlockSkipLog() : _evicted_skips(0) { _entries.SetCapacity(kSize); }
+
+    /** Forget the drops, when the chain starts. */
+    void Clear()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _entries.Clear();
+        _evicted_skips = 0;
+    }
+
+    /**
+     * Record dropped blocks.
+     *
+     * @param position - The number of blocks the node passed down so far, the drop happened before the next one.
+     * @param count - The number of blocks dropped.
+     */
+    void Skip(uint64_t position, uint64_t count = 1)
+    {
+        if (count == 0) return;
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_entries.Empty() && _entries[_entries.Size() - 1].position == position) {
+            _entries[_entries.Size() - 1].total_skips += count;
+            return;
+        }
+        uint64_t total_skips = (_entries.Empty() ? _evicted_skips : _entries[_entries.Size() - 1].total_skips) + count;
+        if (_entries.Full()) {
+            _evicted_skips = _entries.Front().total_skips;
+            _entries.PopFront();
+        }
+        Entry& entry = _entries.PushBack();
+        entry.position = position;
+        entry.total_skips = total_skips;
+    }
+
+    /** The index among the input blocks of the node of its output block `position`. */
+    uint64_t InputIndex(uint64_t position)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // the readers are only a few blocks behind, the newest entries match first
+        for (size_t i = _entries.Size(); i > 0; i--) {
+            if (_entries[i - 1].position <= position) return position + _entries[i - 1].total_skips;
+        }
+        return position + _evicted_skips;
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t position;
+        uint64_t total_skips;   ///< The blocks dropped up to this entry, since the start.
+    };
+
+    static const size_t kSize = 256;
+
+    std::mutex _mutex;
+    FixedRing<Entry> _entries;
+    uint64_t _evicted_skips;
+};
+
+}  //namespace
+
+#endif // !__CAPTURE_CLOCK_NODE_H__
@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __CHAIN_TRACE_H__
+#define __CHAIN_TRACE_H__
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef RESPEAKER_ALLOC_GUARD
+#include "chain_nodes/alloc_guard.h"
+#endif
+
+namespace respeaker
+{
+
+/** One trace event, 32 bytes. */
+struct TraceEvent
+{
+    int64_t time_ns;    ///< CLOCK_MONOTONIC, the start time for a scope.
+    int64_t value;      ///< The duration of a scope, or the value of an instant or a counter event.
+    const char* name;   ///< Must be a string literal (or live as long as the trace), it's stored as a pointer.
+    char phase;         ///< 'X' scope, 'i' instant, 'C' counter, as in the Chrome trace format.
+};
+
+/**
+ * The trace buffer of one thread: a ring of the last `capacity` events, written by its thread only, without locks.
+ * The oldest events are overwritten, so the trace is a flight recorder of the last seconds. When its thread exits, the
+ * buffer keeps its events until a new thread takes it over.
+ */
+class TraceBuffer
+{
+public:
+    TraceBuffer(size_t capacity, long tid) : _events(RoundUp(capacity)), _mask(_events.size() - 1), _head(0), _first(0),
+          _in_use(true), _tid(tid)
+    {
+        for (ScopeTotal& total : _totals) {
+            total.name.store(nullptr, std::memory_order_relaxed);
+            total.total_ns.store(0, std::memory_order_relaxed);
+        }
+        Attach(tid);
+    }
+
+    /** Give the buffer to the calling thread, under the registry lock. The events of the previous thread are gone. */
+    void Attach(long tid)
+    {
+        char name[16] = {0};
+        pthread_getname_np(pthread_self(), name, sizeof(name));
+        _thread_name = name;
+        _tid = tid;
+        _first.store(_head.load(std::memory_order_relaxed), std::memory_order_release);
+        _in_use.store(true, std::memory_order_release);
+    }
+
+    /** Called when the thread exits, the buffer can be taken over by a new thread. */
+    void Detach() { _in_use.store(false, std::memory_order_release); }
+
+    bool IsInUse() { return _in_use.load(std::memory_order_acquire); }
+
+    size_t GetCapacity() { return _events.size(); }
+
+    /** The capacity of a buffer of `num_events`, a power of two. */
+    static size_t RoundUp(size_t num_events)
+    {
+        size_t size = 64;
+        while (size < num_events) size <<= 1;
+        return size;
+    }
+
+    /**
+     * Add the duration of a scope to the running total of its name, kept for `kMaxScopeNames` names per buffer. Unlike
+     * the events, the totals are never overwritten or cleared, they carry on when the buffer changes thread.
+     */
+    void AddScopeTotal(const char* name, int64_t duration_ns)
+    {
+        size_t hash = static_cast<size_t>(reinterpret_cast<uintptr_t>(name) >> 3) % kMaxScopeNames;
+        for (size_t i = 0; i < kMaxScopeNames; i++) {
+            ScopeTotal& total = _totals[(hash + i) % kMaxScopeNames];
+            const char* slot_name = total.name.load(std::memory_order_relaxed);
+            if (slot_name == name) {
+                total.total_ns.store(total.total_ns.load(std::memory_order_relaxed) + duration_ns,
+                                     std::memory_order_relaxed);
+                return;
+            }
+            if (!slot_name) {
+                total.total_ns.store(duration_ns, std::memory_order_relaxed);
+                total.name.store(name, std::memory_order_release);
+                return;
+            }
+        }
+    }
+
+    /** Append the totals of `AddScopeTotal` as (name, nanoseconds). */
+    void GetScopeTotals(std::vector<std::pair<const char*, int64_t>>& totals)
+    {
+        for (ScopeTotal& total : _totals) {
+            const char* name = total.name.load(std::memory_order_acquire);
+            if (name) totals.push_back(std::make_pair(name, total.total_ns.load(std::memory_order_relaxed)));
+        }
+    }
+
+    void Record(char phase, const char* name, int64_t time_ns, int64_t value)
+    {
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        TraceEvent& event = _events[head & _mask];
+        event.time_ns = time_ns;
+        event.value = value;
+        event.name = name;
+        event.phase = phase;
+        _head.store(head + 1, std::memory_order_release);
+    }
+
+    /**
+     * Copy the events which are in the buffer, skipping the ones which were overwritten while copying. The slot of
+     * `head_after` (the same as `head_after - capacity`) may be half written, so it's discarded too.
+     */
+    void Snapshot(std::vector<TraceEvent>& events)
+    {
+        uint64_t head = _head.load(std::memory_order_acquire);
+        uint64_t first = head > _events.size() ? head - _events.size() : 0;
+        first = std::max(first, _first.load(std::memory_order_acquire));
+        size_t from = events.size();
+        for (uint64_t i = first; i < head; i++) events.push_back(_events[i & _mask]);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t head_after = _head.load(std::memory_order_relaxed);
+        uint64_t valid = head_after + 1 > _events.size() ? head_after + 1 - _events.size() : 0;
+        if (valid > first) {
+            size_t torn = static_cast<size_t>(std::min<uint64_t>(valid - first, head - first));
+            events.erase(events.begin() + from, events.begin() + from + torn);
+        }
+    }
+
+    /** Drop the events, only from the thread of the buffer or when it's idle. */
+    void Clear() { _first.store(_head.load(std::memory_order_relaxed), std::memory_order_release); }
+
+    long GetTid() { return _tid; }
+
+    const std::string& GetThreadName() { return _thread_name; }
+
+    static const size_t kMaxScopeNames = 32;
+
+private:
+    struct ScopeTotal
+    {
+        std::atomic<const char*> name;
+        std::atomic<int64_t> total_ns;
+    };
+
+    std::vector<TraceEvent> _events;
+    uint64_t _mask;
+    std::atomic<uint64_t> _head;
+    std::atomic<uint64_t> _first;   ///< The events before it belong to a previous thread or were cleared.
+    std::atomic<bool> _in_use;
+    long _tid;                      ///< Changed under the registry lock, like the name.
+    std::string _thread_name;
+    ScopeTotal _totals[kMaxScopeNames];     ///< Written by the thread of the buffer only.
+};
+
+/**
+ * A binary trace of the chain: the processing of every block by the nodes, the queues, the state transitions and the
+ * hotword events, exported on demand as a Chrome trace JSON file which opens in https://ui.perfetto.dev or
+ * chrome://tracing. Unlike the log4cplus logs, an event is a vDSO clock read (two for a scope) and a 32 bytes store
+ * into a buffer of the calling thread, tens of nanoseconds, so the trace can be left enabled in the field. It's one
+ * relaxed load when disabled, build with `-DRESPEAKER_NO_TRACE` to compile the trace points out.
+ *
+ * The nodes of this library have trace points in their `ProcessBlock`. Add your own with the macros, e.g.
+ * ```cpp
+ * ChainTrace::Enable(true);
+ * ...
+ * {
+ *     RESPEAKER_TRACE_SCOPE("upload");
+ *     RESPEAKER_TRACE_COUNTER("upload_queue", queue.size());
+ *     ...
+ * }
+ * ChainTrace::ExportJson("/tmp/respeaker_trace.json");
+ * ```
+ */
+class ChainTrace
+{
+public:
+    /** Enable or disable the trace, it's disabled by default. */
+    static void Enable(bool enable) { _Enabled().store(enable, std::memory_order_relaxed); }
+
+    static bool IsEnabled() { return _Enabled().load(std::memory_order_relaxed); }
+
+    /**
+     * Set how many events each thread keeps, default to 16384 (512KB per thread). Only the buffers of the threads
+     * which record their first event after the call get the new size. The buffer of a thread which exited is reused
+     * by the next new thread, so the memory follows the number of live threads rather than of all the threads ever.
+     */
+    static void SetBufferSize(size_t num_events) { _Registry().buffer_size = num_events; }
+
+    static int64_t NowNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+    }
+
+    /** Record a finished scope, `time_ns` is its start. */
+    static void Scope(const char* name, int64_t time_ns, int64_t duration_ns)
+    {
+        TraceBuffer* buffer = _ThreadBuffer();
+        buffer->Record('X', name, time_ns, duration_ns);
+        buffer->AddScopeTotal(name, duration_ns);
+    }
+
+    /**
+     * Get the total time spent in each scope since the start of the process, summed by name over all the threads,
+     * e.g. the time of `ProcessBlock` for each node of this library. Only the time while the trace was enabled counts.
+     *
+     * @param totals [out] - (name, seconds), the content is replaced.
+     */
+    static void GetScopeSeconds(std::vector<std::pair<std::string, double>>& totals)
+    {
+        std::vector<std::pair<const char*, int64_t>> raw;
+        {
+            std::lock_guard<std::mutex> lock(_Registry().mutex);
+            for (const std::shared_ptr<TraceBuffer>& buffer : _Registry().buffers) buffer->GetScopeTotals(raw);
+        }
+        totals.clear();
+        for (const std::pair<const char*, int64_t>& r : raw) {
+            // the same name may be several literals, one per translation unit
+            size_t i = 0;
+            while (i < totals.size() && totals[i].first != r.first) i++;
+            if (i == totals.size()) totals.push_back(std::make_pair(std::string(r.first), 0.0));
+            totals[i].second += r.second / 1e9;
+        }
+    }
+
+    /** Record an event, e.g. a state transition (`value` is the new state) or a hotword (`value` is its index). */
+    static void Instant(const char* name, int64_t value)
+    {
+        if (IsEnabled()) _ThreadBuffer()->Record('i', name, NowNs(), value);
+    }
+
+    /** Record the value of a counter, e.g. a queue depth after a push or a pop. */
+    static void Counter(const char* name, int64_t value)
+    {
+        if (IsEnabled()) _ThreadBuffer()->Record('C', name, NowNs(), value);
+    }
+
+    /**
+     * Export the events of all the threads (including the threads which exited, until their buffer is reused) as
+     * Chrome trace JSON. The threads keep recording while exporting.
+     */
+    static std::string ExportJson()
+    {
+        std::vector<std::shared_ptr<TraceBuffer>> buffers;
+        std::vector<std::pair<long, std::string>> threads;
+        {
+            std::lock_guard<std::mutex> lock(_Registry().mutex);
+            buffers = _Registry().buffers;
+            for (const std::shared_ptr<TraceBuffer>& buffer : buffers) {
+                threads.push_back(std::make_pair(buffer->GetTid(), buffer->GetThreadName()));
+            }
+        }
+
+        std::string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+        char line[320];
+        long pid = static_cast<long>(getpid());
+        bool first = true;
+        std::vector<TraceEvent> events;
+        for (size_t b = 0; b < buffers.size(); b++) {
+            const std::shared_ptr<TraceBuffer>& buffer = buffers[b];
+            long tid = threads[b].first;
+            snprintf(line, sizeof(line),
+                     "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}",
+                     first ? "" : ",\n", pid, tid, _Escape(threads[b].second).c_str());
+            json += line;
+            first = false;
+
+            events.clear();
+            buffer->Snapshot(events);
+            for (const TraceEvent& e : events) {
+                double ts = e.time_ns / 1000.0;
+                std::string name = _Escape(e.name ? e.name : "");
+                if (e.phase == 'X') {
+                    snprintf(line, sizeof(line),
+                             ",\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f}",
+                             name.c_str(), pid, tid, ts, e.value / 1000.0);
+                } else if (e.phase == 'C') {
+                    snprintf(line, sizeof(line),
+                             ",\n{\"ph\":\"C\",\"name\":\"%s\",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f,"
+                             "\"args\":{\"value\":%lld}}",
+                             name.c_str(), pid, tid, ts, static_cast<long long>(e.value));
+                } else {
+                    snprintf(line, sizeof(line),
+                             ",\n{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f,"
+                             "\"args\":{\"value\":%lld}}",
+                             name.c_str(), pid, tid, ts, static_cast<long long>(e.value));
+                }
+                json += line;
+            }
+        }
+        json += "\n]}\n";
+        return json;
+    }
+
+    /**
+     * @return bool - `false` if the file can't be written.
+     */
+    static bool ExportJson(const std::string& path)
+    {
+        std::string json = ExportJson();
+        FILE* file = fopen(path.c_str(), "w");
+        if (!file) return false;
+        bool ok = fwrite(json.data(), 1, json.size(), file) == json.size();
+        return fclose(file) == 0 && ok;
+    }
+
+    /** Drop the recorded events, call it when the chain is stopped. */
+    static void Clear()
+    {
+        std::lock_guard<std::mutex> lock(_Registry().mutex);
+        for (const std::shared_ptr<TraceBuffer>& buffer : _Registry().buffers) buffer->Clear();
+    }
+
+private:
+    struct Registry
+    {
+        Registry() : buffer_size(16384) {}
+        std::mutex mutex;
+        std::vector<std::shared_ptr<TraceBuffer>> buffers;
+        std::atomic<size_t> buffer_size;
+    };
+
+    static std::atomic<bool>& _Enabled()
+    {
+        static std::atomic<bool> enabled(false);
+        return enabled;
+    }
+
+    static Registry& _Registry()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    /** Hands the buffer back to the registry when the thread exits. */
+    struct ThreadSlot
+    {
+        ThreadSlot() : buffer(nullptr) {}
+        ~ThreadSlot()
+        {
+            if (buffer) buffer->Detach();
+        }
+        TraceBuffer* buffer;
+    };
+
+    /**
+     * The buffer is taken on the first event of the thread: the one of an exited thread if there's one of the right
+     * size, a new one otherwise. The registry keeps them all.
+     */
+    static TraceBuffer* _ThreadBuffer()
+    {
+        static thread_local ThreadSlot slot;
+        if (!slot.buffer) {
+#ifdef RESPEAKER_ALLOC_GUARD
+            // once per thread, and the first event is often in a node scope: it's not an allocation of that node
+            AllocationGuardScope unguarded(nullptr);
+#endif
+            long tid = static_cast<long>(syscall(SYS_gettid));
+            size_t capacity = TraceBuffer::RoundUp(_Registry().buffer_size);
+            std::lock_guard<std::mutex> lock(_Registry().mutex);
+            for (const std::shared_ptr<TraceBuffer>& buffer : _Registry().buffers) {
+                if (buffer->IsInUse() || buffer->GetCapacity() != capacity) continue;
+                buffer->Attach(tid);
+                slot.buffer = buffer.get();
+                break;
+            }
+            if (!slot.buffer) {
+                _Registry().buffers.push_back(std::make_shared<TraceBuffer>(capacity, tid));
+                slot.buffer = _Registry().buffers.back().get();
+            }
+        }
+        return slot.buffer;
+    }
+
+    static std::string _Escape(const std::string& s)
+    {
+        std::string out;
+        for (char c : s) {
+            if (c == '"' || c == '\\') out += '\\';
+            if (static_cast<unsigned char>(c) >= 0x20) out += c;
+        }
+        return out;
+    }
+};
+
+/**
+ * Record the time of a scope, as one 'X' event when it ends. With `-DRESPEAKER_ALLOC_GUARD`, it also names the node
+ * for respeaker::AllocationGuard, so `RESPEAKER_TRACE_SCOPE` stays a single declaration.
+ */
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* name)
+        :
+#ifdef RESPEAKER_ALLOC_GUARD
+          _guard(name),
+#endif
+          _name(name), _start(ChainTrace::IsEnabled() ? ChainTrace::NowNs() : 0) {}
+
+    ~TraceScope()
+    {
+        if (_start) ChainTrace::Scope(_name, _start, ChainTrace::NowNs() - _start);
+    }
+
+private:
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+#ifdef RESPEAKER_ALLOC_GUARD
+    AllocationGuardScope _guard;
+#endif
+    const char* _name;
+    int64_t _start;
+};
+
+}  //namespace
+
+#define RESPEAKER_TRACE_CONCAT_(a, b) a##b
+#define RESPEAKER_TRACE_CONCAT(a, b) RESPEAKER_TRACE_CONCAT_(a, b)
+
+#ifdef RESPEAKER_ALLOC_GUARD
+#define RESPEAKER_ALLOC_GUARD_SCOPE(name) \
+    respeaker::AllocationGuardScope RESPEAKER_TRACE_CONCAT(_alloc_guard_scope_, __LINE__)(name)
+#else
+#define RESPEAKER_ALLOC_GUARD_SCOPE(name) do {} while (0)
+#endif
+
+#ifndef RESPEAKER_NO_TRACE
+#define RESPEAKER_TRACE_SCOPE(name) respeaker::TraceScope RESPEAKER_TRACE_CONCAT(_trace_scope_, __LINE__)(name)
+#define RESPEAKER_TRACE_INSTANT(name, value) respeaker::ChainTrace::Instant(name, static_cast<int64_t>(value))
+#define RESPEAKER_TRACE_COUNTER(name, value) respeaker::ChainTrace::Counter(name, static_cast<int64_t>(value))
+#else
+#define RESPEAKER_TRACE_SCOPE(name) RESPEAKER_ALLOC_GUARD_SCOPE(name)
+#define RESPEAKER_TRACE_INSTANT(name, value) do {} while (0)
+#define RESPEAKER_TRACE_COUNTER(name, value) do {} while (0)
+#endif
+
+#endif // !__CHAIN_TRACE_H__
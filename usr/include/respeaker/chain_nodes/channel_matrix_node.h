@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __CHANNEL_MATRIX_NODE_H__
+#define __CHANNEL_MATRIX_NODE_H__
+
+#include <cstring>
+#include <vector>
+
+#include "chain_nodes/batch_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/chain_trace.h"
+#include "chain_nodes/sample_dsp.h"
+
+namespace respeaker
+{
+
+/**
+ * The ChannelMatrixNode computes `out[r] = sum(matrix[r][c] * in[c])` on every frame, which covers what SelectorNode
+ * does (picking channels) and what it can't: reordering, duplicating, per-channel gains and down-mixing.
+ *
+ * The matrix is compiled in `OnStartThread` into the cheapest kernel for its shape, so the generic matrix product
+ * never runs for a plain selection:
+ * - pass-through - the identity with the same layout, the input block is returned as it is, without a copy.
+ * - plane copy - every output is a copy of one input and both sides are deinterleaved, one `memcpy` per channel.
+ * - gather - every output is a copy of one input, with a layout change, through a precompiled index table.
+ * - mix - the other rows. Each row only visits its non-zero inputs, e.g. a gain is a scaled copy, and the frames
+ *   are accumulated a whole plane at a time so the loop vectorizes (NEON/SSE). The arithmetic is respeaker::DefaultDsp,
+ *   so a fixed-point build does it with integers.
+ *
+ * When several blocks are queued, they are processed in one go (respeaker::BatchNode).
+ */
+class ChannelMatrixNode : public BatchNode
+{
+public:
+    /**
+     * Create a ChannelMatrixNode instance.
+     *
+     * @param matrix - One row per output channel, one column per input channel. Must match the input channels.
+     * @param output_interleaved - Set it true to output interleaved data, false to output deinterleaved data.
+     *
+     * @return ChannelMatrixNode*
+     */
+    static ChannelMatrixNode* Create(std::vector<std::vector<float>> matrix, bool output_interleaved = false)
+    {
+        return new ChannelMatrixNode(matrix, std::vector<int>(), output_interleaved);
+    }
+
+    /**
+     * Create a ChannelMatrixNode which selects channels, like SelectorNode, but an index may be repeated and the
+     * indexes may be in any order.
+     *
+     * @param channel_indexes - The input channel of each output channel, starts from `0`.
+     * @param output_interleaved - Set it true to output interleaved data, false to output deinterleaved data.
+     *
+     * @return ChannelMatrixNode*
+     */
+    static ChannelMatrixNode* CreateSelector(std::vector<int> channel_indexes, bool output_interleaved = false)
+    {
+        return new ChannelMatrixNode(std::vector<std::vector<float>>(), channel_indexes, output_interleaved);
+    }
+
+    virtual ~ChannelMatrixNode() = default;
+
+    virtual bool OnStartThread()
+    {
+        size_t num_in = _input_parameter.num_channel;
+        if (!_channel_indexes.empty()) {
+            _matrix.assign(_channel_indexes.size(), std::vector<float>(num_in, 0.0f));
+            for (size_t r = 0; r < _channel_indexes.size(); r++) {
+                if (_channel_indexes[r] < 0 || static_cast<size_t>(_channel_indexes[r]) >= num_in) return false;
+                _matrix[r][_channel_indexes[r]] = 1.0f;
+            }
+        }
+        if (_matrix.empty()) return false;
+        for (const std::vector<float>& row : _matrix) {
+            if (row.size() != num_in) return false;
+        }
+
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = CHANNEL_MATRIX_NODE;
+        _output_parameter.num_channel = _matrix.size();
+        _output_parameter.interleaved = _output_interleaved;
+        _is_interleaved_after_process = _output_interleaved;
+
+        _Compile();
+        _InitBatch();
+        // an upmix outputs more than it gets, the collectors make room for it in every block (see `_ProcessOne`)
+        if (_matrix.size() > num_in) {
+            size_t block_ms = _input_parameter.block_len_ms ? _input_parameter.block_len_ms : 8;
+            size_t bytes = _input_parameter.rate * block_ms / 1000 * _matrix.size() * sizeof(int16_t);
+            ReserveBlockCapacity(bytes);
+            _output.reserve(bytes);
+        }
+        return true;
+    }
+
+    virtual void ProcessBlocks(std::string* blocks, size_t num_blocks, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("ChannelMatrixNode");
+        if (_kernel == PASS_THROUGH) return;
+        for (size_t b = 0; b < num_blocks; b++) _ProcessOne(blocks[b]);
+    }
+
+    virtual bool OnJoinThread()
+    {
+        return true;
+    }
+
+    /** Get if the matrix compiled to the pass-through, i.e. the node doesn't touch the blocks. */
+    bool IsPassThrough() { return _kernel == PASS_THROUGH; }
+
+protected:
+    ChannelMatrixNode(std::vector<std::vector<float>> matrix, std::vector<int> channel_indexes,
+                      bool output_interleaved)
+        : _matrix(matrix),
+          _channel_indexes(channel_indexes),
+          _output_interleaved(output_interleaved),
+          _kernel(MIX),
+          _mix_scale(1.0f),
+          _post_gain()
+    {}
+
+    /**
+     * Replace the block by its output, the buffer of the block is kept for the next output. For an upmix, the buffers
+     * have the capacity of the output since `OnStartThread` reserved it, so `resize` doesn't allocate.
+     */
+    void _ProcessOne(std::string& block)
+    {
+        const size_t num_in = _input_parameter.num_channel;
+        const size_t num_out = _rows.size();
+        const size_t frames = BlockNumFrames(block, num_in);
+        const int16_t* in = BlockSamples(block);
+        _output.resize(frames * num_out * sizeof(int16_t));
+        int16_t* out = BlockSamples(_output);
+
+        const size_t in_ch_stride = _input_parameter.interleaved ? 1 : frames;
+        const size_t in_fr_stride = _input_parameter.interleaved ? num_in : 1;
+        const size_t out_ch_stride = _output_interleaved ? 1 : frames;
+        const size_t out_fr_stride = _output_interleaved ? num_out : 1;
+
+        if (_kernel == PLANE_COPY) {
+            for (size_t r = 0; r < num_out; r++) {
+                memcpy(out + r * frames, in + _rows[r].source * frames, frames * sizeof(int16_t));
+            }
+        } else if (_kernel == GATHER) {
+            // one pass over the output in memory order
+            if (_output_interleaved) {
+                for (size_t i = 0; i < frames; i++) {
+                    const int16_t* frame = in + i * in_fr_stride;
+                    int16_t* o = out + i * num_out;
+                    for (size_t r = 0; r < num_out; r++) o[r] = frame[_gather[r] * in_ch_stride];
+                }
+            } else {
+                for (size_t r = 0; r < num_out; r++) {
+                    const int16_t* src = in + _gather[r] * in_ch_stride;
+                    int16_t* o = out + r * frames;
+                    for (size_t i = 0; i < frames; i++) o[i] = src[i * in_fr_stride];
+                }
+            }
+        } else {
+            for (size_t r = 0; r < num_out; r++) {
+                _MixRow(_rows[r], in, in_ch_stride, in_fr_stride, frames, out + r * out_ch_stride, out_fr_stride);
+            }
+        }
+        block.swap(_output);
+    }
+
+    enum Kernel { PASS_THROUGH, PLANE_COPY, GATHER, MIX };
+
+    struct Term
+    {
+        size_t source;
+        DefaultDsp::coef_t weight;
+    };
+
+    /** One output channel: a copy of `source`, or a sum of terms (empty for a silent channel). */
+    struct Row
+    {
+        bool copy;
+        size_t source;
+        bool single_gain;
+        DefaultDsp::gain_t gain;
+        std::vector<Term> terms;
+    };
+
+    void _Compile()
+    {
+        const size_t num_in = _input_parameter.num_channel;
+        bool all_copies = true;
+        bool identity = _matrix.size() == num_in;
+        float max_weight = 0.0f;
+        _rows.assign(_matrix.size(), Row());
+        _gather.assign(_matrix.size(), 0);
+
+        for (size_t r = 0; r < _matrix.size(); r++) {
+            Row& row = _rows[r];
+            row.copy = false;
+            row.single_gain = false;
+            row.source = 0;
+            size_t nonzero = 0;
+            for (size_t c = 0; c < num_in; c++) {
+                float w = _matrix[r][c];
+                if (w == 0.0f) continue;
+                nonzero++;
+                row.source = c;
+                float a = w < 0.0f ? -w : w;
+                if (a > max_weight) max_weight = a;
+            }
+            row.copy = nonzero == 1 && _matrix[r][row.source] == 1.0f;
+            // a positive gain is a scaled copy, any other row is a weighted sum of its non-zero inputs
+            row.single_gain = nonzero == 1 && !row.copy && _matrix[r][row.source] > 0.0f;
+            if (row.single_gain) row.gain = DefaultDsp::Gain(_matrix[r][row.source]);
+            _gather[r] = row.source;
+            all_copies = all_copies && row.copy;
+            identity = identity && row.copy && row.source == r;
+        }
+
+        // the Q15/Q31 weights are in [-1, 1], a mix with larger weights is scaled down and up again around the sum;
+        // the sum itself is in `mix_acc_t`, so a row of many large weights doesn't overflow whatever its L1 norm
+        _mix_scale = max_weight > DefaultDsp::MaxCoef() ? max_weight : 1.0f;
+        for (size_t r = 0; r < _matrix.size(); r++) {
+            Row& row = _rows[r];
+            row.terms.clear();
+            if (row.copy || row.single_gain) continue;
+            for (size_t c = 0; c < num_in; c++) {
+                if (_matrix[r][c] != 0.0f) row.terms.push_back(Term{c, DefaultDsp::Coef(_matrix[r][c] / _mix_scale)});
+            }
+        }
+        _post_gain = DefaultDsp::Gain(_mix_scale);
+
+        if (identity && _input_parameter.interleaved == _output_interleaved) {
+            _kernel = PASS_THROUGH;
+        } else if (all_copies && !_input_parameter.interleaved && !_output_interleaved) {
+            _kernel = PLANE_COPY;
+        } else if (all_copies) {
+            _kernel = GATHER;
+        } else {
+            _kernel = MIX;
+        }
+    }
+
+    void _MixRow(const Row& row, const int16_t* in, size_t in_ch_stride, size_t in_fr_stride, size_t frames,
+                 int16_t* out, size_t out_stride)
+    {
+        if (row.copy || row.single_gain) {
+            const int16_t* src = in + row.source * in_ch_stride;
+            for (size_t i = 0; i < frames; i++) out[i * out_stride] = src[i * in_fr_stride];
+            if (row.single_gain) ApplyGain<DefaultDsp>(out, frames, out_stride, row.gain);
+            return;
+        }
+
+        // term by term over whole planes, so the inner loop is a vectorizable multiply-accumulate
+        typedef DefaultDsp::mix_acc_t mix_acc_t;
+        _acc.assign(frames, mix_acc_t());
+        mix_acc_t* RESPEAKER_RESTRICT acc = _acc.data();
+        for (const Term& term : row.terms) {
+            const int16_t* src = in + term.source * in_ch_stride;
+            const mix_acc_t weight = term.weight;
+            if (in_fr_stride == 1) {
+                for (size_t i = 0; i < frames; i++) acc[i] += static_cast<mix_acc_t>(src[i]) * weight;
+            } else {
+                for (size_t i = 0; i < frames; i++) {
+                    acc[i] += static_cast<mix_acc_t>(DefaultDsp::FromS16(src[i * in_fr_stride])) * weight;
+                }
+            }
+        }
+        for (size_t i = 0; i < frames; i++) out[i * out_stride] = DefaultDsp::ToS16(acc[i]);
+        if (_mix_scale > 1.0f) ApplyGain<DefaultDsp>(out, frames, out_stride, _post_gain);
+    }
+
+    std::vector<std::vector<float>> _matrix;
+    std::vector<int> _channel_indexes;
+    bool _output_interleaved;
+
+    Kernel _kernel;
+    std::vector<Row> _rows;
+    std::vector<size_t> _gather;
+    float _mix_scale;
+    DefaultDsp::gain_t _post_gain;
+    std::vector<DefaultDsp::mix_acc_t> _acc;
+    std::string _output;
+};
+
+}  //namespace
+
+#endif // !__CHANNEL_MATRIX_NODE_H__
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __DUTY_CYCLE_NODE_H__
+#define __DUTY_CYCLE_NODE_H__
+
+#include <atomic>
+#include <cstdint>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/chain_trace.h"
+#include "chain_nodes/fixed_ring.h"
+#include "chain_nodes/speech_probability_node.h"
+
+namespace respeaker
+{
+
+/**
+ * The DutyCycleNode lowers the wake-up rate of the nodes after it while the chain is idle. It goes right after a
+ * cheap detector (e.g. respeaker::LightVadNode) and in front of the expensive nodes (beamforming, KWS, encoder...).
+ *
+ * After `idle_after_ms` without speech in WAIT_TRIGGER_* state, it holds the blocks and passes them down in batches
+ * of `idle_batch_ms`, e.g. 8 blocks of 8ms at once: the threads of the nodes after it wake up once per batch instead
+ * of once per block (15 instead of 125 wake-ups per second) and run the batch back to back with warm caches, so
+ * the cores can stay longer in their idle states. No audio is dropped, the idle stream is only late by up to one
+ * batch. The first block with speech, or a LISTEN_* state, flushes the held blocks down and the stream passes
+ * through at full rate again.
+ *
+ * Unlike respeaker::WakeGateNode, the nodes after it still see the whole stream, e.g. for a DoA or an ASR endpoint
+ * which needs the background noise.
+ */
+class DutyCycleNode : public BaseNode
+{
+public:
+    /**
+     * Create a DutyCycleNode instance. The output is the same as the input.
+     *
+     * @param idle_after_ms - The chain is idle after this length of time without speech, default to 2000ms.
+     * @param idle_batch_ms - The length of the batches while idle, rounded to whole blocks, default to 64ms.
+     *
+     * @return DutyCycleNode*
+     */
+    static DutyCycleNode* Create(int idle_after_ms = 2000, int idle_batch_ms = 64)
+    {
+        return new DutyCycleNode(idle_after_ms, idle_batch_ms);
+    }
+
+    virtual ~DutyCycleNode() = default;
+
+    virtual bool OnStartThread()
+    {
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = DUTY_CYCLE_NODE;
+        _is_interleaved_after_process = _input_parameter.interleaved;
+
+        size_t block_ms = _input_parameter.block_len_ms ? _input_parameter.block_len_ms : 8;
+        _idle_after_blocks = (_idle_after_ms + block_ms - 1) / block_ms;
+        _batch_blocks = (_idle_batch_ms + block_ms - 1) / block_ms;
+        if (_batch_blocks == 0) _batch_blocks = 1;
+        _held.Clear();
+        _held.SetCapacity(_batch_blocks);
+        _quiet_blocks = 0;
+        _idle = false;
+        return true;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        // the detector upstream already processed this block
+        bool active = _IsActive();
+        if (active) {
+            _quiet_blocks = 0;
+        } else if (_quiet_blocks < _idle_after_blocks) {
+            _quiet_blocks++;
+        }
+        // a speech block always snaps back, even with `idle_after_ms` 0
+        bool idle = !active && _quiet_blocks >= _idle_after_blocks && _batch_blocks > 1;
+        if (idle != _idle) {
+            _idle = idle;
+            RESPEAKER_TRACE_INSTANT("DutyCycleNode.idle", idle);
+        }
+        return block;
+    }
+
+    virtual void StoreBlock(std::string block, bool& exit)
+    {
+        RESPEAKER_ALLOC_GUARD_SCOPE("DutyCycleNode");
+        if (!_idle) {
+            _Release(exit);
+            _active_blocks++;
+            BaseNode::StoreBlock(std::move(block), exit);
+            return;
+        }
+
+        _held.PushBack().swap(block);
+        _idle_blocks++;
+        if (_held.Full()) {
+            _Release(exit);
+            _batches++;
+        }
+    }
+
+    virtual bool OnJoinThread()
+    {
+        _held.Clear();
+        return true;
+    }
+
+    /**
+     * Take the speech decision from this node rather than from `ChainSharedData::vad`, e.g. a respeaker::LightVadNode
+     * upstream of this node.
+     */
+    void SetSpeechProbabilityNode(SpeechProbabilityNode* speech_node) { _speech_node = speech_node; }
+
+    /** Get if the nodes after this one are in the batched (idle) mode now. */
+    bool IsIdle() { return _idle; }
+
+    /** Get the ratio of the blocks passed down in batches, i.e. the time spent idle. */
+    float GetIdleRatio()
+    {
+        uint64_t idle = _idle_blocks, active = _active_blocks;
+        return (idle + active) ? static_cast<float>(idle) / (idle + active) : 0.0f;
+    }
+
+    /** Get how many batches were passed down. */
+    uint64_t GetBatchCount() { return _batches; }
+
+protected:
+    DutyCycleNode(int idle_after_ms, int idle_batch_ms)
+        : _idle_after_ms(idle_after_ms < 0 ? 0 : idle_after_ms),
+          _idle_batch_ms(idle_batch_ms < 0 ? 0 : idle_batch_ms),
+          _speech_node(nullptr),
+          _idle_after_blocks(0),
+          _batch_blocks(1),
+          _quiet_blocks(0),
+          _idle(false),
+          _idle_blocks(0),
+          _active_blocks(0),
+          _batches(0)
+    {}
+
+    /** Speech, or a state where the stream must not be late. */
+    bool _IsActive()
+    {
+        if (!_chain_shared_data) return true;
+        {
+            std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_state);
+            if (_chain_shared_data->state == LISTEN_QUIETLY || _chain_shared_data->state == LISTEN_WITH_BGM) {
+                return true;
+            }
+        }
+        if (_speech_node) return _speech_node->IsSpeech();
+        // without a detector there's nothing to snap back on, never idle
+        std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_vad);
+        return !_chain_shared_data->vad_node_present || _chain_shared_data->vad;
+    }
+
+    /** Pass the held blocks down, oldest first, the slots keep no buffer. */
+    void _Release(bool& exit)
+    {
+        while (!_held.Empty()) {
+            BaseNode::StoreBlock(std::move(_held.Front()), exit);
+            _held.PopFront();
+        }
+    }
+
+    size_t _idle_after_ms;
+    size_t _idle_batch_ms;
+    SpeechProbabilityNode* _speech_node;
+
+    size_t _idle_after_blocks;
+    size_t _batch_blocks;
+    size_t _quiet_blocks;
+    FixedRing<std::string> _held;
+
+    std::atomic<bool> _idle;
+    std::atomic<uint64_t> _idle_blocks;
+    std::atomic<uint64_t> _active_blocks;
+    std::atomic<uint64_t> _batches;
+};
+
+}  //namespace
+
+#endif // !__DUTY_CYCLE_NODE_H__
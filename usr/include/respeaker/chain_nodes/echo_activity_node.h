@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __ECHO_ACTIVITY_NODE_H__
+#define __ECHO_ACTIVITY_NODE_H__
+
+#include <atomic>
+#include <cmath>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/chain_trace.h"
+
+namespace respeaker
+{
+
+/**
+ * The EchoActivityNode measures the reference channel level and the echo return loss (ERL) every block, and decides
+ * whether there's an audible echo at all. It sits right before VepAecBeamformingNode and passes the block through.
+ *
+ * - While there's no audible echo, `ChainSharedData::vep_freeze` is set, so the VEP lib holds its AEC instead of
+ *   adapting on silence. The filter state is kept, so it's warm again on the first block of playback. This keeps the
+ *   filter from drifting on silence, the VEP lib still runs on every block.
+ * - The chain state follows the playback: WAIT_TRIGGER_QUIETLY <-> WAIT_TRIGGER_WITH_BGM and LISTEN_QUIETLY <->
+ *   LISTEN_WITH_BGM, so the KWS node picks the right mode without the application tracking its player.
+ *
+ * The echo is "audible" when the reference isn't silent and the echo it predicts at the microphone (reference level
+ * minus ERL) is above the microphone noise floor. It's switched on at the first such block, and off after a hangover
+ * which covers the reverb tail. The noise floor only rises while the reference is silent, so a long song doesn't
+ * lift it up to the echo level; a noisy analog reference channel doesn't keep the AEC on either, its noise doesn't
+ * reach the microphone so its ERL ends up high.
+ *
+ * The decision is unknown when the node starts, the first block applies it either way: playback which is audible from
+ * the start switches the chain state to *_WITH_BGM right away, and silence holds the AEC right away. After that,
+ * `vep_freeze` and the state are only written when the decision changes, and `vep_freeze` is released when the node
+ * stops. A freeze set by another writer stays until the next change, so don't drive `vep_freeze` from the application
+ * while this node is in the chain.
+ */
+class EchoActivityNode : public BaseNode
+{
+public:
+    /**
+     * Create a EchoActivityNode instance.
+     *
+     * @param ref_channel_index - The reference channel, the same as `ref_channel_index` of the VEP node.
+     * @param mic_channel_index - The microphone channel used to measure the ERL.
+     * @param hangover_ms - How long the AEC keeps running after the echo is gone, default to 1000.
+     *
+     * @return EchoActivityNode*
+     */
+    static EchoActivityNode* Create(int ref_channel_index=6, int mic_channel_index=0, int hangover_ms=1000)
+    {
+        return new EchoActivityNode(ref_channel_index, mic_channel_index, hangover_ms);
+    }
+
+    virtual ~EchoActivityNode() = default;
+
+    virtual bool OnStartThread()
+    {
+        if (_ref_channel >= _input_parameter.num_channel || _mic_channel >= _input_parameter.num_channel) return false;
+
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = ECHO_ACTIVITY_NODE;
+        _is_interleaved_after_process = _input_parameter.interleaved;
+
+        size_t block_ms = _input_parameter.block_len_ms ? _input_parameter.block_len_ms : 8;
+        _hangover_blocks = (_hangover_ms + block_ms - 1) / block_ms;
+        // no echo seen yet, so the first block without one doesn't wait for a hangover
+        _quiet_blocks = _hangover_blocks;
+        _mic_floor_db = 0.0f;
+        _mic_floor_init = false;
+        _erl_db = kInitialErlDb;
+        _echo_known = false;
+        _echo_active = true;
+        _num_blocks = 0;
+        _num_active_blocks = 0;
+        return true;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("EchoActivityNode");
+        size_t n = BlockNumFrames(block, _input_parameter.num_channel);
+        if (n == 0) return block;
+        bool interleaved = _input_parameter.interleaved;
+        float ref_db = _LevelDb(ChannelEnergy(block, _input_parameter.num_channel, interleaved, _ref_channel), n);
+        float mic_db = _LevelDb(ChannelEnergy(block, _input_parameter.num_channel, interleaved, _mic_channel), n);
+
+        bool ref_active = ref_db > kRefMinDb;
+        // follow down quickly, creep up slowly like WakeGateNode, but don't learn the echo as noise: the floor starts
+        // from the first block without playback, until then any playback is taken as audible
+        if (!_mic_floor_init) {
+            if (!ref_active) {
+                _mic_floor_db = mic_db;
+                _mic_floor_init = true;
+            }
+        } else if (mic_db < _mic_floor_db) {
+            _mic_floor_db += 0.2f * (mic_db - _mic_floor_db);
+        } else if (!ref_active) {
+            _mic_floor_db += 0.005f * (mic_db - _mic_floor_db);
+        }
+
+        if (ref_active) {
+            // the echo alone gives the largest loss, near-end speech only lowers it: follow the upper envelope
+            float erl = ref_db - mic_db;
+            float tracked = _erl_db;
+            _erl_db = tracked + (erl > tracked ? 0.2f : 0.01f) * (erl - tracked);
+        }
+        bool audible = ref_active && (!_mic_floor_init || ref_db - _erl_db > _mic_floor_db + kAudibleMarginDb);
+
+        if (audible) {
+            _quiet_blocks = 0;
+        } else if (_quiet_blocks < _hangover_blocks) {
+            _quiet_blocks++;
+        }
+        bool active = _quiet_blocks < _hangover_blocks;
+        if (!_echo_known || active != _echo_active) {
+            _echo_known = true;
+            _echo_active = active;
+            _ApplyFreeze(!active);
+            if (_auto_state_transfer) _TransferState(active);
+        }
+
+        _num_blocks++;
+        if (active) _num_active_blocks++;
+        _ref_level_db = ref_db;
+        return block;
+    }
+
+    virtual bool OnJoinThread()
+    {
+        // don't leave the AEC held for the next start
+        if (_echo_known && !_echo_active) _ApplyFreeze(false);
+        return true;
+    }
+
+    /** Don't touch the chain state, only `vep_freeze`. @see ReSpeaker::SetChainState */
+    void DisableAutoStateTransfer() { _auto_state_transfer = false; }
+
+    /** Get if the AEC is running now, true until the first block is measured. */
+    bool IsEchoActive() { return _echo_active; }
+
+    /** Get the tracked echo return loss from the reference channel to the microphone, in dB. */
+    float GetErlDb() { return _erl_db; }
+
+    /** Get the reference channel level of the last block, in dB relative to 1 LSB. */
+    float GetReferenceLevelDb() { return _ref_level_db; }
+
+    /** Get the fraction of blocks for which the AEC was adapting (not held). */
+    float GetActiveRatio() { return _num_blocks ? static_cast<float>(_num_active_blocks) / _num_blocks : 0.0f; }
+
+protected:
+    EchoActivityNode(int ref_channel_index, int mic_channel_index, int hangover_ms)
+        : _ref_channel(static_cast<size_t>(ref_channel_index)),
+          _mic_channel(static_cast<size_t>(mic_channel_index)),
+          _hangover_ms(hangover_ms > 0 ? hangover_ms : 0),
+          _hangover_blocks(0),
+          _quiet_blocks(0),
+          _auto_state_transfer(true),
+          _mic_floor_db(0.0f),
+          _mic_floor_init(false),
+          _erl_db(kInitialErlDb),
+          _ref_level_db(0.0f),
+          _echo_known(false),
+          _echo_active(true),
+          _num_blocks(0),
+          _num_active_blocks(0) {}
+
+    static constexpr float kRefMinDb = 20.0f;         ///< A digital-silence reference is ~0dB, 20dB is 10 LSB rms.
+    static constexpr float kAudibleMarginDb = 3.0f;
+    static constexpr float kInitialErlDb = 0.0f;      ///< Pessimistic: assume the echo is as loud as the reference.
+
+    static float _LevelDb(int64_t energy, size_t n)
+    {
+        return 10.0f * std::log10(static_cast<float>(energy) / n + 1.0f);
+    }
+
+    void _ApplyFreeze(bool freeze)
+    {
+        if (!_chain_shared_data) return;
+        std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_vep_freeze);
+        _chain_shared_data->vep_freeze = freeze;
+    }
+
+    void _TransferState(bool with_bgm)
+    {
+        if (!_chain_shared_data) return;
+        std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_state);
+        ChainState& state = _chain_shared_data->state;
+        ChainState old_state = state;
+        if (with_bgm) {
+            if (state == WAIT_TRIGGER_QUIETLY) state = WAIT_TRIGGER_WITH_BGM;
+            else if (state == LISTEN_QUIETLY) state = LISTEN_WITH_BGM;
+        } else {
+            if (state == WAIT_TRIGGER_WITH_BGM) state = WAIT_TRIGGER_QUIETLY;
+            else if (state == LISTEN_WITH_BGM) state = LISTEN_QUIETLY;
+        }
+        if (state != old_state) RESPEAKER_TRACE_INSTANT("chain_state", state);
+    }
+
+    size_t _ref_channel;
+    size_t _mic_channel;
+    size_t _hangover_ms;
+    size_t _hangover_blocks;
+    size_t _quiet_blocks;
+    bool _auto_state_transfer;
+
+    float _mic_floor_db;
+    bool _mic_floor_init;
+    std::atomic<float> _erl_db;
+    std::atomic<float> _ref_level_db;
+    bool _echo_known;                       ///< The first block was measured, `_echo_active` was applied.
+    std::atomic<bool> _echo_active;
+    std::atomic<uint64_t> _num_blocks;
+    std::atomic<uint64_t> _num_active_blocks;
+};
+
+}  //namespace
+
+#endif // !__ECHO_ACTIVITY_NODE_H__
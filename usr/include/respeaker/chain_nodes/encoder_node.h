@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __ENCODER_NODE_H__
+#define __ENCODER_NODE_H__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "chain_nodes/audio_encoder.h"
+#include "chain_nodes/batch_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/chain_trace.h"
+
+namespace respeaker
+{
+
+/** A packet from respeaker::EncoderNode. */
+struct EncodedPacket
+{
+    std::string data;       ///< The encoded bytes, e.g. one Opus packet or one FLAC frame.
+    uint64_t first_frame;   ///< The index of the first audio frame in the packet, counted since the node started.
+    size_t num_frames;      ///< The audio frames in the packet, `0` for stream headers.
+};
+
+/**
+ * The EncoderNode compresses the stream with a respeaker::AudioEncoder (respeaker::OpusAudioEncoder for the cloud ASR,
+ * respeaker::FlacAudioEncoder for lossless archiving) inside the chain, so the application gets ready-to-send packets
+ * from `ListenPacket`/`ListenPackets` instead of compressing the PCM of `ReSpeaker::Listen` in another thread.
+ *
+ * The block is passed through unchanged, so the node can sit anywhere after the processing, e.g. right before the
+ * output node. The packets wait in a ring of `queue_ms` whose buffers are allocated in `OnStartThread`, when the
+ * application doesn't read them in time the oldest ones are dropped. The stream headers the codec writes when it opens
+ * (e.g. the FLAC metadata blocks) are kept apart from the ring so they are never dropped, get them with
+ * `GetHeaderPackets` once the chain started. At stop, the partial frame left in the encoder buffer is encoded too.
+ * When several blocks are queued, they are encoded in one go (respeaker::BatchNode) and the application is woken up
+ * once for all their packets.
+ */
+class EncoderNode : public BatchNode
+{
+public:
+    /**
+     * Create a EncoderNode instance.
+     *
+     * @param encoder - The codec, it's owned by the caller and must outlive the node.
+     * @param channel_index - The channel to encode, e.g. `0` for the beam channel of VepAecBeamformingNode. `-1`
+     *                        encodes all the channels.
+     * @param queue_ms - How much encoded audio is kept for the application, default to 2000.
+     *
+     * @return EncoderNode*
+     */
+    static EncoderNode* Create(AudioEncoder* encoder, int channel_index=0, int queue_ms=2000)
+    {
+        return new EncoderNode(encoder, channel_index, queue_ms);
+    }
+
+    virtual ~EncoderNode() = default;
+
+    virtual bool OnStartThread()
+    {
+        if (!_encoder || _channel_index >= static_cast<int>(_input_parameter.num_channel)) return false;
+        _num_channels = _channel_index < 0 ? _input_parameter.num_channel : 1;
+
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = ENCODER_NODE;
+        _is_interleaved_after_process = _input_parameter.interleaved;
+        _InitBatch();
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex_ring);
+            _ring_head = 0;
+            _ring_count = 0;
+            _headers.clear();
+        }
+        _frames_out = 0;
+        // the stream headers come out of `Open`
+        _opening = true;
+        bool opened = _encoder->Open(_input_parameter.rate, static_cast<int>(_num_channels), _on_packet);
+        _opening = false;
+        if (!opened) return false;
+        _frame_size = _encoder->FrameSize();
+        if (_frame_size == 0) return false;
+        _pcm.assign(_frame_size * _num_channels, 0);
+        _pcm_fill = 0;
+
+        std::lock_guard<std::mutex> lock(_mutex_ring);
+        size_t num_slots = _queue_ms * _input_parameter.rate / 1000 / _frame_size + 4;
+        if (num_slots > _ring.size()) _ring.resize(num_slots);
+        for (EncodedPacket& slot : _ring) slot.data.reserve(_encoder->MaxPacketSize());
+        return true;
+    }
+
+    virtual void ProcessBlocks(std::string* blocks, size_t num_blocks, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("EncoderNode");
+        // one wake-up of the consumer per span rather than per packet
+        _defer_notify = true;
+        for (size_t b = 0; b < num_blocks; b++) _EncodeBlock(blocks[b]);
+        _defer_notify = false;
+        if (_pending_notify) {
+            _pending_notify = false;
+            _cv_ring.notify_one();
+        }
+    }
+
+    virtual bool OnJoinThread()
+    {
+        if (_pcm_fill > 0) {
+            std::fill(_pcm.begin() + _pcm_fill * _num_channels, _pcm.end(), 0);
+            if (!_encoder->EncodeLast(_pcm.data(), _pcm_fill)) _error_count++;
+            _pcm_fill = 0;
+        }
+        _encoder->Close();
+        _cv_ring.notify_all();
+        return true;
+    }
+
+    /**
+     * Fetch the next encoded packet.
+     *
+     * @param packet [out] - Its buffer is reused, so keep the same object across the calls to avoid allocations.
+     * @param timeout_ms - How long to wait for a packet.
+     *
+     * @return bool - `false` when no packet arrived in `timeout_ms`.
+     */
+    bool ListenPacket(EncodedPacket& packet, int timeout_ms = 1000)
+    {
+        std::unique_lock<std::mutex> lock(_mutex_ring);
+        if (!_cv_ring.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] { return _ring_count > 0; })) {
+            return false;
+        }
+        const EncodedPacket& slot = _ring[_ring_head];
+        packet.data.assign(slot.data);
+        packet.first_frame = slot.first_frame;
+        packet.num_frames = slot.num_frames;
+        _ring_head = (_ring_head + 1) % _ring.size();
+        _ring_count--;
+        RESPEAKER_TRACE_COUNTER("EncoderNode.queue", _ring_count);
+        return true;
+    }
+
+    /**
+     * Fetch the encoded packets of `block_time_length_ms` milliseconds of audio, like `ReSpeaker::Listen`.
+     *
+     * @param packets [out] - The packets are appended.
+     * @param block_time_length_ms - How many milliseconds of audio you want, it's rounded up to whole packets.
+     *
+     * @return size_t - The number of packets appended, fewer than asked if the chain stopped.
+     */
+    size_t ListenPackets(std::vector<EncodedPacket>& packets, int block_time_length_ms)
+    {
+        uint64_t wanted = static_cast<uint64_t>(block_time_length_ms) * _input_parameter.rate / 1000;
+        uint64_t got = 0;
+        size_t n = 0;
+        EncodedPacket packet;
+        while (got < wanted && ListenPacket(packet)) {
+            got += packet.num_frames;
+            packets.push_back(packet);
+            n++;
+        }
+        return n;
+    }
+
+    /**
+     * Get the stream headers written when the codec opened, e.g. "fLaC", STREAMINFO and VORBIS_COMMENT for FLAC,
+     * none for Opus. Write them before the packets of `ListenPacket` to get a valid stream.
+     *
+     * @param packets [out] - The headers replace the content.
+     */
+    void GetHeaderPackets(std::vector<EncodedPacket>& packets)
+    {
+        std::lock_guard<std::mutex> lock(_mutex_ring);
+        packets = _headers;
+    }
+
+    /** Get how many packets were dropped because they weren't fetched in time. */
+    uint64_t GetDroppedCount() { return _dropped_count; }
+
+    /** Get how many `Encode` calls failed. */
+    uint64_t GetErrorCount() { return _error_count; }
+
+    /** Get the total size of the packets, for the bitrate. */
+    uint64_t GetEncodedBytes() { return _encoded_bytes; }
+
+protected:
+    EncoderNode(AudioEncoder* encoder, int channel_index, int queue_ms)
+        : _encoder(encoder),
+          _channel_index(channel_index < 0 ? -1 : channel_index),
+          _queue_ms(queue_ms > 0 ? queue_ms : 0),
+          _num_channels(1),
+          _frame_size(0),
+          _pcm_fill(0),
+          _frames_out(0),
+          _opening(false),
+          _defer_notify(false),
+          _pending_notify(false),
+          _ring(16),
+          _ring_head(0),
+          _ring_count(0),
+          _dropped_count(0),
+          _error_count(0),
+          _encoded_bytes(0)
+    {
+        _on_packet = [this](const uint8_t* data, size_t size, size_t num_frames) {
+            _PushPacket(data, size, num_frames);
+        };
+    }
+
+    /** Copy the frames of a block into the frame buffer of the encoder, the block goes down unchanged. */
+    void _EncodeBlock(const std::string& block)
+    {
+        size_t num_in = _input_parameter.num_channel;
+        size_t frames = BlockNumFrames(block, num_in);
+        const int16_t* in = BlockSamples(block);
+        bool interleaved = _input_parameter.interleaved;
+
+        for (size_t i = 0; i < frames; i++) {
+            int16_t* out = &_pcm[_pcm_fill * _num_channels];
+            if (_channel_index >= 0) {
+                out[0] = interleaved ? in[i * num_in + _channel_index] : in[_channel_index * frames + i];
+            } else if (interleaved) {
+                memcpy(out, in + i * num_in, num_in * sizeof(int16_t));
+            } else {
+                for (size_t c = 0; c < num_in; c++) out[c] = in[c * frames + i];
+            }
+            if (++_pcm_fill == _frame_size) {
+                _pcm_fill = 0;
+                if (!_encoder->Encode(_pcm.data())) _error_count++;
+            }
+        }
+    }
+
+    void _PushPacket(const uint8_t* data, size_t size, size_t num_frames)
+    {
+        if (_opening) {
+            std::lock_guard<std::mutex> lock(_mutex_ring);
+            EncodedPacket header;
+            header.data.assign(reinterpret_cast<const char*>(data), size);
+            header.first_frame = 0;
+            header.num_frames = 0;
+            _headers.push_back(header);
+            _encoded_bytes += size;
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex_ring);
+            if (_ring_count == _ring.size()) {
+                _ring_head = (_ring_head + 1) % _ring.size();
+                _ring_count--;
+                _dropped_count++;
+            }
+            // assign() keeps the capacity reserved in OnStartThread
+            EncodedPacket& slot = _ring[(_ring_head + _ring_count) % _ring.size()];
+            slot.data.assign(reinterpret_cast<const char*>(data), size);
+            slot.first_frame = _frames_out;
+            slot.num_frames = num_frames;
+            _ring_count++;
+            RESPEAKER_TRACE_COUNTER("EncoderNode.queue", _ring_count);
+        }
+        _frames_out += num_frames;
+        _encoded_bytes += size;
+        if (_defer_notify) {
+            _pending_notify = true;
+        } else {
+            _cv_ring.notify_one();
+        }
+    }
+
+    AudioEncoder* _encoder;
+    int _channel_index;
+    size_t _queue_ms;
+    size_t _num_channels;
+    size_t _frame_size;
+    std::vector<int16_t> _pcm;
+    size_t _pcm_fill;
+    uint64_t _frames_out;
+    AudioEncoder::PacketCallback _on_packet;
+    bool _opening;
+    bool _defer_notify;
+    bool _pending_notify;
+
+    std::mutex _mutex_ring;
+    std::condition_variable _cv_ring;
+    std::vector<EncodedPacket> _ring;
+    size_t _ring_head;
+    size_t _ring_count;
+    std::vector<EncodedPacket> _headers;
+
+    std::atomic<uint64_t> _dropped_count;
+    std::atomic<uint64_t> _error_count;
+    std::atomic<uint64_t> _encoded_bytes;
+};
+
+}  //namespace
+
+#endif // !__ENCODER_NODE_H__
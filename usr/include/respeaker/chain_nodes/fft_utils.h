@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __FFT_UTILS_H__
+#define __FFT_UTILS_H__
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include "chain_nodes/sample_dsp.h"
+
+namespace respeaker
+{
+
+/**
+ * Real FFT of power-of-two size N, computed by a N/2 points complex FFT plus the split post-processing.
+ * The spectrum is kept in split format (separate real and imaginary arrays of N/2+1 bins), so the per-bin loops in
+ * the nodes are plain float loops and the compiler can vectorize them with NEON/SSE.
+ * The twiddles and the bit-reversal table are computed once in the constructor, the transforms don't allocate.
+ */
+class RealFft
+{
+public:
+    explicit RealFft(size_t n = 256) { Init(n); }
+
+    /** Set up for size `n`, which must be a power of two and at least 4. */
+    void Init(size_t n)
+    {
+        _n = n;
+        _m = n / 2;
+        _bitrev.assign(_m, 0);
+        for (size_t i = 0, j = 0; i < _m; i++) {
+            _bitrev[i] = j;
+            size_t bit = _m >> 1;
+            while (bit && (j & bit)) {
+                j ^= bit;
+                bit >>= 1;
+            }
+            j |= bit;
+        }
+        // complex twiddles for the N/2 FFT, and the split twiddles for the real post-processing
+        _tw_re.resize(_m / 2);
+        _tw_im.resize(_m / 2);
+        for (size_t k = 0; k < _m / 2; k++) {
+            _tw_re[k] = static_cast<float>(std::cos(2.0 * M_PI * k / _m));
+            _tw_im[k] = static_cast<float>(-std::sin(2.0 * M_PI * k / _m));
+        }
+        _split_re.resize(_m + 1);
+        _split_im.resize(_m + 1);
+        for (size_t k = 0; k <= _m; k++) {
+            _split_re[k] = static_cast<float>(std::cos(2.0 * M_PI * k / _n));
+            _split_im[k] = static_cast<float>(-std::sin(2.0 * M_PI * k / _n));
+        }
+        _zr.resize(_m);
+        _zi.resize(_m);
+    }
+
+    size_t Size() const { return _n; }
+    size_t NumBins() const { return _m + 1; }
+
+    /**
+     * Forward transform.
+     *
+     * @param in - N real samples.
+     * @param re [out] - N/2+1 bins, real part.
+     * @param im [out] - N/2+1 bins, imaginary part.
+     */
+    void Forward(const float* RESPEAKER_RESTRICT in, float* RESPEAKER_RESTRICT re, float* RESPEAKER_RESTRICT im)
+    {
+        for (size_t i = 0; i < _m; i++) {
+            size_t j = _bitrev[i];
+            _zr[j] = in[2 * i];
+            _zi[j] = in[2 * i + 1];
+        }
+        _Butterflies();
+
+        re[0] = _zr[0] + _zi[0];
+        im[0] = 0.0f;
+        re[_m] = _zr[0] - _zi[0];
+        im[_m] = 0.0f;
+        for (size_t k = 1; k < _m; k++) {
+            float ar = _zr[k], ai = _zi[k];
+            float br = _zr[_m - k], bi = -_zi[_m - k];
+            float er = 0.5f * (ar + br), ei = 0.5f * (ai + bi);
+            float orr = 0.5f * (ai - bi), oi = -0.5f * (ar - br);
+            float wr = _split_re[k], wi = _split_im[k];
+            re[k] = er + wr * orr - wi * oi;
+            im[k] = ei + wr * oi + wi * orr;
+        }
+    }
+
+    /**
+     * Inverse transform, scaled by 1/N so that `Inverse(Forward(x)) == x`.
+     *
+     * @param re - N/2+1 bins, real part.
+     * @param im - N/2+1 bins, imaginary part.
+     * @param out [out] - N real samples.
+     */
+    void Inverse(const float* RESPEAKER_RESTRICT re, const float* RESPEAKER_RESTRICT im, float* RESPEAKER_RESTRICT out)
+    {
+        for (size_t k = 0; k < _m; k++) {
+            float ar = re[k], ai = im[k];
+            float br = re[_m - k], bi = -im[_m - k];
+            float er = ar + br, ei = ai + bi;
+            float dr = ar - br, di = ai - bi;
+            // odd part = (X[k] - conj(X[M-k])) * conj(w^k), then Z = even + j * odd
+            float wr = _split_re[k], wi = -_split_im[k];
+            float orr = dr * wr - di * wi, oi = dr * wi + di * wr;
+            size_t j = _bitrev[k];
+            // conjugate in, conjugate out: the forward butterflies compute the inverse transform
+            _zr[j] = er - oi;
+            _zi[j] = -(ei + orr);
+        }
+        _Butterflies();
+
+        const float scale = 1.0f / _n;
+        for (size_t i = 0; i < _m; i++) {
+            out[2 * i] = _zr[i] * scale;
+            out[2 * i + 1] = -_zi[i] * scale;
+        }
+    }
+
+private:
+    void _Butterflies()
+    {
+        for (size_t len = 2; len <= _m; len <<= 1) {
+            size_t half = len >> 1;
+            size_t step = _m / len;
+            for (size_t start = 0; start < _m; start += len) {
+                float* RESPEAKER_RESTRICT ar = &_zr[start];
+                float* RESPEAKER_RESTRICT ai = &_zi[start];
+                float* RESPEAKER_RESTRICT br = &_zr[start + half];
+                float* RESPEAKER_RESTRICT bi = &_zi[start + half];
+                for (size_t j = 0; j < half; j++) {
+                    float wr = _tw_re[j * step], wi = _tw_im[j * step];
+                    float tr = br[j] * wr - bi[j] * wi;
+                    float ti = br[j] * wi + bi[j] * wr;
+                    br[j] = ar[j] - tr;
+                    bi[j] = ai[j] - ti;
+                    ar[j] += tr;
+                    ai[j] += ti;
+                }
+            }
+        }
+    }
+
+    size_t _n;
+    size_t _m;
+    std::vector<size_t> _bitrev;
+    std::vector<float> _tw_re, _tw_im;
+    std::vector<float> _split_re, _split_im;
+    std::vector<float> _zr, _zi;
+};
+
+/** Fill `window` with a periodic Hann window of `n` points, or its square root when `sqrt_hann` is true. */
+inline void MakeHannWindow(std::vector<float>& window, size_t n, bool sqrt_hann = false)
+{
+    window.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        double w = 0.5 - 0.5 * std::cos(2.0 * M_PI * i / n);
+        window[i] = static_cast<float>(sqrt_hann ? std::sqrt(w) : w);
+    }
+}
+
+}  // namespace respeaker
+
+#endif // !__FFT_UTILS_H__
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __FIXED_RING_H__
+#define __FIXED_RING_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace respeaker
+{
+
+/**
+ * A FIFO of at most `capacity` elements over slots allocated once, for the queues of the nodes instead of a
+ * `std::deque`, which allocates and frees a chunk every few pushes. The slots are recycled rather than destroyed: a
+ * popped `std::string` keeps its capacity, so `PushBack().assign(block)` doesn't allocate once the ring went round.
+ * Not thread safe, the nodes hold their queue mutex.
+ */
+template <typename T>
+class FixedRing
+{
+public:
+    FixedRing() : _head(0), _size(0) {}
+
+    /**
+     * Set the capacity, keeping the newest elements. It allocates, call it when the chain starts or from a control
+     * path, not per block.
+     */
+    void SetCapacity(size_t capacity)
+    {
+        while (_size > capacity) PopFront();
+        std::rotate(_slots.begin(), _slots.begin() + _head, _slots.end());
+        _head = 0;
+        _slots.resize(capacity);
+    }
+
+    size_t Capacity() const { return _slots.size(); }
+
+    size_t Size() const { return _size; }
+
+    bool Empty() const { return _size == 0; }
+
+    bool Full() const { return _size == _slots.size(); }
+
+    /** The `i`th element from the front. */
+    T& operator[](size_t i) { return _slots[(_head + i) % _slots.size()]; }
+
+    T& Front() { return _slots[_head]; }
+
+    /** Append a slot and get it, it still holds what it held the last time, assign it. The ring must not be full. */
+    T& PushBack()
+    {
+        T& slot = (*this)[_size];
+        _size++;
+        return slot;
+    }
+
+    void PopFront()
+    {
+        _head = (_head + 1) % _slots.size();
+        _size--;
+    }
+
+    /** Remove the `i`th element, the later ones move up by swapping so no slot is destroyed. */
+    void Erase(size_t i)
+    {
+        for (; i + 1 < _size; i++) std::swap((*this)[i], (*this)[i + 1]);
+        _size--;
+    }
+
+    void Clear()
+    {
+        _head = 0;
+        _size = 0;
+    }
+
+private:
+    std::vector<T> _slots;
+    size_t _head;
+    size_t _size;
+};
+
+/**
+ * A lock-free FIFO over slots allocated once, for one producer thread and one consumer thread, e.g. a node thread
+ * handing blocks to a real-time audio callback. The producer fills `BackSlot()` and publishes it with Push(); the
+ * consumer reads the published slots and gives them back with Pop() or Erase(). The elements are swapped in and out
+ * of the slots, so a slot keeps the buffer it got and nothing is allocated once the ring went round.
+ * SetCapacity() allocates and resets the ring, call it only while neither side runs.
+ */
+template <typename T>
+class SpscRing
+{
+public:
+    SpscRing() : _head(0), _tail(0) {}
+
+    /** Set the capacity and drop the elements, the slots start as copies of `value`. Neither side may run. */
+    void SetCapacity(size_t capacity, const T& value = T())
+    {
+        _slots.assign(capacity, value);
+        _head.store(0);
+        _tail.store(0);
+    }
+
+    size_t Capacity() const { return _slots.size(); }
+
+    /** The number of published elements, exact for the consumer, a lower bound of the free slots for the producer. */
+    size_t Size() const
+    {
+        // the head first: it never passes the tail, so the later tail is at least the earlier head
+        uint64_t head = _head.load(std::memory_order_acquire);
+        return static_cast<size_t>(_tail.load(std::memory_order_acquire) - head);
+    }
+
+    /** Producer: the slot to fill, it still holds what it held the last time. nullptr when the ring is full. */
+    T* BackSlot()
+    {
+        uint64_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head.load(std::memory_order_acquire) >= _slots.size()) return nullptr;
+        return &_slots[tail % _slots.size()];
+    }
+
+    /** Producer: publish the slot got from BackSlot(). */
+    void Push() { _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    /** Consumer: the `i`th published element from the front, `i < Size()`. */
+    T& operator[](size_t i) { return _slots[(_head.load(std::memory_order_relaxed) + i) % _slots.size()]; }
+
+    /** Consumer: the front element, the ring must not be empty. */
+    T& Front() { return (*this)[0]; }
+
+    /** Consumer: give the front slot back to the producer. */
+    void Pop() { _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    /** Consumer: remove the `i`th element, the earlier ones move back by swapping so no slot is destroyed. */
+    void Erase(size_t i)
+    {
+        for (; i > 0; i--) std::swap((*this)[i], (*this)[i - 1]);
+        Pop();
+    }
+
+private:
+    std::vector<T> _slots;
+    std::atomic<uint64_t> _head;    ///< Elements popped since the start, written by the consumer only.
+    std::atomic<uint64_t> _tail;    ///< Elements pushed since the start, written by the producer only.
+};
+
+}  //namespace
+
+#endif // !__FIXED_RING_H__
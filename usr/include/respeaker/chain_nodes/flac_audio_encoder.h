@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __FLAC_AUDIO_ENCODER_H__
+#define __FLAC_AUDIO_ENCODER_H__
+
+#include <FLAC/stream_encoder.h>
+
+#include <vector>
+
+#include "chain_nodes/audio_encoder.h"
+
+namespace respeaker
+{
+
+/**
+ * Encode to a lossless FLAC stream, for archiving the audio sent to the ASR. The first packets are the stream header
+ * ("fLaC", the STREAMINFO block and the VORBIS_COMMENT block libFLAC adds with its vendor string, `num_frames` is 0),
+ * then one packet per FLAC frame. Concatenated, the packets are
+ * a valid *.flac file, the STREAMINFO just doesn't carry the total length and the MD5 since the stream isn't seekable.
+ * Please link your application with `-lFLAC`.
+ */
+class FlacAudioEncoder : public AudioEncoder
+{
+public:
+    /**
+     * @param compression_level - [0, 8], default to 5. Levels above 5 cost much more CPU for ~1% of size.
+     * @param frame_ms - The FLAC block size in milliseconds, default to 32 (512 frames at 16KHz).
+     */
+    explicit FlacAudioEncoder(int compression_level = 5, int frame_ms = 32)
+        : _compression_level(compression_level), _frame_ms(frame_ms), _num_channels(0), _frame_size(0),
+          _encoder(nullptr) {}
+
+    virtual ~FlacAudioEncoder() { Close(); }
+
+    virtual bool Open(int rate, int num_channels, const PacketCallback& callback)
+    {
+        Close();
+        if (rate <= 0 || num_channels < 1 || num_channels > 8 || _frame_ms <= 0) return false;
+        _encoder = FLAC__stream_encoder_new();
+        if (!_encoder) return false;
+
+        _num_channels = static_cast<size_t>(num_channels);
+        _frame_size = static_cast<size_t>(rate) * _frame_ms / 1000;
+        _samples.assign(_frame_size * _num_channels, 0);
+        _callback = callback;
+
+        FLAC__stream_encoder_set_channels(_encoder, num_channels);
+        FLAC__stream_encoder_set_bits_per_sample(_encoder, 16);
+        FLAC__stream_encoder_set_sample_rate(_encoder, rate);
+        FLAC__stream_encoder_set_compression_level(_encoder, _compression_level);
+        FLAC__stream_encoder_set_blocksize(_encoder, static_cast<uint32_t>(_frame_size));
+        FLAC__stream_encoder_set_streamable_subset(_encoder, true);
+        // the header is written from inside init
+        if (FLAC__stream_encoder_init_stream(_encoder, &FlacAudioEncoder::_OnWrite, nullptr, nullptr, nullptr, this) !=
+            FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+            FLAC__stream_encoder_delete(_encoder);
+            _encoder = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    virtual size_t FrameSize() { return _frame_size; }
+
+    virtual bool Encode(const int16_t* interleaved)
+    {
+        if (!_encoder) return false;
+        for (size_t i = 0; i < _samples.size(); i++) _samples[i] = interleaved[i];
+        return FLAC__stream_encoder_process_interleaved(_encoder, _samples.data(), static_cast<uint32_t>(_frame_size));
+    }
+
+    /** FLAC allows a shorter last frame, so the padding isn't encoded. */
+    virtual bool EncodeLast(const int16_t* interleaved, size_t num_frames)
+    {
+        if (!_encoder || num_frames > _frame_size) return false;
+        for (size_t i = 0; i < num_frames * _num_channels; i++) _samples[i] = interleaved[i];
+        return FLAC__stream_encoder_process_interleaved(_encoder, _samples.data(), static_cast<uint32_t>(num_frames));
+    }
+
+    /** Flushes the last frame, which libFLAC holds back until it knows it's not the end of the stream. */
+    virtual void Close()
+    {
+        if (!_encoder) return;
+        FLAC__stream_encoder_finish(_encoder);
+        FLAC__stream_encoder_delete(_encoder);
+        _encoder = nullptr;
+    }
+
+    /** A verbatim (uncompressed) frame, with 17 bits for a side channel, plus the frame header and footer. */
+    virtual size_t MaxPacketSize() { return (_frame_size * _num_channels * 17 + 7) / 8 + 64; }
+
+private:
+    static FLAC__StreamEncoderWriteStatus _OnWrite(const FLAC__StreamEncoder* encoder, const FLAC__byte buffer[],
+                                                   size_t bytes, uint32_t samples, uint32_t current_frame,
+                                                   void* client_data)
+    {
+        (void)encoder;
+        (void)current_frame;
+        FlacAudioEncoder* self = static_cast<FlacAudioEncoder*>(client_data);
+        if (self->_callback) self->_callback(buffer, bytes, samples);
+        return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+    }
+
+    int _compression_level;
+    int _frame_ms;
+    size_t _num_channels;
+    size_t _frame_size;
+    FLAC__StreamEncoder* _encoder;
+    std::vector<FLAC__int32> _samples;
+    PacketCallback _callback;
+};
+
+}  //namespace
+
+#endif // !__FLAC_AUDIO_ENCODER_H__
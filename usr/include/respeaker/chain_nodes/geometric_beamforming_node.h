@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+
+#ifndef __GEOMETRIC_BEAMFORMING_NODE_H__
+#define __GEOMETRIC_BEAMFORMING_NODE_H__
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/chain_trace.h"
+#include "chain_nodes/direction_manager_node.h"
+#include "chain_nodes/fft_utils.h"
+#include "chain_nodes/mic_type_info.h"
+
+namespace respeaker
+{
+
+/** The beamforming algorithms of GeometricBeamformingNode */
+enum BeamformerType {
+    DELAY_AND_SUM_BEAMFORMER = 0, ///< Fixed delay-and-sum, the cheapest, works with any geometry.
+    MVDR_BEAMFORMER = 1           ///< MVDR with a noise covariance learned in the quiet blocks, more noise rejection.
+};
+
+/**
+ * The GeometricBeamformingNode is an open frequency-domain beamformer, the steering vectors are built from
+ * MicTypeInfo::mic_coordinates. So it works for all the MicTypes, including those VepAecBeamformingNode doesn't
+ * support yet (e.g. CIRCULAR_4MIC_9BEAM and LINEAR_4MIC_1BEAM). It doesn't do AEC.
+ *
+ * The input is split into 50% overlapped, sqrt-Hann windowed frames (STFT), each directional beam of the MicType is
+ * formed per bin, and the output is synthesized by overlap-add. In single-beam mode, the beam with the most energy
+ * (with hysteresis) is selected, and only that beam is synthesized.
+ */
+class GeometricBeamformingNode : public BaseNode, public DirectionManagerNode
+{
+public:
+    /**
+     * Create a GeometricBeamformingNode instance.
+     *
+     * @param mic_type - Specify the microphone type.
+     * @param is_single_beam_output - Output the most proper beam only (1 channel), or all the directional beams.
+     * @param beamformer_type - One of respeaker::BeamformerType.
+     * @param output_interleaved - Set it true to output interleaved data, false to output deinterleaved data.
+     *
+     * @return GeometricBeamformingNode*
+     */
+    static GeometricBeamformingNode* Create(MicType mic_type, bool is_single_beam_output,
+                                            BeamformerType beamformer_type = DELAY_AND_SUM_BEAMFORMER,
+                                            bool output_interleaved = false)
+    {
+        MicTypeInfo info;
+        SetMicTypeInfo(mic_type, info);
+        return new GeometricBeamformingNode(info, is_single_beam_output, beamformer_type, 0, output_interleaved);
+    }
+
+    /**
+     * @param mic_type_info - A MicTypeInfo with customized `mic_coordinates`.
+     * @param is_single_beam_output - Output the most proper beam only (1 channel), or all the directional beams.
+     * @param beamformer_type - One of respeaker::BeamformerType.
+     * @param first_mic_channel - The index of the channel of microphone 0, the microphones must be consecutive.
+     * @param output_interleaved - Set it true to output interleaved data, false to output deinterleaved data.
+     *
+     * @return GeometricBeamformingNode*
+     */
+    static GeometricBeamformingNode* Create(const MicTypeInfo& mic_type_info, bool is_single_beam_output,
+                                            BeamformerType beamformer_type, int first_mic_channel,
+                                            bool output_interleaved = false)
+    {
+        return new GeometricBeamformingNode(mic_type_info, is_single_beam_output, beamformer_type,
+                                            first_mic_channel, output_interleaved);
+    }
+
+    virtual ~GeometricBeamformingNode() = default;
+
+    /**
+     * Set the angle for microphone 0, if it's not `0` for the board. Only works for circular microphone array.
+     *
+     * @param angle - degree
+     */
+    void SetAngleForMic0(int angle) { _angle_for_mic0 = angle; }
+
+    /**
+     * @param update_interval_ms - How often the MVDR weights are recomputed from the noise covariance, default to 128.
+     */
+    void SetMvdrUpdateInterval(int update_interval_ms) { _update_interval_ms = std::max(update_interval_ms, 1); }
+
+    virtual bool OnStartThread()
+    {
+        _num_mics = _mic_info.num_of_mics;
+        _num_beams = _mic_info.num_of_directional_beams;
+        if (_num_mics < 1 || _num_mics > MAX_NUM_OF_MICS || _num_beams < 1) return false;
+        if (_first_mic_channel + _num_mics > _input_parameter.num_channel) return false;
+
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = GEOMETRIC_BEAMFORMING_NODE;
+        _output_parameter.num_channel = _single_beam ? 1 : _num_beams;
+        _output_parameter.interleaved = _output_interleaved;
+        _is_interleaved_after_process = _output_interleaved;
+
+        size_t block_ms = _input_parameter.block_len_ms ? _input_parameter.block_len_ms : 8;
+        _hop = _input_parameter.rate * block_ms / 1000;
+        _fft_size = 2 * _hop;
+        if (_hop == 0 || (_hop & (_hop - 1))) return false;
+        _num_bins = _fft_size / 2 + 1;
+        _fft.Init(_fft_size);
+        MakeHannWindow(_window, _fft_size, true);
+
+        _frames.assign(_num_mics, std::vector<float>(_fft_size, 0.0f));
+        _spec_re.assign(_num_mics, std::vector<float>(_num_bins, 0.0f));
+        _spec_im.assign(_num_mics, std::vector<float>(_num_bins, 0.0f));
+        _windowed.assign(_fft_size, 0.0f);
+        _block_samples.assign(_hop, 0);
+
+        size_t num_synth = _single_beam ? 1 : _num_beams;
+        _beam_re.assign(_num_beams, std::vector<float>(_num_bins, 0.0f));
+        _beam_im.assign(_num_beams, std::vector<float>(_num_bins, 0.0f));
+        _overlap.assign(num_synth, std::vector<float>(_hop, 0.0f));
+        _synth.assign(_fft_size, 0.0f);
+        _beam_energy.assign(_num_beams, 0.0f);
+
+        _BuildSteering();
+        _weights_re = _steer_re;
+        _weights_im = _steer_im;
+        for (auto& w : _weights_re) w /= static_cast<float>(_num_mics);
+        for (auto& w : _weights_im) w /= static_cast<float>(_num_mics);
+
+        _noise_cov.assign(_num_bins * _num_mics * _num_mics, std::complex<float>(0.0f, 0.0f));
+        for (size_t k = 0; k < _num_bins; k++) {
+            for (size_t m = 0; m < _num_mics; m++) _Cov(k, m, m) = std::complex<float>(1e-6f, 0.0f);
+        }
+        _update_interval_blocks = std::max<size_t>(1, _update_interval_ms / block_ms);
+        _blocks_since_update = 0;
+        _noise_db = 0.0f;
+        _noise_init = false;
+        _selected_beam = 0;
+        _challenge_count = 0;
+        return true;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("GeometricBeamformingNode");
+        if (BlockNumFrames(block, _input_parameter.num_channel) != _hop) return std::string();
+
+        // analysis
+        double energy = 0.0;
+        for (size_t m = 0; m < _num_mics; m++) {
+            std::vector<float>& frame = _frames[m];
+            CopyChannel(block, _input_parameter.num_channel, _input_parameter.interleaved, _first_mic_channel + m,
+                        _block_samples.data());
+            std::copy(frame.begin() + _hop, frame.end(), frame.begin());
+            float* tail = &frame[_hop];
+            for (size_t i = 0; i < _hop; i++) {
+                tail[i] = static_cast<float>(_block_samples[i]);
+                energy += static_cast<double>(tail[i]) * tail[i];
+            }
+            for (size_t i = 0; i < _fft_size; i++) _windowed[i] = frame[i] * _window[i];
+            _fft.Forward(_windowed.data(), _spec_re[m].data(), _spec_im[m].data());
+        }
+
+        if (_type == MVDR_BEAMFORMER) _UpdateNoiseCovariance(energy);
+
+        // beamforming: Y_b = sum_m conj(w_bm) * X_m
+        for (size_t b = 0; b < _num_beams; b++) {
+            float* RESPEAKER_RESTRICT yr = _beam_re[b].data();
+            float* RESPEAKER_RESTRICT yi = _beam_im[b].data();
+            std::fill(yr, yr + _num_bins, 0.0f);
+            std::fill(yi, yi + _num_bins, 0.0f);
+            for (size_t m = 0; m < _num_mics; m++) {
+                const float* RESPEAKER_RESTRICT wr = &_weights_re[(b * _num_mics + m) * _num_bins];
+                const float* RESPEAKER_RESTRICT wi = &_weights_im[(b * _num_mics + m) * _num_bins];
+                const float* RESPEAKER_RESTRICT xr = _spec_re[m].data();
+                const float* RESPEAKER_RESTRICT xi = _spec_im[m].data();
+                for (size_t k = 0; k < _num_bins; k++) {
+                    yr[k] += wr[k] * xr[k] + wi[k] * xi[k];
+                    yi[k] += wr[k] * xi[k] - wi[k] * xr[k];
+                }
+            }
+            float e = 0.0f;
+            for (size_t k = 0; k < _num_bins; k++) e += yr[k] * yr[k] + yi[k] * yi[k];
+            _beam_energy[b] = 0.8f * _beam_energy[b] + 0.2f * e;
+        }
+
+        if (_single_beam) {
+            _SelectBeam();
+            _out_block.assign(_hop * sizeof(int16_t), '\0');
+            _Synthesize(_selected_beam, 0, BlockSamples(_out_block));
+            return SwapOutBlock(block, _out_block);
+        }
+
+        _out_block.assign(_hop * _num_beams * sizeof(int16_t), '\0');
+        int16_t* samples = BlockSamples(_out_block);
+        for (size_t b = 0; b < _num_beams; b++) {
+            if (_output_interleaved) {
+                _Synthesize(b, b, &_block_samples[0]);
+                for (size_t i = 0; i < _hop; i++) samples[i * _num_beams + b] = _block_samples[i];
+            } else {
+                _Synthesize(b, b, samples + b * _hop);
+            }
+        }
+        return SwapOutBlock(block, _out_block);
+    }
+
+    virtual bool OnJoinThread()
+    {
+        return true;
+    }
+
+    /** Get the direction of the selected beam, in degree. */
+    virtual int GetDirection() { return _direction; }
+
+    /** Lock the selected beam to the one nearest to `dir`. Call it with `-1` to go back to automatic selection. */
+    virtual void SetDirection(int dir) { _forced_direction = dir; }
+
+private:
+    GeometricBeamformingNode(const MicTypeInfo& mic_type_info, bool is_single_beam_output,
+                             BeamformerType beamformer_type, int first_mic_channel, bool output_interleaved)
+        : _mic_info(mic_type_info),
+          _single_beam(is_single_beam_output),
+          _type(beamformer_type),
+          _first_mic_channel(first_mic_channel < 0 ? 0 : first_mic_channel),
+          _output_interleaved(output_interleaved),
+          _angle_for_mic0(0),
+          _update_interval_ms(128),
+          _direction(0),
+          _forced_direction(-1) {}
+
+    std::complex<float>& _Cov(size_t k, size_t i, size_t j)
+    {
+        return _noise_cov[(k * _num_mics + i) * _num_mics + j];
+    }
+
+    int _BeamDirection(size_t b)
+    {
+        int dir = GetBeamDirection(_mic_info, static_cast<int>(b));
+        if (_mic_info.geometries == 0) dir = ((dir + _angle_for_mic0) % 360 + 360) % 360;
+        return dir;
+    }
+
+    void _BuildSteering()
+    {
+        const float sound_speed = 343.0f;
+        _steer_re.assign(_num_beams * _num_mics * _num_bins, 0.0f);
+        _steer_im.assign(_num_beams * _num_mics * _num_bins, 0.0f);
+        for (size_t b = 0; b < _num_beams; b++) {
+            // steer in the array frame, the beam direction is reported in the board frame
+            double rad = GetBeamDirection(_mic_info, static_cast<int>(b)) * M_PI / 180.0;
+            double ux = std::cos(rad), uy = std::sin(rad);
+            for (size_t m = 0; m < _num_mics; m++) {
+                const float* r = _mic_info.mic_coordinates[m];
+                double tau = -(r[0] * ux + r[1] * uy) / sound_speed * _input_parameter.rate;
+                for (size_t k = 0; k < _num_bins; k++) {
+                    double phase = -2.0 * M_PI * k * tau / _fft_size;
+                    _steer_re[(b * _num_mics + m) * _num_bins + k] = static_cast<float>(std::cos(phase));
+                    _steer_im[(b * _num_mics + m) * _num_bins + k] = static_cast<float>(std::sin(phase));
+                }
+            }
+        }
+    }
+
+    void _UpdateNoiseCovariance(double energy)
+    {
+        float db = 10.0f * std::log10(static_cast<float>(energy / (_num_mics * _hop)) + 1.0f);
+        if (!_noise_init) {
+            _noise_db = db;
+            _noise_init = true;
+        } else if (db < _noise_db) {
+            _noise_db += 0.2f * (db - _noise_db);
+        } else {
+            _noise_db += 0.005f;
+        }
+
+        // learn the noise field only in the quiet blocks, so the target voice isn't cancelled
+        if (db - _noise_db < 3.0f) {
+            const float beta = 0.98f;
+            for (size_t k = 0; k < _num_bins; k++) {
+                for (size_t i = 0; i < _num_mics; i++) {
+                    std::complex<float> xi(_spec_re[i][k], _spec_im[i][k]);
+                    for (size_t j = i; j < _num_mics; j++) {
+                        std::complex<float> xj(_spec_re[j][k], _spec_im[j][k]);
+                        std::complex<float>& c = _Cov(k, i, j);
+                        c = beta * c + (1.0f - beta) * xi * std::conj(xj);
+                        _Cov(k, j, i) = std::conj(c);
+                    }
+                }
+            }
+        }
+
+        if (++_blocks_since_update >= _update_interval_blocks) {
+            _blocks_since_update = 0;
+            _UpdateMvdrWeights();
+        }
+    }
+
+    /** w = R^-1 d / (d^H R^-1 d), R is diagonally loaded then Cholesky factorized per bin. */
+    void _UpdateMvdrWeights()
+    {
+        const size_t n = _num_mics;
+        std::complex<float> l[MAX_NUM_OF_MICS][MAX_NUM_OF_MICS];
+        std::complex<float> y[MAX_NUM_OF_MICS];
+
+        for (size_t k = 0; k < _num_bins; k++) {
+            float trace = 0.0f;
+            for (size_t i = 0; i < n; i++) trace += _Cov(k, i, i).real();
+            float loading = 0.01f * trace / n + 1e-9f;
+
+            bool ok = true;
+            for (size_t i = 0; i < n && ok; i++) {
+                for (size_t j = 0; j <= i; j++) {
+                    std::complex<float> sum = _Cov(k, i, j);
+                    if (i == j) sum += loading;
+                    for (size_t p = 0; p < j; p++) sum -= l[i][p] * std::conj(l[j][p]);
+                    if (i == j) {
+                        if (sum.real() <= 0.0f) {
+                            ok = false;
+                            break;
+                        }
+                        l[i][i] = std::sqrt(sum.real());
+                    } else {
+                        l[i][j] = sum / l[j][j].real();
+                    }
+                }
+            }
+            if (!ok) continue;
+
+            for (size_t b = 0; b < _num_beams; b++) {
+                const size_t base = b * n * _num_bins + k;
+                // solve L y = d, then L^H x = y
+                for (size_t i = 0; i < n; i++) {
+                    std::complex<float> sum(_steer_re[base + i * _num_bins], _steer_im[base + i * _num_bins]);
+                    for (size_t p = 0; p < i; p++) sum -= l[i][p] * y[p];
+                    y[i] = sum / l[i][i].real();
+                }
+                for (size_t ii = n; ii-- > 0;) {
+                    std::complex<float> sum = y[ii];
+                    for (size_t p = ii + 1; p < n; p++) sum -= std::conj(l[p][ii]) * y[p];
+                    y[ii] = sum / l[ii][ii].real();
+                }
+                std::complex<float> denom(0.0f, 0.0f);
+                for (size_t i = 0; i < n; i++) {
+                    std::complex<float> d(_steer_re[base + i * _num_bins], _steer_im[base + i * _num_bins]);
+                    denom += std::conj(d) * y[i];
+                }
+                if (std::abs(denom) < 1e-12f) continue;
+                for (size_t i = 0; i < n; i++) {
+                    std::complex<float> w = y[i] / denom;
+                    _weights_re[base + i * _num_bins] = w.real();
+                    _weights_im[base + i * _num_bins] = w.imag();
+                }
+            }
+        }
+    }
+
+    void _SelectBeam()
+    {
+        if (_forced_direction >= 0) {
+            int best = 0, best_diff = 360;
+            for (size_t b = 0; b < _num_beams; b++) {
+                int diff = std::abs(_BeamDirection(b) - _forced_direction) % 360;
+                if (diff > 180) diff = 360 - diff;
+                if (diff < best_diff) {
+                    best_diff = diff;
+                    best = static_cast<int>(b);
+                }
+            }
+            _selected_beam = best;
+        } else {
+            size_t best = 0;
+            for (size_t b = 1; b < _num_beams; b++) {
+                if (_beam_energy[b] > _beam_energy[best]) best = b;
+            }
+            // +1dB and 5 blocks in a row to switch
+            if (best != _selected_beam && _beam_energy[best] > 1.26f * _beam_energy[_selected_beam]) {
+                if (++_challenge_count >= 5) {
+                    _selected_beam = best;
+                    _challenge_count = 0;
+                }
+            } else {
+                _challenge_count = 0;
+            }
+        }
+        _direction = _BeamDirection(_selected_beam);
+    }
+
+    void _Synthesize(size_t beam, size_t slot, int16_t* out)
+    {
+        _fft.Inverse(_beam_re[beam].data(), _beam_im[beam].data(), _synth.data());
+        std::vector<float>& overlap = _overlap[slot];
+        for (size_t i = 0; i < _hop; i++) {
+            float v = _synth[i] * _window[i] + overlap[i];
+            overlap[i] = _synth[_hop + i] * _window[_hop + i];
+            v = v > 32767.0f ? 32767.0f : (v < -32768.0f ? -32768.0f : v);
+            out[i] = static_cast<int16_t>(v);
+        }
+    }
+
+    MicTypeInfo _mic_info;
+    bool _single_beam;
+    BeamformerType _type;
+    size_t _first_mic_channel;
+    bool _output_interleaved;
+    int _angle_for_mic0;
+    int _update_interval_ms;
+
+    size_t _num_mics;
+    size_t _num_beams;
+    size_t _hop;
+    size_t _fft_size;
+    size_t _num_bins;
+    RealFft _fft;
+    std::vector<float> _window;
+    std::vector<float> _windowed;
+    std::vector<float> _synth;
+    std::vector<int16_t> _block_samples;
+    std::vector<std::vector<float>> _frames;
+    std::vector<std::vector<float>> _spec_re, _spec_im;
+    std::vector<std::vector<float>> _beam_re, _beam_im;
+    std::vector<std::vector<float>> _overlap;
+    std::vector<float> _beam_energy;
+    std::string _out_block;
+
+    std::vector<float> _steer_re, _steer_im;
+    std::vector<float> _weights_re, _weights_im;
+    std::vector<std::complex<float>> _noise_cov;
+    size_t _update_interval_blocks;
+    size_t _blocks_since_update;
+    float _noise_db;
+    bool _noise_init;
+
+    size_t _selected_beam;
+    int _challenge_count;
+    std::atomic<int> _direction;
+    std::atomic<int> _forced_direction;
+};
+
+}  //namespace
+
+#endif // !__GEOMETRIC_BEAMFORMING_NODE_H__
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+
+#ifndef __KWS_DETECTOR_H__
+#define __KWS_DETECTOR_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace respeaker
+{
+
+/**
+ * The interface of a single-channel keyword scorer, which is run by the multi-beam KWS nodes once per beam.
+ * The return value follows the convention of `ReSpeaker::DetectHotword`.
+ */
+class KwsDetector
+{
+public:
+    virtual ~KwsDetector() = default;
+
+    /**
+     * Feed a chunk of 16KHz, S16_LE mono audio to the scorer.
+     *
+     * @return int - -2: Silence. -1: Error. 0: No event. 1 or More: The index of the hotword triggered.
+     */
+    virtual int RunDetection(const int16_t* data, size_t num_samples) = 0;
+
+    /** Drop the internal state, e.g. before the scorer is fed with audio of another beam. */
+    virtual void Reset() = 0;
+};
+
+/**
+ * Wrap any engine which has `int RunDetection(const int16_t*, int)` and `bool Reset()` into a KwsDetector, e.g.
+ * `snowboy::SnowboyDetect`. The adapter takes the ownership of the engine, so it can't be copied.
+ */
+template <typename Engine>
+class KwsDetectorAdapter : public KwsDetector
+{
+public:
+    explicit KwsDetectorAdapter(Engine* engine) : _engine(engine) {}
+    virtual ~KwsDetectorAdapter() = default;
+
+    virtual int RunDetection(const int16_t* data, size_t num_samples)
+    {
+        return _engine->RunDetection(data, static_cast<int>(num_samples));
+    }
+
+    virtual void Reset() { _engine->Reset(); }
+
+private:
+    std::unique_ptr<Engine> _engine;    ///< Also makes the adapter move-only, a copy would delete the engine twice.
+};
+
+/**
+ * Create one KwsDetector for the given beam index, the node takes the ownership of the returned pointer.
+ */
+typedef std::function<KwsDetector*(int beam_index)> KwsDetectorFactory;
+
+}  //namespace
+
+#endif // !__KWS_DETECTOR_H__
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __LIGHT_VAD_NODE_H__
+#define __LIGHT_VAD_NODE_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/chain_trace.h"
+#include "chain_nodes/sample_dsp.h"
+#include "chain_nodes/speech_probability_node.h"
+
+namespace respeaker
+{
+
+/**
+ * The LightVadNode is a VAD which gives a speech probability for every 10ms frame, at a fraction of the cost of
+ * `HybridNode::CreateVadOnly`. It passes the block through.
+ *
+ * The features are computed in integers on one channel: the log energy, the zero-crossing rate and the spectral
+ * flatness of 4 octave bands (0-1K, 1-2K, 2-4K, 4-8K at 16KHz) from a 3-level Haar split. Each feature is compared with
+ * its value on the tracked background noise, and the probability is a logistic of the weighted distances, so only
+ * one `exp` is computed per frame. The sample loops are plain int16/int32 loops which the compiler vectorizes.
+ *
+ * `ChainSharedData::vad` is set from the probability with a hangover, so `ReSpeaker::ListenToSilence` and
+ * `ReSpeaker::GetVad` work with it like with HybridNode. The probabilities themselves are read by
+ * respeaker::SpeechProbabilityNode, e.g. `PipeWireOutputNode::SetSpeechProbabilityNode` drops non-speech blocks
+ * first when its queue is late.
+ */
+class LightVadNode : public BaseNode, public SpeechProbabilityNode
+{
+public:
+    /**
+     * Create a LightVadNode instance.
+     *
+     * @param channel_index - The channel to run the VAD on, e.g. `0` for the beam channel of VepAecBeamformingNode.
+     * @param hangover_ms - How long `vad` stays true after the probability drops, default to 300.
+     *
+     * @return LightVadNode*
+     */
+    static LightVadNode* Create(int channel_index = 0, int hangover_ms = 300)
+    {
+        return new LightVadNode(channel_index, hangover_ms);
+    }
+
+    virtual ~LightVadNode() = default;
+
+    virtual bool OnStartThread()
+    {
+        if (_channel_index >= _input_parameter.num_channel) return false;
+        _frame_len = _input_parameter.rate / 100;
+        if (_frame_len < 16 || _frame_len % 8) return false;
+
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = LIGHT_VAD_NODE;
+        _is_interleaved_after_process = _input_parameter.interleaved;
+
+        _frame.assign(_frame_len, 0);
+        _haar.assign(_frame_len, 0);
+        _frame_fill = 0;
+        _last_sample = 0;
+        _last_output = 0;
+        _hangover_frames = (_hangover_ms + 9) / 10;
+        _quiet_frames = _hangover_frames + 1;
+        _speech_frames = 0;
+        _num_frames = 0;
+        _noise_frames = 0;
+        _snr_offset_db = 0.0f;
+        _score = -kSnrMidDb;
+        _speech = false;
+
+        if (_chain_shared_data) {
+            std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_vad);
+            _chain_shared_data->vad_node_present = true;
+            _chain_shared_data->vad = false;
+        }
+        return true;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("LightVadNode");
+        size_t num_channels = _input_parameter.num_channel;
+        size_t frames = BlockNumFrames(block, num_channels);
+        const int16_t* in = BlockSamples(block);
+        size_t stride = _input_parameter.interleaved ? num_channels : 1;
+        const int16_t* ch = _input_parameter.interleaved ? in + _channel_index : in + _channel_index * frames;
+
+        bool speech = _speech;
+        for (size_t i = 0; i < frames; i++) {
+            _frame[_frame_fill++] = ch[i * stride];
+            if (_frame_fill == _frame_len) {
+                _frame_fill = 0;
+                speech = _ProcessFrame();
+            }
+        }
+        if (speech != _speech) {
+            _speech = speech;
+            if (_chain_shared_data) {
+                std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_vad);
+                _chain_shared_data->vad = speech;
+            }
+        }
+        return block;
+    }
+
+    virtual bool OnJoinThread()
+    {
+        return true;
+    }
+
+    /**
+     * Set the probability thresholds, `vad` turns on after 2 frames over `on_threshold` and starts the hangover
+     * when a frame is under `off_threshold`. Default to 0.7 and 0.4.
+     */
+    void SetThresholds(float on_threshold, float off_threshold)
+    {
+        _on_threshold = on_threshold;
+        _off_threshold = off_threshold < on_threshold ? off_threshold : on_threshold;
+    }
+
+    virtual float GetSpeechProbability()
+    {
+        uint64_t n = _num_frames.load(std::memory_order_acquire);
+        return n ? _probabilities[(n - 1) % kHistoryFrames].load(std::memory_order_relaxed) : 0.0f;
+    }
+
+    virtual bool IsSpeech() { return _speech; }
+
+    virtual size_t ReadSpeechProbabilities(uint64_t& next_frame, float* out, size_t max_frames)
+    {
+        uint64_t n = _num_frames.load(std::memory_order_acquire);
+        if (n > kHistoryFrames && next_frame < n - kHistoryFrames) next_frame = n - kHistoryFrames;
+        size_t count = 0;
+        while (count < max_frames && next_frame + count < n) {
+            out[count] = _probabilities[(next_frame + count) % kHistoryFrames].load(std::memory_order_relaxed);
+            count++;
+        }
+        // the slots which the writer wrapped over while we were reading are dropped
+        uint64_t now = _num_frames.load(std::memory_order_acquire);
+        size_t skip = 0;
+        if (now > kHistoryFrames && next_frame < now - kHistoryFrames) {
+            skip = static_cast<size_t>(std::min<uint64_t>(count, now - kHistoryFrames - next_frame));
+            for (size_t i = skip; i < count; i++) out[i - skip] = out[i];
+        }
+        next_frame += count;
+        return count - skip;
+    }
+
+protected:
+    LightVadNode(int channel_index, int hangover_ms)
+        : _channel_index(channel_index < 0 ? 0 : channel_index),
+          _hangover_ms(hangover_ms < 0 ? 0 : hangover_ms),
+          _on_threshold(0.7f),
+          _off_threshold(0.4f),
+          _frame_len(160),
+          _frame_fill(0),
+          _last_sample(0),
+          _last_output(0),
+          _hangover_frames(0),
+          _quiet_frames(1),
+          _speech_frames(0),
+          _noise_frames(0),
+          _energy_floor_q8(0),
+          _snr_offset_db(0.0f),
+          _flatness_floor(0.0f),
+          _zcr_floor(0.5f),
+          _score(0.0f),
+          _speech(false),
+          _num_frames(0)
+    {
+        for (size_t i = 0; i < kHistoryFrames; i++) _probabilities[i] = 0.0f;
+    }
+
+    static const size_t kHistoryFrames = 512;   ///< 5.12s of probabilities.
+    static const size_t kCalibrationFrames = 50;
+
+    /** log2(x) in Q8, from the position of the leading bit and the next 8 bits as a linear mantissa. */
+    static int32_t _Log2Q8(uint64_t x)
+    {
+        if (x == 0) return 0;
+        int msb = 63 - __builtin_clzll(x);
+        uint64_t mantissa = msb >= 8 ? (x >> (msb - 8)) & 0xff : (x << (8 - msb)) & 0xff;
+        return msb * 256 + static_cast<int32_t>(mantissa);
+    }
+
+    bool _ProcessFrame()
+    {
+        const size_t n = _frame_len;
+        const int16_t* RESPEAKER_RESTRICT x = _frame.data();
+
+        // ~120Hz high-pass y[i] = x[i] - x[i - 1] + 0.95 * y[i - 1], so rumble under the voice doesn't move the energy
+        int32_t* RESPEAKER_RESTRICT h = _haar.data();
+        int32_t prev_x = _last_sample, prev_y = _last_output;
+        for (size_t i = 0; i < n; i++) {
+            prev_y = x[i] - prev_x + ((prev_y * 61) >> 6);
+            prev_x = x[i];
+            h[i] = prev_y;
+        }
+        _last_sample = prev_x;
+        _last_output = prev_y;
+
+        int64_t energy = 0;
+        int32_t crossings = 0;
+        for (size_t i = 0; i < n; i++) energy += static_cast<int64_t>(h[i]) * h[i];
+        for (size_t i = 1; i < n; i++) crossings += (x[i] ^ x[i - 1]) < 0;
+
+        // 3-level Haar split, the band energies are normalized to a density per coefficient so white noise is flat
+        uint64_t band[4];
+        size_t len = n;
+        for (int level = 1; level <= 3; level++) {
+            int64_t high = 0;
+            len /= 2;
+            for (size_t i = 0; i < len; i++) {
+                int32_t a = h[2 * i], b = h[2 * i + 1];
+                int64_t d = a - b;
+                high += d * d;
+                h[i] = a + b;
+            }
+            band[level - 1] = static_cast<uint64_t>(high) / (len << level);
+        }
+        int64_t low = 0;
+        for (size_t i = 0; i < len; i++) low += static_cast<int64_t>(h[i]) * h[i];
+        band[3] = static_cast<uint64_t>(low) / (len << 3);
+
+        int32_t log_sum_q8 = 0;
+        uint64_t mean = 0;
+        for (int b = 0; b < 4; b++) {
+            log_sum_q8 += _Log2Q8(band[b] + 1);
+            mean += band[b] / 4;
+        }
+        // log2(geometric mean / arithmetic mean), 0 for a flat spectrum, negative for speech
+        float flatness = (log_sum_q8 / 4 - _Log2Q8(mean + 1)) / 256.0f;
+        float zcr = static_cast<float>(crossings) / (n - 1);
+        int32_t energy_q8 = _Log2Q8(static_cast<uint64_t>(energy) / n + 1);
+
+        if (_noise_frames == 0) _energy_floor_q8 = energy_q8;
+        // minimum statistics on the energy: follow down quickly, creep up ~1.2dB/s
+        if (energy_q8 < _energy_floor_q8) {
+            _energy_floor_q8 += (energy_q8 - _energy_floor_q8) / 4;
+        } else {
+            _energy_floor_q8 += 1;
+        }
+
+        // a fluctuating noise sits some dB over its minimum, that offset is learned with the noise shape
+        float snr_db = (energy_q8 - _energy_floor_q8) * (3.0103f / 256.0f);
+        float score = 0.8f * (snr_db - _snr_offset_db - kSnrMidDb) + 3.0f * (_flatness_floor - flatness) +
+                      8.0f * (_zcr_floor - zcr);
+        _score = 0.5f * (_score + score);
+        float p = 1.0f / (1.0f + std::exp(-_score));
+
+        // the first 0.5s is taken as noise, then only the frames which are likely noise are learned
+        if (_noise_frames < kCalibrationFrames || p < 0.3f) {
+            float rate = _noise_frames < kCalibrationFrames ? 1.0f / (_noise_frames + 1) : 1.0f / 32;
+            _snr_offset_db += rate * (snr_db - _snr_offset_db);
+            _flatness_floor += rate * (flatness - _flatness_floor);
+            _zcr_floor += rate * (zcr - _zcr_floor);
+            _noise_frames++;
+        }
+
+        uint64_t index = _num_frames.load(std::memory_order_relaxed);
+        _probabilities[index % kHistoryFrames].store(p, std::memory_order_relaxed);
+        _num_frames.store(index + 1, std::memory_order_release);
+
+        _speech_frames = p >= _on_threshold ? _speech_frames + 1 : 0;
+        if (_speech_frames >= 2) {
+            _quiet_frames = 0;
+        } else if (p < _off_threshold && _quiet_frames <= _hangover_frames) {
+            _quiet_frames++;
+        }
+        // speech in this frame counts on its own, the hangover adds `_hangover_frames` quiet frames after it
+        return _quiet_frames <= _hangover_frames;
+    }
+
+    static constexpr float kSnrMidDb = 4.0f;    ///< The SNR which alone gives a probability of 0.5.
+
+    size_t _channel_index;
+    size_t _hangover_ms;
+    float _on_threshold;
+    float _off_threshold;
+
+    size_t _frame_len;
+    size_t _frame_fill;
+    int32_t _last_sample;
+    int32_t _last_output;
+    std::vector<int16_t> _frame;
+    std::vector<int32_t> _haar;
+
+    size_t _hangover_frames;
+    size_t _quiet_frames;
+    size_t _speech_frames;
+
+    size_t _noise_frames;
+    int32_t _energy_floor_q8;
+    float _snr_offset_db;
+    float _flatness_floor;
+    float _zcr_floor;
+    float _score;                   ///< Smoothed over 2 frames, a single 10ms frame is noisy.
+
+    std::atomic<bool> _speech;
+    std::atomic<uint64_t> _num_frames;
+    std::atomic<float> _probabilities[kHistoryFrames];
+};
+
+}  //namespace
+
+#endif // !__LIGHT_VAD_NODE_H__
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __METRICS_EXPORTER_H__
+#define __METRICS_EXPORTER_H__
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/capture_clock_node.h"
+#include "chain_nodes/chain_trace.h"
+
+namespace respeaker
+{
+
+/**
+ * Serve the metrics of the chain in the Prometheus text exposition format, over a Unix domain socket or a localhost
+ * TCP port, from a thread of its own. Check it with
+ * ```sh
+ * curl --unix-socket /run/respeaker/metrics.sock http://localhost/metrics
+ * curl http://127.0.0.1:9464/metrics
+ * ```
+ * The metrics are read from atomics (the counters of the nodes, e.g. `GetDroppedCount`, and the counters created by
+ * `CreateCounter`), so a scrape never takes a lock of the audio path. The metrics which need more are sampled once per
+ * `SetSampleInterval` by the exporter thread, and a scrape only formats the last sample:
+ * - `respeaker_scope_seconds_total{scope}` - the time spent in each respeaker::ChainTrace scope, i.e. in the
+ *   `ProcessBlock` of each node of this library under its class name, while the trace is enabled. This is the metric
+ *   to break the CPU down per node.
+ * - `respeaker_thread_cpu_seconds_total{tid,thread}` - the CPU time of every thread of the process, from /proc. The
+ *   node threads are started by respeaker::BaseNode without a name, so it tells the application threads apart but
+ *   not the nodes.
+ * - `respeaker_real_time_factor` - the CPU time of the process per second of audio (wall time) over the last sample
+ *   interval, above `1` on a single core the chain can't keep up.
+ * - `respeaker_queue_depth{node}` - the depth of the output queues of the nodes given to `AddQueueDepth`. It's the
+ *   one exception to the lock-free sampling: `BaseNode::GetQueueDeepth` takes the queue locks of the node, once per
+ *   sample, which may hold up its threads for as long as a push.
+ *
+ * Register the metrics before `Start*`, the registration isn't thread-safe.
+ */
+class MetricsExporter
+{
+public:
+    MetricsExporter()
+        : _listen_fd(-1), _running(false), _sample_interval_ms(1000), _thread_cpu(true), _scope_time(true),
+          _real_time_factor(0.0), _last_cpu_seconds(0.0) {}
+
+    virtual ~MetricsExporter() { Stop(); }
+
+    /**
+     * Add a gauge.
+     *
+     * @param name - e.g. `respeaker_doa_direction`.
+     * @param help - The HELP line.
+     * @param read - Returns the value, it's called from the exporter thread so it must not block, e.g. read an atomic.
+     * @param labels - e.g. `node="doa"`, empty for none.
+     */
+    void AddGauge(const std::string& name, const std::string& help, std::function<double()> read,
+                  const std::string& labels = std::string())
+    {
+        _metrics.push_back(Metric{name, help, "gauge", labels, read});
+    }
+
+    /** Add a counter, which only goes up, e.g. `respeaker_output_dropped_blocks_total`. See `AddGauge`. */
+    void AddCounter(const std::string& name, const std::string& help, std::function<double()> read,
+                    const std::string& labels = std::string())
+    {
+        _metrics.push_back(Metric{name, help, "counter", labels, read});
+    }
+
+    /**
+     * Create a counter for the application to increment, e.g. the hotwords returned by `ReSpeaker::DetectHotword`.
+     *
+     * @return std::atomic<uint64_t>* - Owned by the exporter, valid as long as it is.
+     */
+    std::atomic<uint64_t>* CreateCounter(const std::string& name, const std::string& help,
+                                         const std::string& labels = std::string())
+    {
+        _owned_counters.emplace_back(0);
+        std::atomic<uint64_t>* counter = &_owned_counters.back();
+        AddCounter(name, help, [counter] { return static_cast<double>(counter->load(std::memory_order_relaxed)); },
+                   labels);
+        return counter;
+    }
+
+    /**
+     * Sample the depth of the output queues of `node` (see `BaseNode::GetQueueDeepth`), as `{node="label"}`. It takes
+     * the queue locks of the node at each sample, prefer a long `SetSampleInterval` with it.
+     */
+    void AddQueueDepth(BaseNode* node, const std::string& label)
+    {
+        _queues.push_back(QueueDepth{node, label, 0});
+    }
+
+    /** Add the overruns and the clock drift of a collector, as `{node="label"}`. */
+    void AddCaptureClock(CaptureClockNode* collector, const std::string& label)
+    {
+        std::string labels = "node=\"" + label + "\"";
+        AddCounter("respeaker_capture_xruns_total", "Overruns of the capture device.",
+                   [collector] { return static_cast<double>(collector->GetXrunCount()); }, labels);
+        AddGauge("respeaker_capture_drift_ppm", "Drift of the capture clock against CLOCK_MONOTONIC.",
+                 [collector] { return collector->GetDriftPpm(); }, labels);
+    }
+
+    /** Export the CPU time of the threads, enabled by default. */
+    void EnableThreadCpu(bool enable) { _thread_cpu = enable; }
+
+    /** Export the time of the trace scopes, enabled by default. It stays empty until `ChainTrace::Enable(true)`. */
+    void EnableScopeTime(bool enable) { _scope_time = enable; }
+
+    /** How often the CPU times and the queue depths are sampled, default to 1000ms. */
+    void SetSampleInterval(int ms) { _sample_interval_ms = ms > 10 ? ms : 10; }
+
+    /**
+     * Serve on a Unix domain socket, which keeps the metrics local to the device (mind its file permissions).
+     *
+     * @return bool - `false` if the socket can't be bound.
+     */
+    bool StartUnixSocket(const std::string& path)
+    {
+        Stop();
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+        memcpy(addr.sun_path, path.c_str(), path.size());
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return false;
+        unlink(path.c_str());
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+            close(fd);
+            return false;
+        }
+        _unix_path = path;
+        return _StartThread(fd);
+    }
+
+    /**
+     * Serve on 127.0.0.1:`port`, for a Prometheus agent on the device.
+     *
+     * @return bool - `false` if the port can't be bound.
+     */
+    bool StartTcp(int port)
+    {
+        Stop();
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return false;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+            close(fd);
+            return false;
+        }
+        return _StartThread(fd);
+    }
+
+    void Stop()
+    {
+        _running = false;
+        if (_thread && _thread->joinable()) _thread->join();
+        _thread.reset();
+        if (_listen_fd >= 0) {
+            close(_listen_fd);
+            _listen_fd = -1;
+        }
+        if (!_unix_path.empty()) {
+            unlink(_unix_path.c_str());
+            _unix_path.clear();
+        }
+    }
+
+    /** Format the metrics from the last sample. Only call it from the exporter thread, or before `Start*`. */
+    std::string Render()
+    {
+        std::string out;
+        char value[64];
+        // the samples of a family must be together, e.g. the xruns of two collectors
+        std::vector<bool> done(_metrics.size(), false);
+        for (size_t i = 0; i < _metrics.size(); i++) {
+            if (done[i]) continue;
+            const Metric& first = _metrics[i];
+            out += "# HELP " + first.name + " " + first.help + "\n# TYPE " + first.name + " " + first.type + "\n";
+            for (size_t j = i; j < _metrics.size(); j++) {
+                const Metric& metric = _metrics[j];
+                if (done[j] || metric.name != first.name) continue;
+                done[j] = true;
+                snprintf(value, sizeof(value), " %.9g\n", metric.read());
+                out += metric.name + (metric.labels.empty() ? "" : "{" + metric.labels + "}") + value;
+            }
+        }
+        if (!_queues.empty()) {
+            out += "# HELP respeaker_queue_depth Average depth of the output queues of a node.\n"
+                   "# TYPE respeaker_queue_depth gauge\n";
+            for (const QueueDepth& queue : _queues) {
+                snprintf(value, sizeof(value), "\"} %d\n", queue.depth);
+                out += "respeaker_queue_depth{node=\"" + queue.label + value;
+            }
+        }
+        if (_scope_time && !_scopes.empty()) {
+            out += "# HELP respeaker_scope_seconds_total Time in a trace scope, e.g. the ProcessBlock of a node.\n"
+                   "# TYPE respeaker_scope_seconds_total counter\n";
+            for (const std::pair<std::string, double>& scope : _scopes) {
+                snprintf(value, sizeof(value), "\"} %.6f\n", scope.second);
+                out += "respeaker_scope_seconds_total{scope=\"" + scope.first + value;
+            }
+        }
+        if (_thread_cpu) {
+            out += "# HELP respeaker_thread_cpu_seconds_total CPU time of a thread (user and system).\n"
+                   "# TYPE respeaker_thread_cpu_seconds_total counter\n";
+            for (const ThreadCpu& thread : _threads) {
+                snprintf(value, sizeof(value), "%d", thread.tid);
+                out += std::string("respeaker_thread_cpu_seconds_total{tid=\"") + value + "\",thread=\"" +
+                       thread.name + "\"}";
+                snprintf(value, sizeof(value), " %.3f\n", thread.cpu_seconds);
+                out += value;
+            }
+            snprintf(value, sizeof(value), " %.4f\n", _real_time_factor);
+            out += std::string("# HELP respeaker_real_time_factor CPU seconds of the process per second of audio.\n"
+                               "# TYPE respeaker_real_time_factor gauge\nrespeaker_real_time_factor") + value;
+        }
+        return out;
+    }
+
+    /** Take a sample now. Only call it from the exporter thread, or before `Start*`. */
+    void Sample()
+    {
+        for (QueueDepth& queue : _queues) queue.depth = queue.node->GetQueueDeepth();
+        if (_scope_time) {
+            ChainTrace::GetScopeSeconds(_scopes);
+            for (std::pair<std::string, double>& scope : _scopes) {
+                scope.first.erase(std::remove_if(scope.first.begin(), scope.first.end(),
+                                                 [](char c) { return c == '"' || c == '\\' || c == '\n'; }),
+                                  scope.first.end());
+            }
+        }
+        if (!_thread_cpu) return;
+
+        _ReadThreads();
+        // the process counts the threads which exited too
+        std::string name;
+        double cpu_seconds = 0.0;
+        if (!_ReadStat("/proc/self/stat", name, cpu_seconds)) return;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        double wall = std::chrono::duration<double>(now - _last_sample).count();
+        if (_last_sample != std::chrono::steady_clock::time_point() && wall > 0.0) {
+            _real_time_factor = (cpu_seconds - _last_cpu_seconds) / wall;
+        }
+        _last_cpu_seconds = cpu_seconds;
+        _last_sample = now;
+    }
+
+private:
+    struct Metric
+    {
+        std::string name;
+        std::string help;
+        std::string type;
+        std::string labels;
+        std::function<double()> read;
+    };
+
+    struct QueueDepth
+    {
+        BaseNode* node;
+        std::string label;
+        int depth;
+    };
+
+    struct ThreadCpu
+    {
+        int tid;
+        std::string name;
+        double cpu_seconds;
+    };
+
+    bool _StartThread(int fd)
+    {
+        _listen_fd = fd;
+        _running = true;
+        _thread.reset(new std::thread(&MetricsExporter::_ThreadProc, this));
+        return true;
+    }
+
+    void _ThreadProc()
+    {
+        std::chrono::steady_clock::time_point next_sample = std::chrono::steady_clock::now();
+        while (_running) {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now >= next_sample) {
+                Sample();
+                next_sample = now + std::chrono::milliseconds(_sample_interval_ms);
+            }
+            // short polls, so Stop() doesn't wait long
+            pollfd pfd = {_listen_fd, POLLIN, 0};
+            if (poll(&pfd, 1, 200) <= 0) continue;
+            int client = accept4(_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) continue;
+            _Serve(client);
+            close(client);
+        }
+    }
+
+    /** Answer any request with the metrics, HTTP/1.0 so curl and Prometheus are happy, and close. */
+    void _Serve(int client)
+    {
+        char request[2048];
+        pollfd pfd = {client, POLLIN, 0};
+        if (poll(&pfd, 1, 500) > 0) {
+            ssize_t n = read(client, request, sizeof(request));
+            (void)n;
+        }
+        std::string body = Render();
+        char header[160];
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                 body.size());
+        std::string response = header + body;
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += static_cast<size_t>(n);
+        }
+    }
+
+    void _ReadThreads()
+    {
+        _threads.clear();
+        DIR* dir = opendir("/proc/self/task");
+        if (!dir) return;
+        char path[64];
+        while (dirent* entry = readdir(dir)) {
+            int tid = atoi(entry->d_name);
+            if (tid <= 0) continue;
+            snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+            ThreadCpu thread;
+            thread.tid = tid;
+            if (_ReadStat(path, thread.name, thread.cpu_seconds)) _threads.push_back(thread);
+        }
+        closedir(dir);
+    }
+
+    /** Read the name and the CPU time (user and system) of a /proc/.../stat file. */
+    static bool _ReadStat(const char* path, std::string& name, double& cpu_seconds)
+    {
+        static const double ticks_per_second = static_cast<double>(sysconf(_SC_CLK_TCK));
+        char buf[512];
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0) return false;
+        buf[n] = '\0';
+        // "tid (comm) state ppid ...", comm may contain spaces and parentheses
+        char* open_paren = strchr(buf, '(');
+        char* close_paren = strrchr(buf, ')');
+        if (!open_paren || !close_paren || close_paren < open_paren) return false;
+        unsigned long utime = 0, stime = 0;
+        // utime and stime are the 14th and 15th fields, the 11th and 12th after the state
+        if (sscanf(close_paren + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+            return false;
+        }
+        name.clear();
+        for (char* c = open_paren + 1; c < close_paren; c++) {
+            if (*c != '"' && *c != '\\') name += *c;
+        }
+        cpu_seconds = (utime + stime) / ticks_per_second;
+        return true;
+    }
+
+    std::vector<Metric> _metrics;
+    std::list<std::atomic<uint64_t>> _owned_counters;
+    std::vector<QueueDepth> _queues;
+
+    int _listen_fd;
+    std::string _unix_path;
+    std::atomic<bool> _running;
+    std::unique_ptr<std::thread> _thread;
+    int _sample_interval_ms;
+    bool _thread_cpu;
+    bool _scope_time;
+
+    std::vector<ThreadCpu> _threads;
+    std::vector<std::pair<std::string, double>> _scopes;
+    double _real_time_factor;
+    double _last_cpu_seconds;
+    std::chrono::steady_clock::time_point _last_sample;
+};
+
+}  //namespace
+
+#endif // !__METRICS_EXPORTER_H__
@@ -9,17 +9,23 @@
 #ifndef __MIC_TYPE_INFO_H__
 #define __MIC_TYPE_INFO_H__
 
+#include <cmath>
 #include <string>
 
+//The max number of microphones which MicTypeInfo can describe the geometry of.
+#ifndef MAX_NUM_OF_MICS
+#define MAX_NUM_OF_MICS 8
+#endif
+
 namespace respeaker
 {
 
 /** The type of microphone array */
 enum MicType {
     CIRCULAR_6MIC_7BEAM = 0, ///< Corresponding hardware: ReSpeaker Core v2, ReSpeaker 6-Mic Circular Array Kit for Raspberry Pi
-    LINEAR_6MIC_8BEAM, ///< Corresponding hardware: Coming soon, NOT SUPPORTED YET
-    LINEAR_4MIC_1BEAM, ///< Corresponding hardware: ReSpeaker 4-Mic Linear Array Kit for Raspberry Pi, NOT SUPPORTED YET
-    CIRCULAR_4MIC_9BEAM, ///< Corresponding hardware: ReSpeaker 4-Mic Array for Raspberry Pi, NOT SUPPORTED YET
+    LINEAR_6MIC_8BEAM, ///< Corresponding hardware: Coming soon, NOT SUPPORTED YET by VepAecBeamformingNode, use GeometricBeamformingNode
+    LINEAR_4MIC_1BEAM, ///< Corresponding hardware: ReSpeaker 4-Mic Linear Array Kit for Raspberry Pi, NOT SUPPORTED YET by VepAecBeamformingNode, use GeometricBeamformingNode
+    CIRCULAR_4MIC_9BEAM, ///< Corresponding hardware: ReSpeaker 4-Mic Array for Raspberry Pi, NOT SUPPORTED YET by VepAecBeamformingNode, use GeometricBeamformingNode
 };
 
 /** The data structure which contains the information of a microphone array */
@@ -33,7 +39,8 @@ typedef struct MicTypeInfo_
                      geometries(0),
                      pick_up_voice_degree(0),
                      frame(0),
-                     init_flag(false){};
+                     init_flag(false),
+                     mic_coordinates(){};
 
     int num_of_mics;                    ///< This number doesn't contain ref-channel, the ref-channel needs to specify when create node.
     int num_of_beams;                   ///< Equal to (num_of_directional_beams + num_of_auxiliary_beams)
@@ -47,8 +54,44 @@ typedef struct MicTypeInfo_
 
     MicType mic_type;                   ///< Type of microphone
 
+    /**
+     * The x/y/z position of each microphone in meters, the center of the array is the origin. Microphone 0 of a
+     * circular array is on the +x axis, the others go counter-clockwise. A linear array lies on the x axis, from -x
+     * to +x. These are the nominal positions of the boards, fix them up if your board differs.
+     */
+    float mic_coordinates[MAX_NUM_OF_MICS][3];
+
 } MicTypeInfo;
 
+/**
+ * Fill the `mic_coordinates` of a circular array, microphone 0 on the +x axis.
+ *
+ * @param mic_type_info - A reference of MicTypeInfo, `num_of_mics` must be set already.
+ * @param radius - The radius of the circle, in meters.
+ */
+static void SetCircularMicCoordinates(MicTypeInfo& mic_type_info, float radius) {
+    for (int i = 0; i < mic_type_info.num_of_mics && i < MAX_NUM_OF_MICS; i++) {
+        double angle = 2.0 * M_PI * i / mic_type_info.num_of_mics;
+        mic_type_info.mic_coordinates[i][0] = static_cast<float>(radius * std::cos(angle));
+        mic_type_info.mic_coordinates[i][1] = static_cast<float>(radius * std::sin(angle));
+        mic_type_info.mic_coordinates[i][2] = 0.0f;
+    }
+}
+
+/**
+ * Fill the `mic_coordinates` of a linear array, evenly spaced on the x axis.
+ *
+ * @param mic_type_info - A reference of MicTypeInfo, `num_of_mics` must be set already.
+ * @param spacing - The distance between two adjacent microphones, in meters.
+ */
+static void SetLinearMicCoordinates(MicTypeInfo& mic_type_info, float spacing) {
+    for (int i = 0; i < mic_type_info.num_of_mics && i < MAX_NUM_OF_MICS; i++) {
+        mic_type_info.mic_coordinates[i][0] = spacing * (i - (mic_type_info.num_of_mics - 1) / 2.0f);
+        mic_type_info.mic_coordinates[i][1] = 0.0f;
+        mic_type_info.mic_coordinates[i][2] = 0.0f;
+    }
+}
+
 /**
  * Set data structrue MicTypeInfo
  *
@@ -70,6 +113,7 @@ static bool SetMicTypeInfo(MicType mic_type, MicTypeInfo& mic_type_info) {
             mic_type_info.num_of_central_mics = 0;
             mic_type_info.pick_up_voice_degree = 360;
             mic_type_info.mic_type = CIRCULAR_6MIC_7BEAM;
+            SetCircularMicCoordinates(mic_type_info, 0.0463f);
             mic_type_info.init_flag = true;
             // Vep has fixed 8ms block size, so 128 = 16K / 1000 * 8
             // "*2" to ensure enough space 
@@ -86,6 +130,7 @@ static bool SetMicTypeInfo(MicType mic_type, MicTypeInfo& mic_type_info) {
             mic_type_info.num_of_central_mics = 0;
             mic_type_info.pick_up_voice_degree = 180;
             mic_type_info.mic_type = LINEAR_6MIC_8BEAM;
+            SetLinearMicCoordinates(mic_type_info, 0.032f);
             mic_type_info.init_flag = true;
             // Vep has fixed 8ms block size, so 128 = 16K / 1000 * 8
             // "*2" to ensure enough space 
@@ -102,6 +147,7 @@ static bool SetMicTypeInfo(MicType mic_type, MicTypeInfo& mic_type_info) {
             mic_type_info.num_of_central_mics = 0;
             mic_type_info.pick_up_voice_degree = 180;
             mic_type_info.mic_type = LINEAR_4MIC_1BEAM;
+            SetLinearMicCoordinates(mic_type_info, 0.032f);
             mic_type_info.init_flag = true;
             // Vep has fixed 8ms block size, so 128 = 16K / 1000 * 8
             // "*2" to ensure enough space 
@@ -118,6 +164,7 @@ static bool SetMicTypeInfo(MicType mic_type, MicTypeInfo& mic_type_info) {
             mic_type_info.num_of_central_mics = 0;
             mic_type_info.pick_up_voice_degree = 360;
             mic_type_info.mic_type = CIRCULAR_4MIC_9BEAM;
+            SetCircularMicCoordinates(mic_type_info, 0.032f);
             mic_type_info.init_flag = true;
             // Vep has fixed 8ms block size, so 128 = 16K / 1000 * 8
             // "*2" to ensure enough space 
@@ -132,6 +179,27 @@ static bool SetMicTypeInfo(MicType mic_type, MicTypeInfo& mic_type_info) {
     return is_set;
 }
 
+/**
+ * Get the nominal direction of a directional beam. The beams of a circular array are evenly spread over 360 degree
+ * from microphone 0, the beams of a linear array are evenly spread over [0, 180] degree.
+ *
+ * @param mic_type_info - A reference of MicTypeInfo
+ * @param beam_index - The index of the directional beam, starts from `0`.
+ *
+ * @return int - The degree of direction.
+ */
+static int GetBeamDirection(const MicTypeInfo& mic_type_info, int beam_index) {
+    int num_beams = mic_type_info.num_of_directional_beams;
+
+    if (num_beams <= 0) {
+        return 0;
+    }
+    if (mic_type_info.geometries == 0) {
+        return beam_index * 360 / num_beams;
+    }
+    return num_beams > 1 ? beam_index * 180 / (num_beams - 1) : 90;
+}
+
 /**
  * Get MicType from string
  *
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __MULTI_CHANNEL_HYBRID_NODE_H__
+#define __MULTI_CHANNEL_HYBRID_NODE_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/chain_trace.h"
+#include "chain_nodes/fft_utils.h"
+#include "chain_nodes/worker_pool.h"
+
+namespace respeaker
+{
+
+/**
+ * The MultiChannelHybridNode does NS (noise suppression), AGC (automatic gain control) and VAD (voice available
+ * detection) on every channel of the block, e.g. on all the beams before a multi-beam KWS node, or on every beam
+ * which is recorded. It has the same knobs as respeaker::HybridNode, which only runs on one channel.
+ *
+ * All the channels share one STFT (sqrt-Hann, 50% overlap, one hop per block) and one FFT setup. The spectra of the
+ * channels are stored next to each other, so the noise estimation, the Wiener gains and the VAD statistics run as one
+ * flat loop over `channels x bins`, which the compiler vectorizes. The channels can also be split over worker threads,
+ * see `SetNumWorkerThreads`.
+ *
+ * - NS: minimum-tracking noise estimate and a decision-directed Wiener gain, floored by `ns_level`.
+ * - VAD: per channel, the mean log-likelihood ratio of speech over the 300-4000Hz bins, with a hangover.
+ *   `ChainSharedData::vad` is set when any channel has voice (or the one set by `SetVadChannel`), and every channel
+ *   is published by `GetVadMask`.
+ * - AGC: per channel, a slow digital gain which brings the voice peaks to `agc_level` dBFS, with a limiter.
+ *
+ * The block length must be a power-of-two number of frames, e.g. 8ms at 16KHz. The output is one block late.
+ */
+class MultiChannelHybridNode : public BaseNode
+{
+public:
+    /**
+     * @param ns_level - [0, 3], the higher the more noise suppression, -1 disables NS.
+     * @param agc_level - [0, 31], the target peak level of the voice in -dBFS, -1 disables AGC.
+     * @param vad_sensitivity - [0, 3], the higher the more sensitive (more noise being detected as voice), -1 disables
+     *                          VAD.
+     * @param output_interleaved - Set it true to output interleaved data, false to output deinterleaved data.
+     *
+     * @return MultiChannelHybridNode*
+     */
+    static MultiChannelHybridNode* Create(int ns_level = 1, int agc_level = -1, int vad_sensitivity = 0,
+                                          bool output_interleaved=false)
+    {
+        return new MultiChannelHybridNode(ns_level, agc_level, vad_sensitivity, output_interleaved);
+    }
+
+    virtual ~MultiChannelHybridNode() = default;
+
+    /**
+     * Split the channels over `num_workers` extra threads plus the node thread. Must be called before
+     * `RecursivelyStartThread`.
+     *
+     * @param num_workers - The default is 0, all the channels are processed in the node thread.
+     * @param first_core - Bind the workers to the cores from `first_core`, `-1` doesn't bind.
+     */
+    void SetNumWorkerThreads(int num_workers, int first_core = -1)
+    {
+        _num_workers = num_workers < 0 ? 0 : num_workers;
+        _workers_first_core = first_core;
+    }
+
+    /**
+     * Take `ChainSharedData::vad` from one channel only, `-1` (the default) means any channel. The channel must be
+     * one of the input, or OnStartThread fails.
+     */
+    void SetVadChannel(int channel) { _vad_channel = channel < 0 ? -1 : channel; }
+
+    virtual bool OnStartThread()
+    {
+        _num_channels = _input_parameter.num_channel;
+        size_t block_ms = _input_parameter.block_len_ms ? _input_parameter.block_len_ms : 8;
+        _hop = _input_parameter.rate * block_ms / 1000;
+        if (_num_channels == 0 || _hop < 2 || (_hop & (_hop - 1))) return false;
+        if (_vad_channel >= 0 && static_cast<size_t>(_vad_channel) >= _num_channels) return false;
+        _fft_size = 2 * _hop;
+        _num_bins = _fft_size / 2 + 1;
+
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = MULTI_CHANNEL_HYBRID_NODE;
+        _output_parameter.interleaved = _output_interleaved;
+        _is_interleaved_after_process = _output_interleaved;
+
+        MakeHannWindow(_window, _fft_size, true);
+        const size_t cb = _num_channels * _num_bins;
+        _frames.assign(_num_channels * _fft_size, 0.0f);
+        _overlap.assign(_num_channels * _hop, 0.0f);
+        _re.assign(cb, 0.0f);
+        _im.assign(cb, 0.0f);
+        _power.assign(cb, 0.0f);
+        _smoothed.assign(cb, 0.0f);
+        _noise.assign(cb, 0.0f);
+        _prev_clean.assign(cb, 0.0f);
+        _gain.assign(cb, 1.0f);
+        _llr.assign(cb, 0.0f);
+        _vad_hang.assign(_num_channels, 0);
+        _agc_gain_db.assign(_num_channels, 0.0f);
+        _agc_peak_db.assign(_num_channels, -90.0f);
+        _num_frames_seen = 0;
+
+        _band_lo = 300 * _fft_size / _input_parameter.rate;
+        _band_hi = std::min(_num_bins - 1, static_cast<size_t>(4000 * _fft_size / _input_parameter.rate));
+        _vad_hangover_blocks = (kVadHangoverMs + block_ms - 1) / block_ms;
+
+        // one lane per thread, each with its own copy of the FFT setup (the transform has scratch buffers)
+        size_t num_lanes = std::min(_num_channels, static_cast<size_t>(_num_workers) + 1);
+        RealFft fft(_fft_size);
+        _lanes.clear();
+        for (size_t l = 0; l < num_lanes; l++) {
+            std::unique_ptr<Lane> lane(new Lane());
+            lane->fft = fft;
+            lane->windowed.assign(_fft_size, 0.0f);
+            lane->synth.assign(_fft_size, 0.0f);
+            lane->first_channel = _num_channels * l / num_lanes;
+            lane->num_channels = _num_channels * (l + 1) / num_lanes - lane->first_channel;
+            _lanes.push_back(std::move(lane));
+        }
+        _pool.reset(new WorkerPool(num_lanes - 1));
+        if (_workers_first_core >= 0) _pool->BindToCores(_workers_first_core, NUM_CPU_CORE);
+        _run_lane_task = [this](size_t i) { _RunLane(*_lanes[i]); };
+
+        if (_chain_shared_data && _vad_sensitivity >= 0) {
+            std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_vad);
+            _chain_shared_data->vad_node_present = true;
+        }
+        return true;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("MultiChannelHybridNode");
+        if (BlockNumFrames(block, _num_channels) != _hop) return std::string();
+        _in = BlockSamples(block);
+        _out_block.assign(block.size(), '\0');
+        _out = BlockSamples(_out_block);
+
+        _pool->ParallelFor(_lanes.size(), _run_lane_task);
+        _num_frames_seen++;
+
+        // the mask only holds the first 32 channels, the decision takes them all
+        uint32_t mask = 0;
+        bool any_vad = false;
+        for (size_t c = 0; c < _num_channels; c++) {
+            if (_vad_hang[c] == 0) continue;
+            any_vad = true;
+            if (c < 32) mask |= 1u << c;
+        }
+        _vad_mask = mask;
+        if (_chain_shared_data && _vad_sensitivity >= 0) {
+            bool vad = _vad_channel < 0 ? any_vad : _vad_hang[_vad_channel] > 0;
+            std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_vad);
+            _chain_shared_data->vad = vad;
+        }
+        return SwapOutBlock(block, _out_block);
+    }
+
+    virtual bool OnJoinThread()
+    {
+        _pool.reset();
+        return true;
+    }
+
+    /** Get the VAD of every channel of the last block, bit `c` is channel `c` (the first 32 channels). */
+    uint32_t GetVadMask() { return _vad_mask; }
+
+    /** Get the VAD of one channel of the last block. */
+    bool GetChannelVad(int channel) { return channel >= 0 && channel < 32 && ((_vad_mask >> channel) & 1); }
+
+protected:
+    MultiChannelHybridNode(int ns_level, int agc_level, int vad_sensitivity, bool output_interleaved)
+        : _ns_level(std::min(ns_level, 3)),
+          _agc_level(std::min(agc_level, 31)),
+          _vad_sensitivity(std::min(vad_sensitivity, 3)),
+          _output_interleaved(output_interleaved),
+          _num_workers(0),
+          _workers_first_core(-1),
+          _vad_channel(-1),
+          _num_channels(0),
+          _hop(0),
+          _fft_size(0),
+          _num_bins(0),
+          _band_lo(0),
+          _band_hi(0),
+          _vad_hangover_blocks(0),
+          _num_frames_seen(0),
+          _in(nullptr),
+          _out(nullptr),
+          _vad_mask(0) {}
+
+    struct Lane
+    {
+        RealFft fft;
+        std::vector<float> windowed;
+        std::vector<float> synth;
+        size_t first_channel;
+        size_t num_channels;
+    };
+
+    static const size_t kVadHangoverMs = 120;
+    static constexpr float kNoiseBias = 2.5f;       ///< The tracked minimum sits below the mean noise power.
+
+    void _RunLane(Lane& lane)
+    {
+        const size_t first = lane.first_channel, last = lane.first_channel + lane.num_channels;
+        for (size_t c = first; c < last; c++) _Analyze(lane, c);
+        _UpdateNoiseAndGain(first * _num_bins, last * _num_bins);
+        for (size_t c = first; c < last; c++) {
+            if (_vad_sensitivity >= 0) _UpdateVad(c);
+            _Synthesize(lane, c);
+        }
+    }
+
+    void _Analyze(Lane& lane, size_t c)
+    {
+        float* frame = &_frames[c * _fft_size];
+        std::copy(frame + _hop, frame + _fft_size, frame);
+        float* tail = frame + _hop;
+        if (_input_parameter.interleaved) {
+            for (size_t i = 0; i < _hop; i++) tail[i] = _in[i * _num_channels + c];
+        } else {
+            const int16_t* in = _in + c * _hop;
+            for (size_t i = 0; i < _hop; i++) tail[i] = in[i];
+        }
+        for (size_t i = 0; i < _fft_size; i++) lane.windowed[i] = frame[i] * _window[i];
+        lane.fft.Forward(lane.windowed.data(), &_re[c * _num_bins], &_im[c * _num_bins]);
+    }
+
+    /** The per-bin work of all the channels of a lane, `[begin, end)` in the flat `channels x bins` arrays. */
+    void _UpdateNoiseAndGain(size_t begin, size_t end)
+    {
+        static const float kGainFloor[4] = {0.5f, 0.316f, 0.178f, 0.1f};  // -6, -10, -15, -20dB
+        const float floor = _ns_level >= 0 ? kGainFloor[_ns_level] : 1.0f;
+        const float rise = _num_frames_seen < 20 ? 1.2f : 1.003f;         // converge quickly at the start
+        const size_t n = end - begin;
+        const float* RESPEAKER_RESTRICT re = &_re[begin];
+        const float* RESPEAKER_RESTRICT im = &_im[begin];
+        float* RESPEAKER_RESTRICT power = &_power[begin];
+        float* RESPEAKER_RESTRICT smoothed = &_smoothed[begin];
+        float* RESPEAKER_RESTRICT noise = &_noise[begin];
+        float* RESPEAKER_RESTRICT prev_clean = &_prev_clean[begin];
+        float* RESPEAKER_RESTRICT gain = &_gain[begin];
+        float* RESPEAKER_RESTRICT llr = &_llr[begin];
+
+        for (size_t k = 0; k < n; k++) power[k] = re[k] * re[k] + im[k] * im[k];
+        if (_num_frames_seen == 0) {
+            for (size_t k = 0; k < n; k++) smoothed[k] = noise[k] = power[k] + 1.0f;
+        }
+        for (size_t k = 0; k < n; k++) {
+            smoothed[k] = 0.8f * smoothed[k] + 0.2f * power[k];
+            noise[k] = smoothed[k] < noise[k] ? smoothed[k] : noise[k] * rise;
+        }
+        for (size_t k = 0; k < n; k++) {
+            float inv_noise = 1.0f / (kNoiseBias * noise[k] + 1e-3f);
+            float gamma = power[k] * inv_noise;
+            float post = gamma > 1.0f ? gamma - 1.0f : 0.0f;
+            float xi = 0.98f * prev_clean[k] * inv_noise + 0.02f * post;
+            float g = xi / (1.0f + xi);
+            g = g > floor ? g : floor;
+            gain[k] = g;
+            prev_clean[k] = g * g * power[k];
+            // Sohn's log-likelihood ratio, log(1 + xi) is approximated with its first terms to stay vectorizable
+            float l1 = xi < 1.0f ? xi - 0.5f * xi * xi : 0.5f + 0.693f * (xi - 1.0f) / (1.0f + 0.5f * (xi - 1.0f));
+            llr[k] = gamma * xi / (1.0f + xi) - l1;
+        }
+    }
+
+    void _UpdateVad(size_t c)
+    {
+        static const float kThreshold[4] = {1.2f, 0.8f, 0.5f, 0.3f};
+        const float* llr = &_llr[c * _num_bins];
+        float sum = 0.0f;
+        for (size_t k = _band_lo; k <= _band_hi; k++) sum += llr[k];
+        float mean = sum / (_band_hi - _band_lo + 1);
+        if (_num_frames_seen >= 20 && mean > kThreshold[_vad_sensitivity]) {
+            _vad_hang[c] = _vad_hangover_blocks;
+        } else if (_vad_hang[c] > 0) {
+            _vad_hang[c]--;
+        }
+    }
+
+    void _Synthesize(Lane& lane, size_t c)
+    {
+        float* re = &_re[c * _num_bins];
+        float* im = &_im[c * _num_bins];
+        if (_ns_level >= 0) {
+            const float* g = &_gain[c * _num_bins];
+            for (size_t k = 0; k < _num_bins; k++) {
+                re[k] *= g[k];
+                im[k] *= g[k];
+            }
+        }
+        lane.fft.Inverse(re, im, lane.synth.data());
+
+        float* overlap = &_overlap[c * _hop];
+        float peak = 0.0f;
+        for (size_t i = 0; i < _hop; i++) {
+            float v = lane.synth[i] * _window[i] + overlap[i];
+            overlap[i] = lane.synth[_hop + i] * _window[_hop + i];
+            lane.synth[i] = v;
+            peak = std::max(peak, std::fabs(v));
+        }
+
+        float gain = 1.0f;
+        if (_agc_level >= 0) gain = _UpdateAgc(c, peak);
+
+        int16_t* out = _output_interleaved ? _out + c : _out + c * _hop;
+        const size_t stride = _output_interleaved ? _num_channels : 1;
+        for (size_t i = 0; i < _hop; i++) {
+            float v = lane.synth[i] * gain;
+            v = v > 32767.0f ? 32767.0f : (v < -32768.0f ? -32768.0f : v);
+            out[i * stride] = static_cast<int16_t>(std::lrint(v));
+        }
+    }
+
+    /** Move the gain slowly towards the target while there's voice, and never let a peak clip. */
+    float _UpdateAgc(size_t c, float peak)
+    {
+        float peak_db = 20.0f * std::log10(peak / 32768.0f + 1e-9f);
+        if (_vad_hang[c] > 0 || _vad_sensitivity < 0) {
+            float& env = _agc_peak_db[c];
+            env = peak_db > env ? env + 0.3f * (peak_db - env) : env + 0.02f * (peak_db - env);
+            float error = -static_cast<float>(_agc_level) - (env + _agc_gain_db[c]);
+            float gain_db = _agc_gain_db[c] + std::max(-0.5f, std::min(0.1f, error));
+            _agc_gain_db[c] = gain_db > kAgcMaxGainDb ? kAgcMaxGainDb : (gain_db < -10.0f ? -10.0f : gain_db);
+        }
+        float gain_db = _agc_gain_db[c];
+        if (peak_db + gain_db > -0.1f) gain_db = -0.1f - peak_db;
+        return std::pow(10.0f, gain_db / 20.0f);
+    }
+
+    static constexpr float kAgcMaxGainDb = 30.0f;
+
+    int _ns_level;
+    int _agc_level;
+    int _vad_sensitivity;
+    bool _output_interleaved;
+    int _num_workers;
+    int _workers_first_core;
+    int _vad_channel;
+
+    size_t _num_channels;
+    size_t _hop;
+    size_t _fft_size;
+    size_t _num_bins;
+    size_t _band_lo;
+    size_t _band_hi;
+    size_t _vad_hangover_blocks;
+    uint64_t _num_frames_seen;
+
+    std::vector<float> _window;
+    std::vector<float> _frames;
+    std::vector<float> _overlap;
+    std::vector<float> _re, _im;
+    std::vector<float> _power, _smoothed, _noise, _prev_clean, _gain, _llr;
+    std::vector<size_t> _vad_hang;
+    std::vector<float> _agc_gain_db;
+    std::vector<float> _agc_peak_db;
+
+    std::vector<std::unique_ptr<Lane>> _lanes;
+    std::unique_ptr<WorkerPool> _pool;
+    std::function<void(size_t)> _run_lane_task;
+    const int16_t* _in;
+    int16_t* _out;
+    std::string _out_block;
+
+    std::atomic<uint32_t> _vad_mask;
+};
+
+}  //namespace
+
+#endif // !__MULTI_CHANNEL_HYBRID_NODE_H__
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __OPUS_AUDIO_ENCODER_H__
+#define __OPUS_AUDIO_ENCODER_H__
+
+#include <opus/opus.h>
+
+#include <vector>
+
+#include "chain_nodes/audio_encoder.h"
+
+namespace respeaker
+{
+
+/**
+ * Encode to raw Opus packets, one packet per frame, for the cloud ASR APIs which take Opus (usually framed by the
+ * application, e.g. in Ogg or with a length prefix). The voice signal type and a fixed frame size keep the CPU use
+ * steady. At 16KHz mono, 24kbps is ~10x less than the PCM stream. Please link your application with `-lopus`.
+ */
+class OpusAudioEncoder : public AudioEncoder
+{
+public:
+    /**
+     * @param bitrate - In bits per second, default to 24000.
+     * @param frame_ms - 10, 20 (the default), 40 or 60. 10ms halves the delay at some cost of bitrate.
+     * @param complexity - [0, 10], default to 5.
+     * @param low_delay - Use OPUS_APPLICATION_RESTRICTED_LOWDELAY, which drops the speech mode (SILK) and saves ~5ms
+     *                    of look-ahead. Default to false (OPUS_APPLICATION_VOIP).
+     */
+    OpusAudioEncoder(int bitrate = 24000, int frame_ms = 20, int complexity = 5, bool low_delay = false)
+        : _bitrate(bitrate), _frame_ms(frame_ms), _complexity(complexity), _low_delay(low_delay),
+          _frame_size(0), _encoder(nullptr) {}
+
+    virtual ~OpusAudioEncoder() { Close(); }
+
+    virtual bool Open(int rate, int num_channels, const PacketCallback& callback)
+    {
+        Close();
+        if (rate != 8000 && rate != 12000 && rate != 16000 && rate != 24000 && rate != 48000) return false;
+        if (num_channels < 1 || num_channels > 2) return false;
+        if (_frame_ms != 10 && _frame_ms != 20 && _frame_ms != 40 && _frame_ms != 60) return false;
+
+        int err = OPUS_OK;
+        int application = _low_delay ? OPUS_APPLICATION_RESTRICTED_LOWDELAY : OPUS_APPLICATION_VOIP;
+        _encoder = opus_encoder_create(rate, num_channels, application, &err);
+        if (!_encoder || err != OPUS_OK) {
+            _encoder = nullptr;
+            return false;
+        }
+        opus_encoder_ctl(_encoder, OPUS_SET_BITRATE(_bitrate));
+        opus_encoder_ctl(_encoder, OPUS_SET_COMPLEXITY(_complexity));
+        opus_encoder_ctl(_encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+
+        _frame_size = static_cast<size_t>(rate / 1000 * _frame_ms);
+        _packet.assign(MaxPacketSize(), 0);
+        _callback = callback;
+        return true;
+    }
+
+    virtual size_t FrameSize() { return _frame_size; }
+
+    virtual bool Encode(const int16_t* interleaved)
+    {
+        if (!_encoder) return false;
+        opus_int32 n = opus_encode(_encoder, interleaved, static_cast<int>(_frame_size), _packet.data(),
+                                   static_cast<opus_int32>(_packet.size()));
+        if (n < 0) return false;
+        _callback(_packet.data(), static_cast<size_t>(n), _frame_size);
+        return true;
+    }
+
+    virtual void Close()
+    {
+        if (_encoder) {
+            opus_encoder_destroy(_encoder);
+            _encoder = nullptr;
+        }
+    }
+
+    /** The largest packet of the Opus spec, 3 frames of 1275 bytes plus the framing. */
+    virtual size_t MaxPacketSize() { return 4000; }
+
+private:
+    int _bitrate;
+    int _frame_ms;
+    int _complexity;
+    bool _low_delay;
+    size_t _frame_size;
+    OpusEncoder* _encoder;
+    std::vector<unsigned char> _packet;
+    PacketCallback _callback;
+};
+
+}  //namespace
+
+#endif // !__OPUS_AUDIO_ENCODER_H__
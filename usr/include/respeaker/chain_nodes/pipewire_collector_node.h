@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __PIPEWIRE_COLLECTOR_NODE_H__
+#define __PIPEWIRE_COLLECTOR_NODE_H__
+
+#include <semaphore.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <mutex>
+#include <vector>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/chain_trace.h"
+#include "chain_nodes/pipewire_utils.h"
+
+namespace respeaker
+{
+
+/**
+ * The PipeWireCollectorNode collects the audio data from a PipeWire source node through a `pw_stream`, as a native
+ * client instead of going through the PulseAudio compatibility layer.
+ * The stream asks for 16KHz S16_LE and a graph quantum of exactly one block (`node.latency`), so PipeWire does the
+ * resampling in the source's adapter and every process cycle delivers one block.
+ *
+ * The PipeWire data thread is realtime, so it neither allocates nor locks: it copies the frames from the mapped buffer
+ * into a single-producer single-consumer ring allocated when the node starts, and posts a semaphore. The node thread
+ * cuts the ring into blocks, deinterleaving them if needed, and allocates the blocks it hands to the chain.
+ *
+ * This node is header-only and uses libpipewire-0.3 directly, please link your application with
+ * `pkg-config --libs libpipewire-0.3`.
+ */
+class PipeWireCollectorNode : public BaseNode
+{
+public:
+    /**
+     * Create a PipeWireCollectorNode instance. Collect 8 channels audio data stream from PipeWire.
+     *
+     * @param target_name - The `node.name` of the source, users can obtain this by `pw-cli ls Node`. An empty string
+     *                      lets the session manager connect the default source.
+     * @param output_interleaved - Set it true to output interleaved data, false to output deinterleaved data.
+     *
+     * @return PipeWireCollectorNode*
+     */
+    static PipeWireCollectorNode* Create(std::string target_name, bool output_interleaved=false)
+    {
+        return new PipeWireCollectorNode(target_name, 8, 8, output_interleaved);
+    }
+
+    /**
+     * @param target_name - The `node.name` of the source.
+     * @param num_channels - The number of channels to capture, default to 8.
+     * @param block_len_ms - The output block time length, in milliseconds, it's also the requested quantum of the
+     *                       graph, default to 8.
+     * @param output_interleaved - Set it true to output interleaved data, false to output deinterleaved data.
+     *
+     * @return PipeWireCollectorNode*
+     */
+    static PipeWireCollectorNode* Create(std::string target_name, int num_channels, int block_len_ms,
+                                         bool output_interleaved=false)
+    {
+        return new PipeWireCollectorNode(target_name, num_channels, block_len_ms, output_interleaved);
+    }
+
+    virtual ~PipeWireCollectorNode()
+    {
+        _Disconnect();
+        sem_destroy(&_sem_ready);
+    }
+
+    virtual bool OnStartThread()
+    {
+        if (_num_channels <= 0 || _block_len_ms <= 0) return false;
+
+        _block_frames = 16000 * _block_len_ms / 1000;
+        _block_bytes = _block_frames * _num_channels * sizeof(int16_t);
+        _ring_frames = _max_ready_blocks * _block_frames;
+        _ring.assign(_ring_frames * _num_channels, 0);
+        _write_pos = 0;
+        _read_pos = 0;
+        while (sem_trywait(&_sem_ready) == 0) {}
+
+        _output_parameter.node_type = PIPEWIRE_COLLECTOR_NODE;
+        _output_parameter.mic_type = CIRCULAR_6MIC_7BEAM;
+        _output_parameter.block_len_ms = _block_len_ms;
+        _output_parameter.rate = 16000;
+        _output_parameter.num_channel = _num_channels;
+        _output_parameter.interleaved = _output_interleaved;
+        _is_interleaved_after_process = _output_interleaved;
+
+        return _Connect();
+    }
+
+    virtual std::string FetchBlock(bool& exit)
+    {
+        // the block handed to the chain, allocated before the wait, the rest must not allocate
+        std::string block = NewBlock(_block_bytes);
+        RESPEAKER_ALLOC_GUARD_SCOPE("PipeWireCollectorNode");
+        uint64_t read_pos = _read_pos.load(std::memory_order_relaxed);
+        while (_write_pos.load(std::memory_order_acquire) - read_pos < _block_frames) {
+            if (_IsExit()) {
+                exit = true;
+                return std::string();
+            }
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100 * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while (sem_timedwait(&_sem_ready, &deadline) < 0 && errno == EINTR) {}
+        }
+
+        int16_t* out = BlockSamples(block);
+        for (size_t done = 0; done < _block_frames;) {
+            size_t pos = (read_pos + done) % _ring_frames;
+            size_t n = std::min(_block_frames - done, _ring_frames - pos);
+            const int16_t* in = &_ring[pos * _num_channels];
+            if (_output_interleaved) {
+                memcpy(out + done * _num_channels, in, n * _num_channels * sizeof(int16_t));
+            } else {
+                for (size_t i = 0; i < n; i++) {
+                    for (int c = 0; c < _num_channels; c++) {
+                        out[c * _block_frames + done + i] = in[i * _num_channels + c];
+                    }
+                }
+            }
+            done += n;
+        }
+        _read_pos.store(read_pos + _block_frames, std::memory_order_release);
+        return block;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        return block;
+    }
+
+    virtual bool OnJoinThread()
+    {
+        _Disconnect();
+        return true;
+    }
+
+    virtual void Pause()
+    {
+        BaseNode::Pause();
+        _SetActive(false);
+    }
+
+    virtual void Resume()
+    {
+        _SetActive(true);
+        BaseNode::Resume();
+    }
+
+    /** Get how many quanta were dropped because the chain didn't fetch the blocks in time. */
+    uint64_t GetOverrunCount() { return _overrun_count; }
+
+protected:
+    PipeWireCollectorNode(std::string target_name, int num_channels, int block_len_ms, bool output_interleaved)
+        : _target_name(target_name),
+          _num_channels(num_channels),
+          _block_len_ms(block_len_ms),
+          _output_interleaved(output_interleaved),
+          _loop(nullptr),
+          _stream(nullptr),
+          _block_frames(0),
+          _block_bytes(0),
+          _ring_frames(0),
+          _max_ready_blocks(32),
+          _write_pos(0),
+          _read_pos(0),
+          _overrun_count(0)
+    {
+        sem_init(&_sem_ready, 0, 0);
+        PipeWireInitOnce();
+        memset(&_events, 0, sizeof(_events));
+        _events.version = PW_VERSION_STREAM_EVENTS;
+        _events.process = &PipeWireCollectorNode::_OnProcess;
+    }
+
+    bool _Connect()
+    {
+        _loop = pw_thread_loop_new("respeaker-pw-capture", nullptr);
+        if (!_loop) return false;
+
+        std::string latency = PipeWireLatencyProperty(16000, _block_len_ms);
+        struct pw_properties* props = pw_properties_new(
+            PW_KEY_MEDIA_TYPE, "Audio",
+            PW_KEY_MEDIA_CATEGORY, "Capture",
+            PW_KEY_MEDIA_ROLE, "Communication",
+            PW_KEY_NODE_LATENCY, latency.c_str(),
+            nullptr);
+        if (!_target_name.empty()) {
+#ifdef PW_KEY_TARGET_OBJECT
+            pw_properties_set(props, PW_KEY_TARGET_OBJECT, _target_name.c_str());
+#else
+            pw_properties_set(props, PW_KEY_NODE_TARGET, _target_name.c_str());
+#endif
+        }
+
+        pw_thread_loop_lock(_loop);
+        _stream = pw_stream_new_simple(pw_thread_loop_get_loop(_loop), "respeaker-capture", props, &_events, this);
+        uint8_t buffer[1024];
+        struct spa_pod_builder builder;
+        spa_pod_builder_init(&builder, buffer, sizeof(buffer));
+        const struct spa_pod* params[1];
+        params[0] = BuildS16FormatParam(&builder, 16000, _num_channels);
+        int err = _stream ? pw_stream_connect(_stream, PW_DIRECTION_INPUT, PW_ID_ANY,
+                                              static_cast<enum pw_stream_flags>(PW_STREAM_FLAG_AUTOCONNECT |
+                                                                                PW_STREAM_FLAG_MAP_BUFFERS |
+                                                                                PW_STREAM_FLAG_RT_PROCESS),
+                                              params, 1) : -1;
+        pw_thread_loop_unlock(_loop);
+
+        if (err < 0 || pw_thread_loop_start(_loop) < 0) {
+            _Disconnect();
+            return false;
+        }
+        return true;
+    }
+
+    void _Disconnect()
+    {
+        if (!_loop) return;
+        pw_thread_loop_stop(_loop);
+        if (_stream) {
+            pw_stream_destroy(_stream);
+            _stream = nullptr;
+        }
+        pw_thread_loop_destroy(_loop);
+        _loop = nullptr;
+    }
+
+    void _SetActive(bool active)
+    {
+        if (!_loop || !_stream) return;
+        pw_thread_loop_lock(_loop);
+        pw_stream_set_active(_stream, active);
+        pw_thread_loop_unlock(_loop);
+    }
+
+    /** Called by PipeWire in its data thread, once per quantum. */
+    static void _OnProcess(void* data)
+    {
+        PipeWireCollectorNode* self = static_cast<PipeWireCollectorNode*>(data);
+        struct pw_buffer* b = pw_stream_dequeue_buffer(self->_stream);
+        if (!b) return;
+
+        struct spa_data* d = &b->buffer->datas[0];
+        if (d->data && d->chunk) {
+            uint32_t offset = d->chunk->offset < d->maxsize ? d->chunk->offset : d->maxsize;
+            uint32_t size = d->chunk->size < d->maxsize - offset ? d->chunk->size : d->maxsize - offset;
+            const int16_t* in = reinterpret_cast<const int16_t*>(static_cast<const char*>(d->data) + offset);
+            self->_Append(in, size / (self->_num_channels * sizeof(int16_t)));
+        }
+        pw_stream_queue_buffer(self->_stream, b);
+    }
+
+    /** Copy the interleaved frames into the ring, from the data thread: it neither allocates nor locks. */
+    void _Append(const int16_t* in, size_t num_frames)
+    {
+        if (num_frames == 0) return;
+        uint64_t write_pos = _write_pos.load(std::memory_order_relaxed);
+        if (num_frames > _ring_frames - (write_pos - _read_pos.load(std::memory_order_acquire))) {
+            // the node thread is a whole ring behind, the newest quantum is lost
+            _overrun_count++;
+            return;
+        }
+        for (size_t done = 0; done < num_frames;) {
+            size_t pos = (write_pos + done) % _ring_frames;
+            size_t n = std::min(num_frames - done, _ring_frames - pos);
+            memcpy(&_ring[pos * _num_channels], in + done * _num_channels, n * _num_channels * sizeof(int16_t));
+            done += n;
+        }
+        _write_pos.store(write_pos + num_frames, std::memory_order_release);
+        sem_post(&_sem_ready);
+    }
+
+    bool _IsExit()
+    {
+        if (!_chain_shared_data) return false;
+        std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_exit_flag);
+        return _chain_shared_data->exit_flag;
+    }
+
+    std::string _target_name;
+    int _num_channels;
+    int _block_len_ms;
+    bool _output_interleaved;
+
+    struct pw_thread_loop* _loop;
+    struct pw_stream* _stream;
+    struct pw_stream_events _events;
+
+    size_t _block_frames;
+    size_t _block_bytes;
+    size_t _ring_frames;
+    size_t _max_ready_blocks;
+
+    std::vector<int16_t> _ring;                 ///< Interleaved frames, written by the data thread.
+    std::atomic<uint64_t> _write_pos;           ///< Frames written since the start, by the data thread.
+    std::atomic<uint64_t> _read_pos;            ///< Frames cut into blocks since the start, by the node thread.
+    sem_t _sem_ready;
+    std::atomic<uint64_t> _overrun_count;
+};
+
+}  //namespace
+
+#endif // !__PIPEWIRE_COLLECTOR_NODE_H__
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __PIPEWIRE_OUTPUT_NODE_H__
+#define __PIPEWIRE_OUTPUT_NODE_H__
+
+#include <algorithm>
+#include <atomic>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/chain_trace.h"
+#include "chain_nodes/fixed_ring.h"
+#include "chain_nodes/pipewire_utils.h"
+#include "chain_nodes/speech_probability_node.h"
+
+namespace respeaker
+{
+
+/**
+ * The PipeWireOutputNode publishes the processed audio stream as a PipeWire source (`media.class = Audio/Source`),
+ * so the third party ASR engine records it like any microphone, e.g. `pw-record --target respeaker-source`, without
+ * `snd-aloop` and its extra period/buffer hops.
+ * The stream asks for a quantum of one block, so a block is handed to the graph in the next process cycle after it
+ * is stored. When no block is queued the source outputs silence, so the consumers keep running.
+ * The blocks are handed to the PipeWire data thread through a lock-free ring of slots allocated when the chain starts,
+ * so the real-time process callback never waits for the node thread and never allocates.
+ *
+ * Note that the sample rate and channel number of the audio stream are the same as the uplink node, and the format
+ * is fixed to S16_LE. This node is header-only, please link your application with `pkg-config --libs libpipewire-0.3`.
+ */
+class PipeWireOutputNode : public BaseNode
+{
+public:
+    /**
+     * Create a PipeWireOutputNode instance.
+     *
+     * @param source_name - The `node.name` of the published source, default to "respeaker-source".
+     * @param output_interleaved - Set it true to output interleaved data, false to output deinterleaved data. This
+     *                             is only for the downlink node, PipeWire always gets interleaved data.
+     *
+     * @return PipeWireOutputNode*
+     */
+    static PipeWireOutputNode* Create(std::string source_name="respeaker-source", bool output_interleaved=false)
+    {
+        return new PipeWireOutputNode(source_name, output_interleaved);
+    }
+
+    virtual ~PipeWireOutputNode()
+    {
+        _Disconnect();
+    }
+
+    virtual bool OnStartThread()
+    {
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = PIPEWIRE_OUTPUT_NODE;
+        _output_parameter.interleaved = _output_interleaved;
+        _is_interleaved_after_process = _input_parameter.interleaved;
+
+        _num_channels = _input_parameter.num_channel;
+        _block_frames = _input_parameter.rate * _input_parameter.block_len_ms / 1000;
+        if (_num_channels == 0 || _block_frames == 0) return false;
+
+        // the stream isn't connected yet, the only time the ring may be resized
+        size_t delay_ms = _max_delay_ms ? _max_delay_ms : 5 * _input_parameter.block_len_ms;
+        size_t blocks = std::max<size_t>(2, delay_ms / _input_parameter.block_len_ms);
+        QueuedBlock empty = {NewBlock(_block_frames * _num_channels * sizeof(int16_t)), false};
+        _queue.SetCapacity(blocks + kSpareSlots, empty);
+        _max_queued_blocks = blocks;
+        _front_offset = 0;
+
+        return _Connect();
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("PipeWireOutputNode");
+        QueuedBlock* slot = _queue.BackSlot();
+        if (!slot) {
+            // the graph stopped pulling, the latency is trimmed by _Fill() once it pulls again
+            _dropped_count++;
+            RESPEAKER_TRACE_INSTANT("PipeWireOutputNode.drop", _dropped_count);
+            return block;
+        }
+        SpeechProbabilityNode* speech_node = _speech_node.load(std::memory_order_relaxed);
+        slot->speech = speech_node && speech_node->GetSpeechProbability() >= _speech_threshold.load();
+        // the slot takes the block, and the buffer it held (allocated at the start or taken from an earlier block)
+        // carries the copy downstream
+        slot->block.swap(block);
+        block.assign(slot->block);
+        _queue.Push();
+        RESPEAKER_TRACE_COUNTER("PipeWireOutputNode.queue", _queue.Size());
+        return block;
+    }
+
+    virtual bool OnJoinThread()
+    {
+        _Disconnect();
+        return true;
+    }
+
+    /**
+     * Set the "max block delay time" of this node, the blocks which wait longer than this for the graph are dropped.
+     * The ring of the blocks is sized for it when the chain starts, so while the chain runs the delay can't be raised
+     * over the value it started with: a larger value is clamped, and takes effect at the next start.
+     *
+     * @param ms - "max block delay time" in ms. Defalut to (5 * block_len_ms of uplink NodeParameter)ms.
+     *             The minimum value is (2 * block_len_ms of uplink NodeParameter)ms.
+     *
+     * @return int - The actually "max block delay time" in ms, of the running chain.
+     */
+    int SetMaxBlockDelayTime(int ms)
+    {
+        size_t block_ms = _input_parameter.block_len_ms ? _input_parameter.block_len_ms : 8;
+        size_t blocks = std::max<size_t>(2, ms / block_ms);
+        _max_delay_ms = blocks * block_ms;
+        if (_queue.Capacity()) blocks = std::min(blocks, _queue.Capacity() - kSpareSlots);
+        _max_queued_blocks = blocks;
+        return static_cast<int>(blocks * block_ms);
+    }
+
+    /**
+     * When the queue is late, drop the oldest non-speech block instead of the oldest block, so the latency is caught
+     * up in the pauses and the words are kept. The probability of a block is taken when it's stored.
+     *
+     * @param speech_node - e.g. a respeaker::LightVadNode upstream of this node.
+     * @param threshold - The blocks with a speech probability under it can be dropped, default to 0.5.
+     */
+    void SetSpeechProbabilityNode(SpeechProbabilityNode* speech_node, float threshold = 0.5f)
+    {
+        _speech_threshold = threshold;
+        _speech_node = speech_node;
+    }
+
+    /** Get how many blocks were dropped because the graph didn't consume them in time. */
+    uint64_t GetDroppedCount() { return _dropped_count; }
+
+    /** Get how many process cycles were (partly) filled with silence because no block was queued. */
+    uint64_t GetUnderrunCount() { return _underrun_count; }
+
+protected:
+    PipeWireOutputNode(std::string source_name, bool output_interleaved)
+        : _source_name(source_name),
+          _output_interleaved(output_interleaved),
+          _loop(nullptr),
+          _stream(nullptr),
+          _num_channels(0),
+          _block_frames(0),
+          _front_offset(0),
+          _max_delay_ms(0),
+          _max_queued_blocks(5),
+          _speech_node(nullptr),
+          _speech_threshold(0.5f),
+          _dropped_count(0),
+          _underrun_count(0)
+    {
+        PipeWireInitOnce();
+        memset(&_events, 0, sizeof(_events));
+        _events.version = PW_VERSION_STREAM_EVENTS;
+        _events.process = &PipeWireOutputNode::_OnProcess;
+    }
+
+    bool _Connect()
+    {
+        _loop = pw_thread_loop_new("respeaker-pw-source", nullptr);
+        if (!_loop) return false;
+
+        std::string latency = PipeWireLatencyProperty(_input_parameter.rate, _input_parameter.block_len_ms);
+        struct pw_properties* props = pw_properties_new(
+            PW_KEY_MEDIA_TYPE, "Audio",
+            PW_KEY_MEDIA_CATEGORY, "Duplex",
+            PW_KEY_MEDIA_CLASS, "Audio/Source",
+            PW_KEY_MEDIA_ROLE, "Communication",
+            PW_KEY_NODE_NAME, _source_name.c_str(),
+            PW_KEY_NODE_DESCRIPTION, "ReSpeaker processed audio",
+            PW_KEY_NODE_LATENCY, latency.c_str(),
+            nullptr);
+
+        pw_thread_loop_lock(_loop);
+        _stream = pw_stream_new_simple(pw_thread_loop_get_loop(_loop), _source_name.c_str(), props, &_events, this);
+        uint8_t buffer[1024];
+        struct spa_pod_builder builder;
+        spa_pod_builder_init(&builder, buffer, sizeof(buffer));
+        const struct spa_pod* params[1];
+        params[0] = BuildS16FormatParam(&builder, _input_parameter.rate, _num_channels);
+        int err = _stream ? pw_stream_connect(_stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+                                              static_cast<enum pw_stream_flags>(PW_STREAM_FLAG_MAP_BUFFERS |
+                                                                                PW_STREAM_FLAG_RT_PROCESS),
+                                              params, 1) : -1;
+        pw_thread_loop_unlock(_loop);
+
+        if (err < 0 || pw_thread_loop_start(_loop) < 0) {
+            _Disconnect();
+            return false;
+        }
+        return true;
+    }
+
+    void _Disconnect()
+    {
+        if (!_loop) return;
+        pw_thread_loop_stop(_loop);
+        if (_stream) {
+            pw_stream_destroy(_stream);
+            _stream = nullptr;
+        }
+        pw_thread_loop_destroy(_loop);
+        _loop = nullptr;
+    }
+
+    /** Called by PipeWire in its data thread, once per quantum. */
+    static void _OnProcess(void* data)
+    {
+        PipeWireOutputNode* self = static_cast<PipeWireOutputNode*>(data);
+        struct pw_buffer* b = pw_stream_dequeue_buffer(self->_stream);
+        if (!b) return;
+
+        struct spa_data* d = &b->buffer->datas[0];
+        if (d->data) {
+            size_t stride = self->_num_channels * sizeof(int16_t);
+            size_t frames = d->maxsize / stride;
+#if PW_CHECK_VERSION(0, 3, 49)
+            if (b->requested) frames = std::min<size_t>(frames, b->requested);
+#endif
+            self->_Fill(static_cast<int16_t*>(d->data), frames);
+            d->chunk->offset = 0;
+            d->chunk->stride = static_cast<int32_t>(stride);
+            d->chunk->size = static_cast<uint32_t>(frames * stride);
+        }
+        pw_stream_queue_buffer(self->_stream, b);
+    }
+
+    struct QueuedBlock
+    {
+        std::string block;
+        bool speech;
+    };
+
+    /**
+     * Called from _Fill(), the consumer side of the ring. The front block may be half consumed by the graph, so it's
+     * dropped last. Without a speech node no block is marked as speech, so the oldest whole block is dropped.
+     */
+    void _DropOne()
+    {
+        size_t victim = 0;
+        for (size_t i = _front_offset ? 1 : 0; i < _queue.Size(); i++) {
+            if (!_queue[i].speech) {
+                victim = i;
+                break;
+            }
+        }
+        if (victim == 0) _front_offset = 0;
+        _queue.Erase(victim);
+        _dropped_count++;
+        RESPEAKER_TRACE_INSTANT("PipeWireOutputNode.drop", _dropped_count);
+    }
+
+    /**
+     * Interleave the queued blocks straight into the PipeWire buffer, pad with silence. It runs in the real-time data
+     * thread: no lock, no allocation, it only takes the published slots of the ring and gives them back.
+     */
+    void _Fill(int16_t* out, size_t num_frames)
+    {
+        // drop audio rather than let the latency grow, the same as AloopOutputNode does
+        while (_queue.Size() > _max_queued_blocks.load(std::memory_order_relaxed)) _DropOne();
+        size_t filled = 0;
+        while (filled < num_frames && _queue.Size()) {
+            const std::string& block = _queue.Front().block;
+            const int16_t* in = BlockSamples(block);
+            size_t block_frames = BlockNumFrames(block, _num_channels);
+            size_t n = std::min(num_frames - filled, block_frames - _front_offset);
+            if (_input_parameter.interleaved) {
+                memcpy(out + filled * _num_channels, in + _front_offset * _num_channels,
+                       n * _num_channels * sizeof(int16_t));
+            } else {
+                for (size_t i = 0; i < n; i++) {
+                    for (size_t c = 0; c < _num_channels; c++) {
+                        out[(filled + i) * _num_channels + c] = in[c * block_frames + _front_offset + i];
+                    }
+                }
+            }
+            filled += n;
+            _front_offset += n;
+            if (_front_offset == block_frames) {
+                _queue.Pop();
+                _front_offset = 0;
+                RESPEAKER_TRACE_COUNTER("PipeWireOutputNode.queue", _queue.Size());
+            }
+        }
+        if (filled < num_frames) {
+            memset(out + filled * _num_channels, 0, (num_frames - filled) * _num_channels * sizeof(int16_t));
+            _underrun_count++;
+        }
+    }
+
+    std::string _source_name;
+    bool _output_interleaved;
+
+    struct pw_thread_loop* _loop;
+    struct pw_stream* _stream;
+    struct pw_stream_events _events;
+
+    size_t _num_channels;
+    size_t _block_frames;
+
+    /** The ring has this many slots over the max queued blocks, so the node thread can store while _Fill() trims. */
+    static const size_t kSpareSlots = 2;
+
+    SpscRing<QueuedBlock> _queue;
+    size_t _front_offset;                       ///< Frames of the front block taken by the graph, data thread only.
+    size_t _max_delay_ms;                       ///< The delay the ring is sized for at the next start.
+    std::atomic<size_t> _max_queued_blocks;
+    std::atomic<SpeechProbabilityNode*> _speech_node;
+    std::atomic<float> _speech_threshold;
+    std::atomic<uint64_t> _dropped_count;
+    std::atomic<uint64_t> _underrun_count;
+};
+
+}  //namespace
+
+#endif // !__PIPEWIRE_OUTPUT_NODE_H__
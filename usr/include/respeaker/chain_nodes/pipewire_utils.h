@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __PIPEWIRE_UTILS_H__
+#define __PIPEWIRE_UTILS_H__
+
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+namespace respeaker
+{
+
+/** `pw_init` once per process, the PipeWire nodes call it in their constructor. */
+inline void PipeWireInitOnce()
+{
+    static std::once_flag flag;
+    std::call_once(flag, [] { pw_init(nullptr, nullptr); });
+}
+
+/**
+ * Build the S16_LE EnumFormat param of a stream. The channels are marked unpositioned when there're more than 2 of
+ * them, so the session manager doesn't try to remap the raw microphone channels as a surround layout.
+ *
+ * @param builder - The pod builder, its buffer must outlive the `pw_stream_connect` call.
+ */
+inline const struct spa_pod* BuildS16FormatParam(struct spa_pod_builder* builder, uint32_t rate, uint32_t channels)
+{
+    struct spa_audio_info_raw info;
+    memset(&info, 0, sizeof(info));
+    info.format = SPA_AUDIO_FORMAT_S16_LE;
+    info.rate = rate;
+    info.channels = channels;
+    if (channels == 1) {
+        info.position[0] = SPA_AUDIO_CHANNEL_MONO;
+    } else if (channels == 2) {
+        info.position[0] = SPA_AUDIO_CHANNEL_FL;
+        info.position[1] = SPA_AUDIO_CHANNEL_FR;
+    } else {
+        info.flags = SPA_AUDIO_FLAG_UNPOSITIONED;
+        for (uint32_t i = 0; i < channels && i < SPA_AUDIO_MAX_CHANNELS; i++) {
+            info.position[i] = SPA_AUDIO_CHANNEL_AUX0 + i;
+        }
+    }
+    return spa_format_audio_raw_build(builder, SPA_PARAM_EnumFormat, &info);
+}
+
+/** The `node.latency` property which asks the graph for a quantum of exactly one block, e.g. "128/16000". */
+inline std::string PipeWireLatencyProperty(int rate, size_t block_len_ms)
+{
+    return std::to_string(rate * block_len_ms / 1000) + "/" + std::to_string(rate);
+}
+
+}  //namespace
+
+#endif // !__PIPEWIRE_UTILS_H__
@@ -0,0 +1,497 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+
+#ifndef __RANKED_MB_DOA_KWS_NODE_H__
+#define __RANKED_MB_DOA_KWS_NODE_H__
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/chain_trace.h"
+#include "chain_nodes/direction_manager_node.h"
+#include "chain_nodes/hotword_detection_node.h"
+#include "chain_nodes/kws_detector.h"
+#include "chain_nodes/mic_type_info.h"
+#include "chain_nodes/worker_pool.h"
+
+namespace respeaker
+{
+
+/**
+ * Please note that, this node can only uplink to VepAecBeamformingNode, and is_single_beam_output should be false.
+ * This node also provides VAD(Voice available detection).
+ *
+ * Different with `SnowboyMbDoaKwsNode` which searches keyword on every beam, this node ranks the directional beams
+ * every block by their SNR and the DoA history, and only runs the KWS detectors on the top N beams. A beam has to
+ * beat the weakest selected beam by a hysteresis margin for a while before they swap. When a beam gets promoted, its
+ * detector is re-fed with the recent history of that beam, so a keyword which started before the swap isn't lost.
+ * With N = 1 or 2, the cost is close to the single-beam KWS, while most of the multi-beam accuracy is kept.
+ *
+ * The detectors of the searched beams can also run in parallel on several cores, see `SetNumWorkerThreads`, they
+ * join every block before the trigger post-confirm logic.
+ */
+class RankedMbDoaKwsNode : public BaseNode, public DirectionManagerNode, public HotwordDetectionNode
+{
+public:
+    /**
+     * Create a RankedMbDoaKwsNode instance.
+     *
+     * @param detector_factory - Creates one KwsDetector per beam, e.g. wraps `snowboy::SnowboyDetect` with
+     *                           `KwsDetectorAdapter`.
+     * @param num_active_beams - N, how many beams are searched every block. `0` searches all the directional beams,
+     *                           like `SnowboyMbDoaKwsNode` does.
+     * @param output_interleaved - Set it true to output interleaved data, false to output deinterleaved data.
+     *                             The output has only one channel(beam).
+     *
+     * @return RankedMbDoaKwsNode*
+     */
+    static RankedMbDoaKwsNode* Create(KwsDetectorFactory detector_factory,
+                                      int num_active_beams = 2,
+                                      bool output_interleaved = false)
+    {
+        return new RankedMbDoaKwsNode(detector_factory, num_active_beams, output_interleaved);
+    }
+
+    virtual ~RankedMbDoaKwsNode() = default;
+
+    /**
+     * Time length over which we can confirm that trigger has been post for all beams,
+     * then we begin to scoring the triggerd beams, finally calculated the target beam
+     *
+     * @param ms - milliseconds, default to 100.
+     */
+    void SetTriggerPostConfirmThresholdTime(int ms) { _post_confirm_ms = ms < 0 ? 0 : ms; }
+
+    /**
+     * @param hysteresis_db - How many dB a candidate beam must be over the weakest selected beam to replace it,
+     *                        default to 3.
+     * @param hold_ms - How long the candidate must keep winning before the swap, default to 48.
+     */
+    void SetRankHysteresis(float hysteresis_db, int hold_ms)
+    {
+        _hysteresis_db = hysteresis_db;
+        _hold_ms = hold_ms < 0 ? 0 : hold_ms;
+    }
+
+    /**
+     * @param history_ms - The length of audio re-fed to the detector of a newly selected beam, default to 600.
+     * @param catch_up_rate - How many blocks of history are re-fed per block on top of the current one, default to 4.
+     *                        The catch-up is spread over several blocks (about 150ms with the defaults) rather than
+     *                        run at once, so a promotion doesn't delay the block it happens in, only the detection of
+     *                        a keyword in the history by up to that time.
+     */
+    void SetPromotionHistoryTime(int history_ms, int catch_up_rate = 4)
+    {
+        _history_ms = history_ms < 0 ? 0 : history_ms;
+        _catch_up_rate = catch_up_rate < 1 ? 1 : catch_up_rate;
+    }
+
+    /**
+     * @see ReSpeaker::SetChainState
+     *
+     */
+    void DisableAutoStateTransfer() { _auto_state_transfer = false; }
+
+    /**
+     * Run the detectors of the searched beams on `num_workers` extra threads plus the node thread. Must be called
+     * before `RecursivelyStartThread`. The detectors returned by the factory must not share state between beams.
+     *
+     * @param num_workers - The default is 0, all the beams are searched in the node thread.
+     * @param first_core - Bind the workers to the cores from `first_core`, `-1` doesn't bind.
+     */
+    void SetNumWorkerThreads(int num_workers, int first_core = -1)
+    {
+        _num_workers = num_workers < 0 ? 0 : num_workers;
+        _workers_first_core = first_core;
+    }
+
+    virtual bool OnStartThread()
+    {
+        if (!SetMicTypeInfo(_input_parameter.mic_type, _mic_info)) return false;
+        _num_beams = _mic_info.num_of_directional_beams;
+        if (_num_beams <= 0 || _input_parameter.num_channel < static_cast<size_t>(_num_beams)) return false;
+        if (_num_active <= 0 || _num_active > _num_beams) _num_active = _num_beams;
+
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = RANKED_MB_DOA_KWS_NODE;
+        _output_parameter.num_channel = 1;
+        _output_parameter.interleaved = _output_interleaved;
+        _is_interleaved_after_process = _output_interleaved;
+
+        size_t block_ms = _input_parameter.block_len_ms ? _input_parameter.block_len_ms : 8;
+        _num_frames = _input_parameter.rate * block_ms / 1000;
+        _post_confirm_blocks = (_post_confirm_ms + block_ms - 1) / block_ms;
+        _hold_blocks = (_hold_ms + block_ms - 1) / block_ms;
+        _history_len = _input_parameter.rate * _history_ms / 1000;
+
+        _beams.clear();
+        for (int i = 0; i < _num_beams; i++) {
+            std::unique_ptr<BeamState> beam(new BeamState());
+            beam->detector.reset(_detector_factory(i));
+            if (!beam->detector) return false;
+            beam->samples.resize(_num_frames);
+            beam->history.assign(_history_len, 0);
+            beam->direction = GetBeamDirection(_mic_info, i);
+            _beams.push_back(std::move(beam));
+        }
+        for (int i = 0; i < _num_active; i++) _beams[i]->active = true;
+        _active_list.assign(_num_beams, 0);
+
+        _pool.reset(new WorkerPool(std::min(_num_workers, _num_active - 1)));
+        if (_workers_first_core >= 0) _pool->BindToCores(_workers_first_core, NUM_CPU_CORE);
+        _run_beam_task = [this](size_t i) { _RunBeam(*_beams[_active_list[i]]); };
+
+        _confirm_countdown = -1;
+        _output_beam = 0;
+        _last_trigger_dir = -1;
+        _blocks_since_trigger = 1000000;
+
+        if (_chain_shared_data) {
+            std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_vad);
+            _chain_shared_data->vad_node_present = true;
+        }
+        return true;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("RankedMbDoaKwsNode");
+        const size_t num_frames = BlockNumFrames(block, _input_parameter.num_channel);
+        if (num_frames == 0) return std::string();
+        if (num_frames != _num_frames) {
+            _num_frames = num_frames;
+            for (auto& beam : _beams) beam->samples.resize(num_frames);
+        }
+
+        for (int i = 0; i < _num_beams; i++) {
+            BeamState& beam = *_beams[i];
+            CopyChannel(block, _input_parameter.num_channel, _input_parameter.interleaved, i, beam.samples.data());
+            _PushHistory(beam);
+            // the detector of a beam which is catching up falls one more block behind, `_RunBeam` makes it up
+            if (beam.catch_up_frames) beam.catch_up_frames = std::min(beam.history.size(),
+                                                                      beam.catch_up_frames + _num_frames);
+            _UpdateScore(beam);
+        }
+        _blocks_since_trigger++;
+
+        bool listening = _IsListening();
+        bool vad = false;
+        if (!listening) {
+            _Rerank();
+            size_t num_active = 0;
+            for (int i = 0; i < _num_beams; i++) {
+                if (_beams[i]->active) _active_list[num_active++] = i;
+            }
+            _pool->ParallelFor(num_active, _run_beam_task);
+            for (int i = 0; i < _num_beams; i++) {
+                BeamState& beam = *_beams[i];
+                if (!beam.active) continue;
+                if (beam.result != -2) vad = true;
+                if (beam.result > 0) _OnBeamTriggered(i, beam.result);
+            }
+            _ConfirmTrigger();
+        } else {
+            // the detectors are skipped in LISTEN_* state, follow the energy of the locked beam instead
+            vad = _beams[_output_beam]->snr_db > 6.0f;
+        }
+
+        if (_chain_shared_data) {
+            std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_vad);
+            _chain_shared_data->vad = vad;
+        }
+
+        const std::vector<int16_t>& out = _beams[_output_beam]->samples;
+        _out_block.assign(reinterpret_cast<const char*>(out.data()), num_frames * sizeof(int16_t));
+        return SwapOutBlock(block, _out_block);
+    }
+
+    virtual bool OnJoinThread()
+    {
+        _pool.reset();
+        _beams.clear();
+        return true;
+    }
+
+    virtual int GetDirection() { return _direction; }
+
+    /**
+     * Select the output beam which is nearest to `dir`, until the next hotword triggers.
+     *
+     * @param dir - The degree of direction, [0, 360]
+     */
+    virtual void SetDirection(int dir)
+    {
+        _direction = dir;
+        _forced_direction = dir;
+    }
+
+    virtual int HotwordDetected() { return _hotword_index.exchange(0); }
+
+    /** Get the number of beams searched in the last block. */
+    int GetNumActiveBeams() { return _num_active; }
+
+    /** Get how many times a beam has been promoted into the top N set. */
+    uint64_t GetPromotionCount() { return _promotion_count; }
+
+protected:
+    struct BeamState
+    {
+        std::unique_ptr<KwsDetector> detector;
+        std::vector<int16_t> samples;
+        std::vector<int16_t> history;
+        size_t history_pos = 0;
+        int direction = 0;
+        bool active = false;
+        int result = 0;
+        int result_in_window = 0;
+        float energy_db = 0.0f;
+        float noise_db = 0.0f;
+        bool noise_init = false;
+        float snr_db = 0.0f;
+        float rank_score = 0.0f;
+        int challenge_count = 0;
+        size_t catch_up_frames = 0;     ///< The frames at the end of the history not fed to the detector yet.
+    };
+
+    RankedMbDoaKwsNode(KwsDetectorFactory detector_factory, int num_active_beams, bool output_interleaved)
+        : _num_active(num_active_beams),
+          _num_beams(0),
+          _num_frames(0),
+          _detector_factory(detector_factory),
+          _output_interleaved(output_interleaved),
+          _post_confirm_ms(100),
+          _hysteresis_db(3.0f),
+          _hold_ms(48),
+          _history_ms(600),
+          _catch_up_rate(4),
+          _auto_state_transfer(true),
+          _num_workers(0),
+          _workers_first_core(-1),
+          _direction(0),
+          _forced_direction(-1),
+          _hotword_index(0),
+          _promotion_count(0) {}
+
+    /** Run the detector of one beam on the current block, the result is kept in `beam.result`. */
+    void _RunBeam(BeamState& beam)
+    {
+        if (beam.catch_up_frames == 0) {
+            beam.result = beam.detector->RunDetection(beam.samples.data(), _num_frames);
+            return;
+        }
+
+        // re-feed the history (oldest first, it ends with the current block) at most `_catch_up_rate` blocks faster
+        // than real time, the detector reaches the current block after a few blocks
+        int result = 0;
+        size_t len = beam.history.size();
+        size_t budget = _num_frames * (_catch_up_rate + 1);
+        while (beam.catch_up_frames > 0 && budget > 0) {
+            size_t pos = (beam.history_pos + len - beam.catch_up_frames) % len;
+            size_t chunk = std::min(std::min(_num_frames, budget), std::min(beam.catch_up_frames, len - pos));
+            result = std::max(result, beam.detector->RunDetection(&beam.history[pos], chunk));
+            beam.catch_up_frames -= chunk;
+            budget -= chunk;
+        }
+        beam.result = result;
+    }
+
+    /** Trigger post-confirm: collect the beams triggered in a short window, then pick the target beam. */
+    void _ConfirmTrigger()
+    {
+        if (_confirm_countdown < 0 || _confirm_countdown-- > 0) return;
+
+        int best = -1;
+        for (int i = 0; i < _num_beams; i++) {
+            if (_beams[i]->result_in_window > 0 &&
+                (best < 0 || _beams[i]->rank_score > _beams[best]->rank_score)) {
+                best = i;
+            }
+        }
+        if (best >= 0) {
+            _output_beam = best;
+            _direction = _beams[best]->direction;
+            _last_trigger_dir = _direction;
+            _blocks_since_trigger = 0;
+            _forced_direction = -1;
+            _hotword_index = _beams[best]->result_in_window;
+            RESPEAKER_TRACE_INSTANT("hotword", _beams[best]->result_in_window);
+            if (_auto_state_transfer) _TransferToListen();
+        }
+        for (auto& beam : _beams) beam->result_in_window = 0;
+        _confirm_countdown = -1;
+    }
+
+    void _OnBeamTriggered(int beam_index, int hotword_index)
+    {
+        if (_beams[beam_index]->result_in_window <= 0) _beams[beam_index]->result_in_window = hotword_index;
+        if (_confirm_countdown < 0) _confirm_countdown = static_cast<int>(_post_confirm_blocks);
+    }
+
+    std::vector<std::unique_ptr<BeamState>> _beams;
+    int _num_active;
+    int _num_beams;
+    size_t _num_frames;
+    std::vector<int> _active_list;
+    std::unique_ptr<WorkerPool> _pool;
+    std::function<void(size_t)> _run_beam_task;
+
+private:
+    void _PushHistory(BeamState& beam)
+    {
+        size_t len = beam.history.size();
+        if (len == 0) return;
+        for (size_t i = 0; i < _num_frames; i++) {
+            beam.history[beam.history_pos] = beam.samples[i];
+            if (++beam.history_pos == len) beam.history_pos = 0;
+        }
+    }
+
+    void _UpdateScore(BeamState& beam)
+    {
+        int64_t energy = 0;
+        for (size_t i = 0; i < _num_frames; i++) energy += static_cast<int32_t>(beam.samples[i]) * beam.samples[i];
+        float db = 10.0f * std::log10(static_cast<float>(energy) / _num_frames + 1.0f);
+
+        beam.energy_db += 0.3f * (db - beam.energy_db);
+        if (!beam.noise_init) {
+            beam.noise_db = beam.energy_db;
+            beam.noise_init = true;
+        } else if (beam.energy_db < beam.noise_db) {
+            beam.noise_db += 0.2f * (beam.energy_db - beam.noise_db);
+        } else {
+            beam.noise_db += 0.005f;
+        }
+        beam.snr_db = beam.energy_db - beam.noise_db;
+
+        // DoA history: favour the beams around the last triggered (or forced) direction, fading out in ~5s
+        float bonus = 0.0f;
+        int ref_dir = _forced_direction >= 0 ? static_cast<int>(_forced_direction) : _last_trigger_dir;
+        if (ref_dir >= 0) {
+            float diff = static_cast<float>(std::abs(beam.direction - ref_dir) % 360);
+            if (diff > 180.0f) diff = 360.0f - diff;
+            float fade = std::exp(-static_cast<float>(_blocks_since_trigger) * _num_frames /
+                                  (5.0f * _input_parameter.rate));
+            bonus = 6.0f * fade * std::exp(-diff * diff / (2.0f * 30.0f * 30.0f));
+        }
+        beam.rank_score = beam.snr_db + bonus;
+    }
+
+    void _Rerank()
+    {
+        // the weakest selected beam can only be replaced by a challenger which keeps winning for `_hold_blocks`
+        for (;;) {
+            int weakest = -1, strongest = -1;
+            for (int i = 0; i < _num_beams; i++) {
+                BeamState& beam = *_beams[i];
+                if (beam.active) {
+                    if (weakest < 0 || beam.rank_score < _beams[weakest]->rank_score) weakest = i;
+                } else if (strongest < 0 || beam.rank_score > _beams[strongest]->rank_score) {
+                    strongest = i;
+                }
+            }
+            if (weakest < 0 || strongest < 0) break;
+
+            if (_beams[strongest]->rank_score > _beams[weakest]->rank_score + _hysteresis_db) {
+                // a challenge is a run of wins of the same beam, the other challengers start over
+                for (int i = 0; i < _num_beams; i++) {
+                    if (i != strongest) _beams[i]->challenge_count = 0;
+                }
+                if (++_beams[strongest]->challenge_count < static_cast<int>(_hold_blocks)) break;
+                BeamState& promoted = *_beams[strongest];
+                _beams[weakest]->active = false;
+                _beams[weakest]->catch_up_frames = 0;
+                promoted.active = true;
+                promoted.challenge_count = 0;
+                promoted.detector->Reset();
+                promoted.catch_up_frames = promoted.history.size();
+                _promotion_count++;
+            } else {
+                for (auto& beam : _beams) beam->challenge_count = 0;
+                break;
+            }
+        }
+
+        if (_forced_direction >= 0) {
+            _output_beam = _NearestBeam(_forced_direction);
+        } else if (_confirm_countdown < 0) {
+            // follow the best searched beam until a trigger locks the output beam
+            int best = _output_beam;
+            for (int i = 0; i < _num_beams; i++) {
+                if (_beams[i]->active && (!_beams[best]->active || _beams[i]->rank_score > _beams[best]->rank_score)) {
+                    best = i;
+                }
+            }
+            if (_blocks_since_trigger * _num_frames > static_cast<size_t>(_input_parameter.rate) * 2) _output_beam = best;
+        }
+    }
+
+    int _NearestBeam(int dir)
+    {
+        int best = 0, best_diff = 360;
+        for (int i = 0; i < _num_beams; i++) {
+            int diff = std::abs(_beams[i]->direction - dir) % 360;
+            if (diff > 180) diff = 360 - diff;
+            if (diff < best_diff) {
+                best_diff = diff;
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    bool _IsListening()
+    {
+        if (!_chain_shared_data) return false;
+        std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_state);
+        return _chain_shared_data->state == LISTEN_QUIETLY || _chain_shared_data->state == LISTEN_WITH_BGM;
+    }
+
+    void _TransferToListen()
+    {
+        if (!_chain_shared_data) return;
+        std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_state);
+        if (_chain_shared_data->state == WAIT_TRIGGER_QUIETLY) _chain_shared_data->state = LISTEN_QUIETLY;
+        else if (_chain_shared_data->state == WAIT_TRIGGER_WITH_BGM) _chain_shared_data->state = LISTEN_WITH_BGM;
+        RESPEAKER_TRACE_INSTANT("chain_state", _chain_shared_data->state);
+    }
+
+    KwsDetectorFactory _detector_factory;
+    bool _output_interleaved;
+    MicTypeInfo _mic_info;
+
+    int _post_confirm_ms;
+    size_t _post_confirm_blocks;
+    float _hysteresis_db;
+    int _hold_ms;
+    size_t _hold_blocks;
+    int _history_ms;
+    int _catch_up_rate;
+    size_t _history_len;
+    bool _auto_state_transfer;
+    int _num_workers;
+    int _workers_first_core;
+
+    int _confirm_countdown;
+    int _output_beam;
+    int _last_trigger_dir;
+    uint64_t _blocks_since_trigger;
+    std::string _out_block;
+
+    std::atomic<int> _direction;
+    std::atomic<int> _forced_direction;
+    std::atomic<int> _hotword_index;
+    std::atomic<uint64_t> _promotion_count;
+};
+
+}  //namespace
+
+#endif // !__RANKED_MB_DOA_KWS_NODE_H__
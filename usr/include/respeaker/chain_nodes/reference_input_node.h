@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __REFERENCE_INPUT_NODE_H__
+#define __REFERENCE_INPUT_NODE_H__
+
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/chain_trace.h"
+#include "chain_nodes/fft_utils.h"
+#include "chain_nodes/reference_source.h"
+
+namespace respeaker
+{
+
+/**
+ * The ReferenceInputNode feeds the AEC reference of respeaker::VepAecBeamformingNode from a playback tap (see
+ * respeaker::ReferenceSource) instead of a hardware loopback channel of the capture.
+ * It writes the reference, time-aligned to the microphones, into the channel `ref_channel_index` of the block, so the
+ * capture only needs the microphones: e.g. capture 6 channels and output 8 with the reference on channel 6.
+ *
+ * The delay from the player to the microphones is estimated every 0.5s while the playback is active, by GCC-PHAT
+ * cross-correlation of the reference against one microphone, computed with a real FFT in split format. A new delay
+ * is only taken after two consistent estimates. The reference is output a little ahead of the echo (the "alignment
+ * margin"), so the echo path stays causal for the AEC filter.
+ *
+ *     collector(6ch) --> ReferenceInputNode(8ch, ref on 6) --> VepAecBeamformingNode(ref_channel_index = 6)
+ */
+class ReferenceInputNode : public BaseNode
+{
+public:
+    /**
+     * Create a ReferenceInputNode instance.
+     *
+     * @param source - The reference source, it's owned by the caller and must outlive the node.
+     * @param ref_channel_index - The output channel of the reference, the same as `ref_channel_index` of the VEP node.
+     *                            If it's less than the input channels, that channel is replaced.
+     * @param num_output_channels - The channels of the output, the input channels are copied, the others are silent.
+     *                              Default to 8, as VepAecBeamformingNode expects for the ReSpeaker v2.
+     * @param mic_channel_index - The microphone used for the delay estimation.
+     *
+     * @return ReferenceInputNode*
+     */
+    static ReferenceInputNode* Create(ReferenceSource* source, int ref_channel_index=6, int num_output_channels=8,
+                                      int mic_channel_index=0)
+    {
+        return new ReferenceInputNode(source, ref_channel_index, num_output_channels, mic_channel_index);
+    }
+
+    virtual ~ReferenceInputNode() = default;
+
+    virtual bool OnStartThread()
+    {
+        if (!_source || _input_parameter.rate != 16000) return false;
+        if (_ref_channel < 0 || _ref_channel >= _num_out_channels) return false;
+        if (_mic_channel < 0 || static_cast<size_t>(_mic_channel) >= _input_parameter.num_channel) return false;
+        if (static_cast<size_t>(_num_out_channels) < _input_parameter.num_channel) return false;
+        if (!_source->Open()) return false;
+
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = REFERENCE_INPUT_NODE;
+        _output_parameter.num_channel = _num_out_channels;
+        _is_interleaved_after_process = _input_parameter.interleaved;
+
+        size_t block_ms = _input_parameter.block_len_ms ? _input_parameter.block_len_ms : 8;
+        _estimate_interval_blocks = 500 / block_ms;
+        // the output is larger than the input when the reference is an added channel, the collectors make room for it
+        ReserveBlockCapacity(_input_parameter.rate * block_ms / 1000 * _num_out_channels * sizeof(int16_t));
+        _blocks_since_estimate = 0;
+
+        // the rings keep `max delay + correlation window + some blocks`
+        size_t need = _max_delay + kWindow + 16 * 16 * block_ms;
+        size_t size = 1;
+        while (size < need) size <<= 1;
+        _mask = size - 1;
+        _ref_ring.assign(size, 0);
+        _mic_ring.assign(size, 0);
+        _t = 0;
+
+        size_t n = 1;
+        while (n < kWindow + _max_delay) n <<= 1;
+        _fft.Init(n);
+        _buf_ref.assign(n, 0.0f);
+        _buf_mic.assign(n, 0.0f);
+        _spec_ref_re.assign(_fft.NumBins(), 0.0f);
+        _spec_ref_im.assign(_fft.NumBins(), 0.0f);
+        _spec_mic_re.assign(_fft.NumBins(), 0.0f);
+        _spec_mic_im.assign(_fft.NumBins(), 0.0f);
+        _corr.assign(n, 0.0f);
+        _block_ref.clear();
+        _candidate = -1;
+        return true;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("ReferenceInputNode");
+        size_t num_in = _input_parameter.num_channel;
+        size_t frames = BlockNumFrames(block, num_in);
+        bool interleaved = _input_parameter.interleaved;
+
+        // the reference which is played now lands in the ring next to the microphone samples captured now
+        _block_ref.resize(frames);
+        size_t got = _source->Read(_block_ref.data(), frames);
+        for (size_t i = got; i < frames; i++) _block_ref[i] = 0;
+        const int16_t* in = BlockSamples(block);
+        for (size_t i = 0; i < frames; i++) {
+            _ref_ring[(_t + i) & _mask] = _block_ref[i];
+            _mic_ring[(_t + i) & _mask] = interleaved ? in[i * num_in + _mic_channel] : in[_mic_channel * frames + i];
+        }
+        _t += frames;
+
+        if (_fixed_delay < 0 && ++_blocks_since_estimate >= _estimate_interval_blocks) {
+            _blocks_since_estimate = 0;
+            _EstimateDelay();
+        }
+        int delay = _fixed_delay >= 0 ? _fixed_delay : _delay.load();
+        size_t lead = static_cast<size_t>(delay > _margin ? delay - _margin : 0);
+
+        // reuses the buffer of the previous input, it's large enough for the added channel when the blocks come from
+        // a collector of this library (see ReserveBlockCapacity), else it's grown, one allocation per block
+        _out_block.assign(frames * _num_out_channels * sizeof(int16_t), '\0');
+        int16_t* o = BlockSamples(_out_block);
+        size_t start = _t - frames - lead;
+        if (interleaved) {
+            for (size_t i = 0; i < frames; i++) {
+                memcpy(o + i * _num_out_channels, in + i * num_in, num_in * sizeof(int16_t));
+                o[i * _num_out_channels + _ref_channel] = _ref_ring[(start + i) & _mask];
+            }
+        } else {
+            memcpy(o, in, block.size());
+            int16_t* ref = o + _ref_channel * frames;
+            for (size_t i = 0; i < frames; i++) ref[i] = _ref_ring[(start + i) & _mask];
+        }
+        return SwapOutBlock(block, _out_block);
+    }
+
+    virtual bool OnJoinThread()
+    {
+        if (_source) _source->Close();
+        return true;
+    }
+
+    /** The longest delay which is searched, in milliseconds, default to 250. Must be called before starting. */
+    void SetMaxDelay(int ms) { _max_delay = static_cast<size_t>(ms > 0 ? ms : 1) * 16; }
+
+    /** How early the reference is output before the echo, in milliseconds, default to 2. A negative value is 0. */
+    void SetAlignmentMargin(int ms) { _margin = ms > 0 ? ms * 16 : 0; }
+
+    /** Use a known delay, in milliseconds, and stop estimating it. A negative value enables the estimation again. */
+    void SetFixedDelay(int ms) { _fixed_delay = ms < 0 ? -1 : ms * 16; }
+
+    /** Get the delay in use from the player to the microphones, in milliseconds. */
+    float GetDelayMs() { return (_fixed_delay >= 0 ? _fixed_delay : _delay.load()) / 16.0f; }
+
+    /** Get the peak-to-average ratio of the last accepted correlation, `0` before the delay is known. */
+    float GetDelayConfidence() { return _confidence; }
+
+protected:
+    ReferenceInputNode(ReferenceSource* source, int ref_channel_index, int num_output_channels, int mic_channel_index)
+        : _source(source),
+          _ref_channel(ref_channel_index),
+          _num_out_channels(num_output_channels),
+          _mic_channel(mic_channel_index),
+          _max_delay(250 * 16),
+          _margin(2 * 16),
+          _fixed_delay(-1),
+          _estimate_interval_blocks(62),
+          _blocks_since_estimate(0),
+          _mask(0),
+          _t(0),
+          _candidate(-1),
+          _delay(0),
+          _confidence(0.0f) {}
+
+    static const size_t kWindow = 4096;        ///< The microphone window of the correlation, 256ms.
+    static constexpr float kMinRms = 30.0f;     ///< Below this the reference (or the echo) is too quiet to correlate.
+    static constexpr float kMinConfidence = 6.0f;
+
+    void _EstimateDelay()
+    {
+        if (_t < kWindow + _max_delay) return;
+        const size_t n = _fft.Size();
+        // mic[n] for the last `kWindow` samples against ref over the same span plus `_max_delay` before it:
+        // corr[k] = sum(mic[j] * ref[j + k]), the echo delay is `_max_delay - k`
+        size_t ref_start = _t - kWindow - _max_delay;
+        size_t mic_start = _t - kWindow;
+        double ref_energy = 0.0, mic_energy = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            float r = i < kWindow + _max_delay ? _ref_ring[(ref_start + i) & _mask] : 0.0f;
+            float m = i < kWindow ? _mic_ring[(mic_start + i) & _mask] : 0.0f;
+            _buf_ref[i] = r;
+            _buf_mic[i] = m;
+            ref_energy += r * r;
+            mic_energy += m * m;
+        }
+        if (std::sqrt(ref_energy / (kWindow + _max_delay)) < kMinRms || std::sqrt(mic_energy / kWindow) < kMinRms) {
+            return;
+        }
+
+        _fft.Forward(_buf_ref.data(), _spec_ref_re.data(), _spec_ref_im.data());
+        _fft.Forward(_buf_mic.data(), _spec_mic_re.data(), _spec_mic_im.data());
+        _PhatCrossSpectrum();
+        _fft.Inverse(_spec_ref_re.data(), _spec_ref_im.data(), _corr.data());
+
+        size_t best = 0;
+        float peak = -1.0f, sum = 0.0f;
+        for (size_t k = 0; k <= _max_delay; k++) {
+            float v = std::fabs(_corr[k]);
+            sum += v;
+            if (v > peak) {
+                peak = v;
+                best = k;
+            }
+        }
+        float confidence = peak / (sum / (_max_delay + 1) + 1e-12f);
+        if (confidence < kMinConfidence) return;
+
+        int estimate = static_cast<int>(_max_delay - best);
+        if (_candidate >= 0 && std::abs(estimate - _candidate) <= 2) {
+            _delay = estimate;
+            _confidence = confidence;
+        }
+        _candidate = estimate;
+    }
+
+    /** ref * conj(mic), whitened (PHAT) and band limited to 200-6000Hz, written back into the ref spectrum. */
+    void _PhatCrossSpectrum()
+    {
+        const size_t bins = _fft.NumBins();
+        const size_t lo = 200 * _fft.Size() / 16000, hi = 6000 * _fft.Size() / 16000;
+        float* RESPEAKER_RESTRICT rr = _spec_ref_re.data();
+        float* RESPEAKER_RESTRICT ri = _spec_ref_im.data();
+        const float* RESPEAKER_RESTRICT mr = _spec_mic_re.data();
+        const float* RESPEAKER_RESTRICT mi = _spec_mic_im.data();
+        for (size_t k = 0; k < bins; k++) {
+            float cr = rr[k] * mr[k] + ri[k] * mi[k];
+            float ci = ri[k] * mr[k] - rr[k] * mi[k];
+            float w = (k >= lo && k <= hi) ? 1.0f / (std::sqrt(cr * cr + ci * ci) + 1e-9f) : 0.0f;
+            rr[k] = cr * w;
+            ri[k] = ci * w;
+        }
+    }
+
+    ReferenceSource* _source;
+    int _ref_channel;
+    int _num_out_channels;
+    int _mic_channel;
+    size_t _max_delay;
+    int _margin;
+    int _fixed_delay;
+
+    size_t _estimate_interval_blocks;
+    size_t _blocks_since_estimate;
+
+    size_t _mask;
+    size_t _t;                          ///< The number of samples seen since the start.
+    std::vector<int16_t> _ref_ring;
+    std::vector<int16_t> _mic_ring;
+    std::vector<int16_t> _block_ref;
+    std::string _out_block;
+
+    RealFft _fft;
+    std::vector<float> _buf_ref, _buf_mic;
+    std::vector<float> _spec_ref_re, _spec_ref_im;
+    std::vector<float> _spec_mic_re, _spec_mic_im;
+    std::vector<float> _corr;
+
+    int _candidate;
+    std::atomic<int> _delay;
+    std::atomic<float> _confidence;
+};
+
+}  //namespace
+
+#endif // !__REFERENCE_INPUT_NODE_H__
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __REFERENCE_SOURCE_H__
+#define __REFERENCE_SOURCE_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "chain_nodes/resampler.h"
+
+namespace respeaker
+{
+
+/**
+ * A source of the playback audio (the AEC reference) for respeaker::ReferenceInputNode, mono 16KHz S16.
+ * `Read` is called from the node thread once per block and must not block: it returns what's available, and the node
+ * pads the rest with silence.
+ */
+class ReferenceSource
+{
+public:
+    virtual ~ReferenceSource() = default;
+
+    /** Called in `ReferenceInputNode::OnStartThread`. */
+    virtual bool Open() { return true; }
+
+    /**
+     * @param out [out] - Mono 16KHz samples.
+     * @param num_frames - The number of samples wanted.
+     *
+     * @return size_t - The number of samples written, at most `num_frames`.
+     */
+    virtual size_t Read(int16_t* out, size_t num_frames) = 0;
+
+    virtual void Close() {}
+};
+
+/**
+ * The application pushes the audio it plays, e.g. from the callback of its player, right before writing it to the
+ * sound card. Single producer (the player), single consumer (the node), lock-free.
+ */
+class PushReferenceSource : public ReferenceSource
+{
+public:
+    /**
+     * @param capacity_ms - How much audio can be buffered, what doesn't fit is dropped.
+     */
+    explicit PushReferenceSource(size_t capacity_ms = 500)
+        : _ring(16 * capacity_ms + 1), _head(0), _tail(0), _dropped(0) {}
+
+    /**
+     * Push mono 16KHz samples.
+     *
+     * @return size_t - The number of samples accepted, the rest is dropped.
+     */
+    size_t Push(const int16_t* samples, size_t num_frames)
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        size_t tail = _tail.load(std::memory_order_acquire);
+        size_t free_space = (tail + _ring.size() - head - 1) % _ring.size();
+        size_t n = num_frames < free_space ? num_frames : free_space;
+        for (size_t i = 0; i < n; i++) {
+            _ring[head] = samples[i];
+            if (++head == _ring.size()) head = 0;
+        }
+        _head.store(head, std::memory_order_release);
+        _dropped += num_frames - n;
+        return n;
+    }
+
+    virtual size_t Read(int16_t* out, size_t num_frames)
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        size_t head = _head.load(std::memory_order_acquire);
+        size_t avail = (head + _ring.size() - tail) % _ring.size();
+        size_t n = num_frames < avail ? num_frames : avail;
+        for (size_t i = 0; i < n; i++) {
+            out[i] = _ring[tail];
+            if (++tail == _ring.size()) tail = 0;
+        }
+        _tail.store(tail, std::memory_order_release);
+        return n;
+    }
+
+    /** Get how many samples were dropped because the node didn't read them in time. */
+    uint64_t GetDroppedCount() { return _dropped; }
+
+private:
+    std::vector<int16_t> _ring;
+    std::atomic<size_t> _head;
+    std::atomic<size_t> _tail;
+    std::atomic<uint64_t> _dropped;
+};
+
+/**
+ * Read the reference from a S16_LE *.wav file, e.g. the file the device plays in a test. Multi-channel files are
+ * downmixed, a rate which is a multiple of 16KHz is decimated. The file is read once in `Open`.
+ */
+class FileReferenceSource : public ReferenceSource
+{
+public:
+    explicit FileReferenceSource(const std::string& wav_path, bool loop = false)
+        : _path(wav_path), _loop(loop), _pos(0) {}
+
+    virtual bool Open()
+    {
+        FILE* f = fopen(_path.c_str(), "rb");
+        if (!f) return false;
+        bool ok = _Load(f);
+        fclose(f);
+        _pos = 0;
+        return ok;
+    }
+
+    virtual size_t Read(int16_t* out, size_t num_frames)
+    {
+        size_t n = 0;
+        while (n < num_frames && !_samples.empty()) {
+            if (_pos == _samples.size()) {
+                if (!_loop) break;
+                _pos = 0;
+            }
+            size_t k = std::min(num_frames - n, _samples.size() - _pos);
+            memcpy(out + n, &_samples[_pos], k * sizeof(int16_t));
+            n += k;
+            _pos += k;
+        }
+        return n;
+    }
+
+private:
+    bool _Load(FILE* f)
+    {
+        char riff[12];
+        if (fread(riff, 1, 12, f) != 12 || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+            return false;
+        }
+        uint16_t format = 0, channels = 0, bits = 0;
+        uint32_t rate = 0;
+        char id[4];
+        uint32_t size;
+        while (fread(id, 1, 4, f) == 4 && fread(&size, 4, 1, f) == 1) {
+            if (memcmp(id, "fmt ", 4) == 0 && size >= 16) {
+                uint8_t fmt[16];
+                if (fread(fmt, 1, 16, f) != 16) return false;
+                memcpy(&format, fmt, 2);
+                memcpy(&channels, fmt + 2, 2);
+                memcpy(&rate, fmt + 4, 4);
+                memcpy(&bits, fmt + 14, 2);
+                fseek(f, size - 16 + (size & 1), SEEK_CUR);
+            } else if (memcmp(id, "data", 4) == 0) {
+                if (format != 1 || bits != 16 || channels == 0 || rate == 0 || rate % 16000 != 0) return false;
+                std::vector<int16_t> raw(size / 2);
+                raw.resize(fread(raw.data(), 2, raw.size(), f));
+                size_t frames = raw.size() / channels;
+                std::vector<int16_t> mono(frames);
+                for (size_t i = 0; i < frames; i++) {
+                    int32_t acc = 0;
+                    for (size_t c = 0; c < channels; c++) acc += raw[i * channels + c];
+                    mono[i] = static_cast<int16_t>(acc / channels);
+                }
+                DecimatingResampler resampler;
+                resampler.Init(rate / 16000, 1);
+                _samples.resize(frames / (rate / 16000) + 1);
+                _samples.resize(resampler.Process(mono.data(), 0, 1, frames, _samples.data(), 0, 1));
+                return true;
+            } else {
+                fseek(f, size + (size & 1), SEEK_CUR);
+            }
+        }
+        return false;
+    }
+
+    std::string _path;
+    bool _loop;
+    size_t _pos;
+    std::vector<int16_t> _samples;
+};
+
+}  //namespace
+
+#endif // !__REFERENCE_SOURCE_H__
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __REPLAY_COLLECTOR_NODE_H__
+#define __REPLAY_COLLECTOR_NODE_H__
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/chain_trace.h"
+#include "chain_nodes/direction_manager_node.h"
+#include "chain_nodes/session_log.h"
+
+namespace respeaker
+{
+
+/**
+ * The ReplayCollectorNode replays a session recorded by respeaker::SessionRecorderNode: the same blocks in the same
+ * format (any number of channels, interleaved or not), with the supervisor calls of respeaker::RecordingReSpeaker
+ * applied between the same two blocks as in the live session. The chain behind it sees what the live chain saw, so a
+ * field CPU spike can be reproduced and profiled on a desk.
+ *
+ * `SetChainState` calls are applied to the chain shared data and `SetDirection` calls to the node given by
+ * `SetDirectionManagerNode`. The other calls (`Pause`/`Resume`, the `DetectHotword`/`Listen` results...) aren't
+ * applied here, they're all passed to the handler of `SetApiCallHandler`, if any. At the end of the log, the exit flag
+ * is returned.
+ */
+class ReplayCollectorNode : public BaseNode
+{
+public:
+    /**
+     * Create a ReplayCollectorNode instance.
+     *
+     * @param path - The session log.
+     * @param realtime - Replay the blocks at their recorded times, with the recorded jitter. `false` replays them as
+     *                   fast as the chain takes them, for throughput and CPU measurements; mind that the queues of
+     *                   the chain grow if some node is slower than this collector. Default to true.
+     *
+     * @return ReplayCollectorNode*
+     */
+    static ReplayCollectorNode* Create(std::string path, bool realtime=true)
+    {
+        return new ReplayCollectorNode(path, realtime);
+    }
+
+    virtual ~ReplayCollectorNode() = default;
+
+    virtual bool OnStartThread()
+    {
+        if (!_reader.Open(_path)) return false;
+        SessionRecord record;
+        if (!_reader.Next(record) || record.type != SESSION_FORMAT || record.payload.size() < sizeof(SessionFormat)) {
+            return false;
+        }
+        SessionFormat format;
+        memcpy(&format, record.payload.data(), sizeof(format));
+        if (format.rate <= 0 || format.num_channel == 0 || format.block_len_ms == 0) return false;
+
+        _output_parameter.node_type = REPLAY_COLLECTOR_NODE;
+        _output_parameter.mic_type = static_cast<MicType>(format.mic_type);
+        _output_parameter.block_len_ms = format.block_len_ms;
+        _output_parameter.rate = format.rate;
+        _output_parameter.num_channel = format.num_channel;
+        _output_parameter.interleaved = format.interleaved != 0;
+        _is_interleaved_after_process = _output_parameter.interleaved;
+        _block_size = static_cast<size_t>(format.rate) * format.block_len_ms / 1000 * format.num_channel *
+                      sizeof(int16_t);
+
+        _first_block = true;
+        _replayed_blocks = 0;
+        _finished = false;
+        return true;
+    }
+
+    virtual std::string FetchBlock(bool& exit)
+    {
+        // the block handed to the chain, allocated before the scope; the audio is swapped in from the record, whose
+        // buffer then gets this one for the next record, so the reader doesn't allocate either
+        std::string block = NewBlock(_block_size);
+        RESPEAKER_ALLOC_GUARD_SCOPE("ReplayCollectorNode");
+        while (true) {
+            if (_IsExit()) {
+                exit = true;
+                return std::string();
+            }
+            if (!_reader.Next(_record)) {
+                _finished = true;
+                exit = true;
+                return std::string();
+            }
+
+            if (_record.type == SESSION_API_CALL) {
+                _ApplyApiCall(_record);
+                continue;
+            }
+            if (_record.type != SESSION_BLOCK) continue;
+
+            if (_realtime && !_WaitUntil(_record.time_ns)) {
+                exit = true;
+                return std::string();
+            }
+            _replayed_blocks++;
+            // recorded without the audio, the block is silence
+            if (!_record.payload.empty()) block.swap(_record.payload);
+            return block;
+        }
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        return block;
+    }
+
+    virtual bool OnJoinThread()
+    {
+        _reader.Close();
+        return true;
+    }
+
+    /** The node which gets the recorded `SetDirection` calls. Must be called before `RecursivelyStartThread`. */
+    void SetDirectionManagerNode(DirectionManagerNode* direction_manager) { _direction_manager = direction_manager; }
+
+    /**
+     * Get the recorded API calls, to replay the ones which drive the application (e.g. `Pause`) or to check the
+     * results of the replay against the recorded `DetectHotword` results. Must be called before
+     * `RecursivelyStartThread`.
+     *
+     * The handler is called from the thread of this node, between two blocks, so it mustn't call the supervisor from
+     * there, the supervisor calls act on the nodes of the chain, this one included. To replay such a call, hand the
+     * record over to the application thread (e.g. through a queue it drains) and make the call from there.
+     */
+    void SetApiCallHandler(std::function<void(const SessionRecord&)> handler) { _api_call_handler = handler; }
+
+    /** Get how many blocks have been replayed. */
+    uint64_t GetReplayedBlocks() { return _replayed_blocks; }
+
+    /** Get if the whole log has been replayed. */
+    bool IsFinished() { return _finished; }
+
+protected:
+    ReplayCollectorNode(std::string path, bool realtime)
+        : _path(path),
+          _realtime(realtime),
+          _block_size(0),
+          _first_block(true),
+          _first_block_time_ns(0),
+          _direction_manager(nullptr),
+          _replayed_blocks(0),
+          _finished(false)
+    {}
+
+    void _ApplyApiCall(const SessionRecord& record)
+    {
+        if (record.arg == SESSION_API_SET_CHAIN_STATE && _chain_shared_data) {
+            std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_state);
+            _chain_shared_data->state = static_cast<ChainState>(record.value);
+        } else if (record.arg == SESSION_API_SET_DIRECTION && _direction_manager) {
+            _direction_manager->SetDirection(record.value);
+        }
+        if (_api_call_handler) _api_call_handler(record);
+    }
+
+    /** Sleep until the recorded time of the block, relative to the first block, in slices to see the exit flag. */
+    bool _WaitUntil(int64_t time_ns)
+    {
+        if (_first_block) {
+            _first_block = false;
+            _first_block_time_ns = time_ns;
+            _start = std::chrono::steady_clock::now();
+            return true;
+        }
+        std::chrono::steady_clock::time_point target = _start + std::chrono::nanoseconds(time_ns - _first_block_time_ns);
+        while (true) {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now >= target) return true;
+            if (_IsExit()) return false;
+            std::chrono::steady_clock::duration slice = std::chrono::milliseconds(100);
+            std::this_thread::sleep_for(target - now < slice ? target - now : slice);
+        }
+    }
+
+    bool _IsExit()
+    {
+        if (!_chain_shared_data) return false;
+        std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_exit_flag);
+        return _chain_shared_data->exit_flag;
+    }
+
+    std::string _path;
+    bool _realtime;
+    size_t _block_size;
+    SessionLogReader _reader;
+    SessionRecord _record;
+
+    bool _first_block;
+    int64_t _first_block_time_ns;
+    std::chrono::steady_clock::time_point _start;
+
+    DirectionManagerNode* _direction_manager;
+    std::function<void(const SessionRecord&)> _api_call_handler;
+
+    std::atomic<uint64_t> _replayed_blocks;
+    std::atomic<bool> _finished;
+};
+
+}  //namespace
+
+#endif // !__REPLAY_COLLECTOR_NODE_H__
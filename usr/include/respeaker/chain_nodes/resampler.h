@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __RESAMPLER_H__
+#define __RESAMPLER_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "chain_nodes/sample_dsp.h"
+
+namespace respeaker
+{
+
+/**
+ * Multi-channel integer-factor decimator, e.g. 48KHz to 16KHz. A windowed-sinc low-pass FIR is evaluated only at the
+ * kept samples (polyphase), and the input is read with an arbitrary stride, so the collectors can feed it straight
+ * from an interleaved DMA ring and write the output straight into a deinterleaved or interleaved block.
+ * The state is kept across calls, so the input can be split anywhere (e.g. at the wrap of a ring buffer).
+ *
+ * The step between two output samples can be nudged by a few hundred ppm with `SetDriftPpm`, to follow a capture
+ * clock which doesn't run at its nominal rate. The FIR is then evaluated at fractional positions, with the taps
+ * interpolated from an oversampled table.
+ *
+ * The arithmetic is given by `Dsp` (see respeaker::FloatDsp), respeaker::DecimatingResampler uses the one selected at
+ * build time. With a fixed-point `Dsp`, the delay lines stay in int16 and the taps (including the interpolated ones)
+ * are integers, so no sample goes through the FPU. The position between the input samples is kept in Q32 in all
+ * the builds, the FPU is only used by `Init` and `SetDriftPpm`.
+ */
+template <typename Dsp>
+class DecimatingResamplerT
+{
+public:
+    typedef typename Dsp::sample_t sample_t;
+    typedef typename Dsp::coef_t coef_t;
+
+    DecimatingResamplerT() : _factor(1), _num_taps(1), _num_channels(0), _pos(0), _step(kOne), _acc(kOne) {}
+
+    /**
+     * @param factor - The decimation factor, 1 makes it a plain (delayed) copy until a drift is set.
+     * @param num_channels - The number of channels.
+     * @param taps_per_phase - The FIR length is `factor * taps_per_phase`.
+     */
+    void Init(size_t factor, size_t num_channels, size_t taps_per_phase = 16)
+    {
+        _factor = factor < 1 ? 1 : factor;
+        _num_channels = num_channels;
+        _num_taps = _factor * taps_per_phase;
+
+        // the prototype spans [0, _num_taps] and is sampled `kOversample` times per input sample;
+        // cut off at 90% of the output Nyquist, Blackman window
+        const size_t len = _num_taps * kOversample;
+        double cutoff = _factor == 1 ? 1.0 : 0.9 / _factor;
+        double center = _num_taps / 2.0;
+        std::vector<double> prototype(len + 2, 0.0);
+        for (size_t j = 0; j <= len; j++) {
+            double u = static_cast<double>(j) / kOversample;
+            double x = u - center;
+            double sinc = x == 0.0 ? cutoff : std::sin(M_PI * cutoff * x) / (M_PI * x);
+            double w = 0.42 - 0.5 * std::cos(2.0 * M_PI * j / len) + 0.08 * std::cos(4.0 * M_PI * j / len);
+            prototype[j] = sinc * w;
+        }
+        double sum = 0.0;
+        for (size_t i = 0; i < _num_taps; i++) sum += prototype[i * kOversample];
+        _table.resize(len + 2);
+        for (size_t j = 0; j < len + 2; j++) _table[j] = Dsp::Coef(prototype[j] / sum);
+
+        _taps.resize(_num_taps);
+        for (size_t i = 0; i < _num_taps; i++) _taps[i] = _table[i * kOversample];
+        _frac_taps.assign(_num_taps, coef_t());
+
+        // each delay line is written twice, so the dot product always reads `_num_taps` contiguous samples
+        _delay.assign(_num_channels * 2 * _num_taps, sample_t());
+        _pos = 0;
+        _step = static_cast<int64_t>(_factor) * kOne;
+        _acc = _step;
+    }
+
+    size_t GetFactor() const { return _factor; }
+
+    /** Forget the input after a gap in the stream (e.g. an overrun), so the next outputs don't mix audio across it. */
+    void Reset()
+    {
+        std::fill(_delay.begin(), _delay.end(), sample_t());
+        _pos = 0;
+        _acc = _step;
+    }
+
+    /**
+     * Compensate a clock drift: the output takes `factor * (1 + ppm / 1e6)` input samples per output sample.
+     *
+     * @param ppm - Positive when the capture clock runs faster than its nominal rate.
+     */
+    void SetDriftPpm(double ppm)
+    {
+        double step = _factor * (1.0 + ppm * 1e-6);
+        _step = static_cast<int64_t>(std::floor((step < 0.5 ? 0.5 : step) * kOne + 0.5));
+    }
+
+    /** The number of input frames needed to produce `num_out_frames` more output frames. */
+    size_t NumInputFrames(size_t num_out_frames) const
+    {
+        if (num_out_frames == 0) return 0;
+        int64_t need = _acc + static_cast<int64_t>(num_out_frames - 1) * _step;
+        return need <= 0 ? 0 : static_cast<size_t>((need + kOne - 1) >> 32);
+    }
+
+    /**
+     * Resample up to `num_in_frames` frames.
+     *
+     * @param in - The first sample of channel 0, the samples of channel `c` frame `i` is `in[c * in_channel_stride +
+     *             i * in_frame_stride]`, strides are counted in samples.
+     * @param out - The first sample of output channel 0, laid out the same way by the out strides.
+     * @param max_out_frames - Stop consuming input once this many frames are written.
+     * @param num_consumed [out] - The number of input frames consumed, optional.
+     *
+     * @return size_t - The number of output frames written.
+     */
+    size_t Process(const int16_t* in, size_t in_channel_stride, size_t in_frame_stride, size_t num_in_frames,
+                   int16_t* out, size_t out_channel_stride, size_t out_frame_stride,
+                   size_t max_out_frames = SIZE_MAX, size_t* num_consumed = nullptr)
+    {
+        size_t num_out = 0;
+        size_t i = 0;
+        for (; i < num_in_frames && num_out < max_out_frames; i++) {
+            const int16_t* frame = in + i * in_frame_stride;
+            for (size_t c = 0; c < _num_channels; c++) {
+                sample_t* line = &_delay[c * 2 * _num_taps];
+                sample_t s = Dsp::FromS16(frame[c * in_channel_stride]);
+                line[_pos] = s;
+                line[_pos + _num_taps] = s;
+            }
+            if (++_pos == _num_taps) _pos = 0;
+
+            // an output is due `mu` input samples before the newest one, `mu` in [0, 1) in Q32
+            _acc -= kOne;
+            while (_acc <= 0 && num_out < max_out_frames) {
+                uint64_t mu = static_cast<uint64_t>(-_acc);
+                _acc += _step;
+                // the table has `kOversample` entries per input sample, its position is walked in Q16
+                uint32_t mu_q16 = static_cast<uint32_t>((mu * kOversample) >> 16);
+                const coef_t* taps = mu_q16 == 0 ? _taps.data() : _FracTaps(mu_q16);
+                int16_t* o = out + num_out * out_frame_stride;
+                for (size_t c = 0; c < _num_channels; c++) {
+                    o[c * out_channel_stride] = _Dot(&_delay[c * 2 * _num_taps + _pos], taps);
+                }
+                num_out++;
+            }
+        }
+        if (num_consumed) *num_consumed = i;
+        return num_out;
+    }
+
+private:
+    static const size_t kOversample = 64;
+    static const int64_t kOne = 1LL << 32;     ///< One input sample in the Q32 phase.
+
+    const coef_t* _FracTaps(uint32_t mu_q16)
+    {
+        // tap `i` weights the sample `_num_taps - 1 - i` samples before the newest one, so it samples the
+        // prototype at `i + mu`, i.e. at `i * kOversample + mu_q16` in Q16 table entries
+        for (size_t i = 0; i < _num_taps; i++) {
+            uint32_t u = static_cast<uint32_t>(i * kOversample << 16) + mu_q16;
+            size_t j = u >> 16;
+            _frac_taps[i] = Dsp::Lerp(_table[j], _table[j + 1], u & 0xffff);
+        }
+        return _frac_taps.data();
+    }
+
+    int16_t _Dot(const sample_t* RESPEAKER_RESTRICT line, const coef_t* RESPEAKER_RESTRICT taps) const
+    {
+        // `line` starts at the oldest sample
+        typename Dsp::acc_t acc = 0;
+        for (size_t k = 0; k < _num_taps; k++) acc = Dsp::Mac(acc, line[k], taps[k]);
+        return Dsp::ToS16(acc);
+    }
+
+    size_t _factor;
+    size_t _num_taps;
+    size_t _num_channels;
+    size_t _pos;
+    int64_t _step;      ///< Input samples per output sample, Q32.
+    int64_t _acc;       ///< Input samples until the next output, Q32.
+    std::vector<coef_t> _table;
+    std::vector<coef_t> _taps;
+    std::vector<coef_t> _frac_taps;
+    std::vector<sample_t> _delay;
+};
+
+/** The resampler with the arithmetic selected at build time, see respeaker::DefaultDsp. */
+typedef DecimatingResamplerT<DefaultDsp> DecimatingResampler;
+
+}  // namespace respeaker
+
+#endif // !__RESAMPLER_H__
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __SAMPLE_DSP_H__
+#define __SAMPLE_DSP_H__
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+/** The pointers of the inner loops which don't alias, so the compiler can vectorize them. */
+#ifndef RESPEAKER_RESTRICT
+#define RESPEAKER_RESTRICT __restrict
+#endif
+
+namespace respeaker
+{
+
+/**
+ * The arithmetic of the sample stages (resampling, gains, mixing) of the library, as a policy class for the templates
+ * of those stages, so the float and the fixed-point builds share one code path:
+ * - `sample_t` - a sample in a delay line.
+ * - `coef_t` - a filter tap or a mixing weight, in [-1, 1].
+ * - `gain_t` - a gain, in [0, 32768).
+ * - `acc_t` - the accumulator of a dot product with taps of |h|_1 < 1.5, e.g. a low-pass FIR.
+ * - `mix_acc_t` - the accumulator of a mix, whose weights may add up to much more than 1 (e.g. 8 channels at 1.0).
+ *
+ * respeaker::FloatDsp is the default. On the boards with a weak FPU (e.g. ARMv7 without NEON, where every
+ * int16 <-> float conversion is a VFP round trip), build with `-DRESPEAKER_DSP_Q15` or `-DRESPEAKER_DSP_Q31` to
+ * make respeaker::DefaultDsp a fixed-point policy. The stages then only use integer multiply-accumulates.
+ */
+struct FloatDsp
+{
+    typedef float sample_t;
+    typedef float coef_t;
+    typedef float gain_t;
+    typedef float acc_t;
+    typedef float mix_acc_t;
+
+    static sample_t FromS16(int16_t s) { return s; }
+    static float MaxCoef() { return 1e30f; }
+    static coef_t Coef(double c) { return static_cast<float>(c); }
+    static gain_t Gain(double g) { return static_cast<float>(g); }
+
+    /** `a + (b - a) * frac`, `frac` is in Q16. */
+    static coef_t Lerp(coef_t a, coef_t b, uint32_t frac_q16) { return a + (b - a) * (frac_q16 * (1.0f / 65536.0f)); }
+
+    static acc_t Mac(acc_t acc, sample_t s, coef_t c) { return acc + s * c; }
+
+    static int16_t ToS16(acc_t acc)
+    {
+        acc = acc > 32767.0f ? 32767.0f : (acc < -32768.0f ? -32768.0f : acc);
+        return static_cast<int16_t>(std::lrint(acc));
+    }
+
+    static int16_t ApplyGain(int16_t s, gain_t g) { return ToS16(s * g); }
+};
+
+/**
+ * Q15 taps and weights with a 32 bits accumulator, i.e. one `SMLABB`/`vmlal.s16` per tap. The taps are normalized
+ * to a unity DC gain, a windowed-sinc has |h|_1 < 1.5 so the accumulator keeps its headroom.
+ */
+struct Q15Dsp
+{
+    typedef int16_t sample_t;
+    typedef int16_t coef_t;
+    typedef int32_t gain_t;     ///< Q16
+    typedef int32_t acc_t;      ///< Q15
+    typedef int64_t mix_acc_t;  ///< Q15, 8 full-scale channels at weight 1.0 already overflow 32 bits
+
+    static sample_t FromS16(int16_t s) { return s; }
+    static float MaxCoef() { return 1.0f; }
+
+    static coef_t Coef(double c)
+    {
+        double q = std::floor(c * 32768.0 + 0.5);
+        return static_cast<int16_t>(q > 32767.0 ? 32767.0 : (q < -32768.0 ? -32768.0 : q));
+    }
+
+    static gain_t Gain(double g)
+    {
+        double q = std::floor(g * 65536.0 + 0.5);
+        return static_cast<int32_t>(q > 2147483647.0 ? 2147483647.0 : (q < 0.0 ? 0.0 : q));
+    }
+
+    static coef_t Lerp(coef_t a, coef_t b, uint32_t frac_q16)
+    {
+        return static_cast<int16_t>(a + ((static_cast<int32_t>(b - a) * static_cast<int32_t>(frac_q16 >> 1)) >> 15));
+    }
+
+    static acc_t Mac(acc_t acc, sample_t s, coef_t c) { return acc + static_cast<int32_t>(s) * c; }
+
+    /** Takes `acc_t` and `mix_acc_t` alike. */
+    static int16_t ToS16(int64_t acc) { return _Saturate((acc + (1 << 14)) >> 15); }
+
+    static int16_t ApplyGain(int16_t s, gain_t g) { return _Saturate((static_cast<int64_t>(s) * g + 32768) >> 16); }
+
+    static int16_t _Saturate(int64_t v)
+    {
+        return static_cast<int16_t>(v > 32767 ? 32767 : (v < -32768 ? -32768 : v));
+    }
+};
+
+/** Q31 taps and weights with a 64 bits accumulator (`SMLAL`), for the filters which need more than 16 bits taps. */
+struct Q31Dsp
+{
+    typedef int16_t sample_t;
+    typedef int32_t coef_t;
+    typedef int32_t gain_t;     ///< Q16
+    typedef int64_t acc_t;      ///< Q31
+    typedef int64_t mix_acc_t;  ///< Q31, 2^46 per channel leaves room for thousands of channels
+
+    static sample_t FromS16(int16_t s) { return s; }
+    static float MaxCoef() { return 1.0f; }
+
+    static coef_t Coef(double c)
+    {
+        double q = std::floor(c * 2147483648.0 + 0.5);
+        return static_cast<int32_t>(q > 2147483647.0 ? 2147483647.0 : (q < -2147483648.0 ? -2147483648.0 : q));
+    }
+
+    static gain_t Gain(double g) { return Q15Dsp::Gain(g); }
+
+    static coef_t Lerp(coef_t a, coef_t b, uint32_t frac_q16)
+    {
+        return static_cast<int32_t>(a + ((static_cast<int64_t>(b) - a) * frac_q16 >> 16));
+    }
+
+    static acc_t Mac(acc_t acc, sample_t s, coef_t c) { return acc + static_cast<int64_t>(s) * c; }
+
+    static int16_t ToS16(acc_t acc) { return Q15Dsp::_Saturate((acc + (1LL << 30)) >> 31); }
+
+    static int16_t ApplyGain(int16_t s, gain_t g) { return Q15Dsp::ApplyGain(s, g); }
+};
+
+#if defined(RESPEAKER_DSP_Q15)
+typedef Q15Dsp DefaultDsp;
+#elif defined(RESPEAKER_DSP_Q31)
+typedef Q31Dsp DefaultDsp;
+#else
+typedef FloatDsp DefaultDsp;
+#endif
+
+/**
+ * Multiply `num_samples` samples, `stride` apart, by a gain with saturation, in place.
+ *
+ * @param gain - From `Dsp::Gain(linear_gain)`, convert it once, not per block.
+ */
+template <typename Dsp>
+inline void ApplyGain(int16_t* samples, size_t num_samples, size_t stride, typename Dsp::gain_t gain)
+{
+    for (size_t i = 0; i < num_samples; i++) samples[i * stride] = Dsp::ApplyGain(samples[i * stride], gain);
+}
+
+}  // namespace respeaker
+
+#endif // !__SAMPLE_DSP_H__
@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __SESSION_LOG_H__
+#define __SESSION_LOG_H__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/fixed_ring.h"
+
+namespace respeaker
+{
+
+/** The record types of a session log. */
+enum SessionRecordType {
+    SESSION_FORMAT = 1,     ///< The stream format, `payload` is a SessionFormat. Written at every start of the
+                            ///< chain, the block indexes start again from 0 after it.
+    SESSION_BLOCK = 2,      ///< A collector block, `payload` is the block (empty if the audio isn't recorded),
+                            ///< `value` the start of the chain it belongs to (see SessionLogWriter::GetChainStart).
+    SESSION_TAP = 3,        ///< A block passed the tap `arg`, `sequence` is the index of the block, `value` the start
+                            ///< of the chain, a block is identified by both.
+    SESSION_API_CALL = 4,   ///< A supervisor API call, `arg` is a SessionApi, `value` its argument or result,
+                            ///< `sequence` the index of the next block.
+    SESSION_STATE = 5,      ///< The chain state changed, `value` is the new ChainState.
+};
+
+/** The supervisor API calls in a session log. */
+enum SessionApi {
+    SESSION_API_START = 1,
+    SESSION_API_STOP = 2,
+    SESSION_API_PAUSE = 3,
+    SESSION_API_RESUME = 4,
+    SESSION_API_SET_CHAIN_STATE = 5,    ///< `value` is the ChainState.
+    SESSION_API_SET_DIRECTION = 6,      ///< `value` is the direction.
+    SESSION_API_DETECT_HOTWORD = 7,     ///< `value` is the result, only non-zero results are logged.
+    SESSION_API_LISTEN = 8,             ///< `value` is the length asked in milliseconds, `0` for the default.
+    SESSION_API_LISTEN_TO_SILENCE = 9,  ///< `value` is the length returned in milliseconds.
+};
+
+/** The payload of SESSION_FORMAT, the output parameter of the collector. */
+struct SessionFormat
+{
+    int32_t rate;
+    uint32_t num_channel;
+    uint32_t block_len_ms;
+    uint32_t interleaved;
+    uint32_t mic_type;
+};
+
+/** One record of a session log. */
+struct SessionRecord
+{
+    uint16_t type;          ///< One of respeaker::SessionRecordType.
+    uint16_t arg;
+    int32_t value;
+    uint64_t sequence;
+    int64_t time_ns;        ///< Since the start of the session, in nanoseconds of CLOCK_MONOTONIC.
+    std::string payload;
+};
+
+/**
+ * A compact append-only binary log of a live session: the collector blocks with their capture times, the supervisor
+ * API calls and the chain state changes, and the times at which the blocks pass some taps of the chain. It's written
+ * by respeaker::SessionRecorderNode and respeaker::RecordingReSpeaker, and replayed by
+ * respeaker::ReplayCollectorNode.
+ *
+ * The file is a 16 bytes header ("RSPKSES1", version, reserved) followed by records of a 32 bytes little-endian
+ * header (type, arg, value, payload size, sequence, time) and the payload. A session which was cut (e.g. a crash) is
+ * read up to its last complete record.
+ *
+ * The node threads never wait for the disk, like respeaker::AsyncWavWriter: `Append` copies the record into a chunk
+ * allocated in `Open` (the mutex is held for that copy only), and a background thread writes the full chunks. When
+ * all the chunks are waiting for the disk, the records are dropped and counted.
+ */
+class SessionLogWriter
+{
+public:
+    SessionLogWriter()
+        : _chunk_bytes(1 << 20), _num_chunks(4), _file(nullptr), _current(-1), _fill(0), _stop(false),
+          _num_blocks(0), _num_starts(0), _start(std::chrono::steady_clock::now()), _dropped_records(0) {}
+
+    virtual ~SessionLogWriter() { Close(); }
+
+    /**
+     * Set the chunk size and the number of chunks, must be called before `Open`. Default to 1MB and 4, a record
+     * larger than a chunk (e.g. a huge block) is dropped.
+     */
+    void SetChunking(size_t chunk_bytes, size_t num_chunks)
+    {
+        _chunk_bytes = chunk_bytes < kRecordHeaderSize ? kRecordHeaderSize : chunk_bytes;
+        _num_chunks = num_chunks < 2 ? 2 : num_chunks;
+    }
+
+    /** Create the file, allocate the chunks, start the writer thread and the session clock. */
+    bool Open(const std::string& path)
+    {
+        Close();
+        _file = fopen(path.c_str(), "wb");
+        if (!_file) return false;
+        uint8_t header[kFileHeaderSize] = {'R', 'S', 'P', 'K', 'S', 'E', 'S', '1'};
+        uint32_t version = kVersion;
+        memcpy(header + 8, &version, 4);
+        fwrite(header, 1, sizeof(header), _file);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _chunks.assign(_num_chunks, std::vector<uint8_t>(_chunk_bytes));
+        _free.Clear();
+        _full.Clear();
+        _free.SetCapacity(_num_chunks);
+        _full.SetCapacity(_num_chunks);
+        for (size_t i = 1; i < _num_chunks; i++) _free.PushBack() = static_cast<int>(i);
+        _current = 0;
+        _fill = 0;
+        _stop = false;
+        _num_blocks = 0;
+        _num_starts = 0;
+        _dropped_records = 0;
+        _start = std::chrono::steady_clock::now();
+        _thread = std::thread(&SessionLogWriter::_Run, this);
+        return true;
+    }
+
+    /** The session clock, in nanoseconds since `Open`. */
+    int64_t NowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count();
+    }
+
+    /** Convert a CLOCK_MONOTONIC time (e.g. a capture time of respeaker::CaptureClockNode) to the session clock. */
+    int64_t FromMonotonicNs(int64_t monotonic_ns)
+    {
+        return monotonic_ns - std::chrono::duration_cast<std::chrono::nanoseconds>(_start.time_since_epoch()).count();
+    }
+
+    /** Append a record, thread-safe. It's only copied, the disk write happens in the writer thread. */
+    void Append(SessionRecordType type, uint16_t arg, int32_t value, uint64_t sequence, int64_t time_ns,
+                const void* payload = nullptr, size_t payload_size = 0)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _AppendLocked(type, arg, value, sequence, time_ns, payload, payload_size);
+        if (type == SESSION_BLOCK) _num_blocks = sequence + 1;
+        if (type == SESSION_FORMAT) {
+            _num_blocks = 0;
+            _num_starts++;
+        }
+    }
+
+    /**
+     * The index of the current start of the chain in this log, from 0: the number of SESSION_FORMAT records minus
+     * one. The block indexes restart with the chain, so the records of a block carry it in their `value`.
+     */
+    int32_t GetChainStart()
+    {
+        uint32_t num_starts = _num_starts;
+        return num_starts ? static_cast<int32_t>(num_starts - 1) : 0;
+    }
+
+    /**
+     * Log a supervisor API call, now. It's tagged with the index of the next block, so the replay applies it between
+     * the same two blocks as in the live session, whatever the pace.
+     */
+    void AppendApiCall(SessionApi api, int32_t value = 0)
+    {
+        int64_t now = NowNs();
+        std::lock_guard<std::mutex> lock(_mutex);
+        _AppendLocked(SESSION_API_CALL, static_cast<uint16_t>(api), value, _num_blocks, now, nullptr, 0);
+    }
+
+    /** Hand the records appended so far to the writer thread, it doesn't wait for the disk. */
+    void Flush()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_current >= 0 && _fill > 0) _SubmitLocked();
+    }
+
+    /** Write what's left, stop the writer thread and close the file. */
+    void Close()
+    {
+        if (!_thread.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_current >= 0 && _fill > 0) _SubmitLocked();
+            _stop = true;
+        }
+        _cv.notify_one();
+        _thread.join();
+        fclose(_file);
+        _file = nullptr;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _chunks.clear();
+        _current = -1;
+    }
+
+    /** Get how many records were dropped because all the chunks were waiting for the disk. */
+    uint64_t GetDroppedRecords() { return _dropped_records; }
+
+    static const size_t kFileHeaderSize = 16;
+    static const size_t kRecordHeaderSize = 32;
+    static const uint32_t kVersion = 1;
+
+private:
+    struct FullChunk
+    {
+        int index;
+        size_t bytes;
+    };
+
+    /** A record never spans two chunks, so a log cut between two chunks still ends on a complete record. */
+    void _AppendLocked(SessionRecordType type, uint16_t arg, int32_t value, uint64_t sequence, int64_t time_ns,
+                       const void* payload, size_t payload_size)
+    {
+        if (_chunks.empty()) return;
+        size_t record_bytes = kRecordHeaderSize + payload_size;
+        if (_current >= 0 && _fill + record_bytes > _chunk_bytes) _SubmitLocked();
+        if (_current < 0 && !_free.Empty()) {
+            _current = _free.Front();
+            _free.PopFront();
+        }
+        if (_current < 0 || record_bytes > _chunk_bytes) {
+            _dropped_records++;
+            return;
+        }
+
+        uint8_t* h = _chunks[_current].data() + _fill;
+        uint16_t t = static_cast<uint16_t>(type);
+        uint32_t size = static_cast<uint32_t>(payload_size);
+        memcpy(h, &t, 2);
+        memcpy(h + 2, &arg, 2);
+        memcpy(h + 4, &value, 4);
+        memcpy(h + 8, &size, 4);
+        memset(h + 12, 0, 4);
+        memcpy(h + 16, &sequence, 8);
+        memcpy(h + 24, &time_ns, 8);
+        if (payload_size) memcpy(h + kRecordHeaderSize, payload, payload_size);
+        _fill += record_bytes;
+    }
+
+    /** Hand the current chunk to the writer and take a free one, if any. */
+    void _SubmitLocked()
+    {
+        _full.PushBack() = FullChunk{_current, _fill};
+        _current = -1;
+        _fill = 0;
+        if (!_free.Empty()) {
+            _current = _free.Front();
+            _free.PopFront();
+        }
+        _cv.notify_one();
+    }
+
+    void _Run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _cv.wait(lock, [this] { return _stop || !_full.Empty(); });
+            if (_full.Empty()) break;
+            FullChunk chunk = _full.Front();
+            _full.PopFront();
+            lock.unlock();
+            fwrite(_chunks[chunk.index].data(), 1, chunk.bytes, _file);
+            fflush(_file);
+            lock.lock();
+            _free.PushBack() = chunk.index;
+        }
+    }
+
+    size_t _chunk_bytes;
+    size_t _num_chunks;
+    FILE* _file;                    ///< Written by the writer thread while it runs.
+
+    std::mutex _mutex;              ///< Held to copy a record or to push or pop a chunk, never for a disk write.
+    std::condition_variable _cv;
+    std::vector<std::vector<uint8_t>> _chunks;
+    FixedRing<int> _free;
+    FixedRing<FullChunk> _full;
+    int _current;                   ///< The chunk being filled, `-1` if none is free.
+    size_t _fill;
+    bool _stop;
+    std::thread _thread;
+
+    uint64_t _num_blocks;
+    std::atomic<uint32_t> _num_starts;
+    std::chrono::steady_clock::time_point _start;
+    std::atomic<uint64_t> _dropped_records;
+};
+
+/** Read a session log record by record. */
+class SessionLogReader
+{
+public:
+    SessionLogReader() : _file(nullptr) {}
+
+    virtual ~SessionLogReader() { Close(); }
+
+    bool Open(const std::string& path)
+    {
+        Close();
+        _file = fopen(path.c_str(), "rb");
+        if (!_file) return false;
+        uint8_t header[SessionLogWriter::kFileHeaderSize];
+        uint32_t version = 0;
+        if (fread(header, 1, sizeof(header), _file) != sizeof(header) || memcmp(header, "RSPKSES1", 8) != 0) {
+            Close();
+            return false;
+        }
+        memcpy(&version, header + 8, 4);
+        if (version != SessionLogWriter::kVersion) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @param record [out] - Its payload buffer is reused.
+     *
+     * @return bool - `false` at the end of the log.
+     */
+    bool Next(SessionRecord& record)
+    {
+        if (!_file) return false;
+        uint8_t h[SessionLogWriter::kRecordHeaderSize];
+        if (fread(h, 1, sizeof(h), _file) != sizeof(h)) return false;
+        uint32_t size;
+        memcpy(&record.type, h, 2);
+        memcpy(&record.arg, h + 2, 2);
+        memcpy(&record.value, h + 4, 4);
+        memcpy(&size, h + 8, 4);
+        memcpy(&record.sequence, h + 16, 8);
+        memcpy(&record.time_ns, h + 24, 8);
+        record.payload.resize(size);
+        return size == 0 || fread(&record.payload[0], 1, size, _file) == size;
+    }
+
+    /** Go back to the first record. */
+    void Rewind()
+    {
+        if (_file) fseek(_file, SessionLogWriter::kFileHeaderSize, SEEK_SET);
+    }
+
+    void Close()
+    {
+        if (_file) {
+            fclose(_file);
+            _file = nullptr;
+        }
+    }
+
+private:
+    FILE* _file;
+};
+
+}  //namespace
+
+#endif // !__SESSION_LOG_H__
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __SESSION_RECORDER_NODE_H__
+#define __SESSION_RECORDER_NODE_H__
+
+#include <cstdint>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/capture_clock_node.h"
+#include "chain_nodes/session_log.h"
+
+namespace respeaker
+{
+
+/**
+ * The SessionRecorderNode records a live session into a respeaker::SessionLogWriter, for respeaker::ReplayCollectorNode
+ * to reproduce it later, e.g. a CPU spike seen in the field, with the same audio, the same state changes and the same
+ * block timing.
+ *
+ * The block is passed through unchanged. The node with tap id `0` goes right after the collector node: it records the
+ * stream format, every block with its capture time and the chain state changes. The nodes with other tap ids go after
+ * the nodes you want to time, they only record when each block passed them. Wrap the supervisor with
+ * respeaker::RecordingReSpeaker to record the API calls too.
+ */
+class SessionRecorderNode : public BaseNode
+{
+public:
+    /**
+     * Create a SessionRecorderNode instance.
+     *
+     * @param writer - The session log, it's owned by the caller and must outlive the node. Shared by all the taps.
+     * @param tap_id - `0` for the recorder behind the collector, `1`, `2`... in the chain order for the other taps.
+     * @param record_audio - Record the audio of the blocks, default to true. Without it the log is ~100x smaller but
+     *                       it's replayed as silence, which is enough to time the state changes, not the DSP.
+     *
+     * @return SessionRecorderNode*
+     */
+    static SessionRecorderNode* Create(SessionLogWriter* writer, int tap_id=0, bool record_audio=true)
+    {
+        return new SessionRecorderNode(writer, tap_id, record_audio);
+    }
+
+    virtual ~SessionRecorderNode() = default;
+
+    virtual bool OnStartThread()
+    {
+        if (!_writer || _tap_id < 0 || _tap_id > 0xffff) return false;
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = SESSION_RECORDER_NODE;
+        _is_interleaved_after_process = _input_parameter.interleaved;
+        _sequence = 0;
+        _last_state = -1;
+
+        if (_tap_id == 0) {
+            SessionFormat format;
+            format.rate = _input_parameter.rate;
+            format.num_channel = static_cast<uint32_t>(_input_parameter.num_channel);
+            format.block_len_ms = static_cast<uint32_t>(_input_parameter.block_len_ms);
+            format.interleaved = _input_parameter.interleaved ? 1 : 0;
+            format.mic_type = static_cast<uint32_t>(_input_parameter.mic_type);
+            _writer->Append(SESSION_FORMAT, 0, 0, 0, _writer->NowNs(), &format, sizeof(format));
+        }
+        return true;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        // the tap 0 logged the start of this block before any other tap saw it
+        int32_t chain_start = _writer->GetChainStart();
+        if (_tap_id != 0) {
+            _writer->Append(SESSION_TAP, static_cast<uint16_t>(_tap_id), chain_start, _sequence++, _writer->NowNs());
+            return block;
+        }
+
+        int64_t time_ns = _writer->NowNs();
+        if (_capture_clock) {
+            BlockTimestamp timestamp = _capture_clock->GetBlockTimestamp(_sequence);
+            if (timestamp.capture_time_ns > 0) time_ns = _writer->FromMonotonicNs(timestamp.capture_time_ns);
+        }
+        _RecordState(time_ns);
+        _writer->Append(SESSION_BLOCK, 0, chain_start, _sequence++, time_ns, _record_audio ? block.data() : nullptr,
+                        _record_audio ? block.size() : 0);
+        return block;
+    }
+
+    virtual bool OnJoinThread()
+    {
+        _writer->Flush();
+        return true;
+    }
+
+    /**
+     * Take the block times from the device clock of the collector instead of the arrival at the node, so the replay
+     * reproduces the capture jitter. Only for the tap `0`, must be called before `RecursivelyStartThread`. The blocks
+     * are matched with the ones of the collector by counting them, so the tap `0` must follow the collector directly.
+     */
+    void SetCaptureClock(CaptureClockNode* capture_clock) { _capture_clock = capture_clock; }
+
+protected:
+    SessionRecorderNode(SessionLogWriter* writer, int tap_id, bool record_audio)
+        : _writer(writer),
+          _tap_id(tap_id),
+          _record_audio(record_audio),
+          _capture_clock(nullptr),
+          _sequence(0),
+          _last_state(-1)
+    {}
+
+    /** The state is changed by the supervisor and by some nodes (e.g. the KWS nodes), it's sampled once per block. */
+    void _RecordState(int64_t time_ns)
+    {
+        if (!_chain_shared_data) return;
+        int state;
+        {
+            std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_state);
+            state = static_cast<int>(_chain_shared_data->state);
+        }
+        if (state == _last_state) return;
+        _last_state = state;
+        _writer->Append(SESSION_STATE, 0, state, _sequence, time_ns);
+    }
+
+    SessionLogWriter* _writer;
+    int _tap_id;
+    bool _record_audio;
+    CaptureClockNode* _capture_clock;
+    uint64_t _sequence;
+    int _last_state;
+};
+
+}  //namespace
+
+#endif // !__SESSION_RECORDER_NODE_H__
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __SESSION_TIMING_H__
+#define __SESSION_TIMING_H__
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "chain_nodes/session_log.h"
+
+namespace respeaker
+{
+
+/** The timing of one tap of a session, in microseconds. */
+struct SessionTapTiming
+{
+    int tap_id;
+    size_t count;           ///< The blocks which passed the tap.
+    double latency_mean_us; ///< From the block record (the collector) to the tap.
+    double latency_p50_us;
+    double latency_p99_us;
+    double latency_max_us;
+    double stage_mean_us;   ///< From the previous tap (by id) to this one, i.e. the nodes between the two taps.
+    double stage_p99_us;
+    double stage_max_us;
+};
+
+/**
+ * Compute the per tap timing of a session log, from the SESSION_BLOCK and SESSION_TAP records. With a
+ * respeaker::SessionRecorderNode after each node of interest (tap ids in the chain order), the stage times are the
+ * processing times of the nodes, queueing included.
+ *
+ * @param path - The session log.
+ * @param timings [out] - One entry per tap id, sorted by id.
+ *
+ * @return bool - `false` if the log can't be read.
+ */
+inline bool ComputeSessionTimings(const std::string& path, std::vector<SessionTapTiming>& timings)
+{
+    SessionLogReader reader;
+    if (!reader.Open(path)) return false;
+
+    // a block is identified by the start of the chain and its index, the indexes restart with the chain
+    typedef std::pair<int32_t, uint64_t> BlockKey;
+    std::map<BlockKey, int64_t> block_times;
+    std::map<int, std::map<BlockKey, int64_t>> tap_times;
+    SessionRecord record;
+    while (reader.Next(record)) {
+        if (record.type == SESSION_BLOCK) {
+            block_times[BlockKey(record.value, record.sequence)] = record.time_ns;
+        } else if (record.type == SESSION_TAP) {
+            tap_times[record.arg][BlockKey(record.value, record.sequence)] = record.time_ns;
+        }
+    }
+
+    auto percentile = [](std::vector<double>& v, double p) {
+        if (v.empty()) return 0.0;
+        size_t i = static_cast<size_t>(p * (v.size() - 1) + 0.5);
+        std::nth_element(v.begin(), v.begin() + i, v.end());
+        return v[i];
+    };
+    auto mean = [](const std::vector<double>& v) {
+        double sum = 0.0;
+        for (double x : v) sum += x;
+        return v.empty() ? 0.0 : sum / v.size();
+    };
+    auto max = [](const std::vector<double>& v) { return v.empty() ? 0.0 : *std::max_element(v.begin(), v.end()); };
+
+    timings.clear();
+    const std::map<BlockKey, int64_t>* previous = nullptr;
+    for (const auto& tap : tap_times) {
+        std::vector<double> latency, stage;
+        for (const auto& t : tap.second) {
+            auto b = block_times.find(t.first);
+            int64_t block_time = b == block_times.end() ? -1 : b->second;
+            if (block_time >= 0) latency.push_back((t.second - block_time) / 1000.0);
+            int64_t from = block_time;
+            if (previous) {
+                auto p = previous->find(t.first);
+                from = p == previous->end() ? -1 : p->second;
+            }
+            if (from >= 0) stage.push_back((t.second - from) / 1000.0);
+        }
+        previous = &tap.second;
+
+        SessionTapTiming timing;
+        timing.tap_id = tap.first;
+        timing.count = tap.second.size();
+        timing.latency_mean_us = mean(latency);
+        timing.latency_max_us = max(latency);
+        timing.latency_p50_us = percentile(latency, 0.5);
+        timing.latency_p99_us = percentile(latency, 0.99);
+        timing.stage_mean_us = mean(stage);
+        timing.stage_max_us = max(stage);
+        timing.stage_p99_us = percentile(stage, 0.99);
+        timings.push_back(timing);
+    }
+    return true;
+}
+
+/**
+ * Compare the tap timings of a recorded session and of its replay (recorded by the same taps behind
+ * respeaker::ReplayCollectorNode), e.g. to check a build for performance regressions.
+ *
+ * @return std::string - A table, one line per tap, with the recorded and the replayed stage time and latency, in
+ *         microseconds. Empty if a log can't be read.
+ */
+inline std::string CompareSessionTimings(const std::string& recorded_path, const std::string& replayed_path)
+{
+    std::vector<SessionTapTiming> recorded, replayed;
+    if (!ComputeSessionTimings(recorded_path, recorded) || !ComputeSessionTimings(replayed_path, replayed)) {
+        return std::string();
+    }
+
+    std::string report = "tap  blocks  stage_mean  stage_p99  stage_max | latency_p50  latency_p99  latency_max\n";
+    char line[256];
+    for (const SessionTapTiming& r : recorded) {
+        const SessionTapTiming* p = nullptr;
+        for (const SessionTapTiming& x : replayed) {
+            if (x.tap_id == r.tap_id) p = &x;
+        }
+        snprintf(line, sizeof(line), "%3d  %6zu  %10.1f  %9.1f  %9.1f | %11.1f  %11.1f  %11.1f  recorded\n",
+                 r.tap_id, r.count, r.stage_mean_us, r.stage_p99_us, r.stage_max_us,
+                 r.latency_p50_us, r.latency_p99_us, r.latency_max_us);
+        report += line;
+        if (!p) {
+            report += "     (not in the replay)\n";
+            continue;
+        }
+        snprintf(line, sizeof(line), "%3d  %6zu  %10.1f  %9.1f  %9.1f | %11.1f  %11.1f  %11.1f  replayed (%+.1f%%)\n",
+                 p->tap_id, p->count, p->stage_mean_us, p->stage_p99_us, p->stage_max_us,
+                 p->latency_p50_us, p->latency_p99_us, p->latency_max_us,
+                 r.stage_mean_us > 0.0 ? (p->stage_mean_us / r.stage_mean_us - 1.0) * 100.0 : 0.0);
+        report += line;
+    }
+    return report;
+}
+
+}  //namespace
+
+#endif // !__SESSION_TIMING_H__
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __SHM_OUTPUT_NODE_H__
+#define __SHM_OUTPUT_NODE_H__
+
+#include <atomic>
+#include <vector>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/capture_clock_node.h"
+#include "chain_nodes/chain_trace.h"
+#include "chain_nodes/direction_manager_node.h"
+#include "chain_nodes/shm_ring.h"
+
+namespace respeaker
+{
+
+/**
+ * The ShmOutputNode publishes the output audio stream into a lock-free ring in POSIX shared memory, together with
+ * the sequence number, timestamps, VAD, DoA and hotword metadata of each block. Any number of local processes (ASR,
+ * recorder, analytics...) can read it with respeaker::ShmRingReader from "chain_nodes/shm_ring.h", without a sound
+ * server round trip and without the chain ever waiting for them.
+ *
+ * Note that the sample rate, channel number and interleaving of the audio stream are the same as the uplink node, and
+ * the format is fixed to S16_LE. Link your application with `-lrt` on old glibc.
+ */
+class ShmOutputNode : public BaseNode
+{
+public:
+    /**
+     * Create a ShmOutputNode instance.
+     *
+     * @param shm_name - The POSIX shm name, starting with '/', e.g. "/respeaker". The readers open the same name.
+     * @param ring_time_ms - How much audio the ring keeps, a reader which falls further behind skips ahead, default to
+     *                       512ms.
+     *
+     * @return ShmOutputNode*
+     */
+    static ShmOutputNode* Create(std::string shm_name="/respeaker", int ring_time_ms=512)
+    {
+        return new ShmOutputNode(shm_name, ring_time_ms);
+    }
+
+    virtual ~ShmOutputNode()
+    {
+        _writer.Close();
+        _writer.Unlink();
+    }
+
+    virtual bool OnStartThread()
+    {
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = SHM_OUTPUT_NODE;
+        _is_interleaved_after_process = _input_parameter.interleaved;
+
+        _block_sequence = 0;
+        size_t block_ms = _input_parameter.block_len_ms ? _input_parameter.block_len_ms : 8;
+        size_t block_bytes = _input_parameter.rate * block_ms / 1000 * _input_parameter.num_channel * sizeof(int16_t);
+        if (block_bytes == 0) return false;
+        uint32_t num_slots = static_cast<uint32_t>((_ring_time_ms + block_ms - 1) / block_ms);
+        if (num_slots < 4) num_slots = 4;
+
+        return _writer.Create(_shm_name, num_slots, static_cast<uint32_t>(block_bytes), _input_parameter.rate,
+                              static_cast<uint32_t>(_input_parameter.num_channel), static_cast<uint32_t>(block_ms),
+                              _input_parameter.interleaved);
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("ShmOutputNode");
+        ShmBlockMeta meta;
+        memset(&meta, 0, sizeof(meta));
+        meta.publish_time_ns = ShmMonotonicNs();
+        meta.direction = _direction_node ? _direction_node->GetDirection() : -1;
+        meta.hotword_index = _pending_hotword.exchange(0);
+        if (_capture_clock) {
+            // back through the drops of the nodes in between, from the nearest one up to the collector
+            uint64_t sequence = _block_sequence;
+            for (size_t i = _skip_logs.size(); i > 0; i--) sequence = _skip_logs[i - 1]->InputIndex(sequence);
+            meta.capture_time_ns = _capture_clock->GetBlockTimestamp(sequence).capture_time_ns;
+        }
+        _block_sequence++;
+        if (_chain_shared_data) {
+            {
+                std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_vad);
+                meta.vad = _chain_shared_data->vad ? 1 : 0;
+            }
+            std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_state);
+            meta.chain_state = static_cast<uint8_t>(_chain_shared_data->state);
+        }
+        _writer.Publish(block.data(), block.size(), meta);
+        return block;
+    }
+
+    virtual bool OnJoinThread()
+    {
+        _writer.Close();
+        return true;
+    }
+
+    /** Take the DoA of each block from this node, e.g. the KWS node. Must be called before `RecursivelyStartThread`. */
+    void SetDirectionManagerNode(DirectionManagerNode* direction_node) { _direction_node = direction_node; }
+
+    /**
+     * Take the capture timestamp of each block from this collector. Must be called before `RecursivelyStartThread`.
+     * The blocks are matched with the ones of the collector by counting them, so the nodes in between must pass every
+     * block down, or log the ones they drop (see AddBlockSkipLog). The queue flush of an overloaded node
+     * (`EnableQueueFlush`) drops blocks without logging them, keep it off between the collector and this node.
+     */
+    void SetCaptureClockNode(CaptureClockNode* capture_clock) { _capture_clock = capture_clock; }
+
+    /**
+     * Take into account the blocks dropped by a node between the collector and this one, e.g.
+     * `shm_output->AddBlockSkipLog(wake_gate->GetBlockSkipLog())`. Add the logs in the order of the nodes, from the
+     * collector down. Must be called before `RecursivelyStartThread`.
+     */
+    void AddBlockSkipLog(BlockSkipLog* skip_log) { _skip_logs.push_back(skip_log); }
+
+    /**
+     * Tag the next published block with a hotword. `HotwordDetected()` consumes the event, so the application which
+     * gets it from `ReSpeaker::DetectHotword` forwards it here.
+     *
+     * @param hotword_index - The index returned by `DetectHotword`, 1 for the first hotword.
+     */
+    void MarkHotword(int hotword_index) { _pending_hotword = hotword_index; }
+
+protected:
+    ShmOutputNode(std::string shm_name, int ring_time_ms)
+        : _shm_name(shm_name),
+          _ring_time_ms(ring_time_ms > 0 ? ring_time_ms : 512),
+          _direction_node(nullptr),
+          _capture_clock(nullptr),
+          _block_sequence(0),
+          _pending_hotword(0) {}
+
+    std::string _shm_name;
+    size_t _ring_time_ms;
+    ShmRingWriter _writer;
+    DirectionManagerNode* _direction_node;
+    CaptureClockNode* _capture_clock;
+    std::vector<BlockSkipLog*> _skip_logs;
+    uint64_t _block_sequence;
+    std::atomic<int> _pending_hotword;
+};
+
+}  //namespace
+
+#endif // !__SHM_OUTPUT_NODE_H__
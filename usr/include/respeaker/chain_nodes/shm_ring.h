@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __SHM_RING_H__
+#define __SHM_RING_H__
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+
+#if ATOMIC_LLONG_LOCK_FREE != 2 || ATOMIC_INT_LOCK_FREE != 2
+#error "the shared memory ring needs address-free 32 and 64 bits atomics"
+#endif
+
+namespace respeaker
+{
+
+/**
+ * The layout of the audio ring in POSIX shared memory, written by ShmOutputNode and read by any number of local
+ * processes with ShmRingReader. This header only depends on libc, so the consumers can include it alone.
+ *
+ * There's one writer and no reader state in the segment, so a slow or crashed reader never blocks the chain or the
+ * other readers: each slot carries a seqlock version, and a reader which falls more than `num_slots` blocks behind
+ * sees the version change and skips ahead. The readers sleep on a futex which is bumped after every block.
+ */
+static const uint32_t kShmRingMagic = 0x52535052;  // "RSPR"
+static const uint32_t kShmRingVersion = 1;
+
+/** The metadata of a block. */
+struct ShmBlockMeta
+{
+    uint64_t sequence;         ///< The index of the block since the writer started.
+    int64_t publish_time_ns;   ///< CLOCK_MONOTONIC time when the block was published.
+    int64_t capture_time_ns;   ///< CLOCK_MONOTONIC time when the block was captured, 0 if unknown.
+    int32_t direction;         ///< The DoA direction in degrees, -1 if unknown.
+    int32_t hotword_index;     ///< The index of the hotword which fired at this block, 0 if none.
+    uint8_t vad;               ///< If the block contains voice, from ChainSharedData::vad.
+    uint8_t chain_state;       ///< The respeaker::ChainState when the block was published.
+    uint8_t reserved[2];
+    uint32_t payload_bytes;    ///< The number of audio bytes in this block.
+};
+
+struct alignas(64) ShmRingHeader
+{
+    std::atomic<uint32_t> magic;       ///< Written last by the writer, after the header is complete.
+    uint32_t version;
+    uint64_t session_id;               ///< Changes every time the writer (re)creates the segment.
+    uint32_t num_slots;
+    uint32_t slot_stride;              ///< Bytes from one slot to the next.
+    uint32_t max_payload_bytes;
+    uint32_t rate;
+    uint32_t num_channels;
+    uint32_t block_len_ms;
+    uint32_t interleaved;
+    std::atomic<uint32_t> closed;      ///< Set when the writer has stopped.
+    alignas(64) std::atomic<uint64_t> write_sequence;  ///< The number of blocks published.
+    std::atomic<uint32_t> futex_word;  ///< Bumped after every block, the readers wait on it.
+};
+
+struct alignas(64) ShmSlotHeader
+{
+    std::atomic<uint64_t> version;     ///< `2 * sequence + 1` while being written, `2 * sequence + 2` when complete.
+    ShmBlockMeta meta;
+};
+
+inline size_t ShmSlotStride(size_t max_payload_bytes)
+{
+    return (sizeof(ShmSlotHeader) + max_payload_bytes + 63) / 64 * 64;
+}
+
+inline size_t ShmRingBytes(size_t num_slots, size_t max_payload_bytes)
+{
+    return sizeof(ShmRingHeader) + num_slots * ShmSlotStride(max_payload_bytes);
+}
+
+inline int64_t ShmMonotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+/** The writer side, used by ShmOutputNode. */
+class ShmRingWriter
+{
+public:
+    ShmRingWriter() : _header(nullptr), _bytes(0) {}
+    ~ShmRingWriter() { Close(); }
+
+    /**
+     * Create the segment `/dev/shm/<name>`. A segment left by a previous writer, even a crashed one, is marked closed
+     * and unlinked first: its readers keep their mapping, drain it, get CLOSED and reopen the new one.
+     *
+     * @param name - The POSIX shm name, starting with '/', e.g. "/respeaker".
+     *
+     * @return bool
+     */
+    bool Create(const std::string& name, uint32_t num_slots, uint32_t max_payload_bytes,
+                uint32_t rate, uint32_t num_channels, uint32_t block_len_ms, bool interleaved)
+    {
+        Close();
+        if (num_slots == 0) return false;
+        _CloseStale(name);
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0) return false;
+        _bytes = ShmRingBytes(num_slots, max_payload_bytes);
+        if (ftruncate(fd, _bytes) < 0) {
+            ::close(fd);
+            return false;
+        }
+        void* p = mmap(nullptr, _bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        _name = name;
+
+        _header = new (p) ShmRingHeader();
+        _header->version = kShmRingVersion;
+        _header->session_id = static_cast<uint64_t>(ShmMonotonicNs()) ^ (static_cast<uint64_t>(getpid()) << 48);
+        _header->num_slots = num_slots;
+        _header->slot_stride = static_cast<uint32_t>(ShmSlotStride(max_payload_bytes));
+        _header->max_payload_bytes = max_payload_bytes;
+        _header->rate = rate;
+        _header->num_channels = num_channels;
+        _header->block_len_ms = block_len_ms;
+        _header->interleaved = interleaved ? 1 : 0;
+        _header->closed.store(0, std::memory_order_relaxed);
+        _header->write_sequence.store(0, std::memory_order_relaxed);
+        _header->futex_word.store(0, std::memory_order_relaxed);
+        for (uint32_t i = 0; i < num_slots; i++) new (_Slot(i)) ShmSlotHeader();
+        _header->magic.store(kShmRingMagic, std::memory_order_release);
+        return true;
+    }
+
+    /** Mark the ring closed, wake up the readers and unmap it. The segment is left for the readers to drain. */
+    void Close()
+    {
+        if (!_header) return;
+        _header->closed.store(1, std::memory_order_release);
+        _header->futex_word.fetch_add(1, std::memory_order_release);
+        _Wake(_header);
+        munmap(_header, _bytes);
+        _header = nullptr;
+    }
+
+    /** Remove the segment name, the mappings of the readers stay valid until they close. */
+    void Unlink()
+    {
+        if (!_name.empty()) shm_unlink(_name.c_str());
+    }
+
+    /**
+     * Publish a block, `meta.sequence` and `meta.payload_bytes` are filled in here.
+     *
+     * @return uint64_t - The sequence of the block.
+     */
+    uint64_t Publish(const void* data, size_t bytes, ShmBlockMeta meta)
+    {
+        if (!_header) return 0;
+        if (bytes > _header->max_payload_bytes) bytes = _header->max_payload_bytes;
+        uint64_t seq = _header->write_sequence.load(std::memory_order_relaxed);
+        ShmSlotHeader* slot = _Slot(seq % _header->num_slots);
+
+        slot->version.store(2 * seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        meta.sequence = seq;
+        meta.payload_bytes = static_cast<uint32_t>(bytes);
+        slot->meta = meta;
+        memcpy(reinterpret_cast<char*>(slot) + sizeof(ShmSlotHeader), data, bytes);
+        slot->version.store(2 * seq + 2, std::memory_order_release);
+
+        _header->write_sequence.store(seq + 1, std::memory_order_release);
+        _header->futex_word.fetch_add(1, std::memory_order_release);
+        // the readers map the ring read-only and keep no waiter count, so every block costs one FUTEX_WAKE
+        _Wake(_header);
+        return seq;
+    }
+
+private:
+    ShmSlotHeader* _Slot(uint64_t index)
+    {
+        return reinterpret_cast<ShmSlotHeader*>(reinterpret_cast<char*>(_header) + sizeof(ShmRingHeader) +
+                                                index * _header->slot_stride);
+    }
+
+    static void _Wake(ShmRingHeader* header)
+    {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&header->futex_word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    /**
+     * Close the ring left under `name`. Its readers would never see the `session_id` of the new segment, which is
+     * another mapping, so they'd time out forever without this.
+     */
+    static void _CloseStale(const std::string& name)
+    {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0) return;
+        struct stat st;
+        void* p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(ShmRingHeader)) {
+            p = mmap(nullptr, sizeof(ShmRingHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (p == MAP_FAILED) return;
+        ShmRingHeader* header = static_cast<ShmRingHeader*>(p);
+        if (header->magic.load(std::memory_order_acquire) == kShmRingMagic) {
+            header->closed.store(1, std::memory_order_release);
+            header->futex_word.fetch_add(1, std::memory_order_release);
+            _Wake(header);
+        }
+        munmap(p, sizeof(ShmRingHeader));
+    }
+
+    std::string _name;
+    ShmRingHeader* _header;
+    size_t _bytes;
+};
+
+/**
+ * The reader library. Each reader keeps its own cursor, so any number of processes can read the same ring.
+ *
+ * Zero-copy reading:
+ * ```
+ * ShmRingReader reader;
+ * reader.Open("/respeaker");
+ * ShmBlockView view;
+ * while (reader.Next(&view, 100) != ShmRingReader::CLOSED) {
+ *     if (view.data == nullptr) continue;   // timeout or overrun
+ *     consume(view.data, view.meta.payload_bytes);
+ *     if (!reader.StillValid(view)) ...;    // the writer lapped us while we were reading, drop what we consumed
+ * }
+ * ```
+ */
+struct ShmBlockView
+{
+    ShmBlockMeta meta;
+    const char* data;           ///< Points into the shared memory, valid until the writer laps the reader.
+    const ShmSlotHeader* slot;
+    uint64_t version;
+};
+
+class ShmRingReader
+{
+public:
+    enum Status {
+        OK = 0,       ///< A block was read.
+        TIMEOUT,      ///< No new block within the timeout.
+        OVERRUN,      ///< The reader was lapped, it skipped to the oldest block still in the ring, see GetLostBlocks.
+        CLOSED,       ///< The writer has stopped or restarted, reopen the ring (a restarted writer closes the old one).
+        NOT_READY     ///< The ring isn't open.
+    };
+
+    ShmRingReader() : _header(nullptr), _bytes(0), _cursor(0), _session_id(0), _lost_blocks(0) {}
+    ~ShmRingReader() { Close(); }
+
+    /**
+     * Map the ring, the reader starts from the newest block.
+     *
+     * @return bool - false if the segment doesn't exist or the writer hasn't finished creating it yet.
+     */
+    bool Open(const std::string& name)
+    {
+        Close();
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(ShmRingHeader)) {
+            ::close(fd);
+            return false;
+        }
+        _bytes = st.st_size;
+        void* p = mmap(nullptr, _bytes, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        _header = static_cast<const ShmRingHeader*>(p);
+        if (_header->magic.load(std::memory_order_acquire) != kShmRingMagic ||
+            _header->version != kShmRingVersion ||
+            ShmRingBytes(_header->num_slots, _header->max_payload_bytes) > _bytes) {
+            Close();
+            return false;
+        }
+        _session_id = _header->session_id;
+        _cursor = _header->write_sequence.load(std::memory_order_acquire);
+        _lost_blocks = 0;
+        return true;
+    }
+
+    void Close()
+    {
+        if (!_header) return;
+        munmap(const_cast<ShmRingHeader*>(_header), _bytes);
+        _header = nullptr;
+    }
+
+    bool IsOpen() const { return _header != nullptr; }
+
+    /** The stream format, only valid after Open. */
+    uint32_t GetRate() const { return _header ? _header->rate : 0; }
+    uint32_t GetNumChannels() const { return _header ? _header->num_channels : 0; }
+    uint32_t GetBlockLenMs() const { return _header ? _header->block_len_ms : 0; }
+    bool IsInterleaved() const { return _header && _header->interleaved; }
+
+    /** The number of blocks skipped because of overruns since Open. */
+    uint64_t GetLostBlocks() const { return _lost_blocks; }
+
+    /**
+     * Get the next block without copying it.
+     *
+     * @param view [out] - Points into the shared memory. `view->data` is nullptr unless OK is returned.
+     * @param timeout_ms - How long to wait for a new block, 0 to poll, -1 to wait forever.
+     *
+     * @return Status
+     */
+    Status Next(ShmBlockView* view, int timeout_ms)
+    {
+        view->data = nullptr;
+        if (!_header) return NOT_READY;
+        if (_header->session_id != _session_id) return CLOSED;
+        // a writer which crashed never closes the ring, the reader sees TIMEOUT until the next writer closes it
+
+        uint64_t written = _header->write_sequence.load(std::memory_order_acquire);
+        if (_cursor >= written) {
+            if (_header->closed.load(std::memory_order_acquire)) return CLOSED;
+            if (timeout_ms == 0 || !_Wait(written, timeout_ms)) return TIMEOUT;
+            written = _header->write_sequence.load(std::memory_order_acquire);
+            if (_cursor >= written) return _header->closed.load(std::memory_order_acquire) ? CLOSED : TIMEOUT;
+        }
+        if (written - _cursor > _header->num_slots) {
+            _Skip(written - _header->num_slots + 1);
+            return OVERRUN;
+        }
+
+        const ShmSlotHeader* slot = _Slot(_cursor % _header->num_slots);
+        uint64_t version = slot->version.load(std::memory_order_acquire);
+        if (version != 2 * _cursor + 2) {
+            // lapped between the two loads
+            _Skip(_header->write_sequence.load(std::memory_order_acquire) - _header->num_slots + 1);
+            return OVERRUN;
+        }
+        view->meta = slot->meta;
+        view->slot = slot;
+        view->version = version;
+        view->data = reinterpret_cast<const char*>(slot) + sizeof(ShmSlotHeader);
+        if (!StillValid(*view)) {
+            view->data = nullptr;
+            _Skip(_header->write_sequence.load(std::memory_order_acquire) - _header->num_slots + 1);
+            return OVERRUN;
+        }
+        _cursor++;
+        return OK;
+    }
+
+    /** Check that the writer didn't overwrite the block while the reader was using it. */
+    bool StillValid(const ShmBlockView& view) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return view.slot && view.slot->version.load(std::memory_order_relaxed) == view.version;
+    }
+
+    /**
+     * Get the next block and copy it, for the readers which keep the audio around.
+     *
+     * @param buffer [out] - Replaced by the audio data of the block.
+     * @param meta [out] - The metadata of the block, optional.
+     */
+    Status Read(std::string& buffer, ShmBlockMeta* meta, int timeout_ms)
+    {
+        ShmBlockView view;
+        Status status = Next(&view, timeout_ms);
+        if (status != OK) return status;
+        buffer.assign(view.data, view.meta.payload_bytes);
+        if (!StillValid(view)) {
+            _Skip(_header->write_sequence.load(std::memory_order_acquire) - _header->num_slots + 1);
+            return OVERRUN;
+        }
+        if (meta) *meta = view.meta;
+        return OK;
+    }
+
+private:
+    const ShmSlotHeader* _Slot(uint64_t index) const
+    {
+        return reinterpret_cast<const ShmSlotHeader*>(reinterpret_cast<const char*>(_header) + sizeof(ShmRingHeader) +
+                                                      index * _header->slot_stride);
+    }
+
+    void _Skip(uint64_t to)
+    {
+        if (to > _cursor) {
+            _lost_blocks += to - _cursor;
+            _cursor = to;
+        }
+    }
+
+    bool _Wait(uint64_t written, int timeout_ms)
+    {
+        ShmRingHeader* header = const_cast<ShmRingHeader*>(_header);
+        uint32_t word = header->futex_word.load(std::memory_order_acquire);
+        if (header->write_sequence.load(std::memory_order_acquire) != written) return true;
+
+        struct timespec ts;
+        struct timespec* pts = nullptr;
+        if (timeout_ms > 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            pts = &ts;
+        }
+        int r = syscall(SYS_futex, reinterpret_cast<uint32_t*>(&header->futex_word), FUTEX_WAIT, word, pts,
+                        nullptr, 0);
+        return r == 0 || errno == EAGAIN || errno == EINTR;
+    }
+
+    const ShmRingHeader* _header;
+    size_t _bytes;
+    uint64_t _cursor;
+    uint64_t _session_id;
+    uint64_t _lost_blocks;
+};
+
+}  //namespace
+
+#endif // !__SHM_RING_H__
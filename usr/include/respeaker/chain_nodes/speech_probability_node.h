@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __SPEECH_PROBABILITY_NODE_H__
+#define __SPEECH_PROBABILITY_NODE_H__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace respeaker
+{
+
+/**
+ * The nodes who can give a speech probability for every 10ms frame should inherit from this class, so the other nodes
+ * (e.g. the output nodes, to decide which blocks to drop) and the application can consume the probabilities instead
+ * of the single `ChainSharedData::vad` bool.
+ */
+class SpeechProbabilityNode
+{
+public:
+    virtual ~SpeechProbabilityNode() = default;
+
+    /**
+     * Subclass should implement this method, get the speech probability of the latest 10ms frame, [0, 1].
+     */
+    virtual float GetSpeechProbability() = 0;
+
+    /**
+     * Subclass should implement this method, get the decision after the hangover, which is what goes to
+     * `ChainSharedData::vad`.
+     */
+    virtual bool IsSpeech() = 0;
+
+    /**
+     * Subclass should implement this method, read the probability stream, one value per 10ms frame.
+     * Every reader keeps its own cursor, frames which are too old to be kept any more are skipped.
+     *
+     * @param next_frame [in/out] - The index of the first frame to read, start from `0`, it's moved past the frames read.
+     * @param out [out] - The probabilities.
+     * @param max_frames - The size of `out`.
+     *
+     * @return size_t - The number of probabilities written.
+     */
+    virtual size_t ReadSpeechProbabilities(uint64_t& next_frame, float* out, size_t max_frames) = 0;
+};
+
+}  //namespace
+
+#endif // !__SPEECH_PROBABILITY_NODE_H__
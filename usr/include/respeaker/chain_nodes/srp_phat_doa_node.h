@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+
+#ifndef __SRP_PHAT_DOA_NODE_H__
+#define __SRP_PHAT_DOA_NODE_H__
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/chain_trace.h"
+#include "chain_nodes/direction_manager_node.h"
+#include "chain_nodes/fft_utils.h"
+#include "chain_nodes/mic_type_info.h"
+
+namespace respeaker
+{
+
+/**
+ * The SrpPhatDoaNode estimates the direction of arrival every block, from the raw microphone channels.
+ *
+ * The GCC-PHAT cross-spectra of all the microphone pairs are smoothed over time, turned into cross-correlations at
+ * fractional lags (only the lags the geometry allows), and summed over a 1 degree grid of azimuths (SRP-PHAT). The
+ * peak is refined by parabolic interpolation, so the resolution is not bounded by the beam count. The per-bin loops
+ * work on split real/imaginary float arrays, which the compiler vectorizes. The cost is fixed per block, about
+ * `pairs * lags * bins` multiply-adds, e.g. 15 * 37 * 56 for CIRCULAR_6MIC_7BEAM.
+ *
+ * Besides the instant direction, it provides a confidence value in [0, 1] and a smoothed track, which is what
+ * `GetDirection` returns. Linear arrays can only tell [0, 180] degree.
+ *
+ * The output is the same as the input, so this node can be put right after the collector node, in parallel with
+ * VepAecBeamformingNode.
+ */
+class SrpPhatDoaNode : public BaseNode, public DirectionManagerNode
+{
+public:
+    /**
+     * Create a SrpPhatDoaNode instance.
+     *
+     * @param mic_type - Specify the microphone type, the geometry comes from MicTypeInfo::mic_coordinates.
+     * @param first_mic_channel - The index of the channel of microphone 0, the microphones must be consecutive.
+     *
+     * @return SrpPhatDoaNode*
+     */
+    static SrpPhatDoaNode* Create(MicType mic_type, int first_mic_channel = 0)
+    {
+        MicTypeInfo info;
+        SetMicTypeInfo(mic_type, info);
+        return new SrpPhatDoaNode(info, first_mic_channel);
+    }
+
+    /**
+     * @param mic_type_info - A MicTypeInfo with customized `mic_coordinates`.
+     * @param first_mic_channel - The index of the channel of microphone 0, the microphones must be consecutive.
+     *
+     * @return SrpPhatDoaNode*
+     */
+    static SrpPhatDoaNode* Create(const MicTypeInfo& mic_type_info, int first_mic_channel)
+    {
+        return new SrpPhatDoaNode(mic_type_info, first_mic_channel);
+    }
+
+    virtual ~SrpPhatDoaNode() = default;
+
+    /**
+     * Set the angle for microphone 0, if it's not `0` for the board. Only works for circular microphone array.
+     *
+     * @param angle - degree
+     */
+    void SetAngleForMic0(int angle) { _angle_for_mic0 = angle; }
+
+    /**
+     * @param track_time_ms - The time constant of the smoothed track at full confidence, default to 200.
+     */
+    void SetTrackTime(int track_time_ms) { _track_time_ms = track_time_ms < 1 ? 1 : track_time_ms; }
+
+    /**
+     * The callback is called in the node thread after every block, with the instant direction and its confidence.
+     * Keep it short, e.g. just post the values to the LED or camera thread.
+     */
+    void SetDirectionCallback(std::function<void(float direction, float confidence)> callback)
+    {
+        _callback = callback;
+    }
+
+    virtual bool OnStartThread()
+    {
+        _num_mics = _mic_info.num_of_mics;
+        if (_num_mics < 2 || _num_mics > MAX_NUM_OF_MICS) return false;
+        if (_first_mic_channel + _num_mics > _input_parameter.num_channel) return false;
+
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = SRP_PHAT_DOA_NODE;
+
+        size_t block_ms = _input_parameter.block_len_ms ? _input_parameter.block_len_ms : 8;
+        _hop = _input_parameter.rate * block_ms / 1000;
+        _fft_size = 64;
+        while (_fft_size < 2 * _hop) _fft_size <<= 1;
+        _fft.Init(_fft_size);
+        MakeHannWindow(_window, _fft_size);
+
+        // 300Hz ~ 3.5KHz carries most of the speech energy and is below the spatial aliasing of the boards
+        _bin_lo = static_cast<size_t>(300.0 * _fft_size / _input_parameter.rate);
+        _bin_hi = static_cast<size_t>(3500.0 * _fft_size / _input_parameter.rate);
+        if (_bin_lo < 1) _bin_lo = 1;
+        if (_bin_hi >= _fft_size / 2) _bin_hi = _fft_size / 2 - 1;
+        _num_bins = _bin_hi - _bin_lo + 1;
+
+        _frames.assign(_num_mics, std::vector<float>(_fft_size, 0.0f));
+        _spec_re.assign(_num_mics, std::vector<float>(_fft_size / 2 + 1, 0.0f));
+        _spec_im.assign(_num_mics, std::vector<float>(_fft_size / 2 + 1, 0.0f));
+        _windowed.assign(_fft_size, 0.0f);
+        _block_samples.assign(_hop, 0);
+
+        _pairs.clear();
+        for (size_t p = 0; p < _num_mics; p++) {
+            for (size_t q = p + 1; q < _num_mics; q++) _pairs.push_back(std::make_pair(p, q));
+        }
+        _cross_re.assign(_pairs.size(), std::vector<float>(_num_bins, 0.0f));
+        _cross_im.assign(_pairs.size(), std::vector<float>(_num_bins, 0.0f));
+
+        _BuildLagTable();
+        _BuildGrid();
+
+        _noise_db = 0.0f;
+        _noise_init = false;
+        _track_x = 1.0f;
+        _track_y = 0.0f;
+        return true;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("SrpPhatDoaNode");
+        size_t num_frames = BlockNumFrames(block, _input_parameter.num_channel);
+        if (num_frames != _hop) return block;
+
+        double energy = 0.0;
+        for (size_t m = 0; m < _num_mics; m++) {
+            std::vector<float>& frame = _frames[m];
+            CopyChannel(block, _input_parameter.num_channel, _input_parameter.interleaved, _first_mic_channel + m,
+                        _block_samples.data());
+            std::copy(frame.begin() + _hop, frame.end(), frame.begin());
+            float* tail = &frame[_fft_size - _hop];
+            for (size_t i = 0; i < _hop; i++) {
+                tail[i] = _block_samples[i] * (1.0f / 32768.0f);
+                energy += tail[i] * tail[i];
+            }
+            for (size_t i = 0; i < _fft_size; i++) _windowed[i] = frame[i] * _window[i];
+            _fft.Forward(_windowed.data(), _spec_re[m].data(), _spec_im[m].data());
+        }
+
+        _UpdateCrossSpectra();
+        float confidence = 0.0f;
+        float direction = _SteeredResponse(confidence);
+
+        // scale the confidence down when the block is not over the noise floor
+        float db = 10.0f * std::log10(static_cast<float>(energy / (_num_mics * _hop)) + 1e-10f);
+        if (!_noise_init) {
+            _noise_db = db;
+            _noise_init = true;
+        } else if (db < _noise_db) {
+            _noise_db += 0.2f * (db - _noise_db);
+        } else {
+            _noise_db += 0.005f;
+        }
+        float snr_weight = (db - _noise_db - 3.0f) / 6.0f;
+        confidence *= snr_weight < 0.0f ? 0.0f : (snr_weight > 1.0f ? 1.0f : snr_weight);
+
+        _UpdateTrack(direction, confidence);
+        _direction = direction;
+        _confidence = confidence;
+        if (_callback) _callback(direction, confidence);
+        return block;
+    }
+
+    virtual bool OnJoinThread()
+    {
+        return true;
+    }
+
+    /** Get the smoothed direction, in degree [0, 360). */
+    virtual int GetDirection() { return static_cast<int>(std::lround(GetSmoothedDirection())) % 360; }
+
+    /** Reset the smoothed track to `dir`, the node thread applies it from the next block. */
+    virtual void SetDirection(int dir)
+    {
+        dir = (dir % 360 + 360) % 360;
+        _smoothed_direction = static_cast<float>(dir);
+        _pending_direction = dir;
+    }
+
+    /** Get the instant direction of the last block, in degree, with sub-degree resolution. */
+    float GetInstantDirection() { return _direction; }
+
+    /** Get the confidence of the last block, [0, 1]. 0 means noise only or diffuse sound. */
+    float GetConfidence() { return _confidence; }
+
+    /** Get the smoothed direction track, in degree [0, 360). */
+    float GetSmoothedDirection() { return _smoothed_direction; }
+
+private:
+    SrpPhatDoaNode(const MicTypeInfo& mic_type_info, int first_mic_channel)
+        : _mic_info(mic_type_info),
+          _first_mic_channel(first_mic_channel < 0 ? 0 : first_mic_channel),
+          _angle_for_mic0(0),
+          _track_time_ms(200),
+          _direction(0.0f),
+          _confidence(0.0f),
+          _smoothed_direction(0.0f),
+          _pending_direction(-1) {}
+
+    void _UpdateCrossSpectra()
+    {
+        const float alpha = 0.7f;
+        for (size_t i = 0; i < _pairs.size(); i++) {
+            const float* RESPEAKER_RESTRICT pr = &_spec_re[_pairs[i].first][_bin_lo];
+            const float* RESPEAKER_RESTRICT pi = &_spec_im[_pairs[i].first][_bin_lo];
+            const float* RESPEAKER_RESTRICT qr = &_spec_re[_pairs[i].second][_bin_lo];
+            const float* RESPEAKER_RESTRICT qi = &_spec_im[_pairs[i].second][_bin_lo];
+            float* RESPEAKER_RESTRICT cr = _cross_re[i].data();
+            float* RESPEAKER_RESTRICT ci = _cross_im[i].data();
+            for (size_t k = 0; k < _num_bins; k++) {
+                // X_p * conj(X_q), PHAT weighted
+                float re = pr[k] * qr[k] + pi[k] * qi[k];
+                float im = pi[k] * qr[k] - pr[k] * qi[k];
+                float inv = 1.0f / (std::sqrt(re * re + im * im) + 1e-12f);
+                cr[k] = alpha * cr[k] + (1.0f - alpha) * re * inv;
+                ci[k] = alpha * ci[k] + (1.0f - alpha) * im * inv;
+            }
+        }
+    }
+
+    float _SteeredResponse(float& confidence)
+    {
+        // cross-correlation of every pair at the fractional lags
+        for (size_t i = 0; i < _pairs.size(); i++) {
+            const float* RESPEAKER_RESTRICT cr = _cross_re[i].data();
+            const float* RESPEAKER_RESTRICT ci = _cross_im[i].data();
+            float* corr = &_corr[i * _num_lags];
+            for (size_t l = 0; l < _num_lags; l++) {
+                const float* RESPEAKER_RESTRICT c = &_lag_cos[l * _num_bins];
+                const float* RESPEAKER_RESTRICT s = &_lag_sin[l * _num_bins];
+                float sum = 0.0f;
+                for (size_t k = 0; k < _num_bins; k++) sum += cr[k] * c[k] - ci[k] * s[k];
+                corr[l] = sum;
+            }
+        }
+
+        // steered response power over the grid
+        size_t best = 0;
+        float sum_power = 0.0f;
+        for (size_t d = 0; d < _num_dirs; d++) {
+            float power = 0.0f;
+            const float* pos = &_grid_lag_pos[d * _pairs.size()];
+            for (size_t i = 0; i < _pairs.size(); i++) {
+                size_t idx = static_cast<size_t>(pos[i]);
+                float frac = pos[i] - idx;
+                const float* corr = &_corr[i * _num_lags + idx];
+                power += corr[0] + frac * (corr[1] - corr[0]);
+            }
+            _power[d] = power;
+            sum_power += power;
+            if (power > _power[best]) best = d;
+        }
+
+        // parabolic refinement around the peak
+        float offset = 0.0f;
+        bool circular = _mic_info.geometries == 0;
+        if (circular || (best > 0 && best + 1 < _num_dirs)) {
+            float l = _power[(best + _num_dirs - 1) % _num_dirs];
+            float c = _power[best];
+            float r = _power[(best + 1) % _num_dirs];
+            float denom = l - 2.0f * c + r;
+            if (denom < 0.0f) offset = 0.5f * (l - r) / denom;
+        }
+
+        float peak = _power[best];
+        float mean = sum_power / _num_dirs;
+        confidence = (peak - mean) / (_pairs.size() * _num_bins);
+        if (confidence < 0.0f) confidence = 0.0f;
+        if (confidence > 1.0f) confidence = 1.0f;
+
+        float direction = (best + offset) * _grid_step;
+        if (circular) {
+            direction += _angle_for_mic0;
+            direction = std::fmod(direction, 360.0f);
+            if (direction < 0.0f) direction += 360.0f;
+        }
+        return direction;
+    }
+
+    void _UpdateTrack(float direction, float confidence)
+    {
+        int pending = _pending_direction.exchange(-1);
+        if (pending >= 0) {
+            float pending_rad = static_cast<float>(pending * M_PI / 180.0);
+            _track_x = std::cos(pending_rad);
+            _track_y = std::sin(pending_rad);
+        }
+
+        size_t block_ms = _input_parameter.block_len_ms ? _input_parameter.block_len_ms : 8;
+        float a = confidence * (1.0f - std::exp(-static_cast<float>(block_ms) / _track_time_ms));
+        float rad = static_cast<float>(direction * M_PI / 180.0);
+        _track_x += a * (std::cos(rad) - _track_x);
+        _track_y += a * (std::sin(rad) - _track_y);
+        float deg = static_cast<float>(std::atan2(_track_y, _track_x) * 180.0 / M_PI);
+        _smoothed_direction = deg < 0.0f ? deg + 360.0f : deg;
+    }
+
+    void _BuildLagTable()
+    {
+        const float sound_speed = 343.0f;
+        const float lags_per_sample = 4.0f;
+        float max_dist = 0.0f;
+        for (size_t i = 0; i < _pairs.size(); i++) {
+            max_dist = std::max(max_dist, _Distance(_pairs[i].first, _pairs[i].second));
+        }
+        _max_lag = max_dist / sound_speed * _input_parameter.rate;
+        _lag_step = 1.0f / lags_per_sample;
+        _num_lags = 2 * static_cast<size_t>(std::ceil(_max_lag * lags_per_sample)) + 2;
+        _lag_cos.resize(_num_lags * _num_bins);
+        _lag_sin.resize(_num_lags * _num_bins);
+        for (size_t l = 0; l < _num_lags; l++) {
+            double lag = -std::ceil(_max_lag * lags_per_sample) * _lag_step + l * _lag_step;
+            for (size_t k = 0; k < _num_bins; k++) {
+                double phase = 2.0 * M_PI * (_bin_lo + k) * lag / _fft_size;
+                _lag_cos[l * _num_bins + k] = static_cast<float>(std::cos(phase));
+                _lag_sin[l * _num_bins + k] = static_cast<float>(std::sin(phase));
+            }
+        }
+        _corr.assign(_pairs.size() * _num_lags, 0.0f);
+    }
+
+    void _BuildGrid()
+    {
+        const float sound_speed = 343.0f;
+        bool circular = _mic_info.geometries == 0;
+        _grid_step = 1.0f;
+        _num_dirs = circular ? 360 : 181;
+        _power.assign(_num_dirs, 0.0f);
+        _grid_lag_pos.resize(_num_dirs * _pairs.size());
+
+        float lag_origin = std::ceil(_max_lag / _lag_step) * _lag_step;
+        for (size_t d = 0; d < _num_dirs; d++) {
+            double rad = d * _grid_step * M_PI / 180.0;
+            float ux = static_cast<float>(std::cos(rad)), uy = static_cast<float>(std::sin(rad));
+            for (size_t i = 0; i < _pairs.size(); i++) {
+                const float* rp = _mic_info.mic_coordinates[_pairs[i].first];
+                const float* rq = _mic_info.mic_coordinates[_pairs[i].second];
+                // the mic closer to the source hears it first: tau_pq = -(r_p - r_q) . u / c
+                float tau = -((rp[0] - rq[0]) * ux + (rp[1] - rq[1]) * uy) / sound_speed * _input_parameter.rate;
+                float pos = (tau + lag_origin) / _lag_step;
+                if (pos < 0.0f) pos = 0.0f;
+                if (pos > _num_lags - 2) pos = static_cast<float>(_num_lags - 2);
+                _grid_lag_pos[d * _pairs.size() + i] = pos;
+            }
+        }
+    }
+
+    float _Distance(size_t p, size_t q)
+    {
+        float dx = _mic_info.mic_coordinates[p][0] - _mic_info.mic_coordinates[q][0];
+        float dy = _mic_info.mic_coordinates[p][1] - _mic_info.mic_coordinates[q][1];
+        float dz = _mic_info.mic_coordinates[p][2] - _mic_info.mic_coordinates[q][2];
+        return std::sqrt(dx * dx + dy * dy + dz * dz);
+    }
+
+    MicTypeInfo _mic_info;
+    size_t _first_mic_channel;
+    size_t _num_mics;
+    int _angle_for_mic0;
+    int _track_time_ms;
+    std::function<void(float, float)> _callback;
+
+    size_t _hop;
+    size_t _fft_size;
+    RealFft _fft;
+    std::vector<float> _window;
+    std::vector<float> _windowed;
+    std::vector<int16_t> _block_samples;
+    std::vector<std::vector<float>> _frames;
+    std::vector<std::vector<float>> _spec_re, _spec_im;
+
+    size_t _bin_lo, _bin_hi, _num_bins;
+    std::vector<std::pair<size_t, size_t>> _pairs;
+    std::vector<std::vector<float>> _cross_re, _cross_im;
+
+    float _max_lag;
+    float _lag_step;
+    size_t _num_lags;
+    std::vector<float> _lag_cos, _lag_sin;
+    std::vector<float> _corr;
+
+    float _grid_step;
+    size_t _num_dirs;
+    std::vector<float> _grid_lag_pos;
+    std::vector<float> _power;
+
+    float _noise_db;
+    bool _noise_init;
+    float _track_x, _track_y;
+
+    std::atomic<float> _direction;
+    std::atomic<float> _confidence;
+    std::atomic<float> _smoothed_direction;
+    std::atomic<int> _pending_direction;    ///< Set by `SetDirection`, `-1` when there's none.
+};
+
+}  //namespace
+
+#endif // !__SRP_PHAT_DOA_NODE_H__
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+
+#ifndef __WAKE_GATE_NODE_H__
+#define __WAKE_GATE_NODE_H__
+
+#include <cmath>
+#include <vector>
+
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/capture_clock_node.h"
+#include "chain_nodes/chain_trace.h"
+
+namespace respeaker
+{
+
+/**
+ * The WakeGateNode is a cheap, always-on first stage placed in front of a KWS node (Snowboy*KwsNode or Snips*KwsNode).
+ * While the chain is in WAIT_TRIGGER_* state, it keeps the stream in a short look-back buffer and doesn't pass it down,
+ * so the KWS node sleeps on its input queue. When the energy/spectral detector (and optionally the chain VAD) fires,
+ * the look-back buffer is flushed down first, then the stream passes through until `hangover_ms` of quietness is seen.
+ * In LISTEN_* state the gate is always open.
+ *
+ * Please note that `ReSpeaker::DetectHotword` blocks while the gate is closed, since there's no block reaching the
+ * output node.
+ */
+class WakeGateNode : public BaseNode
+{
+public:
+    /**
+     * Create a WakeGateNode instance. The output is the same as the input.
+     *
+     * @param channel_index - The channel to run the detector on, e.g. `0` for the beam channel of VepAecBeamformingNode.
+     * @param lookback_ms - The length of audio kept before the trigger, which is flushed down when the gate opens.
+     * @param hangover_ms - The gate closes after this length of time without detection.
+     *
+     * @return WakeGateNode*
+     */
+    static WakeGateNode* Create(int channel_index = 0, int lookback_ms = 400, int hangover_ms = 1500)
+    {
+        return new WakeGateNode(channel_index, lookback_ms, hangover_ms, 9.0f, false);
+    }
+
+    /**
+     * @param channel_index - The channel to run the detector on.
+     * @param lookback_ms - The length of audio kept before the trigger.
+     * @param hangover_ms - The gate closes after this length of time without detection.
+     * @param snr_threshold_db - How many dB the block energy must be over the tracked noise floor to fire, default to 9.
+     * @param use_chain_vad - Also require `ChainSharedData::vad` to fire. Only set it true when the Vad node (e.g.
+     *                        HybridNode::CreateVadOnly) is upstream of this node, a downstream Vad node won't update
+     *                        while the gate is closed.
+     *
+     * @return WakeGateNode*
+     */
+    static WakeGateNode* Create(int channel_index, int lookback_ms, int hangover_ms,
+                                float snr_threshold_db, bool use_chain_vad)
+    {
+        return new WakeGateNode(channel_index, lookback_ms, hangover_ms, snr_threshold_db, use_chain_vad);
+    }
+
+    virtual ~WakeGateNode() = default;
+
+    virtual bool OnStartThread()
+    {
+        if (_channel_index >= _input_parameter.num_channel) return false;
+
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = WAKE_GATE_NODE;
+
+        size_t block_ms = _input_parameter.block_len_ms ? _input_parameter.block_len_ms : 8;
+        _lookback_blocks = (_lookback_ms + block_ms - 1) / block_ms;
+        _hangover_blocks = (_hangover_ms + block_ms - 1) / block_ms;
+        _lookback.assign(_lookback_blocks, std::string());
+        _lookback_head = 0;
+        _lookback_count = 0;
+        _stored_blocks = 0;
+        _skip_log.Clear();
+
+        _noise_floor_db = 0.0f;
+        _noise_floor_init = false;
+        _attack_count = 0;
+        _quiet_count = 0;
+        _open = false;
+        return true;
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("WakeGateNode");
+        bool fire = _Detect(block);
+
+        if (fire) {
+            _quiet_count = 0;
+            if (!_open) {
+                _open = true;
+                _flush_pending = true;
+                _wake_count++;
+            }
+        } else if (_open && ++_quiet_count >= _hangover_blocks) {
+            _open = false;
+        }
+        return block;
+    }
+
+    virtual void StoreBlock(std::string block, bool& exit)
+    {
+        RESPEAKER_ALLOC_GUARD_SCOPE("WakeGateNode");
+        if (_open || _IsListening()) {
+            if (_flush_pending) {
+                _FlushLookback(exit);
+                _flush_pending = false;
+            }
+            // what was kept before a LISTEN_* state is older than the stream now, never flush it later
+            _skip_log.Skip(_stored_blocks, _lookback_count);
+            _lookback_count = 0;
+            _passed_blocks++;
+            _stored_blocks++;
+            BaseNode::StoreBlock(std::move(block), exit);
+            return;
+        }
+
+        // keep the newest blocks, the block is swapped into the slot, neither copied nor allocated, and the buffer of
+        // the oldest one is dropped
+        if (_lookback_count == _lookback_blocks) _skip_log.Skip(_stored_blocks);
+        if (_lookback_blocks == 0) return;
+        _lookback[_lookback_head].swap(block);
+        _lookback_head = (_lookback_head + 1) % _lookback_blocks;
+        if (_lookback_count < _lookback_blocks) _lookback_count++;
+        _gated_blocks++;
+    }
+
+    virtual bool OnJoinThread()
+    {
+        _lookback.clear();
+        return true;
+    }
+
+    /**
+     * Get where the blocks were dropped while the gate was closed, for a node downstream which counts the blocks to
+     * match them with the collector, e.g. `ShmOutputNode::AddBlockSkipLog`.
+     */
+    BlockSkipLog* GetBlockSkipLog() { return &_skip_log; }
+
+    /** Get if the gate is open now. */
+    bool IsGateOpen() { return _open; }
+
+    /** Get how many times the gate has been opened by the detector. */
+    uint64_t GetWakeCount() { return _wake_count; }
+
+    /**
+     * Get the ratio of the blocks passed down to the KWS node, this is roughly the CPU ratio of the KWS node
+     * compared with running it all the time.
+     */
+    float GetOpenRatio()
+    {
+        uint64_t passed = _passed_blocks, gated = _gated_blocks;
+        return (passed + gated) ? static_cast<float>(passed) / (passed + gated) : 1.0f;
+    }
+
+private:
+    WakeGateNode(int channel_index, int lookback_ms, int hangover_ms, float snr_threshold_db, bool use_chain_vad)
+        : _channel_index(channel_index < 0 ? 0 : channel_index),
+          _lookback_ms(lookback_ms < 0 ? 0 : lookback_ms),
+          _hangover_ms(hangover_ms < 0 ? 0 : hangover_ms),
+          _snr_threshold_db(snr_threshold_db),
+          _use_chain_vad(use_chain_vad),
+          _stored_blocks(0),
+          _flush_pending(false),
+          _wake_count(0),
+          _passed_blocks(0),
+          _gated_blocks(0) {}
+
+    bool _IsListening()
+    {
+        if (!_chain_shared_data) return false;
+        std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_state);
+        return _chain_shared_data->state == LISTEN_QUIETLY || _chain_shared_data->state == LISTEN_WITH_BGM;
+    }
+
+    bool _Detect(const std::string& block)
+    {
+        int64_t diff_energy = 0;
+        int64_t energy = ChannelEnergy(block, _input_parameter.num_channel, _input_parameter.interleaved,
+                                       _channel_index, &diff_energy);
+        size_t num_frames = BlockNumFrames(block, _input_parameter.num_channel);
+        if (num_frames == 0) return false;
+
+        float energy_db = 10.0f * std::log10(static_cast<float>(energy) / num_frames + 1.0f);
+        float tilt = energy ? static_cast<float>(diff_energy) / energy : 0.0f;
+
+        // minimum statistics: follow the floor down quickly, creep up slowly (~0.6dB/s at 8ms blocks)
+        if (!_noise_floor_init) {
+            _noise_floor_db = energy_db;
+            _noise_floor_init = true;
+        } else if (energy_db < _noise_floor_db) {
+            _noise_floor_db += 0.2f * (energy_db - _noise_floor_db);
+        } else {
+            _noise_floor_db += 0.005f;
+        }
+
+        // speech sits between low rumble (tilt ~0) and white-ish noise (tilt ~2)
+        bool candidate = (energy_db - _noise_floor_db > _snr_threshold_db) && tilt > 0.005f && tilt < 1.5f;
+
+        if (candidate && _use_chain_vad && _chain_shared_data) {
+            std::lock_guard<std::mutex> lock(_chain_shared_data->mutex_vad);
+            candidate = !_chain_shared_data->vad_node_present || _chain_shared_data->vad;
+        }
+
+        // require 3 consecutive blocks to filter clicks
+        _attack_count = candidate ? _attack_count + 1 : 0;
+        return _attack_count >= 3 || (_open && candidate);
+    }
+
+    /** The buffers leave with the blocks, the slots are empty until the next gated blocks are swapped in. */
+    void _FlushLookback(bool& exit)
+    {
+        size_t start = (_lookback_head + _lookback_blocks - _lookback_count) % _lookback_blocks;
+        for (size_t i = 0; i < _lookback_count; i++) {
+            BaseNode::StoreBlock(std::move(_lookback[(start + i) % _lookback_blocks]), exit);
+            _passed_blocks++;
+            _stored_blocks++;
+        }
+        _lookback_count = 0;
+    }
+
+    size_t _channel_index;
+    size_t _lookback_ms;
+    size_t _hangover_ms;
+    float _snr_threshold_db;
+    bool _use_chain_vad;
+
+    std::vector<std::string> _lookback;
+    size_t _lookback_blocks;
+    size_t _lookback_head;
+    size_t _lookback_count;
+    size_t _hangover_blocks;
+    uint64_t _stored_blocks;        ///< The blocks passed down since the start, the positions of the skip log.
+    BlockSkipLog _skip_log;
+
+    float _noise_floor_db;
+    bool _noise_floor_init;
+    int _attack_count;
+    size_t _quiet_count;
+
+    std::atomic<bool> _open;
+    bool _flush_pending;
+    std::atomic<uint64_t> _wake_count;
+    std::atomic<uint64_t> _passed_blocks;
+    std::atomic<uint64_t> _gated_blocks;
+};
+
+}  //namespace
+
+#endif // !__WAKE_GATE_NODE_H__
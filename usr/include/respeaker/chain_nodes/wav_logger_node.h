@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __WAV_LOGGER_NODE_H__
+#define __WAV_LOGGER_NODE_H__
+
+#include <memory>
+
+#include "chain_nodes/async_wav_writer.h"
+#include "chain_nodes/base_node.h"
+#include "chain_nodes/block_utils.h"
+#include "chain_nodes/chain_trace.h"
+
+namespace respeaker
+{
+
+/**
+ * The WavLoggerNode records the stream at its place in the chain into rotating *.wav files, through a
+ * respeaker::AsyncWavWriter, so the node thread only copies the block into a preallocated chunk. It passes the block
+ * through. Unlike the `enable_wav_log` of VepAecBeamformingNode, it can stay on in the field: put one before the VEP
+ * node for the microphones and the reference, and one after it for the beams.
+ *
+ *     collector --> WavLoggerNode("/data/log", "in") --> VepAecBeamformingNode --> WavLoggerNode("/data/log", "out")
+ */
+class WavLoggerNode : public BaseNode
+{
+public:
+    /**
+     * Create a WavLoggerNode instance.
+     *
+     * @param directory - Where the files go, it must exist.
+     * @param prefix - The files are named `prefix-YYYYmmdd-HHMMSS-N.wav`.
+     * @param max_file_mb - A new file is started at this size, default to 64.
+     * @param max_total_mb - The oldest files of this node are deleted above this size, default to 512.
+     *
+     * @return WavLoggerNode*
+     */
+    static WavLoggerNode* Create(std::string directory, std::string prefix="respeaker", int max_file_mb=64,
+                                 int max_total_mb=512)
+    {
+        return new WavLoggerNode(directory, prefix, max_file_mb, max_total_mb);
+    }
+
+    virtual ~WavLoggerNode() = default;
+
+    virtual bool OnStartThread()
+    {
+        _output_parameter = _input_parameter;
+        _output_parameter.node_type = WAV_LOGGER_NODE;
+        _is_interleaved_after_process = _input_parameter.interleaved;
+        return _writer->Open(_input_parameter.rate, static_cast<int>(_input_parameter.num_channel));
+    }
+
+    virtual std::string ProcessBlock(std::string block, bool& exit)
+    {
+        (void)exit;
+        RESPEAKER_TRACE_SCOPE("WavLoggerNode");
+        if (_enabled) {
+            size_t frames = BlockNumFrames(block, _input_parameter.num_channel);
+            _writer->Write(BlockSamples(block), frames, _input_parameter.interleaved);
+        }
+        return block;
+    }
+
+    virtual bool OnJoinThread()
+    {
+        _writer->Close();
+        return true;
+    }
+
+    /** Pause or resume the recording without stopping the chain, e.g. from a remote debug switch. */
+    void SetEnabled(bool enabled) { _enabled = enabled; }
+
+    /** Get the writer, for its counters, or to set up `SetChunking`/`SetDirectIo` before starting. */
+    AsyncWavWriter* GetWriter() { return _writer.get(); }
+
+protected:
+    WavLoggerNode(std::string directory, std::string prefix, int max_file_mb, int max_total_mb)
+        : _writer(new AsyncWavWriter(directory, prefix)),
+          _enabled(true)
+    {
+        _writer->SetRotation(static_cast<uint64_t>(max_file_mb > 1 ? max_file_mb : 1) << 20,
+                             static_cast<uint64_t>(max_total_mb > 1 ? max_total_mb : 1) << 20);
+    }
+
+    std::unique_ptr<AsyncWavWriter> _writer;
+    std::atomic<bool> _enabled;
+};
+
+}  //namespace
+
+#endif // !__WAV_LOGGER_NODE_H__
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __WORKER_POOL_H__
+#define __WORKER_POOL_H__
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace respeaker
+{
+
+/**
+ * A small fork-join pool for data-parallel work inside one node, e.g. the per-beam detectors of a multi-beam node.
+ * The calling thread (the node thread) takes part in the work, so a pool of `N - 1` workers keeps N cores busy.
+ * `ParallelFor` doesn't allocate, the task is passed by reference and the indexes are handed out by an atomic counter.
+ */
+class WorkerPool
+{
+public:
+    /**
+     * @param num_workers - The number of worker threads, not counting the calling thread. `0` runs everything
+     *                      in the calling thread.
+     */
+    explicit WorkerPool(size_t num_workers)
+        : _task(nullptr), _num_items(0), _next_item(0), _pending(0), _active_workers(0), _generation(0), _exit(false)
+    {
+        for (size_t i = 0; i < num_workers; i++) {
+            _threads.emplace_back(&WorkerPool::_WorkerProc, this);
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _exit = true;
+        }
+        _cv_start.notify_all();
+        for (auto& t : _threads) t.join();
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    /** Get the number of worker threads, not counting the calling thread. */
+    size_t GetNumWorkers() const { return _threads.size(); }
+
+    /**
+     * Bind the worker `i` to core `(first_core + i) % num_cores`. The calling thread is bound by
+     * `BaseNode::BindToCore`.
+     *
+     * @return bool
+     */
+    bool BindToCores(int first_core, int num_cores)
+    {
+        if (num_cores <= 0) return false;
+        bool ok = true;
+        for (size_t i = 0; i < _threads.size(); i++) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET((first_core + static_cast<int>(i)) % num_cores, &cpuset);
+            ok = pthread_setaffinity_np(_threads[i].native_handle(), sizeof(cpu_set_t), &cpuset) == 0 && ok;
+        }
+        return ok;
+    }
+
+    /**
+     * Run `task(i)` for every `i` in [0, num_items), spread over the workers and the calling thread.
+     * Returns after all the items are done. Must be called from one thread at a time.
+     */
+    void ParallelFor(size_t num_items, const std::function<void(size_t)>& task)
+    {
+        if (num_items == 0) return;
+        if (_threads.empty() || num_items == 1) {
+            for (size_t i = 0; i < num_items; i++) task(i);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _task = &task;
+            _num_items = num_items;
+            _next_item.store(0, std::memory_order_relaxed);
+            _pending.store(num_items, std::memory_order_relaxed);
+            _generation++;
+        }
+        _cv_start.notify_all();
+
+        _RunItems(task);
+
+        // also wait for the workers to check out, so none of them touches `task` after we return
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv_done.wait(lock, [this] { return _pending.load(std::memory_order_acquire) == 0 && _active_workers == 0; });
+        _task = nullptr;
+    }
+
+private:
+    void _RunItems(const std::function<void(size_t)>& task)
+    {
+        size_t i;
+        while ((i = _next_item.fetch_add(1, std::memory_order_relaxed)) < _num_items) {
+            task(i);
+            if (_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _cv_done.notify_one();
+            }
+        }
+    }
+
+    void _WorkerProc()
+    {
+        uint64_t seen = 0;
+        for (;;) {
+            const std::function<void(size_t)>* task;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cv_start.wait(lock, [this, seen] { return _exit || _generation != seen; });
+                if (_exit) return;
+                seen = _generation;
+                task = _task;
+                if (!task) continue;
+                _active_workers++;
+            }
+            _RunItems(*task);
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _active_workers--;
+            }
+            _cv_done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _cv_start;
+    std::condition_variable _cv_done;
+
+    const std::function<void(size_t)>* _task;
+    size_t _num_items;
+    std::atomic<size_t> _next_item;
+    std::atomic<size_t> _pending;
+    size_t _active_workers;
+    uint64_t _generation;
+    bool _exit;
+};
+
+}  // namespace respeaker
+
+#endif // !__WORKER_POOL_H__
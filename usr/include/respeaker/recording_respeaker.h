@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2019 Seeed Technology Co., Ltd.
+ *
+ */
+
+
+#ifndef __RECORDING_RESPEAKER_H__
+#define __RECORDING_RESPEAKER_H__
+
+#include <memory>
+#include <string>
+
+#include "respeaker.h"
+#include "chain_nodes/session_log.h"
+
+namespace respeaker
+{
+
+/**
+ * A ReSpeaker supervisor which records the API calls of the application into a respeaker::SessionLogWriter and
+ * forwards them to the real supervisor, so respeaker::ReplayCollectorNode can replay them with the audio recorded by
+ * respeaker::SessionRecorderNode. Use it in place of the supervisor, e.g.
+ * ```cpp
+ * std::unique_ptr<ReSpeaker> respeaker(new RecordingReSpeaker(ReSpeaker::Create(INFO_LOG_LEVEL), &session_log));
+ * ```
+ * `SetChainState`, `SetDirection`, `Pause`, `Resume`, `Start` and `Stop` are recorded with their arguments, the
+ * hotword events of `DetectHotword` and the lengths fetched by `Listen`/`ListenToSilence` with their results.
+ */
+class RecordingReSpeaker : public ReSpeaker
+{
+public:
+    /**
+     * @param respeaker - The real supervisor, it's owned (and deleted) by this instance.
+     * @param writer - The session log, it's owned by the caller and must outlive this instance.
+     */
+    RecordingReSpeaker(ReSpeaker* respeaker, SessionLogWriter* writer) : _respeaker(respeaker), _writer(writer) {}
+
+    virtual ~RecordingReSpeaker() = default;
+
+    virtual void SetLogLevel(LogLevel log_level) { _respeaker->SetLogLevel(log_level); }
+
+    virtual void RegisterChainByHead(BaseNode* head_node) { _respeaker->RegisterChainByHead(head_node); }
+
+    virtual void RegisterDirectionManagerNode(DirectionManagerNode* dir_manager_node)
+    {
+        _respeaker->RegisterDirectionManagerNode(dir_manager_node);
+    }
+
+    virtual void RegisterHotwordDetectionNode(HotwordDetectionNode* hotword_detection_node)
+    {
+        _respeaker->RegisterHotwordDetectionNode(hotword_detection_node);
+    }
+
+    virtual void RegisterOutputNode(BaseNode* output_node) { _respeaker->RegisterOutputNode(output_node); }
+
+    virtual bool Start(bool* interrupt)
+    {
+        _writer->AppendApiCall(SESSION_API_START);
+        return _respeaker->Start(interrupt);
+    }
+
+    virtual bool Stop()
+    {
+        _writer->AppendApiCall(SESSION_API_STOP);
+        bool ret = _respeaker->Stop();
+        _writer->Flush();
+        return ret;
+    }
+
+    virtual int DetectHotword()
+    {
+        int detected = _respeaker->DetectHotword();
+        if (detected != 0) _writer->AppendApiCall(SESSION_API_DETECT_HOTWORD, detected);
+        return detected;
+    }
+
+    virtual const std::string DetectHotword(int& detected)
+    {
+        const std::string block = _respeaker->DetectHotword(detected);
+        if (detected != 0) _writer->AppendApiCall(SESSION_API_DETECT_HOTWORD, detected);
+        return block;
+    }
+
+    virtual const std::string Listen(int block_time_length_ms)
+    {
+        _writer->AppendApiCall(SESSION_API_LISTEN, block_time_length_ms);
+        return _respeaker->Listen(block_time_length_ms);
+    }
+
+    virtual const std::string Listen()
+    {
+        _writer->AppendApiCall(SESSION_API_LISTEN, 0);
+        return _respeaker->Listen();
+    }
+
+    virtual const std::string ListenToSilence(int cmd_silence_gap_ms = 3000, int cmd_max_timeout_ms = 10000)
+    {
+        const std::string chunk = _respeaker->ListenToSilence(cmd_silence_gap_ms, cmd_max_timeout_ms);
+        _writer->AppendApiCall(SESSION_API_LISTEN_TO_SILENCE, _ChunkMs(chunk));
+        return chunk;
+    }
+
+    virtual const std::string ListenToSilence(void (*DirectionReportCallback)(int), int cmd_silence_gap_ms = 3000,
+                                              int cmd_max_timeout_ms = 10000)
+    {
+        const std::string chunk = _respeaker->ListenToSilence(DirectionReportCallback, cmd_silence_gap_ms,
+                                                              cmd_max_timeout_ms);
+        _writer->AppendApiCall(SESSION_API_LISTEN_TO_SILENCE, _ChunkMs(chunk));
+        return chunk;
+    }
+
+    virtual int GetDirection() { return _respeaker->GetDirection(); }
+
+    virtual void SetDirection(int dir)
+    {
+        _writer->AppendApiCall(SESSION_API_SET_DIRECTION, dir);
+        _respeaker->SetDirection(dir);
+    }
+
+    virtual bool GetVad() { return _respeaker->GetVad(); }
+
+    virtual void SetChainState(ChainState state)
+    {
+        _writer->AppendApiCall(SESSION_API_SET_CHAIN_STATE, static_cast<int32_t>(state));
+        _respeaker->SetChainState(state);
+    }
+
+    virtual void Pause()
+    {
+        _writer->AppendApiCall(SESSION_API_PAUSE);
+        _respeaker->Pause();
+    }
+
+    virtual void Resume()
+    {
+        _writer->AppendApiCall(SESSION_API_RESUME);
+        _respeaker->Resume();
+    }
+
+    virtual ChainSharedData* GetChainSharedDataPtr() { return _respeaker->GetChainSharedDataPtr(); }
+
+    virtual size_t GetNumOutputChannels() { return _respeaker->GetNumOutputChannels(); }
+
+    virtual int GetNumOutputRate() { return _respeaker->GetNumOutputRate(); }
+
+private:
+    int32_t _ChunkMs(const std::string& chunk)
+    {
+        size_t bytes_per_ms = GetNumOutputChannels() * sizeof(int16_t) * GetNumOutputRate() / 1000;
+        return bytes_per_ms ? static_cast<int32_t>(chunk.size() / bytes_per_ms) : 0;
+    }
+
+    std::unique_ptr<ReSpeaker> _respeaker;
+    SessionLogWriter* _writer;
+};
+
+}  //namespace
+
+#endif // !__RECORDING_RESPEAKER_H__
@@ -43,21 +43,59 @@
  * The list of nodes:
  * - respeaker::PulseCollectorNode - collect the audio data from PulseAudio.
  * - respeaker::AlsaCollectorNode - collect the audio data from Alsa directly.
+ * - respeaker::AlsaMmapCollectorNode - collect the audio data from Alsa with mmap access, resample and deinterleave it
+ *   straight from the DMA ring buffer.
+ * - respeaker::PipeWireCollectorNode - collect the audio data from PipeWire as a native client, one block per graph
+ *   quantum.
  * - respeaker::FileCollectorNode - collect the audio data from a given *.wav file.
+ * - respeaker::ReplayCollectorNode - replay a session log recorded by respeaker::SessionRecorderNode, the blocks and
+ *   the supervisor calls, at the recorded pace or as fast as possible.
  * - respeaker::SelectorNode - select specified channels from the input stream, and output with same rate and format.
+ * - respeaker::ChannelMatrixNode - reorder, duplicate, scale and mix channels by a matrix, which is compiled to a
+ *   copy, a gather or a sparse mix kernel, and to no work at all for an identity selection.
+ * - respeaker::BroadcastNode - fan the stream out to several branches through a ring which the block is published into
+ *   once, read by respeaker::BroadcastReaderNode downlinks with a block, drop or detach policy when they're too slow.
+ * - respeaker::SrpPhatDoaNode - do continuous DoA on the raw microphone channels every block (SRP-PHAT), with sub-beam
+ *   resolution, a confidence value and a smoothed track.
+ * - respeaker::ReferenceInputNode - insert the AEC reference from a playback tap (respeaker::ReferenceSource), time
+ *   aligned to the microphones, into the channel which VepAecBeamformingNode takes as the reference.
+ * - respeaker::EchoActivityNode - measure the reference level and the echo return loss every block, hold the AEC of
+ *   VepAecBeamformingNode and switch the chain state between *_QUIETLY and *_WITH_BGM by the actual playback.
  * - respeaker::VepAecBeamformingNode - do beamforming, AEC(acoustic echo cancellation), NR(noise reduction) and 
  *   a part of DOA(direction of arrival) on the input audio stream,output the most proper beam(single-beam) or 
  *   all the beams(multi-beam). These algorithms are provided by Alango.
+ * - respeaker::GeometricBeamformingNode - do delay-and-sum or MVDR beamforming with steering vectors built from the
+ *   microphone coordinates, for the microphone types which VepAecBeamformingNode doesn't support yet.
  * - respeaker::Snowboy1bDoaKwsNode - do single-beam keyword(hotword triggering) search with Snowboy KWS Engine and 
  *   DoA (direction of arrival) and VAD(Voice available detection).
  * - respeaker::SnowboyMbDoaKwsNode - do multi-beam keyword search with Snowboy KWS Engine and DoA and VAD(Voice available detection), 
  *   note that this node only works on ReSpeaker Core v2.
+ * - respeaker::RankedMbDoaKwsNode - do multi-beam keyword search and DoA, but only on the top N beams ranked by SNR and
+ *   DoA history, so the cost is close to single-beam search. The KWS engine is plugged in by respeaker::KwsDetector.
  * - respeaker::SnowboyManKwsNode - this node don't do DoA, you need to select the beam manually to pick the voice audio.
  * - respeaker::Snips1bDoaKwsNode - do single-beam keyword search with Snips KWS Engine and DoA.
  * - respeaker::SnipsManBeamKwsNode - this node don't do DoA, you need to select the beam manually to pick the voice audio.
  * - respeaker::HybridNode - provide NS(Noise suppresstion), AGC(Automatic gain control) and VAD(Voice available detection)
  *   from WebRTC library.
+ * - respeaker::MultiChannelHybridNode - the NS, AGC and VAD of HybridNode on every channel of the stream, e.g. all the
+ *   beams, with one shared STFT and optional worker threads, and the VAD of every channel published.
+ * - respeaker::LightVadNode - a cheap integer VAD which gives a speech probability every 10ms and sets the chain VAD
+ *   with a hangover, for ReSpeaker::ListenToSilence and the output nodes.
+ * - respeaker::EncoderNode - encode the stream with Opus (respeaker::OpusAudioEncoder) or FLAC
+ *   (respeaker::FlacAudioEncoder) inside the chain, and hand out the packets with a `Listen`-style API.
+ * - respeaker::WavLoggerNode - record the stream into rotating *.wav files from a background thread, with size caps, so
+ *   the recording can stay on in the field.
+ * - respeaker::SessionRecorderNode - record the collector blocks with their times and the chain state into a session
+ *   log, or time the nodes in front of it. With respeaker::RecordingReSpeaker, the supervisor calls are recorded too.
+ * - respeaker::WakeGateNode - a cheap energy/VAD gate in front of the KWS node, the KWS node only runs when there's
+ *   voice-like sound, with a short look-back buffer so no audio is lost.
+ * - respeaker::DutyCycleNode - after sustained silence, pass the stream to the nodes after it in batches of several
+ *   blocks, so their threads wake up less often, and back to full rate on speech.
  * - respeaker::AloopOutputNode - output audio stream to a specific Alsa device(eg. "hw:Loopback,0,0").
+ * - respeaker::PipeWireOutputNode - publish the output audio stream as a PipeWire source, which the ASR engine can
+ *   record from directly without the aloop device.
+ * - respeaker::ShmOutputNode - publish the output audio stream and its VAD/DoA/hotword metadata into a lock-free ring
+ *   in POSIX shared memory, which any number of local processes can read with respeaker::ShmRingReader.
  * - may have more in the future
  *
  * Each node inherits from one or more interface classes:
@@ -65,6 +103,10 @@
  *   start/stop, etc...
  * - respeaker::DirectionManagerNode - defines an interface of getting DoA result and setting direction.
  * - respeaker::HotwordDetectionNode - defines an interface of getting hotword trigger event.
+ * - respeaker::CaptureClockNode - defines an interface of getting the device timestamp of the blocks, the overrun count
+ *   and the clock drift of a collector.
+ * - respeaker::SpeechProbabilityNode - defines an interface of getting the speech probability of every 10ms frame.
+ * - respeaker::BatchNode - defines `ProcessBlocks`, processing the blocks queued for the node several at a time.
  *
  * The nodes are linked together by calling the `Uplink` method, please see the examples to know how to link up.
  *